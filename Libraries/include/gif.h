@@ -11,6 +11,12 @@
 // dithering. (It does at least use delta encoding - only the changed portions of each
 // frame are saved.)
 //
+// Ordered (Bayer) dithering is also available - see GifOrderedDitherRows().
+//
+// Per-frame palettes normally median-split every changed pixel. Set sampledPalette on
+// the writer's encoder to build them from a sample of the pixels instead, refined with
+// k-means starting from the encoder's seed palette (see GifMakePaletteSampled()).
+//
 // So resulting files are often quite large. The hope is that it will be handy nonetheless
 // as a quick and easily-integrated way for programs to spit out animations.
 //
@@ -25,6 +31,18 @@
 // Pass subsequent frames to GifWriteFrame().
 // Finally, call GifEnd() to close the file handle and free memory.
 //
+// Palette lookups go through a per-frame RGB555 cache by default, which is much faster
+// but can pick a slightly worse color than a full search. Set exactPalette on the writer
+// after GifBegin() to always search the palette exactly.
+//
+// For animations whose colors are known ahead of time, GifSetFixedPalette() makes every
+// frame reuse one palette instead of building its own (see GifMakePaletteFromPixels()),
+// and GifLearnPalette() builds that palette from the first few frames instead.
+//
+// GifEncodeFrame() compresses a single frame into memory without touching the writer,
+// so callers can encode several frames at once on different threads (one GifEncoder
+// each) and write the results to the file in order.
+//
 
 #ifndef gif_h
 #define gif_h
@@ -34,11 +52,16 @@
 #include <stdint.h>  // for integer typedefs
 #include <stdbool.h> // for bool macros
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GIF_SSE2
+#endif
+
 // Define these macros to hook into a custom memory allocator.
 // TEMP_MALLOC and TEMP_FREE will only be called in stack fashion - frees in the reverse order of mallocs
 // and any temp memory allocated by a function will be freed before it exits.
-// MALLOC and FREE are used only by GifBegin and GifEnd respectively (to allocate a buffer the size of the image, which
-// is used to find changed pixels for delta-encoding.)
+// MALLOC and FREE are used for memory that outlives a single call - the image used to find changed pixels for
+// delta-encoding, the output buffer, and the scratch images and LZW dictionary that GifEncoder reuses between frames.
 
 #ifndef GIF_TEMP_MALLOC
 #include <stdlib.h>
@@ -62,6 +85,14 @@
 
 const int kGifTransIndex = 0;
 
+// Values for the dither argument. The original bool argument still works: true is Floyd-Steinberg.
+enum
+{
+    kGifDitherNone = 0,
+    kGifDitherFloydSteinberg = 1,
+    kGifDitherOrdered = 2
+};
+
 typedef struct
 {
     int bitDepth;
@@ -134,6 +165,41 @@ void GifGetClosestPaletteColor( GifPalette* pPal, int r, int g, int b, int* best
     }
 }
 
+// Lookup table from a color quantized to RGB555 to its palette entry.
+// Entries hold the palette index plus one, so that zero means "not filled in yet".
+typedef struct
+{
+    uint16_t entry[1 << 15];
+} GifPaletteCache;
+
+void GifClearPaletteCache( GifPaletteCache* cache )
+{
+    memset(cache->entry, 0, sizeof(cache->entry));
+}
+
+// picks the palette entry for a color, going through the cache when one is given.
+// A cache miss searches the k-d tree for the center of the RGB555 cell rather than
+// the color itself, so the result doesn't depend on which pixel happened to fill the entry.
+int GifGetPaletteColor( GifPalette* pPal, GifPaletteCache* cache, int r, int g, int b )
+{
+    int32_t bestDiff = 1000000;
+    int32_t bestInd = 1;
+
+    if(!cache)
+    {
+        GifGetClosestPaletteColor(pPal, r, g, b, &bestInd, &bestDiff, 1);
+        return bestInd;
+    }
+
+    int key = ((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3);
+    if(cache->entry[key])
+        return cache->entry[key] - 1;
+
+    GifGetClosestPaletteColor(pPal, (r & ~7) | 4, (g & ~7) | 4, (b & ~7) | 4, &bestInd, &bestDiff, 1);
+    cache->entry[key] = (uint16_t)(bestInd + 1);
+    return bestInd;
+}
+
 void GifSwapPixels(uint8_t* image, int pixA, int pixB)
 {
     uint8_t rA = image[pixA*4];
@@ -376,42 +442,230 @@ int GifPickChangedPixels( const uint8_t* lastFrame, uint8_t* frame, int numPixel
     return numChanged;
 }
 
-// Creates a palette by placing all the image pixels in a k-d tree and then averaging the blocks at the bottom.
+// Creates a palette by placing the pixels in a k-d tree and then averaging the blocks at the bottom.
 // This is known as the "median split" technique
-void GifMakePalette( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, int bitDepth, bool buildForDither, GifPalette* pPal )
+// The pixels are RGBA and get reordered in place.
+void GifMakePaletteFromPixels( uint8_t* pixels, int numPixels, int bitDepth, bool buildForDither, GifPalette* pPal )
 {
+    // the split skips the colors and tree nodes no pixel reaches (all of them if the frame did not
+    // change), and those are still written to the file and searched, so they start out as zeros
+    memset(pPal, 0, sizeof(GifPalette));
     pPal->bitDepth = bitDepth;
 
+    GifSplitPalette(pixels, numPixels, 1, 0, buildForDither, pPal);
+
+    // add the bottom node for the transparency index
+    pPal->treeSplit[1 << (bitDepth-1)] = 0;
+    pPal->treeSplitElt[1 << (bitDepth-1)] = 0;
+
+    pPal->r[0] = pPal->g[0] = pPal->b[0] = 0;
+}
+
+// Creates a palette for the pixels of nextFrame that changed since lastFrame
+// scratch must hold width*height*4 bytes, or be NULL to use temporary memory
+void GifMakePalette( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, int bitDepth, bool buildForDither, GifPalette* pPal, uint8_t* scratch )
+{
     // SplitPalette is destructive (it sorts the pixels by color) so
     // we must create a copy of the image for it to destroy
     size_t imageSize = (size_t)(width * height * 4 * sizeof(uint8_t));
-    uint8_t* destroyableImage = (uint8_t*)GIF_TEMP_MALLOC(imageSize);
+    uint8_t* destroyableImage = scratch? scratch : (uint8_t*)GIF_TEMP_MALLOC(imageSize);
     memcpy(destroyableImage, nextFrame, imageSize);
 
     int numPixels = (int)(width * height);
     if(lastFrame)
         numPixels = GifPickChangedPixels(lastFrame, destroyableImage, numPixels);
 
-    GifSplitPalette(destroyableImage, numPixels, 1, 0, buildForDither, pPal);
+    GifMakePaletteFromPixels(destroyableImage, numPixels, bitDepth, buildForDither, pPal);
 
-    GIF_TEMP_FREE(destroyableImage);
+    if(!scratch)
+        GIF_TEMP_FREE(destroyableImage);
+}
 
-    // add the bottom node for the transparency index
-    pPal->treeSplit[1 << (bitDepth-1)] = 0;
-    pPal->treeSplitElt[1 << (bitDepth-1)] = 0;
+// GifMakePaletteSampled() keeps every this many changed pixels...
+const int kGifSampleStride = 16;
+// ...but never fewer samples than this (unless there are not that many pixels), or more than this
+const int kGifMinSamples = 4096;
+const int kGifMaxSamples = 32768;
+// k-means passes when starting from the previous palette, and when starting from scratch
+const int kGifSeededPasses = 2;
+const int kGifUnseededPasses = 1;
+
+// Distance between the pixels GifMakePaletteSampled() keeps out of numPixels
+int GifSampleStride( int numPixels )
+{
+    int numSamples = GifIMin(GifIMax(numPixels / kGifSampleStride, kGifMinSamples), kGifMaxSamples);
+    return GifIMax(1, numPixels / numSamples);
+}
+
+// Sorts palette entries [first, first+count) by one color component (there are at most 256 of them)
+void GifSortPaletteEntries( GifPalette* pPal, int first, int count, int com )
+{
+    uint8_t* comps[3] = { pPal->r, pPal->g, pPal->b };
+    for( int ii=first+1; ii<first+count; ++ii )
+    {
+        uint8_t r = pPal->r[ii], g = pPal->g[ii], b = pPal->b[ii];
+        uint8_t key = comps[com][ii];
+        int jj = ii;
+        for( ; jj>first && comps[com][jj-1] > key; --jj )
+        {
+            pPal->r[jj] = pPal->r[jj-1];
+            pPal->g[jj] = pPal->g[jj-1];
+            pPal->b[jj] = pPal->b[jj-1];
+        }
+        pPal->r[jj] = r; pPal->g[jj] = g; pPal->b[jj] = b;
+    }
+}
+
+// Rebuilds the k-d tree for palette colors that were moved after GifSplitPalette() placed them.
+// Entries [first, first+count) belong to treeNode; they are reordered so that each half of
+// the range lies on its own side of the split. The transparent entry 0 keeps its place.
+void GifBuildPaletteTree( GifPalette* pPal, int treeNode, int first, int count )
+{
+    if(count < 2) return;
+
+    // entry 0 holds no color, so it is left out of the sorting
+    int sortFirst = (first == kGifTransIndex)? first+1 : first;
+    int sortCount = count - (sortFirst - first);
+
+    int minC[3] = { 255, 255, 255 }, maxC[3] = { 0, 0, 0 };
+    for( int ii=sortFirst; ii<sortFirst+sortCount; ++ii )
+    {
+        int c[3] = { pPal->r[ii], pPal->g[ii], pPal->b[ii] };
+        for( int cc=0; cc<3; ++cc )
+        {
+            minC[cc] = GifIMin(minC[cc], c[cc]);
+            maxC[cc] = GifIMax(maxC[cc], c[cc]);
+        }
+    }
+
+    int splitCom = 1;
+    if(maxC[2] - minC[2] > maxC[1] - minC[1]) splitCom = 2;
+    if(maxC[0] - minC[0] > maxC[2] - minC[2] && maxC[0] - minC[0] > maxC[1] - minC[1]) splitCom = 0;
+
+    GifSortPaletteEntries(pPal, sortFirst, sortCount, splitCom);
+
+    // everything left of the split is no larger than the first color right of it
+    int half = count / 2;
+    const uint8_t* comps[3] = { pPal->r, pPal->g, pPal->b };
+    pPal->treeSplitElt[treeNode] = (uint8_t)splitCom;
+    pPal->treeSplit[treeNode] = comps[splitCom][first + half];
+
+    GifBuildPaletteTree(pPal, treeNode*2,   first,        half);
+    GifBuildPaletteTree(pPal, treeNode*2+1, first + half, half);
+}
+
+// Creates a palette for the pixels of nextFrame that changed since lastFrame from a sample of them.
+// Only every kGifSampleStride-th changed pixel is used, and never more than kGifMaxSamples of them,
+// so past about 960x540 the cost stays the same as frames get larger.
+// The colors start from pSeed (usually the previous frame's palette) when it has the same bit depth,
+// or from a median split of the sample otherwise, and are then moved to the mean of the samples
+// nearest to them by a few passes of k-means.
+// scratch must hold width*height*4 bytes, or be NULL to use temporary memory
+void GifMakePaletteSampled( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, int bitDepth, bool buildForDither, const GifPalette* pSeed, GifPalette* pPal, uint8_t* scratch )
+{
+    int numPixels = (int)(width * height);
+    uint8_t* samples = scratch? scratch : (uint8_t*)GIF_TEMP_MALLOC((size_t)numPixels * 4);
+
+    int numSamples = 0;
+    if(lastFrame)
+    {
+        // the changed pixels are only known after a full pass, so they are all collected first and thinned out after
+        memcpy(samples, nextFrame, (size_t)numPixels * 4);
+        int numChanged = GifPickChangedPixels(lastFrame, samples, numPixels);
+        int stride = GifSampleStride(numChanged);
+        for( int ii=0; ii<numChanged; ii += stride )
+            memmove(samples + (size_t)numSamples++ * 4, samples + (size_t)ii * 4, 4);
+    }
+    else
+    {
+        int stride = GifSampleStride(numPixels);
+        for( int ii=0; ii<numPixels; ii += stride )
+            memcpy(samples + (size_t)numSamples++ * 4, nextFrame + (size_t)ii * 4, 4);
+    }
+
+    int numColors = 1 << bitDepth;
+    int passes = kGifSeededPasses;
+    memset(pPal, 0, sizeof(GifPalette));
+    if(pSeed && pSeed->bitDepth == bitDepth)
+    {
+        memcpy(pPal, pSeed, sizeof(GifPalette));
+    }
+    else
+    {
+        GifMakePaletteFromPixels(samples, numSamples, bitDepth, buildForDither, pPal);
+        passes = kGifUnseededPasses;
+    }
+
+    for( int pass=0; pass<passes && numSamples > 0; ++pass )
+    {
+        uint32_t sums[256][4];
+        memset(sums, 0, sizeof(sums));
+        int minC[3] = { 255, 255, 255 }, maxC[3] = { 0, 0, 0 };
+
+        for( int ii=0; ii<numSamples; ++ii )
+        {
+            const uint8_t* pix = samples + (size_t)ii * 4;
+            int32_t bestDiff = 1000000;
+            int32_t bestInd = 1;
+            GifGetClosestPaletteColor(pPal, pix[0], pix[1], pix[2], &bestInd, &bestDiff, 1);
+            sums[bestInd][0] += pix[0];
+            sums[bestInd][1] += pix[1];
+            sums[bestInd][2] += pix[2];
+            sums[bestInd][3]++;
+            for( int cc=0; cc<3; ++cc )
+            {
+                minC[cc] = GifIMin(minC[cc], pix[cc]);
+                maxC[cc] = GifIMax(maxC[cc], pix[cc]);
+            }
+        }
+
+        int emptyIndex = 0;
+        for( int ind=1; ind<numColors; ++ind )
+        {
+            uint32_t count = sums[ind][3];
+            if(count)
+            {
+                pPal->r[ind] = (uint8_t)((sums[ind][0] + count/2) / count);
+                pPal->g[ind] = (uint8_t)((sums[ind][1] + count/2) / count);
+                pPal->b[ind] = (uint8_t)((sums[ind][2] + count/2) / count);
+            }
+            else
+            {
+                // nothing is near this color any more; move it somewhere samples are
+                const uint8_t* pix = samples + (size_t)((emptyIndex++ * 7919) % numSamples) * 4;
+                pPal->r[ind] = pix[0];
+                pPal->g[ind] = pix[1];
+                pPal->b[ind] = pix[2];
+            }
+        }
+
+        if(buildForDither)
+        {
+            // same as GifSplitPalette: keep colors as dark and as light as anything in the frame
+            pPal->r[1] = (uint8_t)minC[0]; pPal->g[1] = (uint8_t)minC[1]; pPal->b[1] = (uint8_t)minC[2];
+            pPal->r[numColors-1] = (uint8_t)maxC[0]; pPal->g[numColors-1] = (uint8_t)maxC[1]; pPal->b[numColors-1] = (uint8_t)maxC[2];
+        }
+
+        GifBuildPaletteTree(pPal, 1, 0, numColors);
+    }
 
     pPal->r[0] = pPal->g[0] = pPal->b[0] = 0;
+
+    if(!scratch)
+        GIF_TEMP_FREE(samples);
 }
 
 // Implements Floyd-Steinberg dithering, writes palette value to alpha
-void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal )
+// The palette search goes through pCache unless it is NULL.
+// scratch must hold width*height*4 int32s, or be NULL to use temporary memory
+void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal, GifPaletteCache* pCache, int32_t* scratch )
 {
     int numPixels = (int)(width * height);
 
     // quantPixels initially holds color*256 for all pixels
     // The extra 8 bits of precision allow for sub-single-color error values
     // to be propagated
-    int32_t *quantPixels = (int32_t *)GIF_TEMP_MALLOC(sizeof(int32_t) * (size_t)numPixels * 4);
+    int32_t *quantPixels = scratch? scratch : (int32_t *)GIF_TEMP_MALLOC(sizeof(int32_t) * (size_t)numPixels * 4);
 
     for( int ii=0; ii<numPixels*4; ++ii )
     {
@@ -446,11 +700,9 @@ void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t
                 continue;
             }
 
-            int32_t bestDiff = 1000000;
-            int32_t bestInd = kGifTransIndex;
-
-            // Search the palete
-            GifGetClosestPaletteColor(pPal, rr, gg, bb, &bestInd, &bestDiff, 1);
+            // Search the palete - accumulated error can push a component past 255,
+            // which the cache can't index
+            int32_t bestInd = GifGetPaletteColor(pPal, pCache, GifIMin(rr, 255), GifIMin(gg, 255), GifIMin(bb, 255));
 
             // Write the result to the temp buffer
             int32_t r_err = nextPix[0] - (int32_t)(pPal->r[bestInd]) * 256;
@@ -509,11 +761,13 @@ void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t
         outFrame[ii] = (uint8_t)quantPixels[ii];
     }
 
-    GIF_TEMP_FREE(quantPixels);
+    if(!scratch)
+        GIF_TEMP_FREE(quantPixels);
 }
 
 // Picks palette colors for the image using simple thresholding, no dithering
-void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal )
+// The palette search goes through pCache unless it is NULL.
+void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal, GifPaletteCache* pCache )
 {
     uint32_t numPixels = width*height;
     for( uint32_t ii=0; ii<numPixels; ++ii )
@@ -533,9 +787,7 @@ void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint
         else
         {
             // palettize the pixel
-            int32_t bestDiff = 1000000;
-            int32_t bestInd = 1;
-            GifGetClosestPaletteColor(pPal, nextFrame[0], nextFrame[1], nextFrame[2], &bestInd, &bestDiff, 1);
+            int32_t bestInd = GifGetPaletteColor(pPal, pCache, nextFrame[0], nextFrame[1], nextFrame[2]);
 
             // Write the resulting color to the output buffer
             outFrame[0] = pPal->r[bestInd];
@@ -550,137 +802,341 @@ void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint
     }
 }
 
-// Simple structure to write out the LZW-compressed portion of the image
-// one bit at a time
+// 8x8 Bayer threshold matrix, values 0-63
+const uint8_t kGifBayerMatrix[64] =
+{
+     0, 32,  8, 40,  2, 34, 10, 42,
+    48, 16, 56, 24, 50, 18, 58, 26,
+    12, 44,  4, 36, 14, 46,  6, 38,
+    60, 28, 52, 20, 62, 30, 54, 22,
+     3, 35, 11, 43,  1, 33,  9, 41,
+    51, 19, 59, 27, 49, 17, 57, 25,
+    15, 47,  7, 39, 13, 45,  5, 37,
+    63, 31, 55, 23, 61, 29, 53, 21
+};
+
+// Implements ordered dithering with the Bayer matrix, writes palette value to alpha.
+// Each pixel is nudged by a fixed amount that depends only on its position before the
+// palette lookup, so unlike Floyd-Steinberg no pixel depends on another: rows
+// firstRow to endRow-1 are done on their own, and different bands of rows can be done
+// at the same time on different threads as long as each has its own cache (or NULL).
+// An unchanged pixel also dithers to the color it had before, so it can stay transparent.
+void GifOrderedDitherRows( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t firstRow, uint32_t endRow, GifPalette* pPal, GifPaletteCache* pCache )
+{
+    // about the spacing of a palette of this many colors spread evenly along each axis
+    int spread = 256 >> ((pPal->bitDepth + 2) / 3);
+
+    for( uint32_t yy=firstRow; yy<endRow; ++yy )
+    {
+        // This row's offsets for 8 pixels, split into an amount to add and one to subtract
+        // so that they can be applied with saturating byte arithmetic. Alpha is left alone.
+        uint8_t plus[32], minus[32], dithered[32];
+        for( int xx=0; xx<8; ++xx )
+        {
+            int offset = (2 * kGifBayerMatrix[(yy & 7) * 8 + xx] - 63) * spread / 128;
+            for( int cc=0; cc<4; ++cc )
+            {
+                plus[xx*4+cc] = (uint8_t)(cc < 3 && offset > 0? offset : 0);
+                minus[xx*4+cc] = (uint8_t)(cc < 3 && offset < 0? -offset : 0);
+            }
+        }
+
+        size_t rowStart = (size_t)yy * width * 4;
+        const uint8_t* lastRow = lastFrame? lastFrame + rowStart : NULL;
+        const uint8_t* nextRow = nextFrame + rowStart;
+        uint8_t* outRow = outFrame + rowStart;
+
+        for( uint32_t xx=0; xx<width; xx+=8 )
+        {
+            uint32_t groupPixels = GifIMin(8, (int)(width - xx));
+            const uint8_t* nextPix = nextRow + xx*4;
+#ifdef GIF_SSE2
+            if( groupPixels == 8 )
+            {
+                for( int half=0; half<32; half+=16 )
+                {
+                    __m128i pixels = _mm_loadu_si128((const __m128i*)(nextPix + half));
+                    pixels = _mm_adds_epu8(pixels, _mm_loadu_si128((const __m128i*)(plus + half)));
+                    pixels = _mm_subs_epu8(pixels, _mm_loadu_si128((const __m128i*)(minus + half)));
+                    _mm_storeu_si128((__m128i*)(dithered + half), pixels);
+                }
+            }
+            else
+#endif
+            {
+                for( uint32_t ii=0; ii<groupPixels*4; ++ii )
+                    dithered[ii] = (uint8_t)GifIMax(0, GifIMin(255, nextPix[ii] + plus[ii] - minus[ii]));
+            }
+
+            for( uint32_t ii=0; ii<groupPixels; ++ii )
+            {
+                const uint8_t* pix = nextPix + ii*4;
+                uint8_t* out = outRow + (xx+ii)*4;
+                const uint8_t* lastPix = lastRow? lastRow + (xx+ii)*4 : NULL;
+
+                // same test as GifThresholdImage, on the color before dithering
+                if( lastPix &&
+                    lastPix[0] == pix[0] &&
+                    lastPix[1] == pix[1] &&
+                    lastPix[2] == pix[2] )
+                {
+                    out[0] = lastPix[0];
+                    out[1] = lastPix[1];
+                    out[2] = lastPix[2];
+                    out[3] = kGifTransIndex;
+                    continue;
+                }
+
+                int32_t bestInd = GifGetPaletteColor(pPal, pCache, dithered[ii*4], dithered[ii*4+1], dithered[ii*4+2]);
+                out[0] = pPal->r[bestInd];
+                out[1] = pPal->g[bestInd];
+                out[2] = pPal->b[bestInd];
+                out[3] = (uint8_t)bestInd;
+            }
+        }
+    }
+}
+
+// Growable byte buffer that encoded data is collected in before it goes to the file
 typedef struct
 {
-    uint32_t chunkIndex;
-    uint8_t chunk[256];   // bytes are written in here until we have 256 of them, then written to the file
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} GifBuffer;
+
+void GifBufferInit( GifBuffer* buf )
+{
+    buf->data = NULL;
+    buf->size = 0;
+    buf->capacity = 0;
+}
+
+void GifBufferFree( GifBuffer* buf )
+{
+    GIF_FREE(buf->data);
+    GifBufferInit(buf);
+}
 
-    uint8_t bitIndex;  // how many bits in the partial byte written so far
-    uint8_t byte;      // current partial byte
+void GifBufferReserve( GifBuffer* buf, size_t capacity )
+{
+    if(capacity <= buf->capacity) return;
 
-    uint8_t padding[2];    // make padding explicit
-} GifBitStatus;
+    // grow geometrically so appending stays cheap
+    if(capacity < buf->capacity * 2) capacity = buf->capacity * 2;
 
-// insert a single bit
-void GifWriteBit( GifBitStatus* stat, uint32_t bit )
+    uint8_t* data = (uint8_t*)GIF_MALLOC(capacity);
+    if(buf->size) memcpy(data, buf->data, buf->size);
+    GIF_FREE(buf->data);
+
+    buf->data = data;
+    buf->capacity = capacity;
+}
+
+void GifBufferWrite( GifBuffer* buf, const void* bytes, size_t count )
 {
-    bit = bit & 1;
-    bit = bit << stat->bitIndex;
-    stat->byte |= bit;
+    GifBufferReserve(buf, buf->size + count);
+    memcpy(buf->data + buf->size, bytes, count);
+    buf->size += count;
+}
 
-    ++stat->bitIndex;
-    if( stat->bitIndex > 7 )
+void GifBufferPut( GifBuffer* buf, int byte )
+{
+    if(buf->size == buf->capacity) GifBufferReserve(buf, buf->size + 4096);
+    buf->data[buf->size++] = (uint8_t)byte;
+}
+
+// Packs LZW codes into the output through a 64-bit accumulator, and splits the
+// bytes into the 255-byte sub-blocks GIF wants as it goes.
+// The output buffer must already have room for everything that gets written.
+typedef struct
+{
+    uint64_t bits;         // pending bits, oldest in the lowest position
+    uint32_t numBits;
+    uint32_t blockSize;    // bytes in the current sub-block so far
+    uint8_t* blockLength;  // where the current sub-block's length byte goes
+    uint8_t* cursor;       // next byte of output
+} GifBitWriter;
+
+void GifBitWriterBegin( GifBitWriter* writer, GifBuffer* out )
+{
+    writer->bits = 0;
+    writer->numBits = 0;
+    writer->blockSize = 0;
+    writer->blockLength = out->data + out->size;
+    writer->cursor = writer->blockLength + 1;
+}
+
+void GifWriteBlockByte( GifBitWriter* writer, uint8_t byte )
+{
+    *writer->cursor++ = byte;
+    if( ++writer->blockSize == 255 )
     {
-        // move the newly-finished byte to the chunk buffer
-        stat->chunk[stat->chunkIndex++] = stat->byte;
-        // and start a new byte
-        stat->bitIndex = 0;
-        stat->byte = 0;
+        // sub-block is full, start the next one
+        *writer->blockLength = 255;
+        writer->blockLength = writer->cursor++;
+        writer->blockSize = 0;
     }
 }
 
-// write all bytes so far to the file
-void GifWriteChunk( FILE* f, GifBitStatus* stat )
+void GifWriteCode( GifBitWriter* writer, uint32_t code, uint32_t length )
 {
-    fputc((int)stat->chunkIndex, f);
-    fwrite(stat->chunk, 1, stat->chunkIndex, f);
+    writer->bits |= (uint64_t)code << writer->numBits;
+    writer->numBits += length;
 
-    stat->bitIndex = 0;
-    stat->byte = 0;
-    stat->chunkIndex = 0;
+    // codes are at most 12 bits, so after this there's always room for the next one
+    if( writer->numBits >= 32 )
+    {
+        GifWriteBlockByte(writer, (uint8_t)writer->bits);
+        GifWriteBlockByte(writer, (uint8_t)(writer->bits >> 8));
+        GifWriteBlockByte(writer, (uint8_t)(writer->bits >> 16));
+        GifWriteBlockByte(writer, (uint8_t)(writer->bits >> 24));
+        writer->bits >>= 32;
+        writer->numBits -= 32;
+    }
 }
 
-void GifWriteCode( FILE* f, GifBitStatus* stat, uint32_t code, uint32_t length )
+// writes out the last partial byte and sub-block, and hands the bytes back to the buffer
+void GifBitWriterEnd( GifBitWriter* writer, GifBuffer* out )
 {
-    for( uint32_t ii=0; ii<length; ++ii )
+    while( writer->numBits > 0 )
     {
-        GifWriteBit(stat, code);
-        code = code >> 1;
-
-        if( stat->chunkIndex == 255 )
-        {
-            GifWriteChunk(f, stat);
-        }
+        GifWriteBlockByte(writer, (uint8_t)writer->bits);
+        writer->bits >>= 8;
+        writer->numBits = writer->numBits > 8? writer->numBits - 8 : 0;
     }
+
+    if( writer->blockSize )
+        *writer->blockLength = (uint8_t)writer->blockSize;
+    else
+        writer->cursor = writer->blockLength; // drop the empty sub-block we had started
+
+    out->size = (size_t)(writer->cursor - out->data);
 }
 
 // The LZW dictionary is a 256-ary tree constructed as the file is encoded,
-// this is one node
+// this is one node. Its children only count if its generation matches the
+// dictionary's, which is how the whole tree gets cleared without touching it.
 typedef struct
 {
+    uint32_t generation;
     uint16_t m_next[256];
 } GifLzwNode;
 
-// write a 256-color (8-bit) image palette to the file
-void GifWritePalette( const GifPalette* pPal, FILE* f )
+typedef struct
+{
+    GifLzwNode* nodes;    // one per code, 4096 of them
+    uint32_t generation;
+} GifLzwDictionary;
+
+void GifLzwInit( GifLzwDictionary* dict )
 {
-    fputc(0, f);  // first color: transparency
-    fputc(0, f);
-    fputc(0, f);
+    dict->nodes = (GifLzwNode*)GIF_MALLOC(sizeof(GifLzwNode)*4096);
+    memset(dict->nodes, 0, sizeof(GifLzwNode)*4096);
+    dict->generation = 1;
+}
+
+void GifLzwFree( GifLzwDictionary* dict )
+{
+    GIF_FREE(dict->nodes);
+    dict->nodes = NULL;
+}
+
+void GifLzwClear( GifLzwDictionary* dict )
+{
+    if( ++dict->generation == 0 )
+    {
+        // the counter wrapped, so old nodes could look current again
+        memset(dict->nodes, 0, sizeof(GifLzwNode)*4096);
+        dict->generation = 1;
+    }
+}
 
-    for(int ii=1; ii<(1 << pPal->bitDepth); ++ii)
+// returns the code for the run "code, then value", or 0 if it isn't in the dictionary yet
+uint16_t GifLzwFind( const GifLzwDictionary* dict, int32_t code, uint8_t value )
+{
+    const GifLzwNode* node = dict->nodes + code;
+    return node->generation == dict->generation? node->m_next[value] : 0;
+}
+
+void GifLzwInsert( GifLzwDictionary* dict, int32_t code, uint8_t value, uint16_t newCode )
+{
+    GifLzwNode* node = dict->nodes + code;
+    if( node->generation != dict->generation )
     {
-        uint32_t r = pPal->r[ii];
-        uint32_t g = pPal->g[ii];
-        uint32_t b = pPal->b[ii];
+        // first child since the last clear, throw out the stale ones
+        memset(node->m_next, 0, sizeof(node->m_next));
+        node->generation = dict->generation;
+    }
+    node->m_next[value] = newCode;
+}
+
+// write a 256-color (8-bit) image palette to the output
+void GifWritePalette( const GifPalette* pPal, GifBuffer* out )
+{
+    uint8_t colors[256*3];
+    colors[0] = colors[1] = colors[2] = 0;  // first color: transparency
 
-        fputc((int)r, f);
-        fputc((int)g, f);
-        fputc((int)b, f);
+    int numColors = 1 << pPal->bitDepth;
+    for(int ii=1; ii<numColors; ++ii)
+    {
+        colors[ii*3]   = pPal->r[ii];
+        colors[ii*3+1] = pPal->g[ii];
+        colors[ii*3+2] = pPal->b[ii];
     }
+
+    GifBufferWrite(out, colors, (size_t)numColors * 3);
 }
 
 // write the image header, LZW-compress and write out the image
-void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uint32_t width, uint32_t height, uint32_t delay, GifPalette* pPal)
+void GifWriteLzwImage(GifBuffer* out, GifLzwDictionary* dict, uint8_t* image, uint32_t left, uint32_t top,  uint32_t width, uint32_t height, uint32_t delay, const GifPalette* pPal)
 {
     // graphics control extension
-    fputc(0x21, f);
-    fputc(0xf9, f);
-    fputc(0x04, f);
-    fputc(0x05, f); // leave prev frame in place, this frame has transparency
-    fputc(delay & 0xff, f);
-    fputc((delay >> 8) & 0xff, f);
-    fputc(kGifTransIndex, f); // transparent color index
-    fputc(0, f);
+    GifBufferPut(out, 0x21);
+    GifBufferPut(out, 0xf9);
+    GifBufferPut(out, 0x04);
+    GifBufferPut(out, 0x05); // leave prev frame in place, this frame has transparency
+    GifBufferPut(out, delay & 0xff);
+    GifBufferPut(out, (delay >> 8) & 0xff);
+    GifBufferPut(out, kGifTransIndex); // transparent color index
+    GifBufferPut(out, 0);
 
-    fputc(0x2c, f); // image descriptor block
+    GifBufferPut(out, 0x2c); // image descriptor block
 
-    fputc(left & 0xff, f);           // corner of image in canvas space
-    fputc((left >> 8) & 0xff, f);
-    fputc(top & 0xff, f);
-    fputc((top >> 8) & 0xff, f);
+    GifBufferPut(out, left & 0xff);           // corner of image in canvas space
+    GifBufferPut(out, (left >> 8) & 0xff);
+    GifBufferPut(out, top & 0xff);
+    GifBufferPut(out, (top >> 8) & 0xff);
 
-    fputc(width & 0xff, f);          // width and height of image
-    fputc((width >> 8) & 0xff, f);
-    fputc(height & 0xff, f);
-    fputc((height >> 8) & 0xff, f);
+    GifBufferPut(out, width & 0xff);          // width and height of image
+    GifBufferPut(out, (width >> 8) & 0xff);
+    GifBufferPut(out, height & 0xff);
+    GifBufferPut(out, (height >> 8) & 0xff);
 
-    //fputc(0, f); // no local color table, no transparency
-    //fputc(0x80, f); // no local color table, but transparency
+    //GifBufferPut(out, 0); // no local color table, no transparency
+    //GifBufferPut(out, 0x80); // no local color table, but transparency
 
-    fputc(0x80 + pPal->bitDepth-1, f); // local color table present, 2 ^ bitDepth entries
-    GifWritePalette(pPal, f);
+    GifBufferPut(out, 0x80 + pPal->bitDepth-1); // local color table present, 2 ^ bitDepth entries
+    GifWritePalette(pPal, out);
 
     const int minCodeSize = pPal->bitDepth;
     const uint32_t clearCode = 1 << pPal->bitDepth;
 
-    fputc(minCodeSize, f); // min code size 8 bits
+    GifBufferPut(out, minCodeSize); // min code size 8 bits
 
-    GifLzwNode* codetree = (GifLzwNode*)GIF_TEMP_MALLOC(sizeof(GifLzwNode)*4096);
+    // worst case is a 12-bit code for every pixel, plus the sub-block length bytes and the footer
+    size_t maxCodeBytes = ((size_t)width * height * 12 + 7) / 8 + 16;
+    GifBufferReserve(out, out->size + maxCodeBytes + maxCodeBytes / 255 + 2);
 
-    memset(codetree, 0, sizeof(GifLzwNode)*4096);
+    GifLzwClear(dict);
     int32_t curCode = -1;
     uint32_t codeSize = (uint32_t)minCodeSize + 1;
     uint32_t maxCode = clearCode+1;
 
-    GifBitStatus stat;
-    stat.byte = 0;
-    stat.bitIndex = 0;
-    stat.chunkIndex = 0;
+    GifBitWriter stat;
+    GifBitWriterBegin(&stat, out);
 
-    GifWriteCode(f, &stat, clearCode, codeSize);  // start with a fresh LZW dictionary
+    GifWriteCode(&stat, clearCode, codeSize);  // start with a fresh LZW dictionary
 
     for(uint32_t yy=0; yy<height; ++yy)
     {
@@ -702,19 +1158,22 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
             {
                 // first value in a new run
                 curCode = nextValue;
+                continue;
             }
-            else if( codetree[curCode].m_next[nextValue] )
+
+            uint16_t nextCode = GifLzwFind(dict, curCode, nextValue);
+            if( nextCode )
             {
                 // current run already in the dictionary
-                curCode = codetree[curCode].m_next[nextValue];
+                curCode = nextCode;
             }
             else
             {
                 // finish the current run, write a code
-                GifWriteCode(f, &stat, (uint32_t)curCode, codeSize);
+                GifWriteCode(&stat, (uint32_t)curCode, codeSize);
 
                 // insert the new run into the dictionary
-                codetree[curCode].m_next[nextValue] = (uint16_t)++maxCode;
+                GifLzwInsert(dict, curCode, nextValue, (uint16_t)++maxCode);
 
                 if( maxCode >= (1ul << codeSize) )
                 {
@@ -725,9 +1184,9 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
                 if( maxCode == 4095 )
                 {
                     // the dictionary is full, clear it out and begin anew
-                    GifWriteCode(f, &stat, clearCode, codeSize); // clear tree
+                    GifWriteCode(&stat, clearCode, codeSize); // clear tree
 
-                    memset(codetree, 0, sizeof(GifLzwNode)*4096);
+                    GifLzwClear(dict);
                     codeSize = (uint32_t)(minCodeSize + 1);
                     maxCode = clearCode+1;
                 }
@@ -738,26 +1197,261 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
     }
 
     // compression footer
-    GifWriteCode(f, &stat, (uint32_t)curCode, codeSize);
-    GifWriteCode(f, &stat, clearCode, codeSize);
-    GifWriteCode(f, &stat, clearCode + 1, (uint32_t)minCodeSize + 1);
+    GifWriteCode(&stat, (uint32_t)curCode, codeSize);
+    // the decoder adds one more dictionary entry for the last run; if that breaks
+    // a size barrier it expects the codes after it to be a bit wider
+    if( maxCode + 1 >= (1ul << codeSize) && codeSize < 12 )
+        codeSize++;
+    GifWriteCode(&stat, clearCode, codeSize);
+    GifWriteCode(&stat, clearCode + 1, (uint32_t)minCodeSize + 1);
 
     // write out the last partial chunk
-    while( stat.bitIndex ) GifWriteBit(&stat, 0);
-    if( stat.chunkIndex ) GifWriteChunk(f, &stat);
+    GifBitWriterEnd(&stat, out);
+
+    GifBufferPut(out, 0); // image block terminator
+}
+
+// State kept between frames by whoever encodes them. Nothing in here is shared,
+// so frames can be encoded concurrently as long as each thread has its own encoder.
+typedef struct
+{
+    GifPaletteCache* paletteCache;
+    GifPalette cachedPalette;  // the palette the cache was filled for
+    GifLzwDictionary dictionary;
+
+    // scratch images, reused from frame to frame
+    uint8_t* paletteScratch;   // copy of the frame for building the palette, RGBA
+    int32_t* ditherScratch;    // error diffusion buffer, 4 ints per pixel, only allocated for Floyd-Steinberg
+    size_t scratchPixels;
+    size_t ditherScratchPixels;
+
+    // seeds the next palette when sampledPalette is set, and is replaced by the palette built from it.
+    // Left alone it is the previous frame's palette; callers encoding frames out of order can set it themselves
+    GifPalette seedPalette;
+
+    bool cacheValid;
+    bool sampledPalette;   // build per-frame palettes with GifMakePaletteSampled() instead of GifMakePalette()
+    bool hasSeedPalette;
+
+    uint8_t padding[5];    // make padding explicit
+} GifEncoder;
+
+void GifEncoderInit( GifEncoder* enc )
+{
+    enc->paletteCache = (GifPaletteCache*)GIF_MALLOC(sizeof(GifPaletteCache));
+    enc->cacheValid = false;
+    GifLzwInit(&enc->dictionary);
+    enc->paletteScratch = NULL;
+    enc->ditherScratch = NULL;
+    enc->scratchPixels = 0;
+    enc->ditherScratchPixels = 0;
+    enc->sampledPalette = false;
+    enc->hasSeedPalette = false;
+}
+
+void GifEncoderFree( GifEncoder* enc )
+{
+    GIF_FREE(enc->paletteCache);
+    GifLzwFree(&enc->dictionary);
+    GIF_FREE(enc->paletteScratch);
+    GIF_FREE(enc->ditherScratch);
+    enc->paletteCache = NULL;
+    enc->paletteScratch = NULL;
+    enc->ditherScratch = NULL;
+    enc->scratchPixels = 0;
+    enc->ditherScratchPixels = 0;
+    enc->cacheValid = false;
+    enc->hasSeedPalette = false;
+}
 
-    fputc(0, f); // image block terminator
+// makes sure the scratch images are big enough for a width by height frame
+void GifEncoderReserve( GifEncoder* enc, uint32_t width, uint32_t height, int dither )
+{
+    size_t numPixels = (size_t)width * height;
+    if(numPixels > enc->scratchPixels)
+    {
+        GIF_FREE(enc->paletteScratch);
+        enc->paletteScratch = (uint8_t*)GIF_MALLOC(numPixels * 4);
+        enc->scratchPixels = numPixels;
+    }
 
-    GIF_TEMP_FREE(codetree);
+    if(dither == kGifDitherFloydSteinberg && numPixels > enc->ditherScratchPixels)
+    {
+        GIF_FREE(enc->ditherScratch);
+        enc->ditherScratch = (int32_t*)GIF_MALLOC(numPixels * 4 * sizeof(int32_t));
+        enc->ditherScratchPixels = numPixels;
+    }
 }
 
+// Palettizes one frame into outFrame and appends its compressed image block to out.
+// lastFrame is what the viewer already shows, or NULL for the first frame - pixels that
+// match it are written as transparent. The frame uses pFixedPalette if one is given,
+// and otherwise gets a palette of its own.
+void GifEncodeFrame( GifEncoder* enc, const uint8_t* lastFrame, const uint8_t* image, uint8_t* outFrame, uint32_t width, uint32_t height, uint32_t delay, int bitDepth, int dither, bool exactPalette, const GifPalette* pFixedPalette, GifBuffer* out )
+{
+    GifEncoderReserve(enc, width, height, dither);
+
+    GifPalette pal;
+    const GifPalette* pPal = pFixedPalette;
+    if(!pPal)
+    {
+        // error diffusion can change any pixel, so its palette is built from all of them
+        const uint8_t* paletteLastFrame = (dither == kGifDitherFloydSteinberg)? NULL : lastFrame;
+        if(enc->sampledPalette)
+        {
+            GifMakePaletteSampled(paletteLastFrame, image, width, height, bitDepth, dither != kGifDitherNone, enc->hasSeedPalette? &enc->seedPalette : NULL, &pal, enc->paletteScratch);
+            memcpy(&enc->seedPalette, &pal, sizeof(GifPalette));
+            enc->hasSeedPalette = true;
+        }
+        else
+        {
+            GifMakePalette(paletteLastFrame, image, width, height, bitDepth, dither != kGifDitherNone, &pal, enc->paletteScratch);
+        }
+        pPal = &pal;
+    }
+
+    // keep the cache for as long as the palette stays the same, which with a fixed palette is the whole animation
+    GifPaletteCache* cache = exactPalette? NULL : enc->paletteCache;
+    if(cache && (!enc->cacheValid || memcmp(&enc->cachedPalette, pPal, sizeof(GifPalette)) != 0))
+    {
+        GifClearPaletteCache(cache);
+        memcpy(&enc->cachedPalette, pPal, sizeof(GifPalette));
+        enc->cacheValid = true;
+    }
+
+    if(dither == kGifDitherFloydSteinberg)
+        GifDitherImage(lastFrame, image, outFrame, width, height, (GifPalette*)pPal, cache, enc->ditherScratch);
+    else if(dither == kGifDitherOrdered)
+        GifOrderedDitherRows(lastFrame, image, outFrame, width, 0, height, (GifPalette*)pPal, cache);
+    else
+        GifThresholdImage(lastFrame, image, outFrame, width, height, (GifPalette*)pPal, cache);
+
+    GifWriteLzwImage(out, &enc->dictionary, outFrame, 0, 0, width, height, delay, pPal);
+}
+
+// Changes the delay of a frame encoded by GifEncodeFrame() before it is written.
+// The frame starts with its graphics control extension, which holds the delay.
+void GifSetFrameDelay( GifBuffer* frame, uint32_t delay )
+{
+    if(frame->size < 6 || frame->data[0] != 0x21 || frame->data[1] != 0xf9) return;
+    frame->data[4] = (uint8_t)(delay & 0xff);
+    frame->data[5] = (uint8_t)((delay >> 8) & 0xff);
+}
+
+// only every this many pixels of a frame are kept when learning a palette
+const int kGifLearnStride = 16;
+
+// Collects pixel samples from the first few frames of an animation to build one palette for all of it
+typedef struct
+{
+    uint8_t* pixels;
+    int numPixels;
+    int framesLeft;
+} GifPaletteLearner;
+
+void GifLearnerBegin( GifPaletteLearner* learner, int numFrames, uint32_t width, uint32_t height )
+{
+    size_t samplesPerFrame = ((size_t)width * height + kGifLearnStride - 1) / kGifLearnStride;
+    learner->pixels = (uint8_t*)GIF_MALLOC(samplesPerFrame * 4 * (size_t)numFrames);
+    learner->numPixels = 0;
+    learner->framesLeft = numFrames;
+}
+
+void GifLearnerFree( GifPaletteLearner* learner )
+{
+    GIF_FREE(learner->pixels);
+    learner->pixels = NULL;
+    learner->numPixels = 0;
+    learner->framesLeft = 0;
+}
+
+// Samples one frame. Returns true, with the finished palette in pPal, once the last frame is in.
+bool GifLearnerAddFrame( GifPaletteLearner* learner, const uint8_t* image, uint32_t width, uint32_t height, int bitDepth, bool dither, GifPalette* pPal )
+{
+    if(learner->framesLeft <= 0) return false;
+
+    int numPixels = (int)(width * height);
+    uint8_t* writeIter = learner->pixels + (size_t)learner->numPixels * 4;
+    for(int ii=0; ii<numPixels; ii += kGifLearnStride)
+    {
+        memcpy(writeIter, image + (size_t)ii * 4, 4);
+        writeIter += 4;
+        ++learner->numPixels;
+    }
+
+    if(--learner->framesLeft > 0)
+        return false;
+
+    GifMakePaletteFromPixels(learner->pixels, learner->numPixels, bitDepth, dither, pPal);
+    GifLearnerFree(learner);
+    return true;
+}
+
+// Writes the file header and the dummy global palette, plus the looping extension
+// for animations (delay != 0)
+void GifWriteHeader( GifBuffer* out, uint32_t width, uint32_t height, uint32_t delay )
+{
+    GifBufferWrite(out, "GIF89a", 6);
+
+    // screen descriptor
+    GifBufferPut(out, width & 0xff);
+    GifBufferPut(out, (width >> 8) & 0xff);
+    GifBufferPut(out, height & 0xff);
+    GifBufferPut(out, (height >> 8) & 0xff);
+
+    GifBufferPut(out, 0xf0);  // there is an unsorted global color table of 2 entries
+    GifBufferPut(out, 0);     // background color
+    GifBufferPut(out, 0);     // pixels are square (we need to specify this because it's 1989)
+
+    // now the "global" palette (really just a dummy palette)
+    // color 0: black
+    GifBufferPut(out, 0);
+    GifBufferPut(out, 0);
+    GifBufferPut(out, 0);
+    // color 1: also black
+    GifBufferPut(out, 0);
+    GifBufferPut(out, 0);
+    GifBufferPut(out, 0);
+
+    if( delay != 0 )
+    {
+        // animation header
+        GifBufferPut(out, 0x21); // extension
+        GifBufferPut(out, 0xff); // application specific
+        GifBufferPut(out, 11); // length 11
+        GifBufferWrite(out, "NETSCAPE2.0", 11); // yes, really
+        GifBufferPut(out, 3); // 3 bytes of NETSCAPE2.0 data
+
+        GifBufferPut(out, 1); // this is the Netscape 2.0 sub-block ID and it must be 1, otherwise some viewers error
+        GifBufferPut(out, 0); // loop infinitely (byte 0)
+        GifBufferPut(out, 0); // loop infinitely (byte 1)
+
+        GifBufferPut(out, 0); // block terminator
+    }
+}
+
+// writes out whatever has been collected in the buffer and empties it
+void GifFlush( FILE* f, GifBuffer* buf )
+{
+    fwrite(buf->data, 1, buf->size, f);
+    buf->size = 0;
+}
+
+// GifWriter collects this much output before handing it to fwrite
+const size_t kGifFlushSize = 1 << 20;
+
 typedef struct
 {
     FILE* f;
     uint8_t* oldImage;
+    GifPalette* fixedPalette;   // palette shared by every frame, NULL to build one per frame
+    GifPaletteLearner learner;
+    GifEncoder encoder;
+    GifBuffer buffer;
     bool firstFrame;
+    bool exactPalette;     // skip the palette cache and always search the palette exactly
 
-    uint8_t padding[7];    // make padding explicit
+    uint8_t padding[6];    // make padding explicit
 } GifWriter;
 
 // Creates a gif file.
@@ -775,71 +1469,67 @@ bool GifBegin( GifWriter* writer, const char* filename, uint32_t width, uint32_t
     if(!writer->f) return false;
 
     writer->firstFrame = true;
+    writer->exactPalette = false;
+    writer->fixedPalette = NULL;
+    writer->learner.pixels = NULL;
+    writer->learner.numPixels = 0;
+    writer->learner.framesLeft = 0;
 
     // allocate
     writer->oldImage = (uint8_t*)GIF_MALLOC(width*height*4);
+    GifEncoderInit(&writer->encoder);
+    GifBufferInit(&writer->buffer);
 
-    fputs("GIF89a", writer->f);
+    GifBufferReserve(&writer->buffer, kGifFlushSize);
+    GifWriteHeader(&writer->buffer, width, height, delay);
 
-    // screen descriptor
-    fputc(width & 0xff, writer->f);
-    fputc((width >> 8) & 0xff, writer->f);
-    fputc(height & 0xff, writer->f);
-    fputc((height >> 8) & 0xff, writer->f);
-
-    fputc(0xf0, writer->f);  // there is an unsorted global color table of 2 entries
-    fputc(0, writer->f);     // background color
-    fputc(0, writer->f);     // pixels are square (we need to specify this because it's 1989)
-
-    // now the "global" palette (really just a dummy palette)
-    // color 0: black
-    fputc(0, writer->f);
-    fputc(0, writer->f);
-    fputc(0, writer->f);
-    // color 1: also black
-    fputc(0, writer->f);
-    fputc(0, writer->f);
-    fputc(0, writer->f);
+    return true;
+}
 
-    if( delay != 0 )
+// Makes every following frame use a copy of the given palette instead of building its own.
+// Passing NULL goes back to building a palette for each frame.
+void GifSetFixedPalette( GifWriter* writer, const GifPalette* pPal )
+{
+    if(pPal)
     {
-        // animation header
-        fputc(0x21, writer->f); // extension
-        fputc(0xff, writer->f); // application specific
-        fputc(11, writer->f); // length 11
-        fputs("NETSCAPE2.0", writer->f); // yes, really
-        fputc(3, writer->f); // 3 bytes of NETSCAPE2.0 data
-
-        fputc(1, writer->f); // this is the Netscape 2.0 sub-block ID and it must be 1, otherwise some viewers error
-        fputc(0, writer->f); // loop infinitely (byte 0)
-        fputc(0, writer->f); // loop infinitely (byte 1)
-
-        fputc(0, writer->f); // block terminator
+        if(!writer->fixedPalette)
+            writer->fixedPalette = (GifPalette*)GIF_MALLOC(sizeof(GifPalette));
+        memcpy(writer->fixedPalette, pPal, sizeof(GifPalette));
     }
+    else
+    {
+        GIF_FREE(writer->fixedPalette);
+        writer->fixedPalette = NULL;
+    }
+}
 
-    return true;
+// Samples the next numFrames frames (which still get their own palettes) and then
+// builds a fixed palette from them for the rest of the animation.
+void GifLearnPalette( GifWriter* writer, int numFrames, uint32_t width, uint32_t height )
+{
+    GifLearnerFree(&writer->learner);
+    GifLearnerBegin(&writer->learner, numFrames, width, height);
 }
 
 // Writes out a new frame to a GIF in progress.
 // The GIFWriter should have been created by GIFBegin.
 // AFAIK, it is legal to use different bit depths for different frames of an image -
 // this may be handy to save bits in animations that don't change much.
-bool GifWriteFrame( GifWriter* writer, const uint8_t* image, uint32_t width, uint32_t height, uint32_t delay, int bitDepth = 8, bool dither = false )
+bool GifWriteFrame( GifWriter* writer, const uint8_t* image, uint32_t width, uint32_t height, uint32_t delay, int bitDepth = 8, int dither = kGifDitherNone )
 {
     if(!writer->f) return false;
 
     const uint8_t* oldImage = writer->firstFrame? NULL : writer->oldImage;
     writer->firstFrame = false;
 
-    GifPalette pal;
-    GifMakePalette((dither? NULL : oldImage), image, width, height, bitDepth, dither, &pal);
-
-    if(dither)
-        GifDitherImage(oldImage, image, writer->oldImage, width, height, &pal);
-    else
-        GifThresholdImage(oldImage, image, writer->oldImage, width, height, &pal);
+    GifEncodeFrame(&writer->encoder, oldImage, image, writer->oldImage, width, height, delay, bitDepth, dither, writer->exactPalette, writer->fixedPalette, &writer->buffer);
+    if(writer->buffer.size >= kGifFlushSize)
+        GifFlush(writer->f, &writer->buffer);
 
-    GifWriteLzwImage(writer->f, writer->oldImage, 0, 0, width, height, delay, &pal);
+    // sampled after encoding, so the frame that completes the palette still used its own
+    GifPalette learned;
+    if(GifLearnerAddFrame(&writer->learner, image, width, height, bitDepth, dither, &learned))
+        GifSetFixedPalette(writer, &learned);
 
     return true;
 }
@@ -851,12 +1541,18 @@ bool GifEnd( GifWriter* writer )
 {
     if(!writer->f) return false;
 
-    fputc(0x3b, writer->f); // end of file
+    GifBufferPut(&writer->buffer, 0x3b); // end of file
+    GifFlush(writer->f, &writer->buffer);
     fclose(writer->f);
     GIF_FREE(writer->oldImage);
+    GIF_FREE(writer->fixedPalette);
+    GifLearnerFree(&writer->learner);
+    GifEncoderFree(&writer->encoder);
+    GifBufferFree(&writer->buffer);
 
     writer->f = NULL;
     writer->oldImage = NULL;
+    writer->fixedPalette = NULL;
 
     return true;
 }
@@ -0,0 +1,57 @@
+/*
+* Title: Aligned Vector
+* Description: std::vector whose storage starts on a cache line, for arrays that hot loops stream
+*              through and SIMD code loads from
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#if defined(_MSC_VER)
+#include <malloc.h>
+#endif
+
+// A cache line, which is also enough for any SIMD load
+const size_t ARRAY_ALIGNMENT = 64;
+
+template<typename T>
+struct AlignedAllocator {
+	using value_type = T;
+
+	AlignedAllocator() = default;
+	template<typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+
+	// The C++17 aligned operator new is not used, so this builds as C++14 as well
+	T* allocate(size_t count)
+	{
+		size_t size = count > 0 ? count * sizeof(T) : ARRAY_ALIGNMENT;
+#if defined(_MSC_VER)
+		void* memory = _aligned_malloc(size, ARRAY_ALIGNMENT);
+#else
+		void* memory = nullptr;
+		if (posix_memalign(&memory, ARRAY_ALIGNMENT, size) != 0)
+			memory = nullptr;
+#endif
+		if (memory == nullptr)
+			throw std::bad_alloc();
+		return (T*)memory;
+	}
+
+	void deallocate(T* pointer, size_t)
+	{
+#if defined(_MSC_VER)
+		_aligned_free(pointer);
+#else
+		free(pointer);
+#endif
+	}
+
+	template<typename U> bool operator==(const AlignedAllocator<U>&) const { return true; }
+	template<typename U> bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+
+template<typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
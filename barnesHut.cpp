@@ -0,0 +1,288 @@
+/*
+* Title: Barnes-Hut Gravity
+* Description: Implementation of the tree solver declared in barnesHut.h
+*
+* Every step:
+*   sort   the particles are put in Morton order (mortonOrder.h), copied into arrays of their own so that
+*          cells are contiguous in memory
+*   build  a cell splits its run of particles by the next 2 or 3 bits of the keys; its children go next
+*          to each other in the node arena, and its mass and center of mass are summed from them
+*   walk   the workers take batches of particles in Morton order, so that neighbouring particles walk
+*          much the same cells one after the other, and each walks the tree from the root
+* A cell is accepted as one mass when the particle lies outside the sphere around its center of mass of
+* radius size / openingAngle plus the offset of the center of mass from the center of the cell. The
+* offset keeps a particle from accepting a cell it sits in, however lopsided the cell is
+*/
+
+#include "barnesHut.h"
+#include "alignedVector.h"
+#include "gravityKernel.h"
+#include "mortonOrder.h"
+#include "taskScheduler.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// Cells with this many particles or fewer are not split; their particles are summed directly
+static const uint32_t LEAF_SIZE = 8;
+// Particles walk the tree in batches of this many, one batch per task
+static const size_t WALK_BATCH_SIZE = 128;
+
+struct BarnesHutSolver::State {
+	struct Node {
+		double centerOfMassX;
+		double centerOfMassY;
+		double centerOfMassZ;
+		double mass;
+		// Cells whose center of mass is further than this (squared) from a particle pull like one mass
+		double openingDistance2;
+		// Run of sorted particles in the cell
+		uint32_t begin;
+		uint32_t end;
+		// Children sit next to each other in the arena; a leaf has none
+		uint32_t firstChild;
+		uint32_t childCount;
+	};
+
+	int dimensions;
+	double openingAngle = 0.5;
+
+	// The particles in Morton order
+	MortonOrder morton;
+	AlignedVector<double> sortedMasses;
+	AlignedVector<double> sortedX;
+	AlignedVector<double> sortedY;
+	AlignedVector<double> sortedZ;
+	// The tree, rebuilt every step into the same storage
+	vector<Node> nodes;
+	// Sorted positions of the particles asked for, when only some are
+	vector<uint32_t> particleRanks;
+	vector<uint32_t> targetRanks;
+
+	State(int dimensions)
+		: dimensions(dimensions == 2 ? 2 : 3), morton(dimensions)
+	{
+	}
+
+	// Put the particles in Morton order, keeping their bounding cube in corner and size
+	void sortParticles(size_t count, const double* masses, const double* x, const double* y, const double* z, double* corner, double& size)
+	{
+		morton.sort(count, x, y, z, corner, size);
+		sortedMasses.resize(count);
+		sortedX.resize(count);
+		sortedY.resize(count);
+		sortedZ.resize(count);
+		morton.gather(masses, sortedMasses.data());
+		morton.gather(x, sortedX.data());
+		morton.gather(y, sortedY.data());
+		morton.gather(z, sortedZ.data());
+	}
+
+	// Fill in the node for the particles from begin to end, which share their keys above level, in the cell at
+	// corner with the given size; its children are added to the arena after everything already in it
+	void buildNode(uint32_t nodeIndex, uint32_t begin, uint32_t end, int level, const double* corner, double size)
+	{
+		if (end - begin > LEAF_SIZE && level < morton.levels()) {
+			uint32_t childBegins[9];
+			int childDigits[8];
+			int childCount = morton.split(begin, end, level, childBegins, childDigits);
+
+			uint32_t firstChild = (uint32_t)nodes.size();
+			nodes.resize(nodes.size() + childCount);
+			nodes[nodeIndex].firstChild = firstChild;
+			nodes[nodeIndex].childCount = childCount;
+			const double childSize = 0.5 * size;
+			for (int child = 0; child < childCount; child++) {
+				// Bit 0 of the digit is x, bit 1 y and bit 2 z
+				double childCorner[3] = { corner[0], corner[1], corner[2] };
+				for (int axis = 0; axis < dimensions; axis++) {
+					if (childDigits[child] & (1 << axis))
+						childCorner[axis] += childSize;
+				}
+				buildNode(firstChild + child, childBegins[child], childBegins[child + 1], level + 1, childCorner, childSize);
+			}
+		}
+		else {
+			nodes[nodeIndex].firstChild = 0;
+			nodes[nodeIndex].childCount = 0;
+		}
+
+		// Mass and center of mass, from the particles or the children
+		Node& node = nodes[nodeIndex];
+		node.begin = begin;
+		node.end = end;
+		double mass = 0.0, weightedX = 0.0, weightedY = 0.0, weightedZ = 0.0;
+		if (node.childCount == 0) {
+			for (uint32_t i = begin; i < end; i++) {
+				mass += sortedMasses[i];
+				weightedX += sortedMasses[i] * sortedX[i];
+				weightedY += sortedMasses[i] * sortedY[i];
+				weightedZ += sortedMasses[i] * sortedZ[i];
+			}
+		}
+		else {
+			for (uint32_t child = node.firstChild; child < node.firstChild + node.childCount; child++) {
+				const Node& childNode = nodes[child];
+				mass += childNode.mass;
+				weightedX += childNode.mass * childNode.centerOfMassX;
+				weightedY += childNode.mass * childNode.centerOfMassY;
+				weightedZ += childNode.mass * childNode.centerOfMassZ;
+			}
+		}
+		// Massless cells pull on nothing, and are skipped by the walk
+		double centerX = corner[0] + 0.5 * size;
+		double centerY = corner[1] + 0.5 * size;
+		double centerZ = dimensions == 2 ? 0.0 : corner[2] + 0.5 * size;
+		node.mass = mass;
+		node.centerOfMassX = mass > 0.0 ? weightedX / mass : centerX;
+		node.centerOfMassY = mass > 0.0 ? weightedY / mass : centerY;
+		node.centerOfMassZ = mass > 0.0 ? weightedZ / mass : centerZ;
+		// A flat cell has no z extent, so its particles' z only moves the center of mass
+		double offsetZ = dimensions == 2 ? 0.0 : node.centerOfMassZ - centerZ;
+		double offset = sqrt((node.centerOfMassX - centerX) * (node.centerOfMassX - centerX) + (node.centerOfMassY - centerY) * (node.centerOfMassY - centerY) + offsetZ * offsetZ);
+		double openingDistance = openingAngle > 0.0 ? size / openingAngle + offset : INFINITY;
+		node.openingDistance2 = openingDistance * openingDistance;
+	}
+
+	// Sort the particles and build the tree over them
+	void build(size_t count, const double* masses, const double* x, const double* y, const double* z)
+	{
+		double corner[3], size;
+		sortParticles(count, masses, x, y, z, corner, size);
+		// The arena only grows until it fits the largest tree: about two cells per leaf's worth of particles
+		nodes.reserve(2 * count / LEAF_SIZE + 1);
+		nodes.resize(1);
+		buildNode(0, 0, (uint32_t)count, 0, corner, size);
+	}
+
+	// Acceleration of sorted particle target, before it is scaled by G
+	void walk(uint32_t target, double softening2, double& accelerationX, double& accelerationY, double& accelerationZ) const
+	{
+		const double x = sortedX[target], y = sortedY[target], z = sortedZ[target];
+		double ax = 0.0, ay = 0.0, az = 0.0;
+		uint32_t stack[64 * 8];
+		int stackSize = 0;
+		stack[stackSize++] = 0;
+		while (stackSize > 0) {
+			const Node& node = nodes[stack[--stackSize]];
+			if (node.mass == 0.0)
+				continue;
+			double dx = node.centerOfMassX - x;
+			double dy = node.centerOfMassY - y;
+			double dz = node.centerOfMassZ - z;
+			double distance2 = dx * dx + dy * dy + dz * dz;
+			if (distance2 > node.openingDistance2) {
+				// Far enough away to pull like one mass
+				double inverseDistance = 1.0 / sqrt(distance2 + softening2);
+				double pull = node.mass * inverseDistance * inverseDistance * inverseDistance;
+				ax += dx * pull;
+				ay += dy * pull;
+				az += dz * pull;
+			}
+			else if (node.childCount == 0) {
+				// The target itself is either at no distance or pulls straight at itself, which adds nothing
+				accumulateGravity(x, y, z, node.end - node.begin, &sortedMasses[node.begin], &sortedX[node.begin], &sortedY[node.begin], &sortedZ[node.begin],
+					softening2, ax, ay, az);
+			}
+			else {
+				for (uint32_t child = node.firstChild; child < node.firstChild + node.childCount; child++)
+					stack[stackSize++] = child;
+			}
+		}
+		accelerationX = ax;
+		accelerationY = ay;
+		accelerationZ = az;
+	}
+};
+
+BarnesHutSolver::BarnesHutSolver(int dimensions)
+	: state(make_unique<State>(dimensions))
+{
+}
+
+BarnesHutSolver::~BarnesHutSolver() = default;
+
+void BarnesHutSolver::setOpeningAngle(double openingAngle)
+{
+	state->openingAngle = max(openingAngle, 0.0);
+}
+
+double BarnesHutSolver::openingAngle() const
+{
+	return state->openingAngle;
+}
+
+int BarnesHutSolver::dimensions() const
+{
+	return state->dimensions;
+}
+
+size_t BarnesHutSolver::nodeCount() const
+{
+	return state->nodes.size();
+}
+
+void BarnesHutSolver::computeAccelerations(size_t count, const double* masses, const double* positionsX, const double* positionsY, const double* positionsZ,
+	double gravitationalConstant, double softening, double* accelerationsX, double* accelerationsY, double* accelerationsZ)
+{
+	State& s = *state;
+	s.nodes.clear();
+	if (count == 0)
+		return;
+	s.build(count, masses, positionsX, positionsY, positionsZ);
+
+	const double softening2 = softening * softening;
+	const int batchCount = (int)((count + WALK_BATCH_SIZE - 1) / WALK_BATCH_SIZE);
+	const vector<uint32_t>& order = s.morton.order();
+	TaskScheduler::shared().parallelFor(batchCount, [&](int batch) {
+		size_t end = min(count, (batch + 1) * WALK_BATCH_SIZE);
+		for (size_t i = batch * WALK_BATCH_SIZE; i < end; i++) {
+			double ax, ay, az;
+			s.walk((uint32_t)i, softening2, ax, ay, az);
+			uint32_t particle = order[i];
+			accelerationsX[particle] = gravitationalConstant * ax;
+			accelerationsY[particle] = gravitationalConstant * ay;
+			accelerationsZ[particle] = gravitationalConstant * az;
+		}
+	});
+}
+
+void BarnesHutSolver::computeAccelerations(size_t count, const double* masses, const double* positionsX, const double* positionsY, const double* positionsZ,
+	const uint32_t* targets, size_t targetCount, double gravitationalConstant, double softening,
+	double* accelerationsX, double* accelerationsY, double* accelerationsZ)
+{
+	State& s = *state;
+	s.nodes.clear();
+	if (count == 0 || targetCount == 0)
+		return;
+	s.build(count, masses, positionsX, positionsY, positionsZ);
+
+	// The targets are walked in Morton order too, so that neighbours still walk the same cells one after the other
+	const vector<uint32_t>& order = s.morton.order();
+	s.particleRanks.resize(count);
+	for (size_t i = 0; i < count; i++)
+		s.particleRanks[order[i]] = (uint32_t)i;
+	s.targetRanks.resize(targetCount);
+	for (size_t k = 0; k < targetCount; k++)
+		s.targetRanks[k] = s.particleRanks[targets[k]];
+	sort(s.targetRanks.begin(), s.targetRanks.end());
+
+	const double softening2 = softening * softening;
+	const int batchCount = (int)((targetCount + WALK_BATCH_SIZE - 1) / WALK_BATCH_SIZE);
+	TaskScheduler::shared().parallelFor(batchCount, [&](int batch) {
+		size_t end = min(targetCount, (batch + 1) * WALK_BATCH_SIZE);
+		for (size_t k = batch * WALK_BATCH_SIZE; k < end; k++) {
+			double ax, ay, az;
+			uint32_t rank = s.targetRanks[k];
+			s.walk(rank, softening2, ax, ay, az);
+			uint32_t particle = order[rank];
+			accelerationsX[particle] = gravitationalConstant * ax;
+			accelerationsY[particle] = gravitationalConstant * ay;
+			accelerationsZ[particle] = gravitationalConstant * az;
+		}
+	});
+}
@@ -0,0 +1,48 @@
+/*
+* Title: Barnes-Hut Gravity
+* Description: Approximate gravity for large numbers of particles in O(N log N) rather than O(N^2). The
+*              particles are sorted along a Morton (Z-order) curve, so every cell of the tree holds a
+*              contiguous run of them, and the tree is built over those runs into a node arena that is kept
+*              from one step to the next. A cell that is far away compared with its size pulls like a single
+*              mass at its center of mass. The tree is a quadtree over x and y for flat systems, or an octree
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+class BarnesHutSolver {
+public:
+	// dimensions is 2 for a quadtree, which only splits space along x and y, or 3 for an octree
+	// The particles are walked on the shared task scheduler
+	explicit BarnesHutSolver(int dimensions = 3);
+	~BarnesHutSolver();
+
+	BarnesHutSolver(const BarnesHutSolver&) = delete;
+	BarnesHutSolver& operator=(const BarnesHutSolver&) = delete;
+
+	// A cell counts as one mass once its size is less than openingAngle times its distance (less the offset of
+	// its center of mass from its center). 0 opens every cell, which is exact; 0.5 is a common balance
+	void setOpeningAngle(double openingAngle);
+	double openingAngle() const;
+	int dimensions() const;
+
+	// Write the acceleration of each of count particles. Forces are scaled by gravitationalConstant, and softening
+	// is added to every distance like in NBodySimulation
+	void computeAccelerations(size_t count, const double* masses, const double* positionsX, const double* positionsY, const double* positionsZ,
+		double gravitationalConstant, double softening, double* accelerationsX, double* accelerationsY, double* accelerationsZ);
+	// The same for only the targetCount particles listed in targets, out of a tree over all count of them; the other
+	// accelerations are left as they were. For block time steps, where only some particles need their forces
+	void computeAccelerations(size_t count, const double* masses, const double* positionsX, const double* positionsY, const double* positionsZ,
+		const uint32_t* targets, size_t targetCount, double gravitationalConstant, double softening,
+		double* accelerationsX, double* accelerationsY, double* accelerationsZ);
+
+	// Cells in the tree built by the last call
+	size_t nodeCount() const;
+
+private:
+	struct State;
+	std::unique_ptr<State> state;
+};
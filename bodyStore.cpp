@@ -0,0 +1,298 @@
+/*
+* Title: Body Store
+* Description: Keeps the hot arrays, the cold table and the handle slots of the bodies in step, and the
+*              arrays in depth first order of the hierarchy
+*/
+
+#include "bodyStore.h"
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <utility>
+
+const uint32_t NO_INDEX = UINT32_MAX;
+
+BodyHandle BodyStore::add(BodyHandle parent, const BodyMotion& motion, BodyRenderInfo info)
+{
+	// Reuse the slot of a removed body; its generation was moved on when it was removed
+	uint32_t slot;
+	if (!freeSlots.empty()) {
+		slot = freeSlots.back();
+		freeSlots.pop_back();
+	}
+	else {
+		slot = (uint32_t)slotIndices.size();
+		slotIndices.push_back(NO_INDEX);
+		slotGenerations.push_back(0);
+	}
+	uint32_t index = (uint32_t)size();
+	slotIndices[slot] = index;
+	bodySlots.push_back(slot);
+
+	parents.push_back(indexOf(parent));
+	subtreeEnds.push_back(index + 1);
+	moveSpeeds.push_back(motion.moveSpeed);
+	orbitRadiiX.push_back(motion.orbitRadiusX);
+	orbitRadiiY.push_back(motion.orbitRadiusY);
+	scales.push_back(motion.scale);
+	rotationSpeeds.push_back(motion.rotationSpeed);
+	isVisible.push_back(motion.isVisible);
+	isPlaced.push_back(false);
+	positionsX.push_back(0.0f);
+	positionsY.push_back(0.0f);
+	isShown.push_back(false);
+	renderInfo.push_back(std::move(info));
+	drawOrder.push_back(index);
+	isChanged.push_back(true);
+	isMoving.push_back(false);
+	isSubtreeChanged.push_back(true);
+	isSubtreeMoving.push_back(false);
+	isUpdated.push_back(false);
+
+	// A body at the end is only in its place in the hierarchy if it orbits the center
+	isOrderStale |= parents.back() >= 0;
+	isSummaryStale = true;
+	return { slot, slotGenerations[slot] };
+}
+
+bool BodyStore::setParent(BodyHandle body, BodyHandle parent)
+{
+	int index = indexOf(body);
+	int parentIndex = indexOf(parent);
+	if (index < 0)
+		return false;
+	for (int ancestor = parentIndex; ancestor >= 0; ancestor = parents[ancestor]) {
+		if (ancestor == index)
+			return false;
+	}
+	parents[index] = parentIndex;
+	isOrderStale = true;
+	markChanged(index);
+	return true;
+}
+
+void BodyStore::remove(BodyHandle body)
+{
+	int removedIndex = indexOf(body);
+	if (removedIndex < 0)
+		return;
+
+	// In depth first order the body's subtree is the bodies right after it
+	if (isOrderStale)
+		sortByHierarchy();
+	removedIndex = indexOf(body);
+	std::vector<uint32_t> kept;
+	kept.reserve(size());
+	for (size_t i = 0; i < size(); i++) {
+		if (i >= (size_t)removedIndex && i < subtreeEnds[removedIndex]) {
+			// Old handles to the body stop matching its slot
+			uint32_t slot = bodySlots[i];
+			slotIndices[slot] = NO_INDEX;
+			slotGenerations[slot]++;
+			freeSlots.push_back(slot);
+		}
+		else {
+			kept.push_back((uint32_t)i);
+		}
+	}
+	keepOnly(kept);
+	isSummaryStale = true;
+}
+
+void BodyStore::markChanged(size_t index)
+{
+	isChanged[index] = true;
+	isSummaryStale = true;
+}
+
+void BodyStore::placeAt(size_t index, float x, float y)
+{
+	positionsX[index] = x;
+	positionsY[index] = y;
+	isChanged[index] = true;
+	if (!isPlaced[index]) {
+		// It no longer moves along its orbit
+		isPlaced[index] = true;
+		isSummaryStale = true;
+	}
+	// Bodies are placed every frame, so rather than working out the whole summary again, flag the subtrees
+	// holding the body; once one is flagged, so are all the ones above it
+	if (!isOrderStale && !isSummaryStale) {
+		for (int32_t body = (int32_t)index; body >= 0 && !isSubtreeChanged[body]; body = parents[body])
+			isSubtreeChanged[body] = true;
+	}
+}
+
+bool BodyStore::contains(BodyHandle body) const
+{
+	return indexOf(body) >= 0;
+}
+
+int BodyStore::indexOf(BodyHandle body) const
+{
+	if (body.slot >= slotIndices.size() || slotGenerations[body.slot] != body.generation || slotIndices[body.slot] == NO_INDEX)
+		return -1;
+	return (int)slotIndices[body.slot];
+}
+
+BodyHandle BodyStore::handleAt(size_t index) const
+{
+	if (index >= size())
+		return {};
+	uint32_t slot = bodySlots[index];
+	return { slot, slotGenerations[slot] };
+}
+
+void BodyStore::updatePositions(double time)
+{
+	if (isOrderStale)
+		sortByHierarchy();
+	if (isSummaryStale)
+		summarize();
+
+	const size_t count = size();
+	// Same single precision time the bodies have always been moved with
+	const float bodyTime = (float)time;
+	const bool isTimeChanged = !hasUpdated || time != lastUpdateTime;
+	lastUpdateTime = time;
+	hasUpdated = true;
+
+	const int32_t* parentIndices = parents.data();
+	float* x = positionsX.data();
+	float* y = positionsY.data();
+	size_t i = 0;
+	while (i < count) {
+		int32_t parent = parentIndices[i];
+		// A body is only reached when its parent was, so the parent's flag is from this update
+		bool isParentUpdated = parent >= 0 && isUpdated[parent];
+		if (!isParentUpdated && !isSubtreeChanged[i] && !(isTimeChanged && isSubtreeMoving[i])) {
+			i = subtreeEnds[i];
+			continue;
+		}
+
+		isUpdated[i] = isParentUpdated || isChanged[i] || (isTimeChanged && isMoving[i]);
+		if (isUpdated[i]) {
+			if (!isPlaced[i]) {
+				float angle = bodyTime * moveSpeeds[i];
+				x[i] = orbitRadiiX[i] * cosf(angle);
+				y[i] = orbitRadiiY[i] * sinf(angle);
+				if (parent >= 0) {
+					x[i] += x[parent];
+					y[i] += y[parent];
+				}
+			}
+			isShown[i] = isVisible[i] && (parent < 0 || isShown[parent]);
+		}
+		// Every changed body is reached, as the subtrees holding it are never skipped
+		isChanged[i] = false;
+		isSubtreeChanged[i] = false;
+		i++;
+	}
+}
+
+void BodyStore::sortByHierarchy()
+{
+	// Children of each body, in their current order, with the bodies orbiting the center at the end
+	const size_t count = size();
+	std::vector<uint32_t> childStarts(count + 3, 0);
+	for (size_t i = 0; i < count; i++)
+		childStarts[(parents[i] >= 0 ? parents[i] : count) + 2]++;
+	for (size_t i = 2; i < childStarts.size(); i++)
+		childStarts[i] += childStarts[i - 1];
+	std::vector<uint32_t> children(count);
+	for (size_t i = 0; i < count; i++)
+		children[childStarts[(parents[i] >= 0 ? parents[i] : count) + 1]++] = (uint32_t)i;
+
+	// Depth first, pushing children last to first so they come out first to last
+	std::vector<uint32_t> order;
+	order.reserve(count);
+	std::vector<uint32_t> stack;
+	auto pushChildren = [&](size_t parent) {
+		for (uint32_t child = childStarts[parent + 1]; child > childStarts[parent]; child--)
+			stack.push_back(children[child - 1]);
+	};
+	pushChildren(count);
+	while (!stack.empty()) {
+		uint32_t body = stack.back();
+		stack.pop_back();
+		order.push_back(body);
+		pushChildren(body);
+	}
+
+	keepOnly(order);
+	isOrderStale = false;
+	isSummaryStale = true;
+}
+
+void BodyStore::summarize()
+{
+	const size_t count = size();
+	for (size_t i = 0; i < count; i++) {
+		isMoving[i] = !isPlaced[i] && moveSpeeds[i] != 0.0f && (orbitRadiiX[i] != 0.0f || orbitRadiiY[i] != 0.0f);
+		isSubtreeMoving[i] = isMoving[i];
+		isSubtreeChanged[i] = isChanged[i];
+	}
+	// Children come after their parents, so going backwards each body is complete before it is passed up
+	for (size_t i = count; i-- > 0;) {
+		if (parents[i] >= 0) {
+			isSubtreeMoving[parents[i]] |= isSubtreeMoving[i];
+			isSubtreeChanged[parents[i]] |= isSubtreeChanged[i];
+		}
+	}
+	isSummaryStale = false;
+}
+
+void BodyStore::keepOnly(const std::vector<uint32_t>& indices)
+{
+	// Where each old index went, to point parents and the drawing order at their new place
+	std::vector<int32_t> newIndices(size(), -1);
+	for (size_t i = 0; i < indices.size(); i++)
+		newIndices[indices[i]] = (int32_t)i;
+
+	auto gather = [&](auto& values) {
+		std::remove_reference_t<decltype(values)> gathered;
+		gathered.reserve(indices.size());
+		for (uint32_t index : indices)
+			gathered.push_back(std::move(values[index]));
+		values.swap(gathered);
+	};
+	gather(parents);
+	gather(moveSpeeds);
+	gather(orbitRadiiX);
+	gather(orbitRadiiY);
+	gather(scales);
+	gather(rotationSpeeds);
+	gather(isVisible);
+	gather(isPlaced);
+	gather(positionsX);
+	gather(positionsY);
+	gather(isShown);
+	gather(renderInfo);
+	gather(isChanged);
+	gather(isMoving);
+	gather(isSubtreeChanged);
+	gather(isSubtreeMoving);
+	gather(isUpdated);
+	gather(bodySlots);
+
+	subtreeEnds.resize(size());
+	for (size_t i = 0; i < size(); i++) {
+		if (parents[i] >= 0)
+			parents[i] = newIndices[parents[i]];
+		subtreeEnds[i] = (uint32_t)i + 1;
+		slotIndices[bodySlots[i]] = (uint32_t)i;
+	}
+	// Each subtree ends where the last of its children's subtrees does
+	for (size_t i = size(); i-- > 0;) {
+		if (parents[i] >= 0)
+			subtreeEnds[parents[i]] = std::max(subtreeEnds[parents[i]], subtreeEnds[i]);
+	}
+
+	std::vector<uint32_t> keptDrawOrder;
+	keptDrawOrder.reserve(size());
+	for (uint32_t index : drawOrder) {
+		if (newIndices[index] >= 0)
+			keptDrawOrder.push_back((uint32_t)newIndices[index]);
+	}
+	drawOrder.swap(keptDrawOrder);
+}
@@ -0,0 +1,137 @@
+/*
+* Title: Body Store
+* Description: The bodies of the scene as a structure of arrays. The fields that change or are read
+*              every frame (speeds, orbit radii, scale, positions) live in one contiguous, cache-line
+*              aligned array each, so the per-frame update only streams through what it uses and can
+*              be vectorized; names, buffers, textures, colors and flags sit in a separate table that is
+*              only read while drawing or by the UI. Bodies are referred to by handles that stay valid
+*              while other bodies are added, removed or moved around in the arrays
+*
+*              Bodies orbit each other to any depth (star, planet, moon, a moon's moon...). The arrays keep
+*              the hierarchy flattened depth first: every body comes after its parent and is followed by
+*              everything orbiting it, so world positions resolve in one pass, and a body whose subtree
+*              neither moves nor was changed is skipped together with that subtree. The order bodies are
+*              drawn in is kept apart from that, in drawOrder
+*/
+
+#pragma once
+
+#include "alignedVector.h"
+#include "scene.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+// Refers to one body for as long as it exists; a handle to a removed body is never valid again
+struct BodyHandle {
+	uint32_t slot = UINT32_MAX;
+	uint32_t generation = 0;
+
+	bool operator==(const BodyHandle& other) const { return slot == other.slot && generation == other.generation; }
+	bool operator!=(const BodyHandle& other) const { return !(*this == other); }
+};
+
+// The cold part of a body: what drawing and the UI need, but the per-frame update does not
+struct BodyRenderInfo {
+	std::string name;
+	unsigned int VAO;         // Vertex Array Object for the body
+	unsigned int orbitVAO;    // Vertex Array Object for the orbit, or 0 if the orbit is not drawn
+	unsigned int textureID;   // 0 draws the body in its color
+	int segments;             // Number of segments for rendering
+	glm::vec4 color;
+	glm::vec4 orbitColor;
+	bool isScale;             // Flag for scaling
+	bool isTranslate;         // Flag for translation
+	bool isRotate;            // Flag for rotation
+	bool isDrawAsRing;        // Drawn as an outline around the parent
+	std::vector<SceneAsteroidRing> asteroidRings;	// Set for asteroid belts, which draw many small copies of the body instead
+	float asteroidSpeed;      // Speed of each asteroid around its place in the belt
+	std::vector<glm::vec2> asteroidPositions;	// Where each asteroid is, ring by ring, when gravity moves them instead
+};
+
+// The hot part of a body, as it is added
+struct BodyMotion {
+	float moveSpeed;          // Radians per second around the parent
+	float orbitRadiusX;
+	float orbitRadiusY;
+	float scale;
+	float rotationSpeed;      // Degrees per second
+	bool isVisible;
+};
+
+class BodyStore {
+public:
+	// Per-body arrays, all indexed the same way. Once updatePositions has run, parents come before their
+	// children and each body is followed by its whole subtree, which ends just before subtreeEnds
+	AlignedVector<int32_t> parents;		// Index of the body orbited, or -1 for the center of the scene
+	AlignedVector<uint32_t> subtreeEnds;
+	AlignedVector<float> moveSpeeds;
+	AlignedVector<float> orbitRadiiX;
+	AlignedVector<float> orbitRadiiY;
+	AlignedVector<float> scales;
+	AlignedVector<float> rotationSpeeds;
+	AlignedVector<uint8_t> isVisible;	// Set by the user
+	AlignedVector<uint8_t> isPlaced;	// Put in place by placeAt instead of going around its orbit
+	// Written by updatePositions
+	AlignedVector<float> positionsX;
+	AlignedVector<float> positionsY;
+	AlignedVector<uint8_t> isShown;		// Visible, and so is everything it orbits
+	// The cold table, indexed like the arrays above
+	std::vector<BodyRenderInfo> renderInfo;
+	// Indices of the bodies in the order they are drawn, the order they were added in
+	std::vector<uint32_t> drawOrder;
+
+	size_t size() const { return parents.size(); }
+
+	// Add a body, drawn over the ones before it; parent must be a body in the store, or an invalid handle
+	// for the center of the scene
+	BodyHandle add(BodyHandle parent, const BodyMotion& motion, BodyRenderInfo info);
+	// Make a body orbit another one (or the center, with an invalid handle), taking its subtree along
+	// Returns false, changing nothing, if the body would end up orbiting itself
+	bool setParent(BodyHandle body, BodyHandle parent);
+	// Remove a body together with everything orbiting it; the other bodies keep their order and handles
+	void remove(BodyHandle body);
+	// Has to be called after changing the speed, orbit or visibility of the body at index in the arrays
+	void markChanged(size_t index);
+	// Put a body at a world position from now on, instead of on its orbit; placed by something else, such as
+	// a physics simulation, it stays there until placed again. Bodies orbiting it follow it on the next update
+	void placeAt(size_t index, float x, float y);
+
+	bool contains(BodyHandle body) const;
+	// Where a body is in the arrays, or -1 if it is not in the store
+	int indexOf(BodyHandle body) const;
+	BodyHandle handleAt(size_t index) const;
+
+	// Place every body for the given simulation time, in one pass in array order: each body goes on its
+	// orbit around its parent, which is already in place (placed bodies stay where they were put). Subtrees
+	// where nothing moves are skipped: their
+	// bodies have no speed or orbit (or the time is the same as last time), none of them was changed, and
+	// the body they orbit stayed where it was
+	void updatePositions(double time);
+
+private:
+	// Flatten the hierarchy depth first, keeping bodies with the same parent in their current order
+	void sortByHierarchy();
+	// Work out which bodies move with time, and which subtrees hold a changed or moving body
+	void summarize();
+	// Keep only the bodies at the given indices, in that order
+	void keepOnly(const std::vector<uint32_t>& indices);
+
+	AlignedVector<uint8_t> isChanged;			// Changed since the last update
+	AlignedVector<uint8_t> isMoving;			// Goes around its parent as time passes
+	AlignedVector<uint8_t> isSubtreeChanged;
+	AlignedVector<uint8_t> isSubtreeMoving;
+	AlignedVector<uint8_t> isUpdated;			// Placed again by the last update
+	bool isOrderStale = false;
+	bool isSummaryStale = true;
+	double lastUpdateTime = 0.0;
+	bool hasUpdated = false;
+
+	// Slot of each body in the arrays, and the array index and generation of each slot
+	std::vector<uint32_t> bodySlots;
+	std::vector<uint32_t> slotIndices;
+	std::vector<uint32_t> slotGenerations;
+	std::vector<uint32_t> freeSlots;
+};
@@ -0,0 +1,624 @@
+/*
+* Title: Frame Capture
+* Description: Implementation of the recording sinks declared in capture.h
+*/
+
+#include "capture.h"
+#include "frameCodec.h"
+#include "frameScale.h"
+#include "gif.h"
+#include "taskScheduler.h"
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+
+using namespace std;
+
+/*---------------------------------------------------------------------------------------------
+GIF pipeline
+Each frame only depends on its own pixels and the pixels of the frame before it (which decide
+what can be left transparent), so frames are palettized and compressed concurrently and the
+finished image blocks are put back in order when they are written
+-----------------------------------------------------------------------------------------------*/
+
+// With sampled palettes, each frame's palette is seeded from the one built this many frames earlier
+// It does not depend on the thread count, so the GIF comes out the same however many threads encode it,
+// but it also caps how many sampled frames can be encoded at once
+static const uint64_t SAMPLED_PALETTE_LAG = 16;
+
+// Encoder state and scratch memory used by one frame at a time
+struct EncoderSlot {
+	GifEncoder encoder;
+	vector<uint8_t> quantized;	// palettized frame, palette index in alpha
+	// The frame and the one before it shrunk to the output size, when the pipeline downscales
+	vector<uint8_t> scaledFrame;
+	vector<uint8_t> scaledPrevious;
+};
+
+struct GifPipeline::State {
+	FILE* file = nullptr;
+	// Size of the submitted frames, and of the GIF after they are shrunk by scaleDivisor
+	uint32_t sourceWidth = 0;
+	uint32_t sourceHeight = 0;
+	int scaleDivisor = 1;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	int bitDepth = 8;
+	int dither = kGifDitherNone;
+	bool exactPalette = false;
+	bool sampledPalette = false;
+	int duplicateTolerance = 0;
+
+	// The frames being encoded
+	TaskGroup encodes;
+	// At most this many frames are queued or being encoded, which bounds memory use
+	uint64_t maxFramesInFlight = 0;
+
+	// The last submitted frame, kept for the frame after it to compare against
+	shared_ptr<const vector<uint8_t>> previousFrame;
+	shared_ptr<const GifPalette> fixedPalette;
+	GifPaletteLearner learner = {};
+
+	mutex lock;
+	condition_variable frameWritten;
+	uint64_t submittedFrames = 0;
+	uint64_t writtenFrames = 0;
+	// Encoded frames waiting for the frames before them to be written
+	map<uint64_t, GifBuffer> finishedFrames;
+	// Delays of the frames not written yet; the newest one grows while repeats of it are dropped
+	map<uint64_t, uint32_t> frameDelays;
+	// The part of the newest frame's delay that is only a guess, replaced once the next frame tells how long it stayed up
+	uint32_t guessedDelay = 0;
+	vector<unique_ptr<EncoderSlot>> idleEncoders;
+	// Sampled palettes by frame, kept until the frame SAMPLED_PALETTE_LAG later is submitted; null if the frame did not build one
+	map<uint64_t, shared_ptr<const GifPalette>> sampledPalettes;
+	// Output buffers of frames already written, kept so their memory can be reused
+	vector<GifBuffer> spareBuffers;
+
+	// Write out every finished frame that is next in line; call with the lock held
+	// The newest frame waits for the one after it (or the end of the recording), since its delay can still change
+	void writeFinishedFrames(bool isEnding)
+	{
+		for (auto next = finishedFrames.find(writtenFrames); next != finishedFrames.end(); next = finishedFrames.find(writtenFrames)) {
+			if (!isEnding && writtenFrames + 1 == submittedFrames)
+				break;
+			GifSetFrameDelay(&next->second, frameDelays[writtenFrames]);
+			frameDelays.erase(writtenFrames);
+			GifFlush(file, &next->second);
+			spareBuffers.push_back(next->second);
+			finishedFrames.erase(next);
+			writtenFrames++;
+		}
+	}
+};
+
+// fopen is flagged as unsafe by MSVC
+static FILE* openFile(const char* path, const char* mode)
+{
+#if defined(_MSC_VER)
+	FILE* file = nullptr;
+	fopen_s(&file, path, mode);
+	return file;
+#else
+	return fopen(path, mode);
+#endif
+}
+
+GifPipeline::GifPipeline() : state(make_unique<State>()) {}
+
+GifPipeline::~GifPipeline()
+{
+	end();
+}
+
+// The modes are handed to gif.h as they are
+static_assert((int)GIF_DITHER_NONE == kGifDitherNone && (int)GIF_DITHER_FLOYD_STEINBERG == kGifDitherFloydSteinberg && (int)GIF_DITHER_ORDERED == kGifDitherOrdered,
+	"GifDitherMode must match the gif.h dither values");
+
+bool GifPipeline::begin(const char* filename, int width, int height, int delay, int bitDepth, GifDitherMode dither)
+{
+	end();
+
+	State& s = *state;
+	s.file = openFile(filename, "wb");
+	if (s.file == nullptr)
+		return false;
+
+	s.sourceWidth = (uint32_t)width;
+	s.sourceHeight = (uint32_t)height;
+	s.width = (uint32_t)scaledFrameSize(width, s.scaleDivisor);
+	s.height = (uint32_t)scaledFrameSize(height, s.scaleDivisor);
+	s.bitDepth = bitDepth;
+	s.dither = dither;
+	s.submittedFrames = 0;
+	s.writtenFrames = 0;
+	s.guessedDelay = 0;
+	s.sampledPalettes.clear();
+
+	s.maxFramesInFlight = 2 * (uint64_t)TaskScheduler::shared().threadCount();
+
+	GifBuffer header;
+	GifBufferInit(&header);
+	GifWriteHeader(&header, s.width, s.height, (uint32_t)delay);
+	GifFlush(s.file, &header);
+	GifBufferFree(&header);
+	return true;
+}
+
+void GifPipeline::setPaletteFromSamples(vector<uint8_t>& samples)
+{
+	auto palette = make_shared<GifPalette>();
+	GifMakePaletteFromPixels(samples.data(), (int)(samples.size() / 4), state->bitDepth, state->dither != kGifDitherNone, palette.get());
+	state->fixedPalette = palette;
+}
+
+void GifPipeline::learnPalette(int frameCount)
+{
+	GifLearnerFree(&state->learner);
+	GifLearnerBegin(&state->learner, frameCount, state->sourceWidth, state->sourceHeight);
+}
+
+void GifPipeline::setExactPalette(bool exact)
+{
+	state->exactPalette = exact;
+}
+
+void GifPipeline::setSampledPalette(bool sampled)
+{
+	state->sampledPalette = sampled;
+}
+
+void GifPipeline::setDownscale(int divisor)
+{
+	state->scaleDivisor = min(max(divisor, 1), MAX_FRAME_SCALE_DIVISOR);
+}
+
+void GifPipeline::setDuplicateTolerance(int tolerance)
+{
+	state->duplicateTolerance = max(tolerance, -1);
+}
+
+bool GifPipeline::isOpen() const
+{
+	return state->file != nullptr;
+}
+
+void GifPipeline::submitFrame(const uint8_t* rgba, int delay)
+{
+	State& s = *state;
+	if (s.file == nullptr)
+		return;
+
+	size_t frameSize = (size_t)s.sourceWidth * s.sourceHeight * 4;
+	// The delay is how long the newest frame stayed up, in place of the guess it was given
+	if (s.submittedFrames > 0) {
+		lock_guard<mutex> guard(s.lock);
+		uint32_t& newestDelay = s.frameDelays[s.submittedFrames - 1];
+		newestDelay = min(newestDelay - s.guessedDelay + (uint32_t)delay, 0xffffu);
+		s.guessedDelay = 0;
+	}
+	// A repeat of the last frame kept is not encoded at all; that frame just stays up for longer
+	// The delay field is 16 bits, so a very long pause still starts a new frame now and then
+	if (s.previousFrame && s.duplicateTolerance >= 0 && framesMatch(rgba, s.previousFrame->data(), frameSize, s.duplicateTolerance)) {
+		lock_guard<mutex> guard(s.lock);
+		uint32_t& newestDelay = s.frameDelays[s.submittedFrames - 1];
+		if (newestDelay + (uint32_t)delay <= 0xffff) {
+			newestDelay += (uint32_t)delay;
+			s.guessedDelay = (uint32_t)delay;
+			return;
+		}
+	}
+
+	auto frame = make_shared<const vector<uint8_t>>(rgba, rgba + frameSize);
+	uint64_t frameIndex;
+	shared_ptr<const GifPalette> seedPalette;
+	{
+		unique_lock<mutex> guard(s.lock);
+		// A sampled palette also waits for the frame it is seeded from, which was submitted long enough ago to be done by now
+		bool isSeeded = s.sampledPalette && s.submittedFrames >= SAMPLED_PALETTE_LAG;
+		s.frameWritten.wait(guard, [&s, isSeeded] {
+			return s.submittedFrames - s.writtenFrames < s.maxFramesInFlight && (!isSeeded || s.sampledPalettes.count(s.submittedFrames - SAMPLED_PALETTE_LAG));
+		});
+		frameIndex = s.submittedFrames++;
+		// Until the next frame comes, this one is guessed to stay up as long as the one before it
+		s.frameDelays[frameIndex] = (uint32_t)delay;
+		s.guessedDelay = (uint32_t)delay;
+		if (isSeeded) {
+			auto seed = s.sampledPalettes.find(frameIndex - SAMPLED_PALETTE_LAG);
+			seedPalette = seed->second;
+			s.sampledPalettes.erase(s.sampledPalettes.begin(), next(seed));
+		}
+	}
+
+	auto previousFrame = s.previousFrame;
+	s.previousFrame = frame;
+
+	// Runs on the scheduler: encode the frame, then write out every frame that is now next in line
+	TaskScheduler::shared().run(s.encodes, [&s, frameIndex, frame, previousFrame, palette = s.fixedPalette, delay, exactPalette = s.exactPalette,
+					sampledPalette = s.sampledPalette, seedPalette] {
+		unique_ptr<EncoderSlot> slot;
+		GifBuffer encoded;
+		GifBufferInit(&encoded);
+		{
+			lock_guard<mutex> guard(s.lock);
+			if (!s.idleEncoders.empty()) {
+				slot = move(s.idleEncoders.back());
+				s.idleEncoders.pop_back();
+			}
+			if (!s.spareBuffers.empty()) {
+				encoded = s.spareBuffers.back();
+				s.spareBuffers.pop_back();
+			}
+		}
+		if (!slot) {
+			slot = make_unique<EncoderSlot>();
+			GifEncoderInit(&slot->encoder);
+			slot->quantized.resize((size_t)s.width * s.height * 4);
+		}
+
+		// Everything after this works at the output size, palette building included
+		const uint8_t* image = frame->data();
+		const uint8_t* lastImage = previousFrame ? previousFrame->data() : NULL;
+		if (s.scaleDivisor > 1) {
+			slot->scaledFrame.resize((size_t)s.width * s.height * 4);
+			downscaleFrame(image, s.sourceWidth, s.sourceHeight, s.scaleDivisor, slot->scaledFrame.data());
+			image = slot->scaledFrame.data();
+			if (lastImage) {
+				// The previous frame is shrunk again here rather than shared, since its own job may still be running
+				slot->scaledPrevious.resize((size_t)s.width * s.height * 4);
+				downscaleFrame(lastImage, s.sourceWidth, s.sourceHeight, s.scaleDivisor, slot->scaledPrevious.data());
+				lastImage = slot->scaledPrevious.data();
+			}
+		}
+
+		// The seed is whatever the frame SAMPLED_PALETTE_LAG back built, never the slot's own last palette,
+		// since which frames share a slot depends on how the threads happen to run
+		slot->encoder.sampledPalette = sampledPalette;
+		slot->encoder.hasSeedPalette = seedPalette != nullptr;
+		if (seedPalette)
+			slot->encoder.seedPalette = *seedPalette;
+		GifEncodeFrame(&slot->encoder, lastImage, image, slot->quantized.data(),
+			s.width, s.height, (uint32_t)delay, s.bitDepth, s.dither, exactPalette, palette.get(), &encoded);
+		shared_ptr<const GifPalette> builtPalette;
+		if (sampledPalette && slot->encoder.hasSeedPalette)
+			builtPalette = make_shared<const GifPalette>(slot->encoder.seedPalette);
+
+		lock_guard<mutex> guard(s.lock);
+		if (sampledPalette)
+			s.sampledPalettes[frameIndex] = builtPalette;
+		s.idleEncoders.push_back(move(slot));
+		s.finishedFrames[frameIndex] = encoded;
+		// Frames finish out of order; only the one the file is waiting for (and any ready after it) can go out
+		s.writeFinishedFrames(false);
+		s.frameWritten.notify_all();
+	});
+
+	// Frames sampled while learning still get palettes of their own
+	GifPalette learned;
+	if (GifLearnerAddFrame(&s.learner, rgba, s.sourceWidth, s.sourceHeight, s.bitDepth, s.dither != kGifDitherNone, &learned))
+		s.fixedPalette = make_shared<const GifPalette>(learned);
+}
+
+void GifPipeline::end()
+{
+	State& s = *state;
+	if (s.file == nullptr)
+		return;
+
+	// Every queued frame gets encoded, leaving only the newest one to write
+	TaskScheduler::shared().wait(s.encodes);
+	s.writeFinishedFrames(true);
+	s.frameDelays.clear();
+
+	fputc(0x3b, s.file); // end of file
+	fclose(s.file);
+	s.file = nullptr;
+
+	for (auto& slot : s.idleEncoders) {
+		GifEncoderFree(&slot->encoder);
+	}
+	s.idleEncoders.clear();
+	for (GifBuffer& buffer : s.spareBuffers) {
+		GifBufferFree(&buffer);
+	}
+	s.spareBuffers.clear();
+	s.sampledPalettes.clear();
+	GifLearnerFree(&s.learner);
+	s.previousFrame.reset();
+	s.fixedPalette.reset();
+}
+
+/*----------------------------------------------------------------------
+Replay buffer
+------------------------------------------------------------------------*/
+
+// A key frame is stored this often, which is also how many frames get dropped at once
+const int REPLAY_KEY_FRAME_INTERVAL = 60;
+
+// A stored RGB frame made opaque RGBA again for the GIF encoder
+static void convertRgbToRgba(const uint8_t* rgb, size_t pixelCount, uint8_t* rgba)
+{
+	for (size_t i = 0; i < pixelCount; i++) {
+		rgba[4 * i] = rgb[3 * i];
+		rgba[4 * i + 1] = rgb[3 * i + 1];
+		rgba[4 * i + 2] = rgb[3 * i + 2];
+		rgba[4 * i + 3] = 255;
+	}
+}
+
+void ReplayBuffer::configure(int frameWidth, int frameHeight, double bufferSeconds)
+{
+	if (frameWidth != width || frameHeight != height)
+		clear();
+	width = frameWidth;
+	height = frameHeight;
+	seconds = bufferSeconds;
+}
+
+void ReplayBuffer::clear()
+{
+	lock_guard<mutex> guard(lock);
+	frames.clear();
+	previousFrame.clear();
+	currentFrame.clear();
+	framesSinceKeyFrame = 0;
+	storedBytes = 0;
+}
+
+void ReplayBuffer::addFrame(const uint8_t* rgba, double time)
+{
+	size_t frameSize = (size_t)width * height * 3;
+	bool isKeyFrame = previousFrame.empty() || framesSinceKeyFrame >= REPLAY_KEY_FRAME_INTERVAL;
+
+	currentFrame.resize(frameSize);
+	convertRgbaToRgb(rgba, (size_t)width * height, currentFrame.data());
+	auto frame = make_shared<ReplayFrame>();
+	compressFrame(currentFrame.data(), isKeyFrame ? nullptr : previousFrame.data(), frameSize, frame->data);
+	frame->data.shrink_to_fit();
+	frame->time = time;
+	frame->isKeyFrame = isKeyFrame;
+
+	swap(previousFrame, currentFrame);
+	framesSinceKeyFrame = isKeyFrame ? 1 : framesSinceKeyFrame + 1;
+
+	lock_guard<mutex> guard(lock);
+	frames.push_back(frame);
+	storedBytes += frame->data.size();
+
+	// Drop the oldest group of frames once the group after it alone covers the requested time
+	while (true) {
+		size_t nextKeyFrame = 1;
+		while (nextKeyFrame < frames.size() && !frames[nextKeyFrame]->isKeyFrame)
+			nextKeyFrame++;
+		if (nextKeyFrame == frames.size() || time - frames[nextKeyFrame]->time < seconds)
+			break;
+		for (size_t i = 0; i < nextKeyFrame; i++) {
+			storedBytes -= frames.front()->data.size();
+			frames.pop_front();
+		}
+	}
+}
+
+double ReplayBuffer::duration() const
+{
+	lock_guard<mutex> guard(lock);
+	return frames.empty() ? 0.0 : frames.back()->time - frames.front()->time;
+}
+
+size_t ReplayBuffer::memoryUsed() const
+{
+	lock_guard<mutex> guard(lock);
+	return storedBytes;
+}
+
+vector<shared_ptr<const ReplayFrame>> ReplayBuffer::snapshot() const
+{
+	lock_guard<mutex> guard(lock);
+	return vector<shared_ptr<const ReplayFrame>>(frames.begin(), frames.end());
+}
+
+/*----------------------------------------------------------------------
+Recorder
+------------------------------------------------------------------------*/
+
+// GIF delays are in hundredths of a second, and most viewers slow anything under 2 down to 10,
+// so frames that come sooner than this are left out
+const int MINIMUM_GIF_DELAY = 2;
+
+int nextGifDelay(double time, double& lastTime, double& remainder, bool isFirstFrame, double firstFrameSeconds)
+{
+	if (isFirstFrame) {
+		lastTime = time;
+		remainder = 0.0;
+		return max(MINIMUM_GIF_DELAY, (int)lround(firstFrameSeconds * 100.0));
+	}
+	double centiseconds = (time - lastTime) * 100.0 + remainder;
+	if (centiseconds < MINIMUM_GIF_DELAY)
+		return 0;
+	// Steps like 1/25 s do not add up exactly in floating point, so 3.9999 has to count as 4
+	int delay = (int)(centiseconds + 1e-6);
+	remainder = centiseconds - delay;
+	lastTime = time;
+	return delay;
+}
+
+Recorder::Recorder(int frameWidth, int frameHeight) : width(frameWidth), height(frameHeight) {}
+
+Recorder::~Recorder()
+{
+	stopRecording();
+	stopStream();
+	if (replaySaver.joinable())
+		replaySaver.join();
+}
+
+void Recorder::setPalette(GifPaletteMode mode, vector<uint8_t> sceneSamples, int learnFrames)
+{
+	paletteMode = mode;
+	paletteSamples = move(sceneSamples);
+	paletteLearnFrames = learnFrames;
+}
+
+void Recorder::setCaptureOptions(int step, int divisor)
+{
+	frameStep = max(step, 1);
+	scaleDivisor = min(max(divisor, 1), MAX_FRAME_SCALE_DIVISOR);
+}
+
+void Recorder::beginGif(GifPipeline& pipeline, const string& filename)
+{
+	pipeline.setDownscale(scaleDivisor);
+	pipeline.begin(filename.c_str(), width, height, MINIMUM_GIF_DELAY, 8, ditherMode);
+	if (paletteMode == GIF_PALETTE_FROM_SCENE && !paletteSamples.empty()) {
+		// Building the palette reorders the samples, and they are needed again for the next GIF
+		vector<uint8_t> samples = paletteSamples;
+		pipeline.setPaletteFromSamples(samples);
+	}
+	else if (paletteMode == GIF_PALETTE_FROM_FIRST_FRAMES) {
+		pipeline.learnPalette(paletteLearnFrames);
+	}
+	pipeline.setSampledPalette(paletteMode == GIF_PALETTE_SAMPLED);
+}
+
+void Recorder::startRecording(const string& filename)
+{
+	stopRecording();
+	const string ssrecExtension = ".ssrec";
+	isRecordingSsrec = filename.size() >= ssrecExtension.size() &&
+		filename.compare(filename.size() - ssrecExtension.size(), ssrecExtension.size(), ssrecExtension) == 0;
+	if (isRecordingSsrec) {
+		recording = recordingFile.open(filename, width, height, scaleDivisor);
+	}
+	else {
+		beginGif(recordingPipeline, filename);
+		recording = recordingPipeline.isOpen();
+	}
+	recordingStarted = false;
+	if (!streaming)
+		framesSinceCaptured = 0;
+	currentRecording = recording ? filename : string();
+}
+
+bool Recorder::stopRecording()
+{
+	recordingPipeline.end();
+	bool isComplete = recordingFile.close();
+	recording = false;
+	return isComplete;
+}
+
+bool Recorder::startStream(const string& target, RawStreamFormat format, int frameRate)
+{
+	stopStream();
+	streaming = stream.open(target, width, height, format, frameRate, frameStep, scaleDivisor);
+	if (streaming && !recording)
+		framesSinceCaptured = 0;
+	currentStream = streaming ? target : string();
+	return streaming;
+}
+
+void Recorder::stopStream()
+{
+	stream.close();
+	streaming = false;
+}
+
+void Recorder::setReplayBuffer(bool enabled, double seconds)
+{
+	replayEnabled = enabled;
+	replaySeconds = seconds;
+	if (enabled)
+		replay.configure(width, height, seconds);
+	else
+		replay.clear();
+}
+
+bool Recorder::isSavingReplay() const
+{
+	return replaySaverDone && !*replaySaverDone;
+}
+
+bool Recorder::saveReplay(const string& filename)
+{
+	// Only one replay is written at a time. Waiting for the last one here would stall rendering until it is
+	// done, so the new one is skipped instead; joining a saver that has finished costs nothing
+	if (isSavingReplay())
+		return false;
+	if (replaySaver.joinable())
+		replaySaver.join();
+
+	vector<shared_ptr<const ReplayFrame>> frames = replay.snapshot();
+	if (frames.empty())
+		return false;
+
+	auto done = make_shared<atomic<bool>>(false);
+	replaySaverDone = done;
+	auto pipeline = make_shared<GifPipeline>();
+	beginGif(*pipeline, filename);
+
+	// Frames are decoded in order, since each one builds on the one before it
+	// Every frame is decoded, but only every frameStep-th one is written
+	replaySaver = thread([frames = move(frames), pipeline, done, pixelCount = (size_t)width * height, step = (size_t)frameStep,
+						  firstFrameSeconds = frameInterval * frameStep] {
+		const size_t frameSize = pixelCount * 3;
+		vector<uint8_t> frame(frameSize), previous(frameSize), rgba(pixelCount * 4);
+		double lastTime = 0.0, remainder = 0.0;
+		for (size_t i = 0; i < frames.size(); i++) {
+			const ReplayFrame& stored = *frames[i];
+			if (!decompressFrame(stored.data.data(), stored.data.size(), stored.isKeyFrame ? nullptr : previous.data(), frame.data(), frameSize))
+				break;
+			if (i % step != 0) {
+				swap(frame, previous);
+				continue;
+			}
+			int delay = nextGifDelay(stored.time, lastTime, remainder, i == 0, firstFrameSeconds);
+			if (delay > 0) {
+				convertRgbToRgba(frame.data(), pixelCount, rgba.data());
+				pipeline->submitFrame(rgba.data(), delay);
+			}
+			swap(frame, previous);
+		}
+		pipeline->end();
+		*done = true;
+	});
+	return true;
+}
+
+bool Recorder::wantsFrame()
+{
+	// Skipped frames are never read back unless the replay buffer needs them
+	captureThisFrame = false;
+	if (recording || streaming) {
+		captureThisFrame = framesSinceCaptured == 0;
+		framesSinceCaptured = (framesSinceCaptured + 1) % frameStep;
+	}
+	return captureThisFrame || replayEnabled;
+}
+
+void Recorder::submitFrame(const uint8_t* rgba, double time)
+{
+	if (replayEnabled)
+		replay.addFrame(rgba, time);
+
+	if (streaming && captureThisFrame) {
+		stream.submitFrame(rgba);
+		// Nothing more can be written once the reader has gone away
+		if (stream.hasFailed())
+			stopStream();
+	}
+
+	if (recording && captureThisFrame && isRecordingSsrec) {
+		// Lossless recordings keep every frame with its time; the transcoder works out GIF delays later
+		recordingFile.submitFrame(rgba, time);
+		if (recordingFile.hasFailed())
+			stopRecording();
+	}
+	else if (recording && captureThisFrame) {
+		int delay = nextGifDelay(time, lastRecordedTime, delayRemainder, !recordingStarted, frameInterval * frameStep);
+		recordingStarted = true;
+		if (delay > 0)
+			recordingPipeline.submitFrame(rgba, delay);
+	}
+}
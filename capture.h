@@ -0,0 +1,208 @@
+/*
+* Title: Frame Capture
+* Description: Turns rendered frames into recordings. GIF frames are quantized and LZW-compressed
+*              on the shared task scheduler and written to the file in the order they were rendered.
+*              The Recorder decides which frames are captured at all: nothing is read back from the
+*              GPU unless a recording or raw stream is running or the replay buffer is on
+*/
+
+#pragma once
+
+#include "rawStream.h"
+#include "ssrec.h"
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// How the GIF palette is chosen: built for every frame, built once from samples of the scene's
+// textures and colors, learned from the first few recorded frames and then reused, or built for
+// every frame from a sample of its pixels starting from the palette before it (cheaper for large frames)
+enum GifPaletteMode { GIF_PALETTE_PER_FRAME, GIF_PALETTE_FROM_SCENE, GIF_PALETTE_FROM_FIRST_FRAMES, GIF_PALETTE_SAMPLED };
+
+// How colors missing from the GIF palette are approximated: by the nearest palette color, by spreading
+// the error to neighboring pixels (best looking, but one pixel after another), or by a fixed per-pixel
+// pattern (Bayer matrix), which costs little more than no dithering at all
+enum GifDitherMode { GIF_DITHER_NONE, GIF_DITHER_FLOYD_STEINBERG, GIF_DITHER_ORDERED };
+
+class GifPipeline {
+public:
+	GifPipeline();
+	// Finishes the recording if end() was not called
+	~GifPipeline();
+
+	GifPipeline(const GifPipeline&) = delete;
+	GifPipeline& operator=(const GifPipeline&) = delete;
+
+	// Open the file; frames are encoded on the shared task scheduler. The delay is the time between frames in hundredths of a second
+	bool begin(const char* filename, int width, int height, int delay, int bitDepth = 8, GifDitherMode dither = GIF_DITHER_NONE);
+	// Build one palette from RGBA samples (reordered in place) and use it for every following frame
+	void setPaletteFromSamples(std::vector<uint8_t>& samples);
+	// Build the palette from the next frameCount frames and use it for the rest of the recording
+	void learnPalette(int frameCount);
+	// Search the palette exactly for every pixel instead of going through the lookup cache
+	void setExactPalette(bool exact);
+	// Build per-frame palettes from a sample of the changed pixels, refined from the palette of a frame a fixed distance back
+	void setSampledPalette(bool sampled);
+	// Shrink frames by this whole factor before they are encoded; takes effect at the next begin()
+	void setDownscale(int divisor);
+	// Frames with no channel more than tolerance away from the last frame kept are dropped, and that
+	// frame's delay is extended instead; 0 drops exact repeats only and -1 keeps every frame
+	void setDuplicateTolerance(int tolerance);
+	// Queue a top-down RGBA frame of the size given to begin() for encoding; blocks while too many frames are still waiting
+	// The delay is the time since the last frame was submitted, so it goes to that frame, which is still waiting to be
+	// written; the new frame is given the same delay until the frame after it, or the end, tells how long it stays up
+	void submitFrame(const uint8_t* rgba, int delay);
+	// Wait for all queued frames to be written, then finish and close the file
+	void end();
+
+	bool isOpen() const;
+
+private:
+	struct State;
+	std::unique_ptr<State> state;
+};
+
+// GIF delay in hundredths of a second from the last frame kept to a frame shown at time (seconds), carrying the rounding
+// over to the next frame; GifPipeline::submitFrame() takes it as how long that last frame stayed up
+// The first frame has nothing to measure from, so it gets firstFrameSeconds if known, or the shortest delay, as a guess
+// Returns 0 if the frame comes too soon after the last one and should be skipped
+int nextGifDelay(double time, double& lastTime, double& remainder, bool isFirstFrame, double firstFrameSeconds = 0.0);
+
+/*------------------------------------------------------------------------------------------
+Replay buffer - the last few seconds of frames, compressed losslessly in memory
+Frames are stored as differences from the frame before them, with a key frame every so often
+so that whole groups can be dropped from the front once they are old enough. They are kept as RGB:
+the GIFs made from them have no use for alpha, whose bytes of 255 would break up every zero run
+of a key frame
+--------------------------------------------------------------------------------------------*/
+
+struct ReplayFrame {
+	std::vector<uint8_t> data;	// RGB, compressed with compressFrame()
+	double time;				// seconds
+	bool isKeyFrame;			// decodes without the frame before it
+};
+
+class ReplayBuffer {
+public:
+	void configure(int width, int height, double seconds);
+	void addFrame(const uint8_t* rgba, double time);
+	void clear();
+
+	// Seconds of frames currently held
+	double duration() const;
+	size_t memoryUsed() const;
+	// Copy of the frames, oldest first; the first frame is always a key frame
+	std::vector<std::shared_ptr<const ReplayFrame>> snapshot() const;
+
+private:
+	int width = 0;
+	int height = 0;
+	double seconds = 0.0;
+	std::deque<std::shared_ptr<const ReplayFrame>> frames;
+	std::vector<uint8_t> previousFrame;
+	std::vector<uint8_t> currentFrame;
+	int framesSinceKeyFrame = 0;
+	size_t storedBytes = 0;
+	mutable std::mutex lock;
+};
+
+/*-------------------------------------------------------------------------------------
+Recorder - start/stop recording straight to a GIF, a lossless .ssrec file or a raw
+stream, and save the replay buffer on demand
+---------------------------------------------------------------------------------------*/
+
+class Recorder {
+public:
+	Recorder(int width, int height);
+	// Waits for any recording or replay that is still being written
+	~Recorder();
+
+	// Palette used for every GIF this recorder writes; the samples are only needed for GIF_PALETTE_FROM_SCENE
+	void setPalette(GifPaletteMode mode, std::vector<uint8_t> sceneSamples, int learnFrames);
+	// Dithering for the GIFs this recorder writes, from the next recording or saved replay
+	void setDither(GifDitherMode mode) { ditherMode = mode; }
+	GifDitherMode dither() const { return ditherMode; }
+	// Keep only every frameStep-th frame, shrunk by scaleDivisor, in the GIFs this recorder writes
+	// The step applies straight away; the scale from the next recording or saved replay
+	void setCaptureOptions(int frameStep, int scaleDivisor);
+	int captureFrameStep() const { return frameStep; }
+	int captureScaleDivisor() const { return scaleDivisor; }
+	// Time between rendered frames when the simulation runs at a fixed step, or 0 when it follows the clock
+	// Frame times alone cannot tell how long the first frame of a GIF should be shown
+	void setFrameInterval(double seconds) { frameInterval = seconds; }
+
+	// Filenames ending in ".ssrec" are recorded losslessly for ssrecTranscode; anything else is a GIF
+	void startRecording(const std::string& filename);
+	// False if a lossless recording could not be written completely
+	bool stopRecording();
+	bool isRecording() const { return recording; }
+	const std::string& recordingFilename() const { return currentRecording; }
+
+	// Stream raw frames to a file, a named pipe or standard output ("-") for an external encoder
+	// frameRate is the rate frames are rendered at; the stream's rate accounts for the frame step
+	bool startStream(const std::string& target, RawStreamFormat format, int frameRate);
+	void stopStream();
+	bool isStreaming() const { return streaming; }
+	const std::string& streamTarget() const { return currentStream; }
+
+	void setReplayBuffer(bool enabled, double seconds);
+	bool isReplayBufferEnabled() const { return replayEnabled; }
+	double replayBufferSeconds() const { return replaySeconds; }
+	const ReplayBuffer& replayBuffer() const { return replay; }
+	// Encode what the replay buffer holds right now into a GIF, in the background. Returns false, saving nothing,
+	// if the buffer is empty or the last replay is still being written
+	bool saveReplay(const std::string& filename);
+	bool isSavingReplay() const;
+
+	// Call once for every rendered frame: true if it should be read back and handed to submitFrame()
+	bool wantsFrame();
+	// Top-down RGBA frame rendered at the given time in seconds
+	void submitFrame(const uint8_t* rgba, double time);
+
+	int frameWidth() const { return width; }
+	int frameHeight() const { return height; }
+
+private:
+	void beginGif(GifPipeline& pipeline, const std::string& filename);
+
+	int width;
+	int height;
+
+	GifPaletteMode paletteMode = GIF_PALETTE_PER_FRAME;
+	std::vector<uint8_t> paletteSamples;
+	int paletteLearnFrames = 10;
+	GifDitherMode ditherMode = GIF_DITHER_NONE;
+	int frameStep = 1;
+	int scaleDivisor = 1;
+	double frameInterval = 0.0;
+
+	bool recording = false;
+	std::string currentRecording;
+	GifPipeline recordingPipeline;
+	SsrecWriter recordingFile;
+	bool isRecordingSsrec = false;
+	bool recordingStarted = false;
+	// Rendered frames since the last one kept for the recording and stream, and whether the current one is kept
+	int framesSinceCaptured = 0;
+	bool captureThisFrame = false;
+
+	bool streaming = false;
+	std::string currentStream;
+	RawStreamWriter stream;
+	// Time of the last recorded frame and the rounding left over from its delay
+	double lastRecordedTime = 0.0;
+	double delayRemainder = 0.0;
+
+	bool replayEnabled = false;
+	double replaySeconds = 10.0;
+	ReplayBuffer replay;
+	// A thread of its own rather than a scheduler task: it waits for the encoders, and a worker waiting there
+	// could leave none to run them
+	std::thread replaySaver;
+	std::shared_ptr<std::atomic<bool>> replaySaverDone;
+};
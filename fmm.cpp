@@ -0,0 +1,620 @@
+/*
+* Title: Fast Multipole Gravity
+* Description: Implementation of the solver declared in fmm.h
+*
+* Every step:
+*   sort      the particles are put in Morton order (mortonOrder.h) and copied into arrays of their own
+*   build     a cell with more than LEAF_SIZE particles splits its run by the next digit of the keys, so the
+*             tree is as deep as the particles are crowded and no deeper
+*   upward    level by level from the deepest, each cell's multipole expansion is summed from its particles
+*             (a leaf) or shifted from its children's, the cells of a level in parallel
+*   interact  a dual tree walk pairs cells: a pair far enough apart adds the source's multipole to the target's
+*             local expansion, two leaves too close for that add their particles' forces directly, and any other
+*             pair splits the larger cell. The walk above TASK_LEVEL runs once; below it every cell there walks
+*             its own subtree in parallel, as nothing else writes to it
+*   downward  level by level from the root, each cell's local expansion is shifted down to its children, and
+*             the leaves hand it to their particles, in parallel
+*
+* The expansions are Cartesian Taylor series of 1/r around each cell's center of mass, kept as one coefficient per
+* multi-index (a, b, c) with a + b + c up to the order, and every translation is a table of multi-index terms built
+* when the order is set. Around the center of mass a multipole has no dipole, so those terms are left out of the
+* interactions
+*/
+
+#include "fmm.h"
+#include "alignedVector.h"
+#include "gravityKernel.h"
+#include "mortonOrder.h"
+#include "taskScheduler.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// Cells with this many particles or fewer are not split; leaves this close together are summed directly
+static const uint32_t LEAF_SIZE = 64;
+// Cells at this depth (or leaves above it) walk their part of the tree as one task each
+static const int TASK_LEVEL_2D = 4;
+static const int TASK_LEVEL_3D = 3;
+// Cells of one level are passed up or down in batches of this many, one batch per task
+static const uint32_t LEVEL_BATCH_SIZE = 64;
+// Coefficients in an expansion of FMM_MAX_ORDER: every (a, b, c) with a + b + c <= FMM_MAX_ORDER
+static const int MAX_TERMS = (FMM_MAX_ORDER + 1) * (FMM_MAX_ORDER + 2) * (FMM_MAX_ORDER + 3) / 6;
+// Beyond this cells are too close for the expansions to converge at all
+static const double MAX_OPENING_ANGLE = 0.9;
+
+struct FmmSolver::State {
+	struct Node {
+		// Center of the expansions: the center of mass, or the centroid of the particles when they have no mass
+		double centerX;
+		double centerY;
+		double centerZ;
+		// Distance from the center to the furthest particle in the cell
+		double radius;
+		double mass;
+		// Run of sorted particles in the cell
+		uint32_t begin;
+		uint32_t end;
+		// Children sit next to each other in the arena; a leaf has none
+		uint32_t firstChild;
+		uint32_t childCount;
+		uint32_t parent;
+		int level;
+		// Index in taskRoots if the cell walks its subtree as one task, or -1
+		int task;
+	};
+
+	// Shifting an expansion combines the coefficients of multi-indices part and offset into that of sum = part + offset
+	struct ShiftTerm {
+		uint16_t sum;
+		uint16_t part;
+		uint16_t offset;
+	};
+	// Turning a multipole into a local expansion adds derivative * multipole to local, where derivative = local + multipole
+	struct InteractionTerm {
+		uint16_t local;
+		uint16_t multipole;
+		uint16_t derivative;
+	};
+	// The derivatives of 1/r follow from lower ones: with N = a + b + c, r^2 D(a, b, c) is minus the sum over each axis i of
+	// (2N - 1) / N * n_i * R_i * D(n - e_i) + (N - 1) / N * n_i * (n_i - 1) * D(n - 2 e_i)
+	struct DerivativeTerm {
+		uint16_t first[3];
+		double firstCoefficient[3];
+		uint16_t second[3];
+		double secondCoefficient[3];
+	};
+	// The force from a local expansion: each axis takes the coefficient of term plus one along it
+	struct ForceTerm {
+		uint16_t term;
+		uint16_t shifted[3];
+	};
+
+	int dimensions;
+	int taskLevel;
+	int expansionOrder = 0;
+	double openingAngle = 0.8;
+
+	// The particles in Morton order, and their accelerations before they are scaled by G
+	MortonOrder morton;
+	AlignedVector<double> sortedMasses;
+	AlignedVector<double> sortedX;
+	AlignedVector<double> sortedY;
+	AlignedVector<double> sortedZ;
+	AlignedVector<double> sortedAccelerationsX;
+	AlignedVector<double> sortedAccelerationsY;
+	AlignedVector<double> sortedAccelerationsZ;
+
+	// The tree, rebuilt every step into the same storage, and its cells grouped by level
+	vector<Node> nodes;
+	vector<uint32_t> levelNodes;
+	vector<uint32_t> levelStarts;
+	// The cells that walk their subtree as one task, and the source cells each one still has to walk against
+	vector<uint32_t> taskRoots;
+	vector<vector<uint32_t>> taskSources;
+	// termCount coefficients per cell
+	AlignedVector<double> multipoles;
+	AlignedVector<double> locals;
+
+	// Tables for the current order
+	int termCount = 0;
+	vector<uint16_t> termExponents;
+	vector<DerivativeTerm> derivativeTerms;
+	vector<ShiftTerm> shiftTerms;
+	vector<InteractionTerm> interactionTerms;
+	vector<ForceTerm> forceTerms;
+
+	State(int dimensions)
+		: dimensions(dimensions == 2 ? 2 : 3), taskLevel(dimensions == 2 ? TASK_LEVEL_2D : TASK_LEVEL_3D), morton(dimensions)
+	{
+		setOrder(4);
+	}
+
+	// Build the multi-index tables for expansions of the given order. Terms are numbered by total degree, so every
+	// term comes after the ones it is worked out from
+	void setOrder(int order)
+	{
+		order = min(max(order, 1), FMM_MAX_ORDER);
+		if (order == expansionOrder)
+			return;
+		expansionOrder = order;
+
+		const int side = order + 1;
+		vector<int> termIndices(side * side * side, -1);
+		termExponents.clear();
+		for (int degree = 0; degree <= order; degree++) {
+			for (int a = degree; a >= 0; a--) {
+				for (int b = degree - a; b >= 0; b--) {
+					int c = degree - a - b;
+					termIndices[(a * side + b) * side + c] = (int)termExponents.size() / 3;
+					termExponents.push_back((uint16_t)a);
+					termExponents.push_back((uint16_t)b);
+					termExponents.push_back((uint16_t)c);
+				}
+			}
+		}
+		termCount = (int)termExponents.size() / 3;
+		auto indexOf = [&](const int* n) { return termIndices[(n[0] * side + n[1]) * side + n[2]]; };
+		auto degreeOf = [&](int term) { return termExponents[3 * term] + termExponents[3 * term + 1] + termExponents[3 * term + 2]; };
+
+		derivativeTerms.assign(termCount, DerivativeTerm());
+		for (int term = 1; term < termCount; term++) {
+			DerivativeTerm& derivative = derivativeTerms[term];
+			const int degree = degreeOf(term);
+			for (int axis = 0; axis < 3; axis++) {
+				int n[3] = { termExponents[3 * term], termExponents[3 * term + 1], termExponents[3 * term + 2] };
+				const int exponent = n[axis];
+				derivative.first[axis] = derivative.second[axis] = 0;
+				derivative.firstCoefficient[axis] = derivative.secondCoefficient[axis] = 0.0;
+				if (exponent >= 1) {
+					n[axis] -= 1;
+					derivative.first[axis] = (uint16_t)indexOf(n);
+					derivative.firstCoefficient[axis] = (2.0 * degree - 1.0) / degree * exponent;
+				}
+				if (exponent >= 2) {
+					n[axis] -= 1;
+					derivative.second[axis] = (uint16_t)indexOf(n);
+					derivative.secondCoefficient[axis] = (degree - 1.0) / degree * exponent * (exponent - 1);
+				}
+			}
+		}
+
+		shiftTerms.clear();
+		interactionTerms.clear();
+		forceTerms.clear();
+		for (int part = 0; part < termCount; part++) {
+			for (int offset = 0; offset < termCount; offset++) {
+				int sum[3];
+				for (int axis = 0; axis < 3; axis++)
+					sum[axis] = termExponents[3 * part + axis] + termExponents[3 * offset + axis];
+				if (sum[0] + sum[1] + sum[2] > order)
+					continue;
+				shiftTerms.push_back({ (uint16_t)indexOf(sum), (uint16_t)part, (uint16_t)offset });
+				// Multipoles around the center of mass have no dipole
+				if (degreeOf(offset) != 1)
+					interactionTerms.push_back({ (uint16_t)part, (uint16_t)offset, (uint16_t)indexOf(sum) });
+			}
+			if (degreeOf(part) < order) {
+				ForceTerm force;
+				force.term = (uint16_t)part;
+				for (int axis = 0; axis < 3; axis++) {
+					int n[3] = { termExponents[3 * part], termExponents[3 * part + 1], termExponents[3 * part + 2] };
+					n[axis] += 1;
+					force.shifted[axis] = (uint16_t)indexOf(n);
+				}
+				forceTerms.push_back(force);
+			}
+		}
+	}
+
+	// x^a y^b z^c / (a! b! c!) for every term
+	void monomials(double x, double y, double z, double* values) const
+	{
+		double powersX[FMM_MAX_ORDER + 1], powersY[FMM_MAX_ORDER + 1], powersZ[FMM_MAX_ORDER + 1];
+		powersX[0] = powersY[0] = powersZ[0] = 1.0;
+		for (int i = 1; i <= expansionOrder; i++) {
+			powersX[i] = powersX[i - 1] * x / i;
+			powersY[i] = powersY[i - 1] * y / i;
+			powersZ[i] = powersZ[i - 1] * z / i;
+		}
+		for (int term = 0; term < termCount; term++)
+			values[term] = powersX[termExponents[3 * term]] * powersY[termExponents[3 * term + 1]] * powersZ[termExponents[3 * term + 2]];
+	}
+
+	// Every derivative of 1/r at (x, y, z) up to the order
+	void derivatives(double x, double y, double z, double* values) const
+	{
+		const double inverseDistance2 = 1.0 / (x * x + y * y + z * z);
+		const double axes[3] = { x, y, z };
+		values[0] = sqrt(inverseDistance2);
+		for (int term = 1; term < termCount; term++) {
+			const DerivativeTerm& derivative = derivativeTerms[term];
+			double sum = 0.0;
+			for (int axis = 0; axis < 3; axis++)
+				sum += derivative.firstCoefficient[axis] * axes[axis] * values[derivative.first[axis]] + derivative.secondCoefficient[axis] * values[derivative.second[axis]];
+			values[term] = -inverseDistance2 * sum;
+		}
+	}
+
+	// Put the particles in Morton order
+	void sortParticles(size_t count, const double* masses, const double* x, const double* y, const double* z)
+	{
+		double corner[3], size;
+		morton.sort(count, x, y, z, corner, size);
+		sortedMasses.resize(count);
+		sortedX.resize(count);
+		sortedY.resize(count);
+		sortedZ.resize(count);
+		morton.gather(masses, sortedMasses.data());
+		morton.gather(x, sortedX.data());
+		morton.gather(y, sortedY.data());
+		morton.gather(z, sortedZ.data());
+	}
+
+	// Fill in the node for the particles from begin to end, which share their keys above level; its children are
+	// added to the arena after everything already in it
+	void buildNode(uint32_t nodeIndex, uint32_t begin, uint32_t end, int level, uint32_t parent)
+	{
+		if (end - begin > LEAF_SIZE && level < morton.levels()) {
+			uint32_t childBegins[9];
+			int childDigits[8];
+			int childCount = morton.split(begin, end, level, childBegins, childDigits);
+			uint32_t firstChild = (uint32_t)nodes.size();
+			nodes.resize(nodes.size() + childCount);
+			nodes[nodeIndex].firstChild = firstChild;
+			nodes[nodeIndex].childCount = childCount;
+			for (int child = 0; child < childCount; child++)
+				buildNode(firstChild + child, childBegins[child], childBegins[child + 1], level + 1, nodeIndex);
+		}
+		else {
+			nodes[nodeIndex].firstChild = 0;
+			nodes[nodeIndex].childCount = 0;
+		}
+
+		Node& node = nodes[nodeIndex];
+		node.begin = begin;
+		node.end = end;
+		node.parent = parent;
+		node.level = level;
+		node.task = -1;
+		if (level == taskLevel || (node.childCount == 0 && level < taskLevel)) {
+			node.task = (int)taskRoots.size();
+			taskRoots.push_back(nodeIndex);
+		}
+
+		// Mass and center, from the particles or the children. A massless cell is centered on its particles
+		double mass = 0.0, weightedX = 0.0, weightedY = 0.0, weightedZ = 0.0;
+		double sumX = 0.0, sumY = 0.0, sumZ = 0.0;
+		if (node.childCount == 0) {
+			for (uint32_t i = begin; i < end; i++) {
+				mass += sortedMasses[i];
+				weightedX += sortedMasses[i] * sortedX[i];
+				weightedY += sortedMasses[i] * sortedY[i];
+				weightedZ += sortedMasses[i] * sortedZ[i];
+				sumX += sortedX[i];
+				sumY += sortedY[i];
+				sumZ += sortedZ[i];
+			}
+		}
+		else {
+			for (uint32_t child = node.firstChild; child < node.firstChild + node.childCount; child++) {
+				const Node& childNode = nodes[child];
+				double particles = childNode.end - childNode.begin;
+				mass += childNode.mass;
+				weightedX += childNode.mass * childNode.centerX;
+				weightedY += childNode.mass * childNode.centerY;
+				weightedZ += childNode.mass * childNode.centerZ;
+				sumX += particles * childNode.centerX;
+				sumY += particles * childNode.centerY;
+				sumZ += particles * childNode.centerZ;
+			}
+		}
+		node.mass = mass;
+		if (mass > 0.0) {
+			node.centerX = weightedX / mass;
+			node.centerY = weightedY / mass;
+			node.centerZ = weightedZ / mass;
+		}
+		else {
+			node.centerX = sumX / (end - begin);
+			node.centerY = sumY / (end - begin);
+			node.centerZ = sumZ / (end - begin);
+		}
+
+		// Radius: the furthest particle, or a bound from the children's spheres
+		double radius = 0.0;
+		if (node.childCount == 0) {
+			for (uint32_t i = begin; i < end; i++) {
+				double dx = sortedX[i] - node.centerX, dy = sortedY[i] - node.centerY, dz = sortedZ[i] - node.centerZ;
+				radius = max(radius, dx * dx + dy * dy + dz * dz);
+			}
+			radius = sqrt(radius);
+		}
+		else {
+			for (uint32_t child = node.firstChild; child < node.firstChild + node.childCount; child++) {
+				const Node& childNode = nodes[child];
+				double dx = childNode.centerX - node.centerX, dy = childNode.centerY - node.centerY, dz = childNode.centerZ - node.centerZ;
+				radius = max(radius, sqrt(dx * dx + dy * dy + dz * dz) + childNode.radius);
+			}
+		}
+		node.radius = radius;
+	}
+
+	// Group the cells by level, for the passes up and down the tree
+	void sortLevels()
+	{
+		int deepest = 0;
+		for (const Node& node : nodes)
+			deepest = max(deepest, node.level);
+		levelStarts.assign(deepest + 2, 0);
+		for (const Node& node : nodes)
+			levelStarts[node.level + 1]++;
+		for (int level = 1; level <= deepest + 1; level++)
+			levelStarts[level] += levelStarts[level - 1];
+		levelNodes.resize(nodes.size());
+		vector<uint32_t> next(levelStarts.begin(), levelStarts.end() - 1);
+		for (uint32_t i = 0; i < (uint32_t)nodes.size(); i++)
+			levelNodes[next[nodes[i].level]++] = i;
+	}
+
+	// Run task on every cell of the level, in parallel
+	template<typename Task>
+	void forEachInLevel(int level, const Task& task)
+	{
+		const uint32_t begin = levelStarts[level], end = levelStarts[level + 1];
+		const int batchCount = (int)((end - begin + LEVEL_BATCH_SIZE - 1) / LEVEL_BATCH_SIZE);
+		TaskScheduler::shared().parallelFor(batchCount, [&](int batch) {
+			uint32_t batchEnd = min(end, begin + (batch + 1) * LEVEL_BATCH_SIZE);
+			for (uint32_t i = begin + batch * LEVEL_BATCH_SIZE; i < batchEnd; i++)
+				task(levelNodes[i]);
+		});
+	}
+
+	// The multipole of a leaf, from its particles: the sum of m (-d)^n / n!, with d each particle's offset from the center
+	void particlesToMultipole(uint32_t nodeIndex)
+	{
+		const Node& node = nodes[nodeIndex];
+		double* multipole = &multipoles[(size_t)nodeIndex * termCount];
+		fill(multipole, multipole + termCount, 0.0);
+		if (node.mass == 0.0)
+			return;
+		double values[MAX_TERMS];
+		for (uint32_t i = node.begin; i < node.end; i++) {
+			if (sortedMasses[i] == 0.0)
+				continue;
+			monomials(node.centerX - sortedX[i], node.centerY - sortedY[i], node.centerZ - sortedZ[i], values);
+			for (int term = 0; term < termCount; term++)
+				multipole[term] += sortedMasses[i] * values[term];
+		}
+	}
+
+	// The multipole of a cell, from its children's shifted to its center
+	void childrenToMultipole(uint32_t nodeIndex)
+	{
+		const Node& node = nodes[nodeIndex];
+		double* multipole = &multipoles[(size_t)nodeIndex * termCount];
+		fill(multipole, multipole + termCount, 0.0);
+		double values[MAX_TERMS];
+		for (uint32_t child = node.firstChild; child < node.firstChild + node.childCount; child++) {
+			const Node& childNode = nodes[child];
+			if (childNode.mass == 0.0)
+				continue;
+			const double* childMultipole = &multipoles[(size_t)child * termCount];
+			monomials(node.centerX - childNode.centerX, node.centerY - childNode.centerY, node.centerZ - childNode.centerZ, values);
+			for (const ShiftTerm& shift : shiftTerms)
+				multipole[shift.sum] += values[shift.offset] * childMultipole[shift.part];
+		}
+	}
+
+	// Whether two cells are far enough apart to interact through their expansions
+	bool isWellSeparated(const Node& target, const Node& source) const
+	{
+		double dx = target.centerX - source.centerX, dy = target.centerY - source.centerY, dz = target.centerZ - source.centerZ;
+		double radii = target.radius + source.radius;
+		return &target != &source && radii * radii < openingAngle * openingAngle * (dx * dx + dy * dy + dz * dz);
+	}
+
+	// Add the field of the source's multipole to the target's local expansion
+	void multipoleToLocal(uint32_t target, uint32_t source)
+	{
+		const Node& targetNode = nodes[target];
+		const Node& sourceNode = nodes[source];
+		double values[MAX_TERMS];
+		derivatives(targetNode.centerX - sourceNode.centerX, targetNode.centerY - sourceNode.centerY, targetNode.centerZ - sourceNode.centerZ, values);
+		double* local = &locals[(size_t)target * termCount];
+		const double* multipole = &multipoles[(size_t)source * termCount];
+		for (const InteractionTerm& interaction : interactionTerms)
+			local[interaction.local] += values[interaction.derivative] * multipole[interaction.multipole];
+	}
+
+	// Add the pull of every particle in the source leaf to every particle in the target leaf
+	void particlesToParticles(uint32_t target, uint32_t source, double softening2)
+	{
+		const Node& targetNode = nodes[target];
+		const Node& sourceNode = nodes[source];
+		const uint32_t sourceCount = sourceNode.end - sourceNode.begin;
+		for (uint32_t i = targetNode.begin; i < targetNode.end; i++) {
+			accumulateGravity(sortedX[i], sortedY[i], sortedZ[i], sourceCount, &sortedMasses[sourceNode.begin], &sortedX[sourceNode.begin], &sortedY[sourceNode.begin],
+				&sortedZ[sourceNode.begin], softening2, sortedAccelerationsX[i], sortedAccelerationsY[i], sortedAccelerationsZ[i]);
+		}
+	}
+
+	// The walk above the task level: pairs that reach a task's cell are left for that task
+	void interactAboveTasks(uint32_t target, uint32_t source)
+	{
+		const Node& targetNode = nodes[target];
+		const Node& sourceNode = nodes[source];
+		if (sourceNode.mass == 0.0)
+			return;
+		if (isWellSeparated(targetNode, sourceNode))
+			multipoleToLocal(target, source);
+		else if (targetNode.task >= 0)
+			taskSources[targetNode.task].push_back(source);
+		else if (sourceNode.childCount == 0 || targetNode.radius >= sourceNode.radius) {
+			for (uint32_t child = targetNode.firstChild; child < targetNode.firstChild + targetNode.childCount; child++)
+				interactAboveTasks(child, source);
+		}
+		else {
+			for (uint32_t child = sourceNode.firstChild; child < sourceNode.firstChild + sourceNode.childCount; child++)
+				interactAboveTasks(target, child);
+		}
+	}
+
+	// The walk within a task's subtree
+	void interact(uint32_t target, uint32_t source, double softening2)
+	{
+		const Node& targetNode = nodes[target];
+		const Node& sourceNode = nodes[source];
+		if (sourceNode.mass == 0.0)
+			return;
+		if (isWellSeparated(targetNode, sourceNode))
+			multipoleToLocal(target, source);
+		else if (targetNode.childCount == 0 && sourceNode.childCount == 0)
+			particlesToParticles(target, source, softening2);
+		else if (sourceNode.childCount == 0 || (targetNode.childCount != 0 && targetNode.radius >= sourceNode.radius)) {
+			for (uint32_t child = targetNode.firstChild; child < targetNode.firstChild + targetNode.childCount; child++)
+				interact(child, source, softening2);
+		}
+		else {
+			for (uint32_t child = sourceNode.firstChild; child < sourceNode.firstChild + sourceNode.childCount; child++)
+				interact(target, child, softening2);
+		}
+	}
+
+	// Shift the parent's local expansion to the cell's center and add it: the sum of L(k) d^(k - j) / (k - j)! into L(j)
+	void localToLocal(uint32_t nodeIndex)
+	{
+		const Node& node = nodes[nodeIndex];
+		const Node& parentNode = nodes[node.parent];
+		double values[MAX_TERMS];
+		monomials(node.centerX - parentNode.centerX, node.centerY - parentNode.centerY, node.centerZ - parentNode.centerZ, values);
+		double* local = &locals[(size_t)nodeIndex * termCount];
+		const double* parentLocal = &locals[(size_t)node.parent * termCount];
+		for (const ShiftTerm& shift : shiftTerms)
+			local[shift.part] += values[shift.offset] * parentLocal[shift.sum];
+	}
+
+	// Add the force of a leaf's local expansion to its particles: the gradient of the sum of L(k) d^k / k!, with d each
+	// particle's offset from the center
+	void localToParticles(uint32_t nodeIndex)
+	{
+		const Node& node = nodes[nodeIndex];
+		const double* local = &locals[(size_t)nodeIndex * termCount];
+		double values[MAX_TERMS];
+		for (uint32_t i = node.begin; i < node.end; i++) {
+			monomials(sortedX[i] - node.centerX, sortedY[i] - node.centerY, sortedZ[i] - node.centerZ, values);
+			double ax = 0.0, ay = 0.0, az = 0.0;
+			for (const ForceTerm& force : forceTerms) {
+				ax += local[force.shifted[0]] * values[force.term];
+				ay += local[force.shifted[1]] * values[force.term];
+				az += local[force.shifted[2]] * values[force.term];
+			}
+			sortedAccelerationsX[i] += ax;
+			sortedAccelerationsY[i] += ay;
+			sortedAccelerationsZ[i] += az;
+		}
+	}
+};
+
+FmmSolver::FmmSolver(int dimensions)
+	: state(make_unique<State>(dimensions))
+{
+}
+
+FmmSolver::~FmmSolver() = default;
+
+void FmmSolver::setOrder(int order)
+{
+	state->setOrder(order);
+}
+
+int FmmSolver::order() const
+{
+	return state->expansionOrder;
+}
+
+void FmmSolver::setOpeningAngle(double openingAngle)
+{
+	state->openingAngle = min(max(openingAngle, 0.0), MAX_OPENING_ANGLE);
+}
+
+double FmmSolver::openingAngle() const
+{
+	return state->openingAngle;
+}
+
+int FmmSolver::dimensions() const
+{
+	return state->dimensions;
+}
+
+size_t FmmSolver::nodeCount() const
+{
+	return state->nodes.size();
+}
+
+void FmmSolver::computeAccelerations(size_t count, const double* masses, const double* positionsX, const double* positionsY, const double* positionsZ,
+	double gravitationalConstant, double softening, double* accelerationsX, double* accelerationsY, double* accelerationsZ)
+{
+	State& s = *state;
+	s.nodes.clear();
+	s.taskRoots.clear();
+	if (count == 0)
+		return;
+
+	s.sortParticles(count, masses, positionsX, positionsY, positionsZ);
+	s.nodes.reserve(2 * count / LEAF_SIZE + 1);
+	s.nodes.resize(1);
+	s.buildNode(0, 0, (uint32_t)count, 0, 0);
+	s.sortLevels();
+	const int deepest = (int)s.levelStarts.size() - 2;
+
+	// Upward
+	const size_t coefficients = s.nodes.size() * s.termCount;
+	s.multipoles.resize(coefficients);
+	for (int level = deepest; level >= 0; level--) {
+		s.forEachInLevel(level, [&](uint32_t node) {
+			if (s.nodes[node].childCount == 0)
+				s.particlesToMultipole(node);
+			else
+				s.childrenToMultipole(node);
+		});
+	}
+
+	// Interactions
+	const double softening2 = softening * softening;
+	s.locals.assign(coefficients, 0.0);
+	s.sortedAccelerationsX.assign(count, 0.0);
+	s.sortedAccelerationsY.assign(count, 0.0);
+	s.sortedAccelerationsZ.assign(count, 0.0);
+	if (s.taskSources.size() < s.taskRoots.size())
+		s.taskSources.resize(s.taskRoots.size());
+	for (size_t task = 0; task < s.taskRoots.size(); task++)
+		s.taskSources[task].clear();
+	s.interactAboveTasks(0, 0);
+	TaskScheduler::shared().parallelFor((int)s.taskRoots.size(), [&](int task) {
+		for (uint32_t source : s.taskSources[task])
+			s.interact(s.taskRoots[task], source, softening2);
+	});
+
+	// Downward
+	for (int level = 0; level <= deepest; level++) {
+		s.forEachInLevel(level, [&](uint32_t node) {
+			if (level > 0)
+				s.localToLocal(node);
+			if (s.nodes[node].childCount == 0)
+				s.localToParticles(node);
+		});
+	}
+
+	const vector<uint32_t>& order = s.morton.order();
+	for (size_t i = 0; i < count; i++) {
+		uint32_t particle = order[i];
+		accelerationsX[particle] = gravitationalConstant * s.sortedAccelerationsX[i];
+		accelerationsY[particle] = gravitationalConstant * s.sortedAccelerationsY[i];
+		accelerationsZ[particle] = gravitationalConstant * s.sortedAccelerationsZ[i];
+	}
+}
@@ -0,0 +1,53 @@
+/*
+* Title: Fast Multipole Gravity
+* Description: Gravity for millions of particles in O(N), by the fast multipole method. Particles are put in
+*              an adaptive tree over their Morton order, like in barnesHut.h, and every cell gets a Cartesian
+*              Taylor expansion of the potential of its particles (the multipole expansion, built upwards
+*              from the leaves). Pairs of cells far enough apart for their size turn each other's multipoles
+*              into expansions of the field around themselves (local expansions), which are handed down to
+*              the particles. Where Barnes-Hut works out one particle against every far cell, here whole
+*              cells interact with whole cells, and both their size and the expansion order set the accuracy
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+// Highest expansion order the solver supports
+const int FMM_MAX_ORDER = 10;
+
+class FmmSolver {
+public:
+	// dimensions is 2 for a quadtree, which only splits space along x and y, or 3 for an octree; the expansions
+	// are always three-dimensional. The subtrees are walked on the shared task scheduler
+	explicit FmmSolver(int dimensions = 3);
+	~FmmSolver();
+
+	FmmSolver(const FmmSolver&) = delete;
+	FmmSolver& operator=(const FmmSolver&) = delete;
+
+	// Terms of the expansions, from 1 (each cell pulls like its mass at its center of mass) to FMM_MAX_ORDER, 4 by
+	// default. Every order makes the far forces about openingAngle times more accurate, and costs more per pair of cells
+	void setOrder(int order);
+	int order() const;
+	// Two cells interact through their expansions once the sum of their radii is less than openingAngle times
+	// the distance between them; closer cells are split, down to the particles. 0 works every force out
+	// directly; up to 0.9 is allowed. The default of 0.8 at order 4 is about as accurate as Barnes-Hut at 0.5
+	void setOpeningAngle(double openingAngle);
+	double openingAngle() const;
+	int dimensions() const;
+
+	// Write the acceleration of each of count particles. Forces are scaled by gravitationalConstant. Softening is
+	// added to the distances between particles that are worked out directly; cells far enough apart to interact
+	// through their expansions are much further apart than any softening length
+	void computeAccelerations(size_t count, const double* masses, const double* positionsX, const double* positionsY, const double* positionsZ,
+		double gravitationalConstant, double softening, double* accelerationsX, double* accelerationsY, double* accelerationsZ);
+
+	// Cells in the tree built by the last call
+	size_t nodeCount() const;
+
+private:
+	struct State;
+	std::unique_ptr<State> state;
+};
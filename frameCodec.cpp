@@ -0,0 +1,323 @@
+/*
+* Title: Frame Codec
+* Description: Implementation of the frame compression declared in frameCodec.h
+*
+* A compressed frame is a list of (zero count, literal count, literal bytes) records
+* Counts are stored 7 bits per byte, with the top bit set on every byte except the last
+*
+* LZ data is a list of sequences, each a token byte followed by literals and then a match:
+*   token       high 4 bits literal count, low 4 bits match length - 4 (15 means more length bytes follow)
+*   literals    the literal count continued in bytes of 255 plus a last smaller one, then the bytes
+*   match       2 byte little endian distance back into the output, then the rest of the match length
+* The last sequence has literals only
+*/
+
+#include "frameCodec.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FRAME_CODEC_SSE2
+#endif
+
+using namespace std;
+
+static void writeCount(vector<uint8_t>& out, size_t count)
+{
+	while (count >= 0x80) {
+		out.push_back((uint8_t)(count | 0x80));
+		count >>= 7;
+	}
+	out.push_back((uint8_t)count);
+}
+
+static bool readCount(const uint8_t*& data, const uint8_t* end, size_t& count)
+{
+	count = 0;
+	for (int shift = 0; data < end && shift < 64; shift += 7) {
+		uint8_t byte = *data++;
+		count |= (size_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0)
+			return true;
+	}
+	return false;
+}
+
+// Length of the run of bytes where frame and previousFrame agree (that is, where the XOR is zero)
+static size_t matchingBytes(const uint8_t* frame, const uint8_t* previousFrame, size_t size)
+{
+	size_t position = 0;
+	if (previousFrame == nullptr) {
+		while (position < size && frame[position] == 0)
+			position++;
+		return position;
+	}
+	// Compare 8 bytes at a time while whole words match
+	while (position + 8 <= size) {
+		uint64_t a, b;
+		memcpy(&a, frame + position, 8);
+		memcpy(&b, previousFrame + position, 8);
+		if (a != b)
+			break;
+		position += 8;
+	}
+	while (position < size && frame[position] == previousFrame[position])
+		position++;
+	return position;
+}
+
+void compressFrame(const uint8_t* frame, const uint8_t* previousFrame, size_t size, vector<uint8_t>& out)
+{
+	// Short matches inside a literal run cost more as a record than as bytes
+	const size_t minimumZeroRun = 8;
+
+	size_t position = 0;
+	while (position < size) {
+		size_t zeroRun = matchingBytes(frame + position, previousFrame ? previousFrame + position : nullptr, size - position);
+		position += zeroRun;
+
+		// Extend the literal run until the next long enough stretch of matching bytes
+		size_t literalStart = position;
+		while (position < size) {
+			size_t match = matchingBytes(frame + position, previousFrame ? previousFrame + position : nullptr, size - position);
+			if (match >= minimumZeroRun || position + match == size)
+				break;
+			position += match + 1;
+		}
+
+		writeCount(out, zeroRun);
+		writeCount(out, position - literalStart);
+		for (size_t i = literalStart; i < position; i++) {
+			out.push_back(previousFrame ? (uint8_t)(frame[i] ^ previousFrame[i]) : frame[i]);
+		}
+	}
+}
+
+bool decompressFrame(const uint8_t* data, size_t dataSize, const uint8_t* previousFrame, uint8_t* frame, size_t size)
+{
+	const uint8_t* end = data + dataSize;
+	size_t position = 0;
+	while (position < size) {
+		size_t zeroRun, literalCount;
+		if (!readCount(data, end, zeroRun) || !readCount(data, end, literalCount))
+			return false;
+		if (zeroRun > size - position || literalCount > size - position - zeroRun || literalCount > (size_t)(end - data))
+			return false;
+
+		if (previousFrame)
+			memcpy(frame + position, previousFrame + position, zeroRun);
+		else
+			memset(frame + position, 0, zeroRun);
+		position += zeroRun;
+
+		for (size_t i = 0; i < literalCount; i++, position++) {
+			frame[position] = previousFrame ? (uint8_t)(data[i] ^ previousFrame[position]) : data[i];
+		}
+		data += literalCount;
+	}
+	return true;
+}
+
+/*----------------------------------------------------------------------
+Delta and LZ coding for recordings on disk
+------------------------------------------------------------------------*/
+
+void deltaFrame(const uint8_t* frame, const uint8_t* previousFrame, size_t size, uint8_t* out)
+{
+	if (previousFrame == nullptr) {
+		if (out != frame)
+			memcpy(out, frame, size);
+		return;
+	}
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t a, b;
+		memcpy(&a, frame + i, 8);
+		memcpy(&b, previousFrame + i, 8);
+		a ^= b;
+		memcpy(out + i, &a, 8);
+	}
+	for (; i < size; i++)
+		out[i] = frame[i] ^ previousFrame[i];
+}
+
+bool framesMatch(const uint8_t* frame, const uint8_t* previousFrame, size_t size, int tolerance)
+{
+	if (tolerance <= 0)
+		return memcmp(frame, previousFrame, size) == 0;
+	uint8_t limit = (uint8_t)min(tolerance, 255);
+	size_t i = 0;
+#ifdef FRAME_CODEC_SSE2
+	// |a - b| is the larger of the two saturating differences; anything left after taking off
+	// the tolerance is a byte that changed too much
+	const __m128i limits = _mm_set1_epi8((char)limit);
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 64 <= size; i += 64) {
+		__m128i excess = zero;
+		for (size_t k = 0; k < 64; k += 16) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(frame + i + k));
+			__m128i b = _mm_loadu_si128((const __m128i*)(previousFrame + i + k));
+			__m128i difference = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+			excess = _mm_or_si128(excess, _mm_subs_epu8(difference, limits));
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(excess, zero)) != 0xffff)
+			return false;
+	}
+#endif
+	for (; i < size; i++) {
+		int difference = (int)frame[i] - (int)previousFrame[i];
+		if (difference > limit || -difference > limit)
+			return false;
+	}
+	return true;
+}
+
+const size_t LZ_MIN_MATCH = 4;
+const size_t LZ_MAX_DISTANCE = 65535;
+const int LZ_HASH_BITS = 16;
+
+static inline uint32_t read32(const uint8_t* data)
+{
+	uint32_t value;
+	memcpy(&value, data, 4);
+	return value;
+}
+
+static inline uint32_t lzHash(uint32_t sequence)
+{
+	return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static void writeLzLength(vector<uint8_t>& out, size_t length)
+{
+	while (length >= 255) {
+		out.push_back(255);
+		length -= 255;
+	}
+	out.push_back((uint8_t)length);
+}
+
+static bool readLzLength(const uint8_t*& data, const uint8_t* end, size_t& length)
+{
+	while (data < end) {
+		uint8_t byte = *data++;
+		length += byte;
+		if (byte != 255)
+			return true;
+	}
+	return false;
+}
+
+// matchLength 0 writes the closing literals-only sequence
+static void writeLzSequence(vector<uint8_t>& out, const uint8_t* literals, size_t literalCount, size_t distance, size_t matchLength)
+{
+	size_t matchCode = matchLength ? matchLength - LZ_MIN_MATCH : 0;
+	out.push_back((uint8_t)((min(literalCount, (size_t)15) << 4) | min(matchCode, (size_t)15)));
+	if (literalCount >= 15)
+		writeLzLength(out, literalCount - 15);
+	out.insert(out.end(), literals, literals + literalCount);
+	if (matchLength) {
+		out.push_back((uint8_t)(distance & 0xff));
+		out.push_back((uint8_t)(distance >> 8));
+		if (matchCode >= 15)
+			writeLzLength(out, matchCode - 15);
+	}
+}
+
+// Number of bytes from b onwards (up to end) that equal the bytes from a onwards
+static size_t lzMatchLength(const uint8_t* a, const uint8_t* b, const uint8_t* end)
+{
+	const uint8_t* start = b;
+	while (b + 8 <= end) {
+		uint64_t x, y;
+		memcpy(&x, a, 8);
+		memcpy(&y, b, 8);
+		if (x != y)
+			break;
+		a += 8;
+		b += 8;
+	}
+	while (b < end && *a == *b) {
+		a++;
+		b++;
+	}
+	return (size_t)(b - start);
+}
+
+void lzCompress(const uint8_t* data, size_t size, vector<uint8_t>& out)
+{
+	// Last position each hashed 4 byte sequence was seen at; stale entries are caught by comparing the bytes
+	vector<uint32_t> lastSeen((size_t)1 << LZ_HASH_BITS, 0);
+	const uint8_t* end = data + size;
+	size_t anchor = 0;
+	size_t position = 1;
+	// The search steps further the longer it goes without a match, so data that does not compress passes quickly
+	size_t misses = 0;
+
+	while (position + LZ_MIN_MATCH <= size) {
+		uint32_t sequence = read32(data + position);
+		uint32_t& slot = lastSeen[lzHash(sequence)];
+		size_t candidate = slot;
+		slot = (uint32_t)position;
+
+		if (candidate < position && position - candidate <= LZ_MAX_DISTANCE && read32(data + candidate) == sequence) {
+			size_t length = LZ_MIN_MATCH + lzMatchLength(data + candidate + LZ_MIN_MATCH, data + position + LZ_MIN_MATCH, end);
+			writeLzSequence(out, data + anchor, position - anchor, position - candidate, length);
+			position += length;
+			anchor = position;
+			misses = 0;
+			// Remember a position inside the match, which often starts the next one
+			if (position + LZ_MIN_MATCH <= size)
+				lastSeen[lzHash(read32(data + position - 2))] = (uint32_t)(position - 2);
+		}
+		else {
+			position += 1 + (misses++ >> 6);
+		}
+	}
+	writeLzSequence(out, data + anchor, size - anchor, 0, 0);
+}
+
+bool lzDecompress(const uint8_t* data, size_t dataSize, uint8_t* out, size_t size)
+{
+	const uint8_t* end = data + dataSize;
+	size_t position = 0;
+	while (data < end) {
+		uint8_t token = *data++;
+		size_t literalCount = token >> 4;
+		if (literalCount == 15 && !readLzLength(data, end, literalCount))
+			return false;
+		if (literalCount > (size_t)(end - data) || literalCount > size - position)
+			return false;
+		memcpy(out + position, data, literalCount);
+		data += literalCount;
+		position += literalCount;
+		if (data == end)
+			break;
+
+		if (end - data < 2)
+			return false;
+		size_t distance = data[0] | (data[1] << 8);
+		data += 2;
+		size_t matchLength = token & 15;
+		if (matchLength == 15 && !readLzLength(data, end, matchLength))
+			return false;
+		matchLength += LZ_MIN_MATCH;
+		if (distance == 0 || distance > position || matchLength > size - position)
+			return false;
+
+		// A match may overlap the bytes it produces (a run of zeros is a distance of 1),
+		// so copy in pieces no longer than the distance covered so far, which doubles each time
+		uint8_t* destination = out + position;
+		const uint8_t* source = destination - distance;
+		size_t remaining = matchLength;
+		while (remaining > 0) {
+			size_t piece = min(remaining, (size_t)(destination - source));
+			memcpy(destination, source, piece);
+			destination += piece;
+			remaining -= piece;
+		}
+		position += matchLength;
+	}
+	return position == size;
+}
@@ -0,0 +1,36 @@
+/*
+* Title: Frame Codec
+* Description: Fast lossless compression for raw RGBA frames. Each frame is XORed with the frame
+*              before it, so pixels that did not change become zeros. Frames kept in memory store
+*              runs of zeros as a count; recordings on disk go through a small LZ77 codec, which
+*              also catches repeated patterns and is still cheap enough to run while rendering
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Compress size bytes of frame and append them to out
+// previousFrame may be null, which stores a key frame that can be decoded on its own
+void compressFrame(const uint8_t* frame, const uint8_t* previousFrame, size_t size, std::vector<uint8_t>& out);
+
+// Decode a compressed frame into size bytes of frame
+// previousFrame must hold the same pixels that were given to compressFrame (or be null for a key frame)
+// Returns false if the data is damaged
+bool decompressFrame(const uint8_t* data, size_t dataSize, const uint8_t* previousFrame, uint8_t* frame, size_t size);
+
+// XOR size bytes of frame with previousFrame into out (out may be frame); a null previousFrame copies
+// The same call turns a frame into its difference and the difference back into the frame
+void deltaFrame(const uint8_t* frame, const uint8_t* previousFrame, size_t size, uint8_t* out);
+
+// True if no byte of frame differs from the same byte of previousFrame by more than tolerance
+// A tolerance of 0 asks for identical frames; both stop at the first difference found
+bool framesMatch(const uint8_t* frame, const uint8_t* previousFrame, size_t size, int tolerance);
+
+// LZ77 compression in the style of LZ4: byte-aligned runs of literals and matches, no entropy coding
+// Appends the compressed form of size bytes of data to out
+void lzCompress(const uint8_t* data, size_t size, std::vector<uint8_t>& out);
+// Decode into exactly size bytes of out; returns false if the data is damaged or the size does not match
+bool lzDecompress(const uint8_t* data, size_t dataSize, uint8_t* out, size_t size);
@@ -0,0 +1,93 @@
+/*
+* Title: Frame Scaling
+* Description: Implementation of the box filter declared in frameScale.h
+*
+* Each output row is built in two passes: the divisor source rows are added up per channel into
+* 16 bit sums, then every divisor neighbouring sums are added and divided by the block area
+* SSE2 does both passes on x86; other targets use the plain loops
+*/
+
+#include "frameScale.h"
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FRAME_SCALE_SSE2
+#endif
+
+using namespace std;
+
+// Add one row of bytes to the running 16 bit sums
+static void addRow(const uint8_t* row, uint16_t* sums, int count)
+{
+	int i = 0;
+#ifdef FRAME_SCALE_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= count; i += 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i*)(row + i));
+		__m128i low = _mm_loadu_si128((const __m128i*)(sums + i));
+		__m128i high = _mm_loadu_si128((const __m128i*)(sums + i + 8));
+		_mm_storeu_si128((__m128i*)(sums + i), _mm_add_epi16(low, _mm_unpacklo_epi8(bytes, zero)));
+		_mm_storeu_si128((__m128i*)(sums + i + 8), _mm_add_epi16(high, _mm_unpackhi_epi8(bytes, zero)));
+	}
+#endif
+	for (; i < count; i++)
+		sums[i] += row[i];
+}
+
+// Add up divisor neighbouring pixels of the column sums and divide by the area of the block
+// The division is a multiply by 65536 / area, rounded, which is within one step of exact
+static void writeScaledRow(const uint16_t* sums, int divisor, int outWidth, uint8_t* destination)
+{
+	const uint32_t area = (uint32_t)(divisor * divisor);
+	const uint32_t reciprocal = (65536 + area / 2) / area;
+	int x = 0;
+#ifdef FRAME_SCALE_SSE2
+	const __m128i rounding = _mm_set1_epi16((short)(area / 2));
+	const __m128i scale = _mm_set1_epi16((short)reciprocal);
+	// Two output pixels at a time: eight channel sums fill one register
+	for (; x + 2 <= outWidth; x += 2) {
+		const uint16_t* block = sums + x * divisor * 4;
+		__m128i total = _mm_setzero_si128();
+		for (int i = 0; i < divisor; i++) {
+			__m128i first = _mm_loadl_epi64((const __m128i*)(block + i * 4));
+			__m128i second = _mm_loadl_epi64((const __m128i*)(block + (divisor + i) * 4));
+			total = _mm_add_epi16(total, _mm_unpacklo_epi64(first, second));
+		}
+		total = _mm_mulhi_epu16(_mm_add_epi16(total, rounding), scale);
+		_mm_storel_epi64((__m128i*)(destination + x * 4), _mm_packus_epi16(total, total));
+	}
+#endif
+	for (; x < outWidth; x++) {
+		const uint16_t* block = sums + x * divisor * 4;
+		for (int channel = 0; channel < 4; channel++) {
+			uint32_t total = 0;
+			for (int i = 0; i < divisor; i++)
+				total += block[i * 4 + channel];
+			destination[x * 4 + channel] = (uint8_t)(((total + area / 2) * reciprocal) >> 16);
+		}
+	}
+}
+
+void downscaleFrame(const uint8_t* source, int width, int height, int divisor, uint8_t* destination)
+{
+	if (divisor <= 1) {
+		memcpy(destination, source, (size_t)width * height * 4);
+		return;
+	}
+	if (divisor > MAX_FRAME_SCALE_DIVISOR)
+		divisor = MAX_FRAME_SCALE_DIVISOR;
+
+	const int outWidth = width / divisor;
+	const int outHeight = height / divisor;
+	const int usedBytes = outWidth * divisor * 4;
+	vector<uint16_t> sums(usedBytes);
+
+	for (int y = 0; y < outHeight; y++) {
+		memset(sums.data(), 0, usedBytes * sizeof(uint16_t));
+		for (int row = 0; row < divisor; row++)
+			addRow(source + ((size_t)(y * divisor + row) * width) * 4, sums.data(), usedBytes);
+		writeScaledRow(sums.data(), divisor, outWidth, destination + (size_t)y * outWidth * 4);
+	}
+}
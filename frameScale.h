@@ -0,0 +1,19 @@
+/*
+* Title: Frame Scaling
+* Description: Shrinks RGBA frames by a whole factor with a box filter, so small preview
+*              recordings can be encoded at their own size instead of the window's
+*/
+
+#pragma once
+
+#include <cstdint>
+
+// Largest factor a frame can be shrunk by (the sums of a block must fit in 16 bits)
+const int MAX_FRAME_SCALE_DIVISOR = 16;
+
+// Size of a frame shrunk by divisor; pixels left over at the right and bottom edges are dropped
+inline int scaledFrameSize(int size, int divisor) { return divisor > 1 ? size / divisor : size; }
+
+// Average every divisor x divisor block of the top-down RGBA source into one pixel of destination,
+// which must hold scaledFrameSize(width) x scaledFrameSize(height) pixels
+void downscaleFrame(const uint8_t* source, int width, int height, int divisor, uint8_t* destination);
@@ -0,0 +1,336 @@
+/*
+* Title: Gravity Kernel
+* Description: Implementation of the kernels declared in gravityKernel.h
+*
+* Every version works out, for a register of sources at once,
+*   d = source - particle,  r2 = d.d + softening2,  y = 1 / sqrt(r2),  pull = m y^3,  a += pull d
+* with y from the processor's reciprocal square root estimate and two Newton steps, y' = y (3/2 - r2 y^2 / 2),
+* each of which doubles the correct bits. AVX-512 has an estimate for doubles good to 14 bits, and two steps
+* take it to the full 53. SSE2 and AVX2 only have one for floats, good to 12 bits (46 after two steps), so
+* squared distances outside the range of a float fall back to an exact square root. Each vector version is
+* compiled for its own instruction set, and only called once the processor is known to have it
+*/
+
+#include "gravityKernel.h"
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define GRAVITY_KERNEL_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC compiles any intrinsic without being told the instruction set
+#define GRAVITY_KERNEL_TARGET(isa)
+#else
+#define GRAVITY_KERNEL_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+using namespace std;
+
+static void accumulateScalar(double x, double y, double z, size_t count, const double* masses, const double* sourcesX, const double* sourcesY, const double* sourcesZ,
+	double softening2, double& accelerationX, double& accelerationY, double& accelerationZ)
+{
+	double ax = 0.0, ay = 0.0, az = 0.0;
+	for (size_t j = 0; j < count; j++) {
+		double dx = sourcesX[j] - x;
+		double dy = sourcesY[j] - y;
+		double dz = sourcesZ[j] - z;
+		double distance2 = dx * dx + dy * dy + dz * dz + softening2;
+		double inverseDistance = distance2 > 0.0 ? 1.0 / sqrt(distance2) : 0.0;
+		double pull = masses[j] * inverseDistance * inverseDistance * inverseDistance;
+		ax += dx * pull;
+		ay += dy * pull;
+		az += dz * pull;
+	}
+	accelerationX += ax;
+	accelerationY += ay;
+	accelerationZ += az;
+}
+
+#ifdef GRAVITY_KERNEL_X86
+
+/*-----------------------------------------------------------------------
+SSE2: two sources per register, two registers per iteration
+-------------------------------------------------------------------------*/
+
+GRAVITY_KERNEL_TARGET("sse2")
+static inline __m128d inverseSqrtSse2(__m128d distance2)
+{
+	const __m128d threeHalves = _mm_set1_pd(1.5);
+	const __m128d halfDistance2 = _mm_mul_pd(_mm_set1_pd(0.5), distance2);
+	__m128d y = _mm_cvtps_pd(_mm_rsqrt_ps(_mm_cvtpd_ps(distance2)));
+	y = _mm_mul_pd(y, _mm_sub_pd(threeHalves, _mm_mul_pd(halfDistance2, _mm_mul_pd(y, y))));
+	y = _mm_mul_pd(y, _mm_sub_pd(threeHalves, _mm_mul_pd(halfDistance2, _mm_mul_pd(y, y))));
+	// Beyond what a float holds the estimate is meaningless
+	__m128d outside = _mm_or_pd(_mm_cmplt_pd(distance2, _mm_set1_pd(FLT_MIN)), _mm_cmpgt_pd(distance2, _mm_set1_pd(FLT_MAX)));
+	if (_mm_movemask_pd(outside) != 0)
+		y = _mm_div_pd(_mm_set1_pd(1.0), _mm_sqrt_pd(distance2));
+	// Nothing from sources at no distance
+	return _mm_and_pd(y, _mm_cmpgt_pd(distance2, _mm_setzero_pd()));
+}
+
+GRAVITY_KERNEL_TARGET("sse2")
+static void accumulateSse2(double x, double y, double z, size_t count, const double* masses, const double* sourcesX, const double* sourcesY, const double* sourcesZ,
+	double softening2, double& accelerationX, double& accelerationY, double& accelerationZ)
+{
+	const __m128d targetX = _mm_set1_pd(x), targetY = _mm_set1_pd(y), targetZ = _mm_set1_pd(z);
+	const __m128d softening = _mm_set1_pd(softening2);
+	__m128d sumsX[2] = { _mm_setzero_pd(), _mm_setzero_pd() };
+	__m128d sumsY[2] = { _mm_setzero_pd(), _mm_setzero_pd() };
+	__m128d sumsZ[2] = { _mm_setzero_pd(), _mm_setzero_pd() };
+	size_t j = 0;
+	for (; j + 4 <= count; j += 4) {
+		for (int k = 0; k < 2; k++) {
+			const size_t index = j + 2 * k;
+			__m128d dx = _mm_sub_pd(_mm_loadu_pd(sourcesX + index), targetX);
+			__m128d dy = _mm_sub_pd(_mm_loadu_pd(sourcesY + index), targetY);
+			__m128d dz = _mm_sub_pd(_mm_loadu_pd(sourcesZ + index), targetZ);
+			__m128d distance2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_add_pd(_mm_mul_pd(dz, dz), softening));
+			__m128d inverseDistance = inverseSqrtSse2(distance2);
+			__m128d pull = _mm_mul_pd(_mm_loadu_pd(masses + index), _mm_mul_pd(inverseDistance, _mm_mul_pd(inverseDistance, inverseDistance)));
+			sumsX[k] = _mm_add_pd(sumsX[k], _mm_mul_pd(dx, pull));
+			sumsY[k] = _mm_add_pd(sumsY[k], _mm_mul_pd(dy, pull));
+			sumsZ[k] = _mm_add_pd(sumsZ[k], _mm_mul_pd(dz, pull));
+		}
+	}
+	double sums[3][2];
+	_mm_storeu_pd(sums[0], _mm_add_pd(sumsX[0], sumsX[1]));
+	_mm_storeu_pd(sums[1], _mm_add_pd(sumsY[0], sumsY[1]));
+	_mm_storeu_pd(sums[2], _mm_add_pd(sumsZ[0], sumsZ[1]));
+	accelerationX += sums[0][0] + sums[0][1];
+	accelerationY += sums[1][0] + sums[1][1];
+	accelerationZ += sums[2][0] + sums[2][1];
+	accumulateScalar(x, y, z, count - j, masses + j, sourcesX + j, sourcesY + j, sourcesZ + j, softening2, accelerationX, accelerationY, accelerationZ);
+}
+
+/*-----------------------------------------------------------------------
+AVX2 and FMA: four sources per register, two registers per iteration
+-------------------------------------------------------------------------*/
+
+GRAVITY_KERNEL_TARGET("avx2,fma")
+static inline __m256d inverseSqrtAvx2(__m256d distance2)
+{
+	const __m256d threeHalves = _mm256_set1_pd(1.5);
+	const __m256d halfDistance2 = _mm256_mul_pd(_mm256_set1_pd(0.5), distance2);
+	__m256d y = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(distance2)));
+	y = _mm256_mul_pd(y, _mm256_fnmadd_pd(_mm256_mul_pd(halfDistance2, y), y, threeHalves));
+	y = _mm256_mul_pd(y, _mm256_fnmadd_pd(_mm256_mul_pd(halfDistance2, y), y, threeHalves));
+	__m256d outside = _mm256_or_pd(_mm256_cmp_pd(distance2, _mm256_set1_pd(FLT_MIN), _CMP_LT_OQ), _mm256_cmp_pd(distance2, _mm256_set1_pd(FLT_MAX), _CMP_GT_OQ));
+	if (_mm256_movemask_pd(outside) != 0)
+		y = _mm256_div_pd(_mm256_set1_pd(1.0), _mm256_sqrt_pd(distance2));
+	return _mm256_and_pd(y, _mm256_cmp_pd(distance2, _mm256_setzero_pd(), _CMP_GT_OQ));
+}
+
+GRAVITY_KERNEL_TARGET("avx2,fma")
+static void accumulateAvx2(double x, double y, double z, size_t count, const double* masses, const double* sourcesX, const double* sourcesY, const double* sourcesZ,
+	double softening2, double& accelerationX, double& accelerationY, double& accelerationZ)
+{
+	const __m256d targetX = _mm256_set1_pd(x), targetY = _mm256_set1_pd(y), targetZ = _mm256_set1_pd(z);
+	const __m256d softening = _mm256_set1_pd(softening2);
+	__m256d sumsX[2] = { _mm256_setzero_pd(), _mm256_setzero_pd() };
+	__m256d sumsY[2] = { _mm256_setzero_pd(), _mm256_setzero_pd() };
+	__m256d sumsZ[2] = { _mm256_setzero_pd(), _mm256_setzero_pd() };
+	size_t j = 0;
+	for (; j + 8 <= count; j += 8) {
+		for (int k = 0; k < 2; k++) {
+			const size_t index = j + 4 * k;
+			__m256d dx = _mm256_sub_pd(_mm256_loadu_pd(sourcesX + index), targetX);
+			__m256d dy = _mm256_sub_pd(_mm256_loadu_pd(sourcesY + index), targetY);
+			__m256d dz = _mm256_sub_pd(_mm256_loadu_pd(sourcesZ + index), targetZ);
+			__m256d distance2 = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, _mm256_fmadd_pd(dz, dz, softening)));
+			__m256d inverseDistance = inverseSqrtAvx2(distance2);
+			__m256d pull = _mm256_mul_pd(_mm256_loadu_pd(masses + index), _mm256_mul_pd(inverseDistance, _mm256_mul_pd(inverseDistance, inverseDistance)));
+			sumsX[k] = _mm256_fmadd_pd(dx, pull, sumsX[k]);
+			sumsY[k] = _mm256_fmadd_pd(dy, pull, sumsY[k]);
+			sumsZ[k] = _mm256_fmadd_pd(dz, pull, sumsZ[k]);
+		}
+	}
+	double sums[3][4];
+	_mm256_storeu_pd(sums[0], _mm256_add_pd(sumsX[0], sumsX[1]));
+	_mm256_storeu_pd(sums[1], _mm256_add_pd(sumsY[0], sumsY[1]));
+	_mm256_storeu_pd(sums[2], _mm256_add_pd(sumsZ[0], sumsZ[1]));
+	accelerationX += (sums[0][0] + sums[0][1]) + (sums[0][2] + sums[0][3]);
+	accelerationY += (sums[1][0] + sums[1][1]) + (sums[1][2] + sums[1][3]);
+	accelerationZ += (sums[2][0] + sums[2][1]) + (sums[2][2] + sums[2][3]);
+	accumulateScalar(x, y, z, count - j, masses + j, sourcesX + j, sourcesY + j, sourcesZ + j, softening2, accelerationX, accelerationY, accelerationZ);
+}
+
+/*-----------------------------------------------------------------------
+AVX-512: eight sources per register, two registers per iteration, and
+the last few sources under a mask instead of one at a time
+-------------------------------------------------------------------------*/
+
+GRAVITY_KERNEL_TARGET("avx512f")
+static inline __m512d pullAvx512(__mmask8 lanes, __m512d masses, __m512d dx, __m512d dy, __m512d dz, __m512d softening)
+{
+	const __m512d threeHalves = _mm512_set1_pd(1.5);
+	__m512d distance2 = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, _mm512_fmadd_pd(dz, dz, softening)));
+	const __m512d halfDistance2 = _mm512_mul_pd(_mm512_set1_pd(0.5), distance2);
+	// The masked form starts from zeros; the plain one leaves GCC warning about its undefined source register
+	__m512d y = _mm512_maskz_rsqrt14_pd(lanes, distance2);
+	y = _mm512_mul_pd(y, _mm512_fnmadd_pd(_mm512_mul_pd(halfDistance2, y), y, threeHalves));
+	y = _mm512_mul_pd(y, _mm512_fnmadd_pd(_mm512_mul_pd(halfDistance2, y), y, threeHalves));
+	lanes = _mm512_mask_cmp_pd_mask(lanes, distance2, _mm512_setzero_pd(), _CMP_GT_OQ);
+	return _mm512_maskz_mul_pd(lanes, masses, _mm512_mul_pd(y, _mm512_mul_pd(y, y)));
+}
+
+// The sum of the eight lanes, added in the same order as _mm512_reduce_add_pd, which GCC also builds on an undefined register
+GRAVITY_KERNEL_TARGET("avx512f")
+static inline double sumLanesAvx512(__m512d sums)
+{
+	double lanes[8];
+	_mm512_storeu_pd(lanes, sums);
+	return ((lanes[0] + lanes[4]) + (lanes[2] + lanes[6])) + ((lanes[1] + lanes[5]) + (lanes[3] + lanes[7]));
+}
+
+GRAVITY_KERNEL_TARGET("avx512f")
+static void accumulateAvx512(double x, double y, double z, size_t count, const double* masses, const double* sourcesX, const double* sourcesY, const double* sourcesZ,
+	double softening2, double& accelerationX, double& accelerationY, double& accelerationZ)
+{
+	const __m512d targetX = _mm512_set1_pd(x), targetY = _mm512_set1_pd(y), targetZ = _mm512_set1_pd(z);
+	const __m512d softening = _mm512_set1_pd(softening2);
+	__m512d sumsX[2] = { _mm512_setzero_pd(), _mm512_setzero_pd() };
+	__m512d sumsY[2] = { _mm512_setzero_pd(), _mm512_setzero_pd() };
+	__m512d sumsZ[2] = { _mm512_setzero_pd(), _mm512_setzero_pd() };
+	size_t j = 0;
+	for (; j + 16 <= count; j += 16) {
+		for (int k = 0; k < 2; k++) {
+			const size_t index = j + 8 * k;
+			__m512d dx = _mm512_sub_pd(_mm512_loadu_pd(sourcesX + index), targetX);
+			__m512d dy = _mm512_sub_pd(_mm512_loadu_pd(sourcesY + index), targetY);
+			__m512d dz = _mm512_sub_pd(_mm512_loadu_pd(sourcesZ + index), targetZ);
+			__m512d pull = pullAvx512(0xff, _mm512_loadu_pd(masses + index), dx, dy, dz, softening);
+			sumsX[k] = _mm512_fmadd_pd(dx, pull, sumsX[k]);
+			sumsY[k] = _mm512_fmadd_pd(dy, pull, sumsY[k]);
+			sumsZ[k] = _mm512_fmadd_pd(dz, pull, sumsZ[k]);
+		}
+	}
+	for (; j < count; j += 8) {
+		const __mmask8 lanes = count - j >= 8 ? (__mmask8)0xff : (__mmask8)((1u << (count - j)) - 1);
+		__m512d dx = _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, sourcesX + j), targetX);
+		__m512d dy = _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, sourcesY + j), targetY);
+		__m512d dz = _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, sourcesZ + j), targetZ);
+		__m512d pull = pullAvx512(lanes, _mm512_maskz_loadu_pd(lanes, masses + j), dx, dy, dz, softening);
+		sumsX[0] = _mm512_fmadd_pd(dx, pull, sumsX[0]);
+		sumsY[0] = _mm512_fmadd_pd(dy, pull, sumsY[0]);
+		sumsZ[0] = _mm512_fmadd_pd(dz, pull, sumsZ[0]);
+	}
+	accelerationX += sumLanesAvx512(_mm512_add_pd(sumsX[0], sumsX[1]));
+	accelerationY += sumLanesAvx512(_mm512_add_pd(sumsY[0], sumsY[1]));
+	accelerationZ += sumLanesAvx512(_mm512_add_pd(sumsZ[0], sumsZ[1]));
+}
+
+/*-----------------------------------------------------------------------
+What the processor supports
+-------------------------------------------------------------------------*/
+
+static GravityKernelIsa detectIsa()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	const int leafCount = info[0];
+	__cpuid(info, 1);
+	const bool hasSse2 = (info[3] & (1 << 26)) != 0;
+	const bool hasFma = (info[2] & (1 << 12)) != 0;
+	const bool hasAvx = (info[2] & (1 << 28)) != 0;
+	// The operating system also has to save the wider registers on a thread switch
+	const bool hasOsSave = (info[2] & (1 << 27)) != 0;
+	const unsigned long long savedState = hasOsSave ? _xgetbv(0) : 0;
+	const bool savesYmm = (savedState & 0x06) == 0x06;
+	const bool savesZmm = (savedState & 0xe6) == 0xe6;
+	bool hasAvx2 = false, hasAvx512 = false;
+	if (leafCount >= 7) {
+		__cpuidex(info, 7, 0);
+		hasAvx2 = (info[1] & (1 << 5)) != 0;
+		hasAvx512 = (info[1] & (1 << 16)) != 0;
+	}
+	if (hasAvx512 && savesZmm)
+		return GRAVITY_KERNEL_AVX512;
+	if (hasAvx && hasAvx2 && hasFma && savesYmm)
+		return GRAVITY_KERNEL_AVX2;
+	return hasSse2 ? GRAVITY_KERNEL_SSE2 : GRAVITY_KERNEL_SCALAR;
+#else
+	// These already check that the operating system saves the registers
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return GRAVITY_KERNEL_AVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return GRAVITY_KERNEL_AVX2;
+	return __builtin_cpu_supports("sse2") ? GRAVITY_KERNEL_SSE2 : GRAVITY_KERNEL_SCALAR;
+#endif
+}
+
+#else
+
+static GravityKernelIsa detectIsa()
+{
+	return GRAVITY_KERNEL_SCALAR;
+}
+
+#endif
+
+GravityKernelIsa gravityKernelSupportedIsa()
+{
+	static const GravityKernelIsa supported = detectIsa();
+	return supported;
+}
+
+// The kernel in use, -1 until it is first asked for
+static atomic<int> selectedIsa(-1);
+
+GravityKernelIsa gravityKernelIsa()
+{
+	int isa = selectedIsa.load(memory_order_relaxed);
+	if (isa < 0) {
+		isa = gravityKernelSupportedIsa();
+		selectedIsa.store(isa, memory_order_relaxed);
+	}
+	return (GravityKernelIsa)isa;
+}
+
+GravityKernelIsa setGravityKernelIsa(GravityKernelIsa isa)
+{
+	if (isa > gravityKernelSupportedIsa())
+		isa = gravityKernelSupportedIsa();
+	selectedIsa.store(isa, memory_order_relaxed);
+	return isa;
+}
+
+const char* gravityKernelIsaName(GravityKernelIsa isa)
+{
+	switch (isa) {
+	case GRAVITY_KERNEL_SSE2:
+		return "sse2";
+	case GRAVITY_KERNEL_AVX2:
+		return "avx2";
+	case GRAVITY_KERNEL_AVX512:
+		return "avx512";
+	default:
+		return "scalar";
+	}
+}
+
+void accumulateGravity(double x, double y, double z, size_t count, const double* masses, const double* sourcesX, const double* sourcesY, const double* sourcesZ,
+	double softening2, double& accelerationX, double& accelerationY, double& accelerationZ)
+{
+	switch (gravityKernelIsa()) {
+#ifdef GRAVITY_KERNEL_X86
+	case GRAVITY_KERNEL_AVX512:
+		accumulateAvx512(x, y, z, count, masses, sourcesX, sourcesY, sourcesZ, softening2, accelerationX, accelerationY, accelerationZ);
+		break;
+	case GRAVITY_KERNEL_AVX2:
+		accumulateAvx2(x, y, z, count, masses, sourcesX, sourcesY, sourcesZ, softening2, accelerationX, accelerationY, accelerationZ);
+		break;
+	case GRAVITY_KERNEL_SSE2:
+		accumulateSse2(x, y, z, count, masses, sourcesX, sourcesY, sourcesZ, softening2, accelerationX, accelerationY, accelerationZ);
+		break;
+#endif
+	default:
+		accumulateScalar(x, y, z, count, masses, sourcesX, sourcesY, sourcesZ, softening2, accelerationX, accelerationY, accelerationZ);
+		break;
+	}
+}
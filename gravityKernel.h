@@ -0,0 +1,36 @@
+/*
+* Title: Gravity Kernel
+* Description: The pull of a run of source particles on one particle, the inner loop of every gravity
+*              solver: direct summation, the leaves of the Barnes-Hut tree and the near field of the fast
+*              multipole method. The sources are arrays of masses and coordinates (structure of arrays),
+*              so whole registers of them load at once: 16 sources per iteration with AVX-512, 8 with AVX2
+*              and FMA, 4 with SSE2. The widest instruction set the processor supports is picked the first
+*              time the kernel runs, so one build runs everywhere
+*/
+
+#pragma once
+
+#include <cstddef>
+
+enum GravityKernelIsa {
+	GRAVITY_KERNEL_SCALAR,		// Plain C++, exact 1 / sqrt
+	GRAVITY_KERNEL_SSE2,		// Two doubles per register
+	GRAVITY_KERNEL_AVX2,		// Four, with fused multiply-adds
+	GRAVITY_KERNEL_AVX512		// Eight, with fused multiply-adds
+};
+
+// The widest instruction set this processor and operating system support
+GravityKernelIsa gravityKernelSupportedIsa();
+// The instruction set accumulateGravity uses: the supported one, unless set lower (to compare them, say). Asking for
+// more than is supported gets the supported one; the one used is returned
+GravityKernelIsa gravityKernelIsa();
+GravityKernelIsa setGravityKernelIsa(GravityKernelIsa isa);
+// "scalar", "sse2", "avx2" or "avx512"
+const char* gravityKernelIsaName(GravityKernelIsa isa);
+
+// Add to (accelerationX, accelerationY, accelerationZ) the pull of count sources on a particle at (x, y, z), before it
+// is scaled by G: the sum of m d / (|d|^2 + softening2)^(3/2), where d runs from the particle to each source. Sources
+// at no distance at all, like the particle itself without softening, add nothing. The vector versions start 1 / sqrt
+// from the processor's estimate and refine it by Newton's method, to a relative error of about 1e-13
+void accumulateGravity(double x, double y, double z, size_t count, const double* masses, const double* sourcesX, const double* sourcesY, const double* sourcesZ,
+	double softening2, double& accelerationX, double& accelerationY, double& accelerationZ);
@@ -0,0 +1,206 @@
+/*
+* Title: Headless Rendering
+* Description: Implementation of the windowless OpenGL context declared in headless.h
+*
+* Linux builds link against libEGL. The display is Mesa's surfaceless platform when it is there,
+* which needs no X server, GPU or DRM device; otherwise the default display is used
+*/
+
+#include "headless.h"
+#include <glad/glad.h>
+
+#if defined(__linux__)
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <cstring>
+#define HEADLESS_EGL
+#endif
+
+using namespace std;
+
+struct HeadlessContext::State {
+	string error;
+	bool isCreated = false;
+	GLuint framebuffer = 0;
+	GLuint colorBuffer = 0;
+	GLuint depthBuffer = 0;
+#ifdef HEADLESS_EGL
+	EGLDisplay display = EGL_NO_DISPLAY;
+	EGLContext context = EGL_NO_CONTEXT;
+	EGLSurface surface = EGL_NO_SURFACE;
+
+	// Ask for the surfaceless platform first, then fall back to whatever the default display is
+	EGLDisplay openDisplay()
+	{
+		const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+		if (clientExtensions && strstr(clientExtensions, "EGL_MESA_platform_surfaceless")) {
+			auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+			if (getPlatformDisplay) {
+				EGLDisplay surfaceless = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+				if (surfaceless != EGL_NO_DISPLAY && eglInitialize(surfaceless, nullptr, nullptr))
+					return surfaceless;
+			}
+		}
+		EGLDisplay defaultDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+		if (defaultDisplay != EGL_NO_DISPLAY && eglInitialize(defaultDisplay, nullptr, nullptr))
+			return defaultDisplay;
+		return EGL_NO_DISPLAY;
+	}
+
+	bool createContext(int width, int height)
+	{
+		display = openDisplay();
+		if (display == EGL_NO_DISPLAY) {
+			error = "no EGL display could be opened";
+			return false;
+		}
+		if (!eglBindAPI(EGL_OPENGL_API)) {
+			error = "the EGL driver does not support desktop OpenGL";
+			return false;
+		}
+
+		// Without surfaceless contexts the context needs a surface to be current on; a pbuffer is the only kind with no window
+		const char* extensions = eglQueryString(display, EGL_EXTENSIONS);
+		bool isSurfaceless = extensions && strstr(extensions, "EGL_KHR_surfaceless_context");
+
+		const EGLint configAttributes[] = {
+			EGL_SURFACE_TYPE, isSurfaceless ? 0 : EGL_PBUFFER_BIT,
+			EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+			EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+			EGL_DEPTH_SIZE, 24,
+			EGL_NONE
+		};
+		EGLConfig config;
+		EGLint configCount = 0;
+		if (!eglChooseConfig(display, configAttributes, &config, 1, &configCount) || configCount == 0) {
+			error = "no EGL config supports OpenGL rendering";
+			return false;
+		}
+
+		// The same version and profile the windowed build asks GLFW for
+		const EGLint contextAttributes[] = {
+			EGL_CONTEXT_MAJOR_VERSION, 3,
+			EGL_CONTEXT_MINOR_VERSION, 3,
+			EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+			EGL_NONE
+		};
+		context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+		if (context == EGL_NO_CONTEXT) {
+			error = "the EGL driver could not create an OpenGL 3.3 core context";
+			return false;
+		}
+
+		if (!isSurfaceless) {
+			const EGLint surfaceAttributes[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+			surface = eglCreatePbufferSurface(display, config, surfaceAttributes);
+			if (surface == EGL_NO_SURFACE) {
+				error = "the EGL driver could not create a pbuffer surface";
+				return false;
+			}
+		}
+		if (!eglMakeCurrent(display, surface, surface, context)) {
+			error = "the EGL context could not be made current";
+			return false;
+		}
+
+		// eglGetProcAddress also finds the core functions on Mesa (EGL_KHR_get_all_proc_addresses)
+		if (!gladLoadGLLoader((GLADloadproc)eglGetProcAddress)) {
+			error = "the OpenGL functions could not be loaded";
+			return false;
+		}
+		return true;
+	}
+
+	void destroyContext()
+	{
+		if (display == EGL_NO_DISPLAY)
+			return;
+		eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		if (surface != EGL_NO_SURFACE)
+			eglDestroySurface(display, surface);
+		if (context != EGL_NO_CONTEXT)
+			eglDestroyContext(display, context);
+		eglTerminate(display);
+		display = EGL_NO_DISPLAY;
+		context = EGL_NO_CONTEXT;
+		surface = EGL_NO_SURFACE;
+	}
+#else
+	bool createContext(int, int)
+	{
+		error = "headless rendering needs EGL, which is only set up for Linux builds";
+		return false;
+	}
+
+	void destroyContext() {}
+#endif
+
+	// Everything is drawn into this framebuffer instead of a window's back buffer
+	bool createFramebuffer(int width, int height)
+	{
+		glGenFramebuffers(1, &framebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+		glGenRenderbuffers(1, &colorBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+
+		glGenRenderbuffers(1, &depthBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			error = "the offscreen framebuffer is incomplete";
+			return false;
+		}
+		glViewport(0, 0, width, height);
+		return true;
+	}
+};
+
+HeadlessContext::HeadlessContext() : state(make_unique<State>()) {}
+
+HeadlessContext::~HeadlessContext()
+{
+	destroy();
+}
+
+bool HeadlessContext::create(int width, int height)
+{
+	destroy();
+	State& s = *state;
+	s.error.clear();
+	if (!s.createContext(width, height) || !s.createFramebuffer(width, height)) {
+		destroy();
+		return false;
+	}
+	s.isCreated = true;
+	return true;
+}
+
+void HeadlessContext::destroy()
+{
+	State& s = *state;
+	if (s.framebuffer != 0) {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glDeleteFramebuffers(1, &s.framebuffer);
+		glDeleteRenderbuffers(1, &s.colorBuffer);
+		glDeleteRenderbuffers(1, &s.depthBuffer);
+		s.framebuffer = s.colorBuffer = s.depthBuffer = 0;
+	}
+	s.destroyContext();
+	s.isCreated = false;
+}
+
+bool HeadlessContext::isCreated() const
+{
+	return state->isCreated;
+}
+
+const string& HeadlessContext::error() const
+{
+	return state->error;
+}
@@ -0,0 +1,36 @@
+/*
+* Title: Headless Rendering
+* Description: An OpenGL context with no window, for running the simulation on machines without a
+*              display. On Linux the context comes from EGL - surfaceless where the driver allows it,
+*              with a pbuffer otherwise - which Mesa's llvmpipe provides on CPU-only machines. Frames
+*              are drawn into a framebuffer object, so glReadPixels and the capture path work as they
+*              do with a window. Other platforms have no headless backend
+*/
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+class HeadlessContext {
+public:
+	HeadlessContext();
+	// Releases the context if destroy() was not called
+	~HeadlessContext();
+
+	HeadlessContext(const HeadlessContext&) = delete;
+	HeadlessContext& operator=(const HeadlessContext&) = delete;
+
+	// Create an OpenGL 3.3 core context, load the GL functions through glad and bind a width x height
+	// framebuffer with a depth buffer; returns false, with the reason in error(), if that is not possible here
+	bool create(int width, int height);
+	// Delete the framebuffer and the context; GL objects made with the context should be deleted first
+	void destroy();
+
+	bool isCreated() const;
+	const std::string& error() const;
+
+private:
+	struct State;
+	std::unique_ptr<State> state;
+};
@@ -0,0 +1,364 @@
+/*
+* Title: Kepler Orbits
+* Description: Implementation of the propagator declared in keplerOrbits.h
+*
+* For each orbit the mean anomaly M = M0 + n (t - epoch) is brought into [-pi, pi], and Kepler's equation
+* E - e sin E = M is solved for the eccentric anomaly E by Halley's method from Danby's starting point
+* E0 = M + 0.85 e sign(M), which converges for every e below 1. The orbits are solved KEPLER_BLOCK at a time: every
+* loop over a block has a fixed length and no branches, sin and cos come from polynomials rather than the library,
+* and the iterations go on until the slowest orbit of the block has converged, so the compiler can turn the whole
+* block into vector instructions. The block code is compiled once for each instruction set the gravity kernel knows,
+* and the widest the processor supports is used
+*/
+
+#include "keplerOrbits.h"
+#include "gravityKernel.h"
+#include "taskScheduler.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define KEPLER_X86
+#endif
+#ifdef _MSC_VER
+// MSVC has no per-function instruction sets; it vectorizes the blocks for the one the project is built for
+#define KEPLER_TARGET(isa)
+#define KEPLER_INLINE __forceinline
+#else
+#define KEPLER_TARGET(isa) __attribute__((target(isa)))
+#define KEPLER_INLINE inline __attribute__((always_inline))
+#endif
+
+using namespace std;
+
+// Orbits solved side by side, a multiple of any vector width
+static const size_t KEPLER_BLOCK = 8;
+// Blocks per scheduler task, when there are enough orbits to be worth splitting
+static const size_t BLOCKS_PER_TASK = 512;
+// Halley's method stops once no orbit in a block moved more than this; the error left is about its cube
+static const double KEPLER_TOLERANCE = 1e-8;
+static const int KEPLER_MAX_ITERATIONS = 16;
+// Eccentricities are kept at most this far below 1, where the ellipse is a line and Kepler's equation has no slope
+static const double MAX_ECCENTRICITY = 1.0 - 1e-9;
+
+static const double PI = 3.14159265358979323846;
+// 2 pi in two parts, the first with its low bits zero, so that k times it is exact when reducing angles
+static const double TWO_PI_HIGH = 6.28318530717958623200;
+static const double TWO_PI_LOW = 2.44929359829470635445e-16;
+
+/*-----------------------------------------------------------------------
+Kepler's equation on a block of orbits
+-------------------------------------------------------------------------*/
+
+// sin and cos of x in [-pi, pi]: the Cephes polynomials for a quarter of the angle (good to an ulp within pi / 4),
+// then two doublings, with no branches so that a block of them vectorizes
+static KEPLER_INLINE void sinCos(double x, double& sine, double& cosine)
+{
+	const double q = 0.25 * x;
+	const double q2 = q * q;
+	double s = q + q * q2 * (-1.66666666666666307295e-1 + q2 * (8.33333333332211858878e-3 + q2 * (-1.98412698295895385996e-4
+		+ q2 * (2.75573136213857245213e-6 + q2 * (-2.50507477628578072866e-8 + q2 * 1.58962301576546568060e-10)))));
+	double c = 1.0 - 0.5 * q2 + q2 * q2 * (4.16666666666665929218e-2 + q2 * (-1.38888888888730564116e-3 + q2 * (2.48015872888517045348e-5
+		+ q2 * (-2.75573141792967388112e-7 + q2 * (2.08757008419747316778e-9 + q2 * -1.13585365213876817300e-11)))));
+	// sin 2y = 2 sin y cos y, cos 2y = (cos y - sin y)(cos y + sin y)
+	double s2 = 2.0 * s * c;
+	double c2 = (c - s) * (c + s);
+	sine = 2.0 * s2 * c2;
+	cosine = (c2 - s2) * (c2 + s2);
+}
+
+// Adding and taking away 1.5 * 2^52 rounds a double below 2^51 to the nearest whole number, which unlike floor() needs
+// no SSE4.1 to vectorize
+static const double ROUNDING_OFFSET = 6755399441055744.0;
+
+// The angle minus the whole turns in it, in [-pi, pi]
+static KEPLER_INLINE double reduceAngle(double angle)
+{
+	double turns = (angle * (1.0 / (2.0 * PI)) + ROUNDING_OFFSET) - ROUNDING_OFFSET;
+	return (angle - turns * TWO_PI_HIGH) - turns * TWO_PI_LOW;
+}
+
+// sin E and cos E for a block of mean anomalies in [-pi, pi]. E stays in [-pi, pi] too, since E - e sin E runs from
+// -pi to pi over it
+static KEPLER_INLINE void solveKeplerBlock(const double* meanAnomalies, const double* eccentricities, double* sines, double* cosines)
+{
+	double anomalies[KEPLER_BLOCK];
+	for (size_t k = 0; k < KEPLER_BLOCK; k++)
+		anomalies[k] = meanAnomalies[k] + copysign(0.85 * eccentricities[k], meanAnomalies[k]);
+	for (int iteration = 0; iteration < KEPLER_MAX_ITERATIONS; iteration++) {
+		double steps[KEPLER_BLOCK];
+		for (size_t k = 0; k < KEPLER_BLOCK; k++) {
+			double sine, cosine;
+			sinCos(anomalies[k], sine, cosine);
+			const double e = eccentricities[k];
+			// f(E) = E - e sin E - M, with f' = 1 - e cos E and f'' = e sin E
+			double f = anomalies[k] - e * sine - meanAnomalies[k];
+			double slope = 1.0 - e * cosine;
+			steps[k] = f / (slope - 0.5 * f * e * sine / slope);
+			anomalies[k] = min(max(anomalies[k] - steps[k], -PI), PI);
+		}
+		// Counted apart from the steps, as a floating point maximum would keep the loop above from vectorizing
+		int unconverged = 0;
+		for (size_t k = 0; k < KEPLER_BLOCK; k++)
+			unconverged += fabs(steps[k]) >= KEPLER_TOLERANCE;
+		if (unconverged == 0)
+			break;
+	}
+	for (size_t k = 0; k < KEPLER_BLOCK; k++)
+		sinCos(anomalies[k], sines[k], cosines[k]);
+}
+
+// The arrays of a set of orbits, and the ones their positions and velocities go to (velocities may be null)
+struct PropagationArrays {
+	size_t count;
+	const double* meanMotions;
+	const double* epochMeanAnomalies;
+	const double* eccentricities;
+	const double* majorAxesX;
+	const double* majorAxesY;
+	const double* majorAxesZ;
+	const double* minorAxesX;
+	const double* minorAxesY;
+	const double* minorAxesZ;
+	double* x;
+	double* y;
+	double* z;
+	double* velocityX;
+	double* velocityY;
+	double* velocityZ;
+};
+
+static KEPLER_INLINE void propagateBlocks(const PropagationArrays& orbits, double time, size_t firstBlock, size_t endBlock)
+{
+	for (size_t block = firstBlock; block < endBlock; block++) {
+		const size_t first = block * KEPLER_BLOCK;
+		const double* e = orbits.eccentricities + first;
+		double meanAnomalies[KEPLER_BLOCK], sines[KEPLER_BLOCK], cosines[KEPLER_BLOCK];
+		for (size_t k = 0; k < KEPLER_BLOCK; k++)
+			meanAnomalies[k] = reduceAngle(orbits.epochMeanAnomalies[first + k] + orbits.meanMotions[first + k] * time);
+		solveKeplerBlock(meanAnomalies, e, sines, cosines);
+
+		// Worked out for the whole block, then copied, since the last block has padding the output has no room for
+		double x[KEPLER_BLOCK], y[KEPLER_BLOCK], z[KEPLER_BLOCK];
+		for (size_t k = 0; k < KEPLER_BLOCK; k++) {
+			double major = cosines[k] - e[k];
+			x[k] = orbits.majorAxesX[first + k] * major + orbits.minorAxesX[first + k] * sines[k];
+			y[k] = orbits.majorAxesY[first + k] * major + orbits.minorAxesY[first + k] * sines[k];
+			z[k] = orbits.majorAxesZ[first + k] * major + orbits.minorAxesZ[first + k] * sines[k];
+		}
+		const size_t valid = min(KEPLER_BLOCK, orbits.count - first);
+		for (size_t k = 0; k < valid; k++) {
+			orbits.x[first + k] = x[k];
+			orbits.y[first + k] = y[k];
+			orbits.z[first + k] = z[k];
+		}
+		if (orbits.velocityX == nullptr)
+			continue;
+
+		// dE/dt = n / (1 - e cos E)
+		for (size_t k = 0; k < KEPLER_BLOCK; k++) {
+			double rate = orbits.meanMotions[first + k] / (1.0 - e[k] * cosines[k]);
+			x[k] = (orbits.minorAxesX[first + k] * cosines[k] - orbits.majorAxesX[first + k] * sines[k]) * rate;
+			y[k] = (orbits.minorAxesY[first + k] * cosines[k] - orbits.majorAxesY[first + k] * sines[k]) * rate;
+			z[k] = (orbits.minorAxesZ[first + k] * cosines[k] - orbits.majorAxesZ[first + k] * sines[k]) * rate;
+		}
+		for (size_t k = 0; k < valid; k++) {
+			orbits.velocityX[first + k] = x[k];
+			orbits.velocityY[first + k] = y[k];
+			orbits.velocityZ[first + k] = z[k];
+		}
+	}
+}
+
+static void propagateScalar(const PropagationArrays& orbits, double time, size_t firstBlock, size_t endBlock)
+{
+	propagateBlocks(orbits, time, firstBlock, endBlock);
+}
+
+#ifdef KEPLER_X86
+
+KEPLER_TARGET("sse2")
+static void propagateSse2(const PropagationArrays& orbits, double time, size_t firstBlock, size_t endBlock)
+{
+	propagateBlocks(orbits, time, firstBlock, endBlock);
+}
+
+KEPLER_TARGET("avx2,fma")
+static void propagateAvx2(const PropagationArrays& orbits, double time, size_t firstBlock, size_t endBlock)
+{
+	propagateBlocks(orbits, time, firstBlock, endBlock);
+}
+
+KEPLER_TARGET("avx512f")
+static void propagateAvx512(const PropagationArrays& orbits, double time, size_t firstBlock, size_t endBlock)
+{
+	propagateBlocks(orbits, time, firstBlock, endBlock);
+}
+
+#endif
+
+/*-----------------------------------------------------------------------
+Orbital elements
+-------------------------------------------------------------------------*/
+
+bool orbitalElementsFromState(double mu, double x, double y, double z, double velocityX, double velocityY, double velocityZ,
+	OrbitalElements& elements)
+{
+	const double radius = sqrt(x * x + y * y + z * z);
+	const double speed2 = velocityX * velocityX + velocityY * velocityY + velocityZ * velocityZ;
+	// Angular momentum h = r x v, the normal of the orbit's plane
+	const double hx = y * velocityZ - z * velocityY;
+	const double hy = z * velocityX - x * velocityZ;
+	const double hz = x * velocityY - y * velocityX;
+	const double h = sqrt(hx * hx + hy * hy + hz * hz);
+	if (mu <= 0.0 || radius == 0.0 || h == 0.0)
+		return false;
+	const double inverseA = 2.0 / radius - speed2 / mu;
+	if (inverseA <= 0.0)
+		return false;
+
+	// Eccentricity vector, pointing at the periapsis: ((v^2 - mu / r) r - (r.v) v) / mu
+	const double radialSpeed = (x * velocityX + y * velocityY + z * velocityZ);
+	const double ex = ((speed2 - mu / radius) * x - radialSpeed * velocityX) / mu;
+	const double ey = ((speed2 - mu / radius) * y - radialSpeed * velocityY) / mu;
+	const double ez = ((speed2 - mu / radius) * z - radialSpeed * velocityZ) / mu;
+	const double e = sqrt(ex * ex + ey * ey + ez * ez);
+	if (e >= 1.0)
+		return false;
+
+	elements.semiMajorAxis = 1.0 / inverseA;
+	elements.eccentricity = e;
+	elements.inclination = acos(max(-1.0, min(1.0, hz / h)));
+
+	// The line of nodes, z x h; an orbit in the xy plane has none, so the x axis stands in for it
+	double nodeX = -hy, nodeY = hx;
+	double node = sqrt(nodeX * nodeX + nodeY * nodeY);
+	if (node <= 1e-12 * h) {
+		nodeX = 1.0;
+		nodeY = 0.0;
+		node = 1.0;
+	}
+	nodeX /= node;
+	nodeY /= node;
+	elements.ascendingNode = atan2(nodeY, nodeX);
+
+	// Angles in the orbit's plane are measured the way the body goes: around the unit normal
+	const double normalX = hx / h, normalY = hy / h, normalZ = hz / h;
+	auto angleFrom = [&](double fromX, double fromY, double fromZ, double toX, double toY, double toZ) {
+		double crossX = fromY * toZ - fromZ * toY;
+		double crossY = fromZ * toX - fromX * toZ;
+		double crossZ = fromX * toY - fromY * toX;
+		return atan2(crossX * normalX + crossY * normalY + crossZ * normalZ, fromX * toX + fromY * toY + fromZ * toZ);
+	};
+	// A circle has no periapsis, so the node stands in for it
+	double periapsisX = nodeX, periapsisY = nodeY, periapsisZ = 0.0;
+	elements.argumentOfPeriapsis = 0.0;
+	if (e > 1e-12) {
+		periapsisX = ex / e;
+		periapsisY = ey / e;
+		periapsisZ = ez / e;
+		elements.argumentOfPeriapsis = angleFrom(nodeX, nodeY, 0.0, periapsisX, periapsisY, periapsisZ);
+	}
+
+	// True anomaly, then the eccentric and mean anomalies
+	double trueAnomaly = angleFrom(periapsisX, periapsisY, periapsisZ, x, y, z);
+	double eccentricAnomaly = 2.0 * atan2(sqrt(1.0 - e) * sin(0.5 * trueAnomaly), sqrt(1.0 + e) * cos(0.5 * trueAnomaly));
+	elements.meanAnomaly = eccentricAnomaly - e * sin(eccentricAnomaly);
+	return true;
+}
+
+/*-----------------------------------------------------------------------
+The orbits
+-------------------------------------------------------------------------*/
+
+size_t KeplerOrbits::add(double mu, const OrbitalElements& elements, double epoch)
+{
+	const size_t index = orbits.size();
+	orbits.push_back(elements);
+	OrbitalElements& kept = orbits.back();
+	kept.eccentricity = min(max(kept.eccentricity, 0.0), MAX_ECCENTRICITY);
+
+	// Room for the new orbit, padding the last block with circles of no size that never move
+	const size_t padded = (orbits.size() + KEPLER_BLOCK - 1) / KEPLER_BLOCK * KEPLER_BLOCK;
+	for (AlignedVector<double>* array : { &meanMotions, &epochMeanAnomalies, &eccentricities, &majorAxesX, &majorAxesY, &majorAxesZ,
+			&minorAxesX, &minorAxesY, &minorAxesZ })
+		array->resize(padded, 0.0);
+
+	const double a = kept.semiMajorAxis;
+	const double e = kept.eccentricity;
+	const double meanMotion = sqrt(mu / (a * a * a));
+	meanMotions[index] = meanMotion;
+	epochMeanAnomalies[index] = kept.meanAnomaly - meanMotion * epoch;
+	eccentricities[index] = e;
+
+	// The rotation Rz(Omega) Rx(i) Rz(omega) takes the periapsis direction (1, 0, 0) and the direction of motion
+	// there (0, 1, 0) into space
+	const double cosNode = cos(kept.ascendingNode), sinNode = sin(kept.ascendingNode);
+	const double cosInclination = cos(kept.inclination), sinInclination = sin(kept.inclination);
+	const double cosPeriapsis = cos(kept.argumentOfPeriapsis), sinPeriapsis = sin(kept.argumentOfPeriapsis);
+	const double b = a * sqrt(1.0 - e * e);
+	majorAxesX[index] = a * (cosNode * cosPeriapsis - sinNode * sinPeriapsis * cosInclination);
+	majorAxesY[index] = a * (sinNode * cosPeriapsis + cosNode * sinPeriapsis * cosInclination);
+	majorAxesZ[index] = a * sinPeriapsis * sinInclination;
+	minorAxesX[index] = b * (-cosNode * sinPeriapsis - sinNode * cosPeriapsis * cosInclination);
+	minorAxesY[index] = b * (-sinNode * sinPeriapsis + cosNode * cosPeriapsis * cosInclination);
+	minorAxesZ[index] = b * cosPeriapsis * sinInclination;
+	return index;
+}
+
+void KeplerOrbits::clear()
+{
+	orbits.clear();
+	for (AlignedVector<double>* array : { &meanMotions, &epochMeanAnomalies, &eccentricities, &majorAxesX, &majorAxesY, &majorAxesZ,
+			&minorAxesX, &minorAxesY, &minorAxesZ })
+		array->clear();
+}
+
+double KeplerOrbits::period(size_t index) const
+{
+	return meanMotions[index] > 0.0 ? 2.0 * PI / meanMotions[index] : INFINITY;
+}
+
+void KeplerOrbits::positionsAt(double time, double* x, double* y, double* z) const
+{
+	propagate(time, x, y, z, nullptr, nullptr, nullptr);
+}
+
+void KeplerOrbits::statesAt(double time, double* x, double* y, double* z, double* velocityX, double* velocityY, double* velocityZ) const
+{
+	propagate(time, x, y, z, velocityX, velocityY, velocityZ);
+}
+
+void KeplerOrbits::propagate(double time, double* x, double* y, double* z, double* velocityX, double* velocityY, double* velocityZ) const
+{
+	const PropagationArrays arrays = { size(), meanMotions.data(), epochMeanAnomalies.data(), eccentricities.data(),
+		majorAxesX.data(), majorAxesY.data(), majorAxesZ.data(), minorAxesX.data(), minorAxesY.data(), minorAxesZ.data(),
+		x, y, z, velocityX, velocityY, velocityZ };
+	void (*propagateRange)(const PropagationArrays&, double, size_t, size_t) = propagateScalar;
+#ifdef KEPLER_X86
+	switch (gravityKernelIsa()) {
+	case GRAVITY_KERNEL_AVX512:
+		propagateRange = propagateAvx512;
+		break;
+	case GRAVITY_KERNEL_AVX2:
+		propagateRange = propagateAvx2;
+		break;
+	case GRAVITY_KERNEL_SSE2:
+		propagateRange = propagateSse2;
+		break;
+	default:
+		break;
+	}
+#endif
+
+	const size_t blockCount = (size() + KEPLER_BLOCK - 1) / KEPLER_BLOCK;
+	if (blockCount <= BLOCKS_PER_TASK) {
+		propagateRange(arrays, time, 0, blockCount);
+		return;
+	}
+	const int taskCount = (int)((blockCount + BLOCKS_PER_TASK - 1) / BLOCKS_PER_TASK);
+	TaskScheduler::shared().parallelFor(taskCount, [&](int task) {
+		size_t firstBlock = (size_t)task * BLOCKS_PER_TASK;
+		propagateRange(arrays, time, firstBlock, min(firstBlock + BLOCKS_PER_TASK, blockCount));
+	});
+}
@@ -0,0 +1,67 @@
+/*
+* Title: Kepler Orbits
+* Description: Closed-form two-body orbits, for bodies whose motion is dominated by one central mass. Each orbit
+*              is kept as its elements, and its position at any time comes straight from Kepler's equation, in
+*              O(1) however far that time is from the start, so time can jump back and forth freely. Whole arrays
+*              of orbits are solved at once: Halley's method runs on blocks of orbits side by side, which the
+*              compiler turns into vector instructions (the widest the processor has, as for the gravity kernel),
+*              and large sets are split over the task scheduler
+*/
+
+#pragma once
+
+#include "alignedVector.h"
+#include <cstddef>
+#include <vector>
+
+// An ellipse in space and where along it the body is. The angles are in radians
+struct OrbitalElements {
+	double semiMajorAxis = 1.0;			// a
+	double eccentricity = 0.0;			// e, from 0 for a circle up to (not including) 1
+	double inclination = 0.0;			// i, of the orbit's plane to the xy plane; above pi / 2 goes clockwise seen from +z
+	double ascendingNode = 0.0;			// Omega, the longitude from the x axis where the orbit rises through the xy plane
+	double argumentOfPeriapsis = 0.0;	// omega, from the ascending node to the closest point, the way the body goes
+	double meanAnomaly = 0.0;			// M0, the body's mean anomaly at the epoch
+};
+
+// The elements of the orbit of a particle at (x, y, z) moving at (velocityX, velocityY, velocityZ) around a mass mu / G at the
+// origin. Angles that the orbit leaves undefined are 0: the node of an orbit in the xy plane is taken on the x axis, and the
+// periapsis of a circle at the node. Returns false if the particle is not on an ellipse (it escapes, or is not moving around
+// the origin at all)
+bool orbitalElementsFromState(double mu, double x, double y, double z, double velocityX, double velocityY, double velocityZ,
+	OrbitalElements& elements);
+
+class KeplerOrbits {
+public:
+	// Add an orbit around a mass mu / G, with the elements it has at time epoch, and return its index. The eccentricity is
+	// kept below 1
+	size_t add(double mu, const OrbitalElements& elements, double epoch = 0.0);
+	size_t size() const { return orbits.size(); }
+	void clear();
+
+	const OrbitalElements& elements(size_t index) const { return orbits[index]; }
+	// Time one trip around takes
+	double period(size_t index) const;
+
+	// Where every orbit has its body at time, relative to the mass it goes around
+	void positionsAt(double time, double* x, double* y, double* z) const;
+	// The same, with the velocities as well
+	void statesAt(double time, double* x, double* y, double* z, double* velocityX, double* velocityY, double* velocityZ) const;
+
+private:
+	void propagate(double time, double* x, double* y, double* z, double* velocityX, double* velocityY, double* velocityZ) const;
+
+	std::vector<OrbitalElements> orbits;
+	// What the propagation needs, worked out once per orbit, padded with circles to whole blocks
+	AlignedVector<double> meanMotions;			// n = sqrt(mu / a^3)
+	AlignedVector<double> epochMeanAnomalies;	// M0 - n epoch, so that M = this + n t
+	AlignedVector<double> eccentricities;
+	// The axes of the ellipse: a times the direction of the periapsis, and b = a sqrt(1 - e^2) times the direction the
+	// body moves there, so that the position is A (cos E - e) + B sin E for the eccentric anomaly E
+	AlignedVector<double> majorAxesX;
+	AlignedVector<double> majorAxesY;
+	AlignedVector<double> majorAxesZ;
+	AlignedVector<double> minorAxesX;
+	AlignedVector<double> minorAxesY;
+	AlignedVector<double> minorAxesZ;
+};
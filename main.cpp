@@ -13,14 +13,28 @@
 #include "imgui.h"
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
-#include "gif.h"
+#include "capture.h"
+#include "headless.h"
+#include "softwareRenderer.h"
+#include "scene.h"
+#include "bodyStore.h"
+#include "nbody.h"
+#include "keplerOrbits.h"
+#include "taskScheduler.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define _USE_MATH_DEFINES
+#include <algorithm>
 #include <iostream>
 #include <cmath>
 #include <numbers>
 #include <vector>
+#include <string>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <tuple>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
@@ -29,14 +43,82 @@
 using namespace std;
 
 // Constants
-float ASTERIOD_BELT_RADIUS_X = 0.42f;
-float ASTERIOD_BELT_RADIUS_Y = 0.40f;
-float ASTERIOD_BELT_RADIUS2_X = 0.41f;
-float ASTERIOD_BELT_RADIUS2_Y = 0.39f;
-float ASTERIOD_BELT_RADIUS3_X = 0.4f;
-float ASTERIOD_BELT_RADIUS3_Y = 0.38f;
 float EARTH_MOON_DISTANCE = 0.036f;
 
+// The bodies, their orbits and textures come from this scene file (see scene.h); change it with "--scene <file>"
+string SCENE_FILE = "scenes/solarSystem.json";
+// Move the bodies that have a mass by Newtonian gravity instead of along their orbits ("--physics"). The simulation
+// advances in steps of PHYSICS_TIME_STEP seconds of simulation time with PHYSICS_INTEGRATOR (see Integrator in nbody.h),
+// and each frame shows its latest state. A scene can choose both in its "physics", and "--time-step S" and
+// "--integrator leapfrog|yoshida4|yoshida6|wisdom-holman|block-leapfrog" override the scene. The block leapfrog gives
+// each body steps of PHYSICS_TIME_STEP_ACCURACY times its shortest orbital period ("--time-step-accuracy X"), halving
+// PHYSICS_TIME_STEP as often as that takes, and has every body back in step at the end of each PHYSICS_TIME_STEP.
+// "--integrator kepler" (USE_KEPLER_ORBITS) steps nothing: each body with a mass, and each asteroid of a belt around
+// one, keeps the two-body orbit it starts on around its parent (see keplerOrbits.h), and every frame works out
+// where the orbits are at its time directly, however far that is from the last frame's
+bool USE_PHYSICS = false;
+double PHYSICS_TIME_STEP = 1.0 / 1000.0;
+Integrator PHYSICS_INTEGRATOR = INTEGRATOR_LEAPFROG;
+double PHYSICS_TIME_STEP_ACCURACY = 0.01;
+// "--time-step-criterion acceleration" has the block leapfrog step each body by PHYSICS_TIME_STEP_ACCURACY *
+// sqrt(PHYSICS_TIME_STEP_LENGTH / |acceleration|) instead ("--time-step-length L"), for scenes with many massive bodies
+// (see TimeStepCriterion in nbody.h). Either way PHYSICS_TIME_STEP is halved at most PHYSICS_MAX_TIME_STEP_LEVEL times
+// ("--max-time-step-level N"). The scene's "physics" can set all three
+TimeStepCriterion PHYSICS_TIME_STEP_CRITERION = TIME_STEP_ORBIT;
+double PHYSICS_TIME_STEP_LENGTH = 1e-3;
+int PHYSICS_MAX_TIME_STEP_LEVEL = 16;
+bool USE_KEPLER_ORBITS = false;
+// How the forces are worked out ("--gravity direct|barnes-hut|fmm", see GravitySolver in nbody.h); the trees pay off
+// for scenes with thousands of bodies or asteroids, and the multipole method from hundreds of thousands
+GravitySolver PHYSICS_SOLVER = GRAVITY_DIRECT;
+// Accuracy against speed for the tree solvers: the expansion order of the multipole method ("--multipole-order N") and
+// the opening angle of either ("--opening-angle X"); a negative angle keeps each solver's own default
+int PHYSICS_MULTIPOLE_ORDER = 4;
+double PHYSICS_OPENING_ANGLE = -1.0;
+
+// How the GIF palette is chosen (see GifPaletteMode in capture.h)
+GifPaletteMode GIF_PALETTE_MODE = GIF_PALETTE_FROM_SCENE;
+int GIF_PALETTE_LEARN_FRAMES = 10;
+// GIF dithering (see GifDitherMode in capture.h); ordered dithering is cheap enough for recording live
+GifDitherMode GIF_DITHER_MODE = GIF_DITHER_NONE;
+// Number of texels each texture contributes to the scene palette, so that large textures don't crowd out small ones
+int PALETTE_SAMPLES_PER_TEXTURE = 16384;
+// How many seconds of frames the replay buffer keeps, and whether it is running when the program starts
+float REPLAY_BUFFER_SECONDS = 10.0f;
+bool REPLAY_BUFFER_ON_AT_START = false;
+// Recordings keep every CAPTURE_FRAME_STEP-th frame, shrunk by CAPTURE_SCALE_DIVISOR (1 keeps the window size)
+int CAPTURE_FRAME_STEP = 1;
+int CAPTURE_SCALE_DIVISOR = 1;
+// Record to a lossless .ssrec file instead of a GIF, which costs much less while running; convert it afterwards with ssrecTranscode
+bool RECORD_LOSSLESS = false;
+// Raw frame streams for external encoders: the rate frames are rendered at (the fixed time step's rate replaces it when that is on), and the format used
+// Start one from the UI, or at launch with "--stream <file, pipe or - for stdout> [--stream-format y4m|ppm]"
+int STREAM_FRAME_RATE = 60;
+RawStreamFormat STREAM_FORMAT = RAW_STREAM_Y4M;
+// Deterministic capture: simulation time advances by exactly 1 / FIXED_TIME_STEP_FPS seconds per rendered frame
+// instead of following the clock, so a recording comes out the same however fast the machine renders
+// Vsync is off in this mode; rates that divide 100 (25, 50) give GIF delays without rounding
+// Turn it on from the UI, or at launch with "--fixed-fps <frames per second>"
+bool USE_FIXED_TIME_STEP = false;
+int FIXED_TIME_STEP_FPS = 25;
+
+// Seconds of simulated time - everything that moves is positioned from this, never from the clock directly
+double simulationTime = 0.0;
+
+// Headless rendering for machines without a display: "--headless --frames N" draws N frames offscreen at the fixed
+// time step, with no window and no UI, and then exits. Frames go to "--record <file>" and/or "--stream <target>"
+bool HEADLESS = false;
+int HEADLESS_FRAME_COUNT = 250;
+// Draw on the CPU instead of with OpenGL ("--software", which also means --headless), for machines with no OpenGL driver at all
+bool SOFTWARE_RENDERING = false;
+// The physics, the software renderer, GIF encoding and texture loading share THREAD_COUNT threads: this thread and
+// THREAD_COUNT - 1 workers ("--threads N"; 0 uses one thread per hardware thread). With PIN_THREADS
+// ("--pin-threads"), each worker stays on a logical processor of its own
+int THREAD_COUNT = 0;
+bool PIN_THREADS = false;
+// Created when SOFTWARE_RENDERING is on; texture loading, buffer setup and drawing go to it instead of OpenGL
+unique_ptr<SoftwareRenderer> softwareRenderer;
+
  /*Texture coordinate for background that covers the entire screen
  It forms two triangles with 3 vertices, each with its texture coordinates*/
 
@@ -51,25 +133,26 @@ float backgroundVertices[] = {
 	 1.0f,  1.0f,       1.0f, 1.0f
 };
 
-//Celestial Bodies struct that will be used to update body properties in the rendering loop
-
-struct CelestialBodies {
-	unsigned int VAO;         // Vertex Array Object for the planet
-	float moveSpeed;          // Speed at which the planet moves
-	float orbitRadiusX;       // Max X-axis radius of the orbit
-	float orbitRadiusY;       // Max Y-axis radius of the orbit
-	float scale;              // Scale of the planet
-	int segments;             // Number of segments for rendering
-	float updatePosX;         // Updated X position for the planet
-	float updatePosY;         // Updated Y position for the planet
-	float rotationSpeed;	  // Rotation speed of planet/object
-	bool isScale;             // Flag for scaling
-	bool isTranslate;         // Flag for translation
-	bool isRotate;            // Flag for rotation
-	bool isVisible;		  // Flag to allow the user add or remove planet
-	bool isDrawAsRing;        // Flag for drawing the orbital as ring
-	glm::vec4 color;          // Color of the planet
-	unsigned int textureID;	  // ID of the planet texture
+// A texture file read into memory with its rows bottom-up, and the palette samples taken from it, ready to upload
+struct DecodedTexture {
+	unsigned char* data = nullptr;
+	int width = 0;
+	int height = 0;
+	int channels = 0;
+	vector<uint8_t> paletteSamples;
+};
+
+// The orbits of --integrator kepler, relative to their centers: each is either an earlier orbit (a moon's planet, say),
+// at the index in centerOrbits, or the fixed point in centersX and centersY where centerOrbits has -1. positionsX and
+// positionsY are where the orbits are in the scene, in the same order
+struct KeplerSystem {
+	KeplerOrbits orbits;
+	vector<int> centerOrbits;
+	vector<double> centersX;
+	vector<double> centersY;
+	vector<double> positionsX;
+	vector<double> positionsY;
+	vector<double> positionsZ;
 };
 
 /*--------------------------------------------------------------
@@ -78,16 +161,27 @@ Function prototypes which are defined at the end of this program
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow* window, unsigned int shaderProgram);
-unsigned int loadTexture(char const* path);
+bool decodeTexture(char const* path, DecodedTexture& texture);
+void samplePalette(DecodedTexture& texture);
+unsigned int uploadTexture(DecodedTexture& texture, vector<uint8_t>* paletteSamples);
+map<string, DecodedTexture> decodeSceneTextures(const Scene& scene);
+void addPaletteColor(vector<uint8_t>& paletteSamples, glm::vec4 color, int weight);
+void drawRecordingControls(GLFWwindow* window, Recorder& recorder);
+void setFixedTimeStep(bool isEnabled);
+string nextCaptureFilename(const char* prefix, const char* extension = ".gif");
 void setupObjectBuffer(GLuint& VAO, GLuint& VBO, float radius_x_axis, float radius_y_axis, int segments);
 void useBackgroundTexture(unsigned int shaderProgram, GLuint backgroundVAO, unsigned int backgroundTextureID);
 void setupBackgroundBuffers(GLuint& backgroundVAO, GLuint& backgroundVBO, float* backgroundVertices, size_t vertexCount);
 GLuint createShaderProgram(const char* vertexSource, const char* fragmentSource);
-void drawAsteroidBelt(unsigned int shaderProgram, GLuint asteroidBeltVAO, float asteroidBeltSpeed);
-void processInput(GLFWwindow* window, unsigned int shaderProgram, int& selectedObject, CelestialBodies& sun, CelestialBodies& mercury, 
-	 	  CelestialBodies& venus, CelestialBodies& earth, CelestialBodies& mars, CelestialBodies& jupiter, CelestialBodies& saturn, 
-		  CelestialBodies& uranus, CelestialBodies& neptune, CelestialBodies& moon, CelestialBodies& jupiterMoonIo, 
-	 	  CelestialBodies& jupiterMoonCallisto, CelestialBodies& comet, bool& isDrawAsteroidBelt, float& asteroidBeltMoveSpeed);
+BodyStore createSceneBodies(const Scene& scene, map<string, DecodedTexture>& textures, vector<uint8_t>& paletteSamples, vector<BodyHandle>& handles);
+NBodySimulation createSimulation(const Scene& scene, const vector<BodyHandle>& handles, BodyStore& bodies, vector<BodyHandle>& simulatedBodies,
+	vector<pair<BodyHandle, size_t>>& simulatedBelts);
+KeplerSystem createKeplerSystem(const Scene& scene, const vector<BodyHandle>& handles, BodyStore& bodies, vector<BodyHandle>& simulatedBodies,
+	vector<pair<BodyHandle, size_t>>& simulatedBelts);
+void moveKeplerSystem(KeplerSystem& system, double time);
+void drawBody(unsigned int shaderProgram, const BodyStore& bodies, size_t index);
+void drawAsteroidBelt(unsigned int shaderProgram, const BodyStore& bodies, size_t index);
+void processInput(GLFWwindow* window, unsigned int shaderProgram, BodyHandle& selectedBody, BodyStore& bodies, Recorder& recorder);
 
 
 /*---------------------------------------------
@@ -204,11 +298,8 @@ vector<float> drawPlanet(unsigned int shaderProgram, unsigned int VAO, float pla
 						float updatePosX, float updatePosY, float rotationSpeed, bool isScale, bool isTranslate, bool isRotate, bool isDrawAsRing, glm::vec4 color, 
 						bool useTexture, unsigned int textureID)
 {
-	//Use the shader pragram for the planets/objects, not the background shader
-	glUseProgram(shaderProgram);
-
 	// get the time to update the planet position 
-	float time = (float)glfwGetTime();
+	float time = (float)simulationTime;
 	// Angle used to calculate the new position using time variable - move speed can be modified through the UI
 	float angle = time * planetMoveSpeed;
 	// Angle for rotation - rotation speed can be modified through the UI
@@ -232,6 +323,14 @@ vector<float> drawPlanet(unsigned int shaderProgram, unsigned int VAO, float pla
 		transformation = glm::rotate(transformation, glm::radians(angleRotate), glm::vec3(0.0f, 0.0f, 1.0f));
 	}
 
+	// Without OpenGL the shape is queued on the software renderer, which draws it the same way
+	if (softwareRenderer) {
+		softwareRenderer->draw(VAO, segments, transformation, isDrawAsRing, color, useTexture ? textureID : 0);
+		return { planetOrbitPosition_x, planetOrbitPosition_y };
+	}
+
+	//Use the shader pragram for the planets/objects, not the background shader
+	glUseProgram(shaderProgram);
 	// Get the location of "transform" variable in the shader program
 	int transformLocation = glGetUniformLocation(shaderProgram, "transform");
 	// Send the applied transfomation matrix to the vertex shader to aplly with every vertex in the planet/object
@@ -270,377 +369,360 @@ vector<float> drawPlanet(unsigned int shaderProgram, unsigned int VAO, float pla
 
 
 // Main loop to run the Solar System simulation
-int main()
+int main(int argc, char** argv)
 {
+	// Command line: recordings, the raw stream, deterministic capture and headless runs can be set up from here
+	string streamTarget;
+	string recordTarget;
+	string integratorName;
+	double timeStep = 0.0;
+	double timeStepAccuracy = 0.0;
+	string timeStepCriterionName;
+	double timeStepLength = 0.0;
+	int maxTimeStepLevel = 0;
+	for (int i = 1; i < argc; i++) {
+		string argument = argv[i];
+		if (argument == "--stream" && i + 1 < argc)
+			streamTarget = argv[++i];
+		else if (argument == "--scene" && i + 1 < argc)
+			SCENE_FILE = argv[++i];
+		else if (argument == "--record" && i + 1 < argc)
+			recordTarget = argv[++i];
+		else if (argument == "--headless")
+			HEADLESS = true;
+		else if (argument == "--physics")
+			USE_PHYSICS = true;
+		else if (argument == "--gravity" && i + 1 < argc) {
+			string solver = argv[++i];
+			PHYSICS_SOLVER = solver == "barnes-hut" ? GRAVITY_BARNES_HUT : solver == "fmm" ? GRAVITY_FMM : GRAVITY_DIRECT;
+		}
+		else if (argument == "--integrator" && i + 1 < argc)
+			integratorName = argv[++i];
+		else if (argument == "--time-step" && i + 1 < argc)
+			timeStep = atof(argv[++i]);
+		else if (argument == "--time-step-accuracy" && i + 1 < argc)
+			timeStepAccuracy = atof(argv[++i]);
+		else if (argument == "--time-step-criterion" && i + 1 < argc)
+			timeStepCriterionName = argv[++i];
+		else if (argument == "--time-step-length" && i + 1 < argc)
+			timeStepLength = atof(argv[++i]);
+		else if (argument == "--max-time-step-level" && i + 1 < argc)
+			maxTimeStepLevel = max(1, atoi(argv[++i]));
+		else if (argument == "--multipole-order" && i + 1 < argc)
+			PHYSICS_MULTIPOLE_ORDER = min(max(1, atoi(argv[++i])), FMM_MAX_ORDER);
+		else if (argument == "--opening-angle" && i + 1 < argc)
+			PHYSICS_OPENING_ANGLE = atof(argv[++i]);
+		else if (argument == "--software") {
+			SOFTWARE_RENDERING = true;
+			HEADLESS = true;
+		}
+		else if (argument == "--threads" && i + 1 < argc)
+			THREAD_COUNT = max(0, atoi(argv[++i]));
+		else if (argument == "--pin-threads")
+			PIN_THREADS = true;
+		else if (argument == "--frames" && i + 1 < argc)
+			HEADLESS_FRAME_COUNT = max(1, atoi(argv[++i]));
+		else if (argument == "--stream-format" && i + 1 < argc)
+			STREAM_FORMAT = string(argv[++i]) == "ppm" ? RAW_STREAM_PPM : RAW_STREAM_Y4M;
+		else if (argument == "--fixed-fps" && i + 1 < argc) {
+			FIXED_TIME_STEP_FPS = max(1, atoi(argv[++i]));
+			USE_FIXED_TIME_STEP = true;
+		}
+		else
+			std::cerr << "Unknown argument: " << argument << std::endl;
+	}
+
+	// Read the scene before opening anything, so a broken scene file fails straight away
+	Scene scene;
+	string sceneError;
+	if (!loadScene(SCENE_FILE, scene, sceneError)) {
+		std::cerr << "Failed to load the scene: " << sceneError << std::endl;
+		return -1;
+	}
+	if (integratorName.empty())
+		integratorName = scene.physics.integrator;
+	// Kepler orbits are not an integrator of the simulation, which they take the place of
+	if (integratorName == "kepler")
+		USE_KEPLER_ORBITS = true;
+	else if (!integratorName.empty() && !integratorFromName(integratorName, PHYSICS_INTEGRATOR)) {
+		std::cerr << "There is no integrator called " << integratorName << std::endl;
+		return -1;
+	}
+	if (timeStep <= 0.0)
+		timeStep = scene.physics.timeStep;
+	if (timeStep > 0.0)
+		PHYSICS_TIME_STEP = timeStep;
+	if (timeStepAccuracy <= 0.0)
+		timeStepAccuracy = scene.physics.timeStepAccuracy;
+	if (timeStepAccuracy > 0.0)
+		PHYSICS_TIME_STEP_ACCURACY = timeStepAccuracy;
+	if (timeStepCriterionName.empty())
+		timeStepCriterionName = scene.physics.timeStepCriterion;
+	if (!timeStepCriterionName.empty() && !timeStepCriterionFromName(timeStepCriterionName, PHYSICS_TIME_STEP_CRITERION)) {
+		std::cerr << "There is no time step criterion called " << timeStepCriterionName << std::endl;
+		return -1;
+	}
+	if (timeStepLength <= 0.0)
+		timeStepLength = scene.physics.timeStepLength;
+	if (timeStepLength > 0.0)
+		PHYSICS_TIME_STEP_LENGTH = timeStepLength;
+	if (maxTimeStepLevel <= 0)
+		maxTimeStepLevel = scene.physics.maxTimeStepLevel;
+	if (maxTimeStepLevel > 0)
+		PHYSICS_MAX_TIME_STEP_LEVEL = maxTimeStepLevel;
+	// Before anything starts the workers
+	TaskScheduler::configureShared(THREAD_COUNT, PIN_THREADS);
+
 	/*-----------------------------------------------------------------------
-	Setup the Window
+	Setup the Window, or the offscreen context when running headless
 	-------------------------------------------------------------------------*/
 
-	// Initialize GLFW
-	glfwInit();
-
-	// Tell GLFW what version of OpenGL we are using 
-	// In this case we are using OpenGL 3.3
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-	// Tell GLFW we are using the CORE profile
-	// So that means we only have the modern functions
-	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-
-	// Create a GLFWwindow object of 950 by 950 pixels, naming it "Linear Transformations"
-	GLFWwindow* window = glfwCreateWindow(950, 950, "Solar System", NULL, NULL);
-	// Error check if the window fails to create
-	if (window == NULL)
-	{
-		std::cout << "Failed to initialize the window object" << std::endl;
-		glfwTerminate();
-		return -1;
+	GLFWwindow* window = NULL;
+	HeadlessContext headlessContext;
+	if (SOFTWARE_RENDERING)
+		softwareRenderer = make_unique<SoftwareRenderer>(950, 950);
+	if (HEADLESS) {
+		if (!SOFTWARE_RENDERING && !headlessContext.create(950, 950)) {
+			std::cerr << "Headless rendering is not available: " << headlessContext.error() << std::endl;
+			return -1;
+		}
+		// Headless runs are batch jobs, so their output has to come out the same every time
+		USE_FIXED_TIME_STEP = true;
+		if (recordTarget.empty() && streamTarget.empty())
+			std::cerr << "Nothing to capture: add --record <file> or --stream <target>" << std::endl;
 	}
-	// Make the context of our window the main context in current window
-	glfwMakeContextCurrent(window);
+	else {
+		// Initialize GLFW
+		glfwInit();
+
+		// Tell GLFW what version of OpenGL we are using 
+		// In this case we are using OpenGL 3.3
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		// Tell GLFW we are using the CORE profile
+		// So that means we only have the modern functions
+		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+		// Create a GLFWwindow object of 950 by 950 pixels, naming it "Linear Transformations"
+		window = glfwCreateWindow(950, 950, "Solar System", NULL, NULL);
+		// Error check if the window fails to create
+		if (window == NULL)
+		{
+			std::cerr << "Failed to initialize the window object" << std::endl;
+			glfwTerminate();
+			return -1;
+		}
+		// Make the context of our window the main context in current window
+		glfwMakeContextCurrent(window);
 
-	// This function dynamically sets the viewport size when the user resizes window
-	glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+		// This function dynamically sets the viewport size when the user resizes window
+		glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
 
-	//Load GLAD so it configures OpenGL
-	//Glad helps getting the address of OpenGL functions which are OS specific
-	gladLoadGL();
+		//Load GLAD so it configures OpenGL
+		//Glad helps getting the address of OpenGL functions which are OS specific
+		gladLoadGL();
+	}
 
 	/*---------------------------------------------------------------------------
 	Setup and compile the Vertex and Fragment Shader programs
 	----------------------------------------------------------------------------*/
 	
-	GLuint shaderProgram = createShaderProgram(vertexShaderSource, fragmentShaderSource);
-	GLuint backgroundShaderProgram = createShaderProgram(backgroundVertexShaderSource, backgroundFragmentShaderSource);
+	// The software renderer has no shaders
+	GLuint shaderProgram = SOFTWARE_RENDERING ? 0 : createShaderProgram(vertexShaderSource, fragmentShaderSource);
+	GLuint backgroundShaderProgram = SOFTWARE_RENDERING ? 0 : createShaderProgram(backgroundVertexShaderSource, backgroundFragmentShaderSource);
 
-	/*------------------------------------------------------------------------------
-	 Set up VBO and VAO for the planets - used multiple VAOs to separate object data
-	--------------------------------------------------------------------------------*/
-	
-	//Sun Buffers
-	GLuint sunVAO, sunVBO;
-	setupObjectBuffer(sunVAO, sunVBO, 0.05f, 0.05f, 100);
-	
-	//Mercury Buffers
-	GLuint mercuryVAO, mercuryVBO, mercuryOrbitVAO, mercuryOrbitVBO;
-	setupObjectBuffer(mercuryVAO, mercuryVBO, 0.05f, 0.05f, 100);
-	setupObjectBuffer(mercuryOrbitVAO, mercuryOrbitVBO, 0.09f, 0.07f, 100);
-
-	//Venus Buffer
-	GLuint venusVAO, venusVBO, venusOrbitVAO, venusOrbitVBO;
-	setupObjectBuffer(venusVAO, venusVBO, 0.05f, 0.05f, 100);
-	setupObjectBuffer(venusOrbitVAO, venusOrbitVBO, 0.16f, 0.13f, 100);
-
-	//Earth Buffers
-	GLuint earthVAO, earthVBO, earthOrbitVAO, earthOrbitVBO;
-	setupObjectBuffer(earthVAO, earthVBO, 0.05f, 0.05f, 100);
-	setupObjectBuffer(earthOrbitVAO, earthOrbitVBO, 0.21f, 0.18f, 100);
-	
-	//Earth Moon Buffers
-	GLuint earthMoonVAO, earthMoonVBO, earthMoonOrbitVAO, earthMoonOrbitVBO;
-	setupObjectBuffer(earthMoonVAO, earthMoonVBO, 0.05f, 0.05f, 100);
-	setupObjectBuffer(earthMoonOrbitVAO, earthMoonOrbitVBO, 0.05f, 0.04f, 100);
-
-	//Mars Buffers
-	GLuint marsVAO, marsMoonVBO, marsOrbitVAO, marsOrbitVBO;
-	setupObjectBuffer(marsVAO, marsMoonVBO, 0.05f, 0.05f, 100);
-	setupObjectBuffer(marsOrbitVAO, marsOrbitVBO, 0.32f, 0.29f, 100);
-
-	//Asteroid Belt Buffer
-	GLuint asteroidBeltVAO, asteroidBeltMoonVBO;
-	setupObjectBuffer(asteroidBeltVAO, asteroidBeltMoonVBO, 0.05f, 0.05f, 100);
-	
-	//Jupiter Buffers
-	GLuint jupiterVAO, jupiterVBO, jupiterOrbitVAO, jupiterOrbitVBO;
-	setupObjectBuffer(jupiterVAO, jupiterVBO, 0.05f, 0.05f, 100);
-	setupObjectBuffer(jupiterOrbitVAO, jupiterOrbitVBO, 0.52f, 0.49f, 100);
-
-	//Jupiter Moons and their orbital Buffers
-	GLuint jupiterMoon1VAO, jupiterMoon2VAO, jupiterMoon1VBO, jupiterMoon2VBO, 
-		   jupiterMoon1OrbitVAO, jupiterMoon1OrbitVBO, jupiterMoon2OrbitVAO, jupiterMoon2OrbitVBO;
-	setupObjectBuffer(jupiterMoon1VAO, jupiterMoon1VBO, 0.05f, 0.05f, 100);
-	setupObjectBuffer(jupiterMoon2VAO, jupiterMoon2VBO, 0.05f, 0.05f, 100);
-	setupObjectBuffer(jupiterMoon1OrbitVAO, jupiterMoon1OrbitVBO, 0.05f, 0.03f, 100);
-	setupObjectBuffer(jupiterMoon2OrbitVAO, jupiterMoon2OrbitVBO, 0.07f, 0.05f, 100);
-
-
-	//Saturn Buffers
-	GLuint saturnVAO, saturnVBO, saturnOrbitVAO, saturnOrbitVBO;
-	setupObjectBuffer(saturnVAO, saturnVBO, 0.05f, 0.05f, 100);
-	setupObjectBuffer(saturnOrbitVAO, saturnOrbitVBO, 0.69f, 0.65f, 100);
-	
-	//Saturn Ring Buffers
-	GLuint saturnRingVAO, saturnRingVBO;
-	setupObjectBuffer(saturnRingVAO, saturnRingVBO, 0.05f, 0.05f, 100);
-
-	//Uranus Buffers
-	GLuint uranusVAO, uranusVBO, uranusOrbitVAO, uranusOrbitVBO;
-	setupObjectBuffer(uranusVAO, uranusVBO, 0.05f, 0.05f, 100);
-	setupObjectBuffer(uranusOrbitVAO, uranusOrbitVBO, 0.85f, 0.79f, 100);
+	/*------------------------------------------------------------------------------------
+	 Set up the background and every body of the scene, with their buffers and textures
+	--------------------------------------------------------------------------------------*/
 
-	//Neptune Buffers
-	GLuint neptuneVAO, neptuneVBO, neptuneOrbitVAO, neptuneOrbitVBO;
-	setupObjectBuffer(neptuneVAO, neptuneVBO, 0.05f, 0.05f, 100);
-	setupObjectBuffer(neptuneOrbitVAO, neptuneOrbitVBO, 0.95f, 0.89f, 100);
-
-	//Comet Buffers
-	GLuint cometVAO, cometVBO, cometOrbitVAO, cometOrbitVBO;
-	setupObjectBuffer(cometVAO, cometVBO, 0.06f, 0.02f, 100);
-	setupObjectBuffer(cometOrbitVAO, cometOrbitVBO, 0.95f, 0.89f, 100);
+	// Texels sampled from every texture, used to build a fixed GIF palette for the whole recording
+	vector<uint8_t> paletteSamples;
+	// The files are read in parallel; the textures are still made here, in order, since that needs the OpenGL context
+	map<string, DecodedTexture> sceneTextures = decodeSceneTextures(scene);
 
 	// Get the background texture id to bind it
-	unsigned int backgroundTextureID= loadTexture("textures/starryBackground.png");
+	unsigned int backgroundTextureID = scene.background.empty() ? 0 : uploadTexture(sceneTextures[scene.background], &paletteSamples);
 	//Setup VAO and VBO buffers for the background texture
 	GLuint backgroundVAO, backgroundVBO;
 	setupBackgroundBuffers(backgroundVAO, backgroundVBO, backgroundVertices, sizeof(backgroundVertices) / sizeof(float));
 
-
-	//--------------------Planet Texture IDs----------------------
-	unsigned int sunTextureID = loadTexture("textures/sun.png");
-	unsigned int mercuryTextureID = loadTexture("textures/mercury.png");
-	unsigned int venusTextureID = loadTexture("textures/venus.png");
-	unsigned int earthTextureID = loadTexture("textures/earth.png");
-	unsigned int marsTextureID = loadTexture("textures/mars.png");
-	unsigned int jupiterTextureID = loadTexture("textures/jupiter.png");
-	unsigned int saturnTextureID = loadTexture("textures/saturn.png");
-	unsigned int uranusTextureID = loadTexture("textures/uranus.png");
-	unsigned int neptuneTextureID = loadTexture("textures/neptune.png");
-	unsigned int moonTextureID = loadTexture("textures/moon.png");
-	unsigned int ioTextureID = loadTexture("textures/io.png");
-	unsigned int callistoTextureID = loadTexture("textures/callisto.png");
-
-	/*------------------------------------------------------------------
-	 Initialize the attributes of major celestial bodies such as planets
-	--------------------------------------------------------------------*/
-
-	// Sun's attributes
-	CelestialBodies sun = {
-		sunVAO, 0.0f, 0.0f, 0.0f, 0.9f, 100, 0.0f, 0.0f, 10.0f, true, true, true, true, false, glm::vec4(1.0f, 1.0f, 0.0f, 1.0f), sunTextureID
-	};
-
-	// Mercury's attributes
-	CelestialBodies mercury = {
-		mercuryVAO, 1.2f, 0.09f, 0.07f, 0.2f, 100, 0.0f, 0.0f, 50.0f, true, true, true, true, false, glm::vec4(0.42f, 0.38f, 0.35f, 1.0f), mercuryTextureID
-	};
-
-	// Venus's attributes
-	CelestialBodies venus = {
-		venusVAO, 0.9f, 0.16f, 0.13f, 0.24f, 100, 0.0f, 0.0f, 50.0f, true, true, true, true, false, glm::vec4(0.91f, 0.71f, 0.42f, 1.0f), venusTextureID
-	};
-	
-	// Earth's attributes
-	CelestialBodies earth = {
-		earthVAO, 0.8f, 0.21f, 0.18f, 0.35f, 100, 0.0f, 0.0f, 50.0f, true, true, true, true,  false, glm::vec4(0.0f, 0.5f, 1.0f, 0.1f), earthTextureID
-	};
-
-	// Mars' attributes
-	CelestialBodies mars = {
-		marsVAO, 0.6f, 0.32f, 0.29f, 0.31f, 100, 0.0f, 0.0f, 50.0f, true, true, true, true, false, glm::vec4(0.80f, 0.36f, 0.23f, 1.0f), marsTextureID
-	};
-	
-	// Jupiter's attributes
-	CelestialBodies jupiter = {
-		jupiterVAO, 0.4f, 0.52f, 0.49f, 0.6f, 100, 0.0f, 0.0f, 50.0f, true, true, true, true, false, glm::vec4(0.76f, 0.61f, 0.47f, 1.0f), jupiterTextureID
-	};
-	
-	// Saturn's attributes
-	CelestialBodies saturn = {
-		saturnVAO, 0.3f, 0.69f, 0.65f, 0.43f, 100, 0.0f, 0.0f, 50.0f, true, true, true, true, false, glm::vec4(0.90f, 0.85f, 0.50f, 1.0f), saturnTextureID
-	};
-	
-	// Uranus' attributes
-	CelestialBodies uranus = {
-		uranusVAO, 0.2f, 0.85f, 0.79f, 0.31f, 100, 0.0f, 0.0f, 50.0f, true, true, true, true, false, glm::vec4(0.4f, 0.6f, 0.8f, 1.0f), uranusTextureID
-	};
-
-	// Neptune's attributes
-	CelestialBodies neptune = {
-		neptuneVAO, 0.1f, 0.95f, 0.89f, 0.31f, 100, 0.0f, 0.0f, 50.0f, true, true, true, true, false, glm::vec4(0.2f, 0.3f, 0.8f, 1.0f), neptuneTextureID
-	};
-
-	// Earth Moon's attributes
-	CelestialBodies moon = {
-		earthMoonVAO, 1.3f, 0.04f,0.03f, 0.12f, 100, 0.0, 0.0, 50.0f, true, true, true, true, false, glm::vec4(0.72f, 0.72f, 0.72f, 1.0f), moonTextureID
-	};
-
-	// Jupiter Moon 1 attribute
-	CelestialBodies jupiterMoonIo = {
-		jupiterMoon1VAO, 0.8f, 0.05f,0.05f, 0.13f, 100, 0.0, 0.0, 50.0f, true, true, true, true, false, glm::vec4(1.0f, 0.85f, 0.35f, 1.0f), ioTextureID
-	};
-
-	// Jupiter Moon 2 attribute
-	CelestialBodies jupiterMoonCallisto = {
-		jupiterMoon2VAO, 0.6f, 0.07f,0.06f, 0.15f, 100, 0.0, 0.0, 50.0f, true, true, true, true, false, glm::vec4(0.85f, 0.24f, 0.21f, 1.0f), callistoTextureID
-	};
-
-	// Comet attributes
-	CelestialBodies comet = {
-		cometVAO, 0.2f, 0.5f,0.2f, 0.15f, 100, 0.0, 0.0, 50.0f, true, true, true, true, false, glm::vec4(0.0f, 1.0f, 1.0f, 1.0f), 0
-	};
-
-	// Saturn ring 1 attributes
-	CelestialBodies saturnRing1 = {
-		saturnRingVAO, 0.0f, 0.0f, 0.0f, 0.765f, 100, 0.0, 0.0, 0.0f, true, true, true, true, true, glm::vec4(0.95f, 0.93f, 0.76f, 1.0f),0
-	};
-	// Saturn ring 2 attributes
-	CelestialBodies SaturnRing2 = {
-		saturnRingVAO, 0.0f, 0.0f, 0.0f, 0.68f, 100, 0.0, 0.0, 0.0f, true, true, true, true, true, glm::vec4(0.85f, 0.85f, 0.85f, 1.0f),0
-	};
-	// Saturn ring 3 attributes
-	CelestialBodies SaturnRing3 = {
-		saturnRingVAO, 0.0f, 0.0f, 0.0f, 0.64, 100, 0, 1, 0.0f, true, true, true, true, true, glm::vec4(0.95f, 0.93f, 0.76f, 1.0f), 0
-	};
+	vector<BodyHandle> sceneHandles;
+	BodyStore bodies = createSceneBodies(scene, sceneTextures, paletteSamples, sceneHandles);
+	// With --physics, the bodies with a mass are moved by the simulation, in the order of simulatedBodies, and so are
+	// the asteroids of each belt in simulatedBelts, from the particle paired with the belt on
+	vector<BodyHandle> simulatedBodies;
+	vector<pair<BodyHandle, size_t>> simulatedBelts;
+	NBodySimulation simulation;
+	KeplerSystem keplerSystem;
+	if (USE_PHYSICS && USE_KEPLER_ORBITS)
+		keplerSystem = createKeplerSystem(scene, sceneHandles, bodies, simulatedBodies, simulatedBelts);
+	else if (USE_PHYSICS)
+		simulation = createSimulation(scene, sceneHandles, bodies, simulatedBodies, simulatedBelts);
 
 	//---------ImGui Library Setup (used for UI)---------
-	IMGUI_CHECKVERSION();
-	ImGui::CreateContext();
-	ImGuiIO& io = ImGui::GetIO(); (void)io;
-	ImGui::StyleColorsDark();
-	ImGui_ImplGlfw_InitForOpenGL(window, true);
-	ImGui_ImplOpenGL3_Init("#version 330");
+	// There is no UI without a window
+	if (!HEADLESS) {
+		IMGUI_CHECKVERSION();
+		ImGui::CreateContext();
+		ImGuiIO& io = ImGui::GetIO(); (void)io;
+		ImGui::StyleColorsDark();
+		ImGui_ImplGlfw_InitForOpenGL(window, true);
+		ImGui_ImplOpenGL3_Init("#version 330");
+	}
 	//---------------------------------------------------
 
 	// Variable to track user selected planet/object
-	int selectedObject = 0;
-	// A variable to control the visibility of asteroid belt
-	bool isDrawAsteroidBelt = true;
-	float asteroidBeltMoveSpeed = 0.07;
-
-	// Initialize GIF
-	GifWriter gifWriter;
-	GifBegin(&gifWriter, "output.gif", 950, 950, 0);
-	
-	// rendering loop
-	while (!glfwWindowShouldClose(window))
-	{
-
-		// Specify the color of the background
-		glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
-		// Clean the back buffer and assign the new color to it
-		// We need glClear since we do not want drawings to persist in the background
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-		// Use the starry sky background texture
-		useBackgroundTexture(backgroundShaderProgram, backgroundVAO, backgroundTextureID);
-
-		// setup needed for ImGui library inside the rendering loop
-		ImGui_ImplOpenGL3_NewFrame();
-		ImGui_ImplGlfw_NewFrame();
-		ImGui::NewFrame();
-
-		/*--------------------------------------------------------------------------------------------------
-		 Draw the Planets and their associated objects depending on the visibility attributes of each planet
-		 Draw the Orbit of Planets as elliptical ring, instead of solid object
-		----------------------------------------------------------------------------------------------------*/
-		
-		//Draw Mars and its orbital
-		if (mars.isVisible) {
-			drawPlanet(shaderProgram, marsOrbitVAO, 0.0f, 0.32f, 0.29f, 0.31f, 100, 0.0f, 0.0f, 0.0f, false, false, false, true, glm::vec4(1.0f, 1.0f, 1.0f, 0.1f), false, 0);
-			drawPlanet(shaderProgram, marsVAO, mars.moveSpeed, 0.32f, 0.29f, mars.scale, 100, 0.0f, 0.0f, mars.rotationSpeed, true, true, true, false, mars.color, true, mars.textureID);
-		}
-
-		//Draw asteroid belt between Mars and Jupite
-		if (isDrawAsteroidBelt) {
-			drawAsteroidBelt(shaderProgram, asteroidBeltVAO, asteroidBeltMoveSpeed);
-		}
-
-		//Draw Jupiter and its orbital
-		if (jupiter.isVisible) {
-			drawPlanet(shaderProgram, jupiterOrbitVAO, 0.0f, 0.52f, 0.49f, 0.6f, 100, 0.0f, 0.0f, 0.0f, false, false, false, true, glm::vec4(1.0f, 1.0f, 1.0f, 0.1f), false, 0);//orbital of jupiter
-			vector<float> newJupiterLocation = drawPlanet(shaderProgram, jupiterVAO, jupiter.moveSpeed, 0.52f, 0.49f, jupiter.scale, 100, 0.0f, 0.0f, jupiter.rotationSpeed, true, true, true, false, jupiter.color, true, jupiter.textureID);
-
-
-			//Draw 2 of Jupiter's Moons
-			drawPlanet(shaderProgram, jupiterMoon1VAO, jupiterMoonIo.moveSpeed, 0.05f, 0.05f, jupiterMoonIo.scale, 100, newJupiterLocation[0], newJupiterLocation[1], jupiterMoonIo.rotationSpeed, true, true, true, false, jupiterMoonIo.color, true, jupiterMoonIo.textureID);
-			drawPlanet(shaderProgram, jupiterMoon2VAO, jupiterMoonCallisto.moveSpeed, 0.07f, 0.06f, jupiterMoonCallisto.scale, 100, newJupiterLocation[0], newJupiterLocation[1], jupiterMoonCallisto.rotationSpeed, true, true, true, false, jupiterMoonCallisto.color, true, jupiterMoonCallisto.textureID);
-		}
-
-		//Draw Saturn and its orbital
-		if (saturn.isVisible) {
-			drawPlanet(shaderProgram, saturnOrbitVAO, 0.0f, 0.69f, 0.65f, 0.43f, 100, 0.0f, 0.0f, 0.0f, false, false, false, true, glm::vec4(1.0f, 1.0f, 1.0f, 0.1f), false, 0);
-			vector<float> newSaturnLocation = drawPlanet(shaderProgram, saturnVAO, saturn.moveSpeed, 0.69f, 0.65f, saturn.scale, 100, 0.0f, 0.0f, saturn.rotationSpeed, true, true, true, false, saturn.color, true, saturn.textureID);
-
-			//Draw 3 Saturn Belts - make the rings follow saturn by updateing passing saturn's new xy coordinates (this logic applies to all of moons as well)
-			drawPlanet(shaderProgram, saturnRingVAO, 0.0f, 0.0f, 0.0f, 0.765f + saturn.scale, 100, newSaturnLocation[0], newSaturnLocation[1], 0.0f, true, true, false, true, glm::vec4(0.95f, 0.93f, 0.76f, 1.0f), false, 0);
-			drawPlanet(shaderProgram, saturnRingVAO, 0.0f, 0.0f, 0.0f, 0.68f + saturn.scale, 100, newSaturnLocation[0], newSaturnLocation[1], 0.0f, true, true, false, true, glm::vec4(0.85f, 0.85f, 0.85f, 1.0f), false, 0);
-			drawPlanet(shaderProgram, saturnRingVAO, 0.0f, 0.0f, 0.0f, 0.64 + saturn.scale, 100, newSaturnLocation[0], newSaturnLocation[1], 0.0f, true, true, false, true, glm::vec4(0.95f, 0.93f, 0.76f, 1.0f), false, 0);
+	BodyHandle selectedBody = bodies.handleAt(0);
+
+	// Nothing is captured until the user starts a recording or turns on the replay buffer
+	Recorder recorder(950, 950);
+	recorder.setReplayBuffer(REPLAY_BUFFER_ON_AT_START, REPLAY_BUFFER_SECONDS);
+	recorder.setCaptureOptions(CAPTURE_FRAME_STEP, CAPTURE_SCALE_DIVISOR);
+	if (!streamTarget.empty() && !recorder.startStream(streamTarget, STREAM_FORMAT, USE_FIXED_TIME_STEP ? FIXED_TIME_STEP_FPS : STREAM_FRAME_RATE))
+		std::cerr << "Failed to open stream: " << streamTarget << std::endl;
+
+	if (GIF_PALETTE_MODE == GIF_PALETTE_FROM_SCENE) {
+		// Solid colors cover whole objects, so weigh them like a sizeable patch of texture
+		const int solidColorWeight = 2048;
+		// Empty space, then every color drawn without a texture (orbits, rings, asteroids...), each counted once
+		vector<glm::vec3> solidColors = { glm::vec3(0.0f) };
+		for (const BodyRenderInfo& body : bodies.renderInfo) {
+			if (body.textureID == 0)
+				solidColors.push_back(glm::vec3(body.color));
+			if (body.orbitVAO != 0)
+				solidColors.push_back(glm::vec3(body.orbitColor));
 		}
-
-		//Draw Uranus and its orbital
-		if (uranus.isVisible) {
-			drawPlanet(shaderProgram, uranusOrbitVAO, 0.0f, 0.85f, 0.79f, 0.31f, 100, 0.0f, 0.0f, 0.0f, false, false, false, true, glm::vec4(1.0f, 1.0f, 1.0f, 0.1f), false, 0);
-			drawPlanet(shaderProgram, uranusVAO, uranus.moveSpeed, 0.85f, 0.79f, uranus.scale, 100, 0.0f, 0.0f, uranus.rotationSpeed, true, true, true, false, uranus.color, true, uranus.textureID);
+		for (size_t i = 0; i < solidColors.size(); i++) {
+			if (find(solidColors.begin(), solidColors.begin() + i, solidColors[i]) == solidColors.begin() + i)
+				addPaletteColor(paletteSamples, glm::vec4(solidColors[i], 1.0f), solidColorWeight);
 		}
-
-		//Draw Neptune and its orbital
-		if (neptune.isVisible) {
-			drawPlanet(shaderProgram, neptuneOrbitVAO, 0.0f, 0.95f, 0.89f, 0.31f, 100, 0.0f, 0.0f, 0.0f, false, false, false, true, glm::vec4(1.0f, 1.0f, 1.0f, 0.1f), false, 0);
-			drawPlanet(shaderProgram, neptuneVAO, neptune.moveSpeed, 0.95f, 0.89f, neptune.scale, 100, 0.0f, 0.0f, neptune.rotationSpeed, true, true, true, false, neptune.color, true, neptune.textureID);
+		// The UI panel is part of the captured frame as well
+		for (int i = 0; i < ImGuiCol_COUNT && !HEADLESS; i++) {
+			ImVec4 uiColor = ImGui::GetStyle().Colors[i];
+			addPaletteColor(paletteSamples, glm::vec4(uiColor.x, uiColor.y, uiColor.z, 1.0f), solidColorWeight / 8);
 		}
+	}
+	// The recorder keeps the samples to build the palette for each GIF it writes
+	recorder.setPalette(GIF_PALETTE_MODE, move(paletteSamples), GIF_PALETTE_LEARN_FRAMES);
+	recorder.setDither(GIF_DITHER_MODE);
+	if (!recordTarget.empty()) {
+		recorder.startRecording(recordTarget);
+		if (!recorder.isRecording())
+			std::cerr << "Failed to start recording: " << recordTarget << std::endl;
+	}
+	// Frame read back from the GPU, reused from frame to frame
+	vector<uint8_t> frame(950 * 950 * 4);
+	
+	if (USE_FIXED_TIME_STEP && !HEADLESS)
+		setFixedTimeStep(true);
+	double lastFrameTime = HEADLESS ? 0.0 : glfwGetTime();
+	int renderedFrames = 0;
 
-		// Draw a comet and its orbit
-		if (comet.isVisible) {
-			drawPlanet(shaderProgram, cometVAO, comet.moveSpeed, 0.5f, 0.2f, comet.scale, 100, 0.0, 0.0, comet.rotationSpeed, true, true, true, false, comet.color, false, 0);
+	// rendering loop - headless runs stop after their frame count instead of when the window closes
+	while (HEADLESS ? renderedFrames < HEADLESS_FRAME_COUNT : !glfwWindowShouldClose(window))
+	{
+		// Advance the simulation by one fixed step, or by however long the last frame took
+		double frameTime = HEADLESS ? 0.0 : glfwGetTime();
+		simulationTime += USE_FIXED_TIME_STEP ? 1.0 / FIXED_TIME_STEP_FPS : frameTime - lastFrameTime;
+		lastFrameTime = frameTime;
+		recorder.setFrameInterval(USE_FIXED_TIME_STEP ? 1.0 / FIXED_TIME_STEP_FPS : 0.0);
+
+		if (softwareRenderer) {
+			// The software renderer starts every frame from the background by itself
+			softwareRenderer->beginFrame();
 		}
-
-
-		//Draw Sun if visibility set to true
-		if (sun.isVisible) {
-			drawPlanet(shaderProgram, sunVAO, sun.moveSpeed, 0.0f, 0.0f, sun.scale, 100, 0.0f, 0.0f, sun.rotationSpeed, true, true, true, false, sun.color,true, sun.textureID);
+		else {
+			// Specify the color of the background
+			glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+			// Clean the back buffer and assign the new color to it
+			// We need glClear since we do not want drawings to persist in the background
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 		}
 
-		//Draw Mercury and its orbital if visibility set to true
-		if (mercury.isVisible) {
-			drawPlanet(shaderProgram, mercuryOrbitVAO, 0.0f, 0.09f, 0.07, 0.2f, 100, 0.0f, 0.0f, 100.0f, false, false, false, true, glm::vec4(1.0f, 1.0f, 1.0f, 1.0f),false,0);
-			drawPlanet(shaderProgram, mercuryVAO, mercury.moveSpeed, 0.09f, 0.07f, mercury.scale, 100, 0.0f, 0.0f, mercury.rotationSpeed, true, true, true, false, mercury.color,true,mercury.textureID);
-		}
+		// Use the starry sky background texture
+		useBackgroundTexture(backgroundShaderProgram, backgroundVAO, backgroundTextureID);
 
-		//Draw Venus and its orbital if visibility set to true
-		if (venus.isVisible) {
-			drawPlanet(shaderProgram, venusOrbitVAO, 0.0f, 0.16f, 0.13f, 0.24f, 100, 0.0f, 0.0f, 0.0f, false, false, false, true, glm::vec4(1.0f, 1.0f, 1.0f, 0.5f),false,0);
-			drawPlanet(shaderProgram, venusVAO, venus.moveSpeed, 0.16f, 0.13f, venus.scale, 100, 0.0f, 0.0f, venus.rotationSpeed, true, true, true, false, venus.color,true, venus.textureID);
+		// setup needed for ImGui library inside the rendering loop
+		if (!HEADLESS) {
+			ImGui_ImplOpenGL3_NewFrame();
+			ImGui_ImplGlfw_NewFrame();
+			ImGui::NewFrame();
 		}
 
-		//Draw Earth and its orbital if visibility set to true
-		if (earth.isVisible) {
-			drawPlanet(shaderProgram, earthOrbitVAO, 0.0f, 0.21f, 0.18f, 0.35f, 100, 0.0f, 0.0f, 0.0f, false, false, false, true, glm::vec4(1.0f, 1.0f, 1.0f, 1.0f), false, 0);
-			vector<float> earthNewLocation = drawPlanet(shaderProgram, earthVAO, earth.moveSpeed, 0.21f, 0.18f, earth.scale, 100, 0.0f, 0.0f, earth.rotationSpeed, true, true, true, false, earth.color, true, earth.textureID);
-
-			/*
-			Draw Earth's Moon and its orbital
-			For object that orbit around other planets rather than the Sun, need to be translated to match the correct planet; set the isTranslate argument to true
-			That is why we are passing the Earth's new location to the drawPlanet function
-			*/
-			drawPlanet(shaderProgram, earthMoonVAO, moon.moveSpeed, 0.04f, 0.03f, moon.scale, 100, earthNewLocation[0], earthNewLocation[1], moon.rotationSpeed, true, true, true, false, moon.color, true, moon.textureID);
+		/*--------------------------------------------------------------------------------------------------
+		 Move every body relative to the body it orbits, then draw them in scene order
+		 A body that is removed takes everything orbiting it along
+		----------------------------------------------------------------------------------------------------*/
+		if (USE_PHYSICS) {
+			// Catch the simulation up with the frame in whole steps, or work the orbits out for its time, then put the
+			// bodies where they are
+			const double* particlesX;
+			const double* particlesY;
+			if (USE_KEPLER_ORBITS) {
+				moveKeplerSystem(keplerSystem, simulationTime);
+				particlesX = keplerSystem.positionsX.data();
+				particlesY = keplerSystem.positionsY.data();
+			}
+			else {
+				while (simulation.time() + 0.5 * PHYSICS_TIME_STEP <= simulationTime)
+					simulation.step(PHYSICS_TIME_STEP);
+				particlesX = simulation.positionsX.data();
+				particlesY = simulation.positionsY.data();
+			}
+			for (size_t particle = 0; particle < simulatedBodies.size(); particle++) {
+				int index = bodies.indexOf(simulatedBodies[particle]);
+				if (index >= 0)
+					bodies.placeAt(index, (float)particlesX[particle], (float)particlesY[particle]);
+			}
+			for (const pair<BodyHandle, size_t>& belt : simulatedBelts) {
+				int index = bodies.indexOf(belt.first);
+				if (index < 0)
+					continue;
+				vector<glm::vec2>& asteroids = bodies.renderInfo[index].asteroidPositions;
+				for (size_t asteroid = 0; asteroid < asteroids.size(); asteroid++) {
+					size_t particle = belt.second + asteroid;
+					asteroids[asteroid] = glm::vec2((float)particlesX[particle], (float)particlesY[particle]);
+				}
+			}
 		}
+		bodies.updatePositions(simulationTime);
+		for (uint32_t index : bodies.drawOrder)
+			drawBody(shaderProgram, bodies, index);
 
 		
 		/*----------------------------------------------------------------------------
 		  User has options to modify the planet attributes using the ImGui library
 		------------------------------------------------------------------------------*/
-		processInput(window, shaderProgram, selectedObject,sun, mercury,  venus,  earth, 
-			mars,  jupiter,  saturn,  uranus, neptune,moon, jupiterMoonIo,  jupiterMoonCallisto, comet,  isDrawAsteroidBelt, asteroidBeltMoveSpeed);
-
-		// Capture the frame
-		std::vector<uint8_t> frame(950 * 950 * 4); // RGBA
-		glReadPixels(0, 0, 950, 950, GL_RGBA, GL_UNSIGNED_BYTE, frame.data());
-		
-		// Flip the frame vertically
-		for (int y = 0; y < 950 / 2; ++y) {
-			for (int x = 0; x < 950; ++x) {
-				int topIndex = (y * 950 + x) * 4;
-				int bottomIndex = ((950 - y - 1) * 950 + x) * 4;
-
-				// Swap the pixels
-				std::swap(frame[topIndex], frame[bottomIndex]);
-				std::swap(frame[topIndex + 1], frame[bottomIndex + 1]);
-				std::swap(frame[topIndex + 2], frame[bottomIndex + 2]);
-				std::swap(frame[topIndex + 3], frame[bottomIndex + 3]);
+		if (!HEADLESS)
+			processInput(window, shaderProgram, selectedBody, bodies, recorder);
+
+		// Capture the frame, but only if a recording or the replay buffer needs it
+		if (recorder.wantsFrame() && softwareRenderer) {
+			// Software frames are drawn top-down straight into the frame, and only when one is wanted
+			softwareRenderer->render(frame.data());
+			recorder.submitFrame(frame.data(), simulationTime);
+		}
+		else if (recorder.wantsFrame()) {
+			glReadPixels(0, 0, 950, 950, GL_RGBA, GL_UNSIGNED_BYTE, frame.data());
+
+			// Flip the frame vertically, one row at a time
+			const size_t rowSize = 950 * 4;
+			vector<uint8_t> rowCopy(rowSize);
+			for (int y = 0; y < 950 / 2; ++y) {
+				uint8_t* topRow = frame.data() + y * rowSize;
+				uint8_t* bottomRow = frame.data() + (950 - y - 1) * rowSize;
+				memcpy(rowCopy.data(), topRow, rowSize);
+				memcpy(topRow, bottomRow, rowSize);
+				memcpy(bottomRow, rowCopy.data(), rowSize);
 			}
+			// Hand the frame over - GIF frames are copied and encoded in the background
+			// Frames are stamped with simulation time, so GIF delays match the simulation rather than the render speed
+			recorder.submitFrame(frame.data(), simulationTime);
 		}
-		// Add frame to GIF
-		GifWriteFrame(&gifWriter, frame.data(), 950, 950, 0);
 
+		renderedFrames++;
+		if (HEADLESS)
+			continue;
 		// Swap the back buffer with the front buffer
 		glfwSwapBuffers(window);
 		// Take care of all GLFW events
@@ -648,15 +730,26 @@ int main()
 	}
 
 	// end the ImGui
-	ImGui_ImplOpenGL3_Shutdown();
-	ImGui_ImplGlfw_Shutdown();
-	ImGui::DestroyContext();
-	// end the gif writer
-	GifEnd(&gifWriter);
+	if (!HEADLESS) {
+		ImGui_ImplOpenGL3_Shutdown();
+		ImGui_ImplGlfw_Shutdown();
+		ImGui::DestroyContext();
+	}
+	// end any recording or stream, waiting for the frames still being encoded
+	if (!recorder.stopRecording())
+		std::cerr << "The recording could not be written completely: " << recorder.recordingFilename() << std::endl;
+	recorder.stopStream();
 
 	// Delete all the objects we've created
 	/*glDeleteVertexArrays(1, &planet1VAO);
 	glDeleteBuffers(1, &planet1VBO);*/
+	if (HEADLESS) {
+		softwareRenderer.reset();
+		if (!SOFTWARE_RENDERING)
+			glDeleteProgram(shaderProgram);
+		headlessContext.destroy();
+		return 0;
+	}
 	glDeleteProgram(shaderProgram);
 	// Delete window before ending the program
 	glfwDestroyWindow(window);
@@ -668,169 +761,496 @@ int main()
  /*
  Funtion used in the render loop to process user input
  */
-void processInput(GLFWwindow* window, unsigned int shaderProgram, int& selectedObject,
-				  CelestialBodies& sun, CelestialBodies& mercury, CelestialBodies& venus, CelestialBodies& earth, 
-			      CelestialBodies& mars, CelestialBodies& jupiter, CelestialBodies& saturn, CelestialBodies& uranus, CelestialBodies& neptune,
-				  CelestialBodies& moon, CelestialBodies& jupiterMoonIo, CelestialBodies& jupiterMoonCallisto, CelestialBodies& comet, bool& isDrawAsteroidBelt, float &asteroidBeltMoveSpeed)
+void processInput(GLFWwindow* window, unsigned int shaderProgram, BodyHandle& selectedBody, BodyStore& bodies, Recorder& recorder)
 {
 	
-	// Names needed for selecting different celestial bodies in drop-down menu in ImGui render
-	const char* celestialBodyNames[] = { "Sun", "Mercury", "Venus", "Earth", "Mars", "Jupiter", "Saturn", "Uranus", "Neptune", "Moon", "Io", "Callisto", "Comet", "Asteroid Belt" };
+	// Names needed for selecting different celestial bodies in drop-down menu in ImGui render, each followed by what orbits it
+	vector<const char*> celestialBodyNames;
+	for (const BodyRenderInfo& body : bodies.renderInfo)
+		celestialBodyNames.push_back(body.name.c_str());
 	
 	// ESC key will cause the window to close
 	if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
 		glfwSetWindowShouldClose(window, true);
 
 	ImGui::Begin("Solar System Properties");
-	const int celestialBodyCount = sizeof(celestialBodyNames) / sizeof(celestialBodyNames[0]);
 
-	// Planet selection dropdown
-	ImGui::Combo("Select Planet", &selectedObject, celestialBodyNames, celestialBodyCount);
+	// Planet selection dropdown - the selection follows the body, wherever it is in the store
+	int selectedObject = bodies.indexOf(selectedBody);
+	if (ImGui::Combo("Select Planet", &selectedObject, celestialBodyNames.data(), (int)celestialBodyNames.size()))
+		selectedBody = bodies.handleAt(selectedObject);
 
 	// Slider for modifying the properties of the selected planet
-	switch (selectedObject) {
-	case 0: // Sun
-		ImGui::SliderFloat("Size", &sun.scale, 0.1f, 10.0f);			// size
-		ImGui::SliderFloat("Rotation Speed", &sun.rotationSpeed, 0.0f, 200.0f);// rotation speed
-		ImGui::ColorEdit4("Color", (float*)&sun.color);				// color
-		ImGui::Checkbox("Add/Remove", &sun.isVisible);				// visibility
-		break;
-	case 1: // Mercury
-		ImGui::SliderFloat("Size", &mercury.scale, 0.1f, 10.0f);		// size
-		ImGui::SliderFloat("Rotation Speed", &mercury.rotationSpeed, 0.0f, 200.0f);// rotation speed
-		ImGui::SliderFloat("Speed", &mercury.moveSpeed, 0.1f, 10.0f);// speed
-		ImGui::ColorEdit4("Color", (float*)&mercury.color);			// color
-		ImGui::Checkbox("Add/Remove", &mercury.isVisible);			// visibility
-		break;
-	case 2: // Venus
-		ImGui::SliderFloat("Size", &venus.scale, 0.1f, 10.0f);		// size
-		ImGui::SliderFloat("Rotation Speed", &venus.rotationSpeed, 0.0f, 200.0f);// rotation speed
-		ImGui::SliderFloat("Speed", &venus.moveSpeed, 0.1f, 10.0f);	// speed
-		ImGui::ColorEdit4("Color", (float*)&venus.color);			// color
-		ImGui::Checkbox("Add/Remove", &venus.isVisible);			// visibility
-		break;
-	case 3: // Earth
-		ImGui::SliderFloat("Size", &earth.scale, 0.1f, 10.0f);		// size
-		ImGui::SliderFloat("Rotation Speed", &earth.rotationSpeed, 0.0f, 200.0f);// rotation speed
-		ImGui::SliderFloat("Speed", &earth.moveSpeed, 0.1f, 10.0f);	// speed
-		ImGui::ColorEdit4("Color", (float*)&earth.color);			// color
-		ImGui::Checkbox("Add/Remove", &earth.isVisible);			// visibility
-		break;
-	case 4: // Mars
-		ImGui::SliderFloat("Size", &mars.scale, 0.1f, 10.0f);		// size
-		ImGui::SliderFloat("Rotation Speed", &mars.rotationSpeed, 0.0f, 200.0f);// rotation speed
-		ImGui::SliderFloat("Speed", &mars.moveSpeed, 0.1f, 10.0f);	// speed
-		ImGui::ColorEdit4("Color", (float*)&mars.color);			// color
-		ImGui::Checkbox("Add/Remove", &mars.isVisible);				// visibility
-		break;
-	case 5: // Jupiter
-		ImGui::SliderFloat("Size", &jupiter.scale, 0.1f, 10.0f);		// size
-		ImGui::SliderFloat("Rotation Speed", &jupiter.rotationSpeed, 0.0f, 200.0f);// rotation speed
-		ImGui::SliderFloat("Speed", &jupiter.moveSpeed, 0.1f, 10.0f);// speed
-		ImGui::ColorEdit4("Color", (float*)&jupiter.color);			// color
-		ImGui::Checkbox("Add/Remove", &jupiter.isVisible);			// visibility
-		break;
-	case 6: // Saturn
-		ImGui::SliderFloat("Size", &saturn.scale, 0.1f, 10.0f);		// size
-		ImGui::SliderFloat("Rotation Speed", &saturn.rotationSpeed, 0.0f, 200.0f);// rotation speed
-		ImGui::SliderFloat("Speed", &saturn.moveSpeed, 0.1f, 10.0f);	// speed
-		ImGui::ColorEdit4("Color", (float*)&saturn.color);			// color
-		ImGui::Checkbox("Add/Remove", &saturn.isVisible);				// visibility
-		break;
-	case 7: // Uranus
-		ImGui::SliderFloat("Size", &uranus.scale, 0.1f, 10.0f);		// size
-		ImGui::SliderFloat("Rotation Speed", &uranus.rotationSpeed, 0.0f, 200.0f);// rotation speed
-		ImGui::SliderFloat("Speed", &uranus.moveSpeed, 0.1f, 10.0f);	// speed
-		ImGui::ColorEdit4("Color", (float*)&uranus.color);			// color
-		ImGui::Checkbox("Add/Remove", &uranus.isVisible);			// visibility
-		break;
-	case 8: // Neptune
-		ImGui::SliderFloat("Size", &neptune.scale, 0.1f, 10.0f);		// size
-		ImGui::SliderFloat("Rotation Speed", &neptune.rotationSpeed, 0.0f, 200.0f);// rotation speed
-		ImGui::SliderFloat("Speed", &neptune.moveSpeed, 0.1f, 10.0f);// speed
-		ImGui::ColorEdit4("Color", (float*)&neptune.color);			// color
-		ImGui::Checkbox("Add/Remove", &neptune.isVisible);			// visibility
-		break;
-	case 9:// Moon
-		ImGui::SliderFloat("Size", &moon.scale, 0.1f, 10.0f);	 // size
-		ImGui::SliderFloat("Rotation Speed", &moon.rotationSpeed, 0.0f, 200.0f);// rotation speed
-		ImGui::SliderFloat("Speed", &moon.moveSpeed, 0.1f, 10.0f);// speed
-		ImGui::ColorEdit4("Color", (float*)&moon.color);			// color
-		ImGui::Checkbox("Add/Remove", &moon.isVisible);			// visibility
-		break;
-	case 10:// Io
-		ImGui::SliderFloat("Size", &jupiterMoonIo.scale, 0.1f, 10.0f);	 // size
-		ImGui::SliderFloat("Rotation Speed", &jupiterMoonIo.rotationSpeed, 0.0f, 200.0f);// rotation speed
-		ImGui::SliderFloat("Speed", &jupiterMoonIo.moveSpeed, 0.1f, 10.0f);// speed
-		ImGui::ColorEdit4("Color", (float*)&jupiterMoonIo.color);			// color
-		ImGui::Checkbox("Add/Remove", &jupiterMoonIo.isVisible);			// visibility
-		break;
-	case 11:// Callisto
-		ImGui::SliderFloat("Size", &jupiterMoonCallisto.scale, 0.1f, 10.0f);		// size
-		ImGui::SliderFloat("Rotation Speed", &jupiterMoonCallisto.rotationSpeed, 0.0f, 200.0f);// rotation speed
-		ImGui::SliderFloat("Speed", &jupiterMoonCallisto.moveSpeed, 0.1f, 10.0f);// speed
-		ImGui::ColorEdit4("Color", (float*)&jupiterMoonCallisto.color);			// color
-		ImGui::Checkbox("Add/Remove", &jupiterMoonCallisto.isVisible);			// visibility
-		break;
-	case 12:// Comet
-		ImGui::SliderFloat("Size", &comet.scale, 0.1f, 10.0f);		// size
-		ImGui::SliderFloat("Rotation Speed", &comet.rotationSpeed, 0.0f, 200.0f);// rotation speed
-		ImGui::SliderFloat("Speed", &comet.moveSpeed, 0.1f, 10.0f);// speed
-		ImGui::ColorEdit4("Color", (float*)&comet.color);			// color
-		ImGui::Checkbox("Add/Remove", &comet.isVisible);			// visibility
-		break;
-	case 13:// Asteroid Belt
-		ImGui::SliderFloat("Speed", &asteroidBeltMoveSpeed, 0.1f, 10.0f);// speed
-		ImGui::Checkbox("Add/Remove", &isDrawAsteroidBelt);			// visibility
-		break;
+	if (selectedObject >= 0) {
+		BodyRenderInfo& body = bodies.renderInfo[selectedObject];
+		bool isAsteroidBelt = !body.asteroidRings.empty();
+		if (!isAsteroidBelt) {
+			ImGui::SliderFloat("Size", &bodies.scales[selectedObject], 0.1f, 10.0f);						// size
+			ImGui::SliderFloat("Rotation Speed", &bodies.rotationSpeeds[selectedObject], 0.0f, 200.0f);	// rotation speed
+		}
+		// Only bodies that go around something have a speed; the store only moves the body again once told
+		if (isAsteroidBelt || bodies.orbitRadiiX[selectedObject] != 0.0f || bodies.orbitRadiiY[selectedObject] != 0.0f) {
+			if (ImGui::SliderFloat("Speed", &bodies.moveSpeeds[selectedObject], 0.1f, 10.0f))			// speed
+				bodies.markChanged(selectedObject);
+		}
+		if (!isAsteroidBelt)
+			ImGui::ColorEdit4("Color", (float*)&body.color);											// color
+		bool isVisible = bodies.isVisible[selectedObject] != 0;
+		if (ImGui::Checkbox("Add/Remove", &isVisible)) {												// visibility
+			bodies.isVisible[selectedObject] = isVisible;
+			bodies.markChanged(selectedObject);
+		}
 	}
 
+	// Recording controls sit below the planet properties
+	drawRecordingControls(window, recorder);
+
 	// End the ImGui function
 	ImGui::End();
 	ImGui::Render();
 	ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 }
 
+/*--------------------------------------------------------------------------------------------
+Recording controls, shown in the properties window and mirrored by hotkeys:
+   R - start/stop recording to a new GIF
+   B - turn the replay buffer of the last REPLAY_BUFFER_SECONDS seconds on/off
+   S - save the replay buffer to a new GIF
+----------------------------------------------------------------------------------------------*/
+void drawRecordingControls(GLFWwindow* window, Recorder& recorder)
+{
+	// Remember which hotkeys were down last frame, so holding a key only triggers once
+	static bool wasKeyDown[3] = { false, false, false };
+	const int hotkeys[3] = { GLFW_KEY_R, GLFW_KEY_B, GLFW_KEY_S };
+	bool hotkeyPressed[3];
+	for (int i = 0; i < 3; i++) {
+		bool isKeyDown = glfwGetKey(window, hotkeys[i]) == GLFW_PRESS;
+		// Ignore typing into the UI
+		hotkeyPressed[i] = isKeyDown && !wasKeyDown[i] && !ImGui::GetIO().WantCaptureKeyboard;
+		wasKeyDown[i] = isKeyDown;
+	}
+
+	ImGui::Separator();
+	ImGui::Text("Recording");
+
+	// Smaller previews: skip frames and shrink the rest; the size is fixed once a recording starts
+	bool isOptionChanged = ImGui::SliderInt("Keep Every Nth Frame", &CAPTURE_FRAME_STEP, 1, 10);
+	isOptionChanged |= ImGui::SliderInt("Shrink By", &CAPTURE_SCALE_DIVISOR, 1, 8);
+	if (isOptionChanged)
+		recorder.setCaptureOptions(CAPTURE_FRAME_STEP, CAPTURE_SCALE_DIVISOR);
+	ImGui::Text("Capture size: %d x %d", recorder.frameWidth() / CAPTURE_SCALE_DIVISOR, recorder.frameHeight() / CAPTURE_SCALE_DIVISOR);
+	const char* ditherModes[] = { "None", "Floyd-Steinberg", "Ordered" };
+	int ditherMode = (int)GIF_DITHER_MODE;
+	if (ImGui::Combo("GIF Dithering", &ditherMode, ditherModes, IM_ARRAYSIZE(ditherModes))) {
+		GIF_DITHER_MODE = (GifDitherMode)ditherMode;
+		recorder.setDither(GIF_DITHER_MODE);
+	}
+
+	// Deterministic capture
+	bool isFixedTimeStep = USE_FIXED_TIME_STEP;
+	if (ImGui::Checkbox("Fixed Time Step", &isFixedTimeStep))
+		setFixedTimeStep(isFixedTimeStep);
+	if (USE_FIXED_TIME_STEP) {
+		ImGui::SameLine();
+		if (ImGui::SliderInt("FPS", &FIXED_TIME_STEP_FPS, 10, 60))
+			FIXED_TIME_STEP_FPS = max(1, FIXED_TIME_STEP_FPS);
+	}
+
+	// Start/stop recording
+	ImGui::Checkbox("Record Lossless (.ssrec)", &RECORD_LOSSLESS);
+	if (ImGui::Button(recorder.isRecording() ? "Stop Recording (R)" : "Start Recording (R)") || hotkeyPressed[0]) {
+		if (recorder.isRecording())
+			recorder.stopRecording();
+		else
+			recorder.startRecording(nextCaptureFilename("recording", RECORD_LOSSLESS ? ".ssrec" : ".gif"));
+	}
+	if (recorder.isRecording()) {
+		ImGui::SameLine();
+		ImGui::Text("-> %s", recorder.recordingFilename().c_str());
+	}
+
+	// Raw stream on/off - from the UI it always goes to a new file
+	const char* streamExtension = STREAM_FORMAT == RAW_STREAM_Y4M ? ".y4m" : ".ppm";
+	if (ImGui::Button(recorder.isStreaming() ? "Stop Raw Stream" : "Start Raw Stream")) {
+		if (recorder.isStreaming())
+			recorder.stopStream();
+		else
+			recorder.startStream(nextCaptureFilename("stream", streamExtension), STREAM_FORMAT, USE_FIXED_TIME_STEP ? FIXED_TIME_STEP_FPS : STREAM_FRAME_RATE);
+	}
+	if (recorder.isStreaming()) {
+		ImGui::SameLine();
+		ImGui::Text("-> %s", recorder.streamTarget().c_str());
+	}
+
+	// Replay buffer on/off
+	bool isReplayOn = recorder.isReplayBufferEnabled();
+	if (ImGui::Checkbox("Replay Buffer (B)", &isReplayOn) || hotkeyPressed[1]) {
+		if (hotkeyPressed[1])
+			isReplayOn = !recorder.isReplayBufferEnabled();
+		recorder.setReplayBuffer(isReplayOn, REPLAY_BUFFER_SECONDS);
+	}
+	if (recorder.isReplayBufferEnabled()) {
+		const ReplayBuffer& replay = recorder.replayBuffer();
+		ImGui::Text("%.1f of %.0f s held, %.1f MB", replay.duration(), REPLAY_BUFFER_SECONDS, replay.memoryUsed() / (1024.0 * 1024.0));
+
+		// Saving encodes the buffered frames in the background, one replay at a time
+		if ((ImGui::Button("Save Replay (S)") || hotkeyPressed[2]) && !recorder.isSavingReplay())
+			recorder.saveReplay(nextCaptureFilename("replay"));
+		if (recorder.isSavingReplay()) {
+			ImGui::SameLine();
+			ImGui::Text("Saving...");
+		}
+	}
+}
+
+/*
+Switches between simulation time that follows the clock and time that advances a fixed step per frame
+In the fixed mode frames are not held back to the display's refresh rate, so captures finish as fast as the machine can render
+*/
+void setFixedTimeStep(bool isEnabled)
+{
+	USE_FIXED_TIME_STEP = isEnabled;
+	glfwSwapInterval(isEnabled ? 0 : 1);
+}
+
+/*
+Returns the first "<prefix>_<number><extension>" that does not exist yet, so that captures never overwrite each other
+*/
+string nextCaptureFilename(const char* prefix, const char* extension)
+{
+	for (int number = 1; ; number++) {
+		string filename = string(prefix) + "_" + to_string(number) + extension;
+		if (!filesystem::exists(filename))
+			return filename;
+	}
+}
+
 /*------------------------------------------------------------------------------------------------------------
-Helper function to create multiple small object/asteroid for asteroid belt which is called in the reder loop
-It iterates for 100 times to make a complete angle rotation; where on each iteration an asteroid gets drawn
+Helper function to create the bodies of a scene in the rendering loop's form
+Buffers and textures are made in bulk: bodies with the same outline share one VAO, and every texture file is
+loaded once however many bodies use it, so scenes with thousands of bodies need only a handful of each
 --------------------------------------------------------------------------------------------------------------*/
 
-void drawAsteroidBelt(unsigned int shaderProgram, GLuint asteroidBeltVAO, float asteroidBeltSpeed) {
-	// First belt
-	for (int segment = 0; segment <= 100; segment += 2) {
-		// Divide the circumference into segments and get the angle for segment
-		float angle = (2.0 * M_PI * float(segment)) / 100.0f;
-		// Get the value of x and y coordinates using trigonometric identities
-		float x = ASTERIOD_BELT_RADIUS_X * cosf(angle + asteroidBeltSpeed * glfwGetTime());
-		float y = ASTERIOD_BELT_RADIUS_Y * sinf(angle + asteroidBeltSpeed * glfwGetTime());
-		// Draw the asteroid at the calculated xy coordinate. Essentially, asteroids in this case are just many small planets.
-		drawPlanet(shaderProgram, asteroidBeltVAO, 0.5f, 0.00049f, 0.0005f, 0.05f, 100, x, y, 50.0f, true, true, true, false, glm::vec4(0.5f, 0.5f, 0.5f, 1.0f), false, 0);
+BodyStore createSceneBodies(const Scene& scene, map<string, DecodedTexture>& textures, vector<uint8_t>& paletteSamples, vector<BodyHandle>& handles)
+{
+	map<tuple<float, float, int>, GLuint> shapeVAOs;
+	map<string, unsigned int> textureIDs;
+	// Returns the VAO of an ellipse with the given radii, setting one up the first time it is asked for
+	auto getShapeVAO = [&](float radiusX, float radiusY, int segments) {
+		GLuint& VAO = shapeVAOs[make_tuple(radiusX, radiusY, segments)];
+		if (VAO == 0) {
+			GLuint VBO;
+			setupObjectBuffer(VAO, VBO, radiusX, radiusY, segments);
+		}
+		return VAO;
+	};
+
+	BodyStore bodies;
+	// Handle of each scene body, to find its parent by once they are all in the store
+	handles.clear();
+	handles.reserve(scene.bodies.size());
+	for (const SceneBody& sceneBody : scene.bodies) {
+		BodyMotion motion;
+		motion.moveSpeed = sceneBody.moveSpeed;
+		motion.orbitRadiusX = sceneBody.orbit.x;
+		motion.orbitRadiusY = sceneBody.orbit.y;
+		motion.scale = sceneBody.scale;
+		motion.rotationSpeed = sceneBody.rotationSpeed;
+		motion.isVisible = sceneBody.isVisible;
+
+		BodyRenderInfo body = {};
+		body.name = sceneBody.name;
+		body.VAO = getShapeVAO(sceneBody.shape.x, sceneBody.shape.y, sceneBody.segments);
+		// The orbit ellipse is drawn around the parent, with the same number of segments as the body
+		body.orbitVAO = sceneBody.isOrbitDrawn ? getShapeVAO(sceneBody.orbit.x, sceneBody.orbit.y, sceneBody.segments) : 0;
+		body.segments = sceneBody.segments;
+		body.isScale = true;
+		body.isTranslate = true;
+		// Rings stay level around their planet
+		body.isRotate = !sceneBody.isRing;
+		body.isDrawAsRing = sceneBody.isRing;
+		body.color = sceneBody.color;
+		body.orbitColor = sceneBody.orbitColor;
+		if (!sceneBody.texture.empty()) {
+			auto texture = textureIDs.find(sceneBody.texture);
+			if (texture == textureIDs.end())
+				texture = textureIDs.emplace(sceneBody.texture, uploadTexture(textures[sceneBody.texture], &paletteSamples)).first;
+			body.textureID = texture->second;
+		}
+		body.asteroidRings = sceneBody.asteroidRings;
+		body.asteroidSpeed = sceneBody.asteroidSpeed;
+
+		handles.push_back(bodies.add(BodyHandle(), motion, move(body)));
 	}
-	// Second Belt - larger one
-	for (int segment = 0; segment <= 100; segment++) {
-		// Divide the circumference into segments and get each angle for that point
+	// The scene can list a parent after its children; the store sorts them out
+	for (size_t i = 0; i < scene.bodies.size(); i++) {
+		if (scene.bodies[i].parent >= 0)
+			bodies.setParent(handles[i], handles[scene.bodies[i].parent]);
+	}
+	return bodies;
+}
 
-		for (int i = 0; i <= 100; i++) {
-			float angle = (2.0 * M_PI * float(segment))/ 100.0f;
-			// Get the value of x and y coordinates using trigonometric identities
-			float x = ASTERIOD_BELT_RADIUS2_X * cosf(angle + asteroidBeltSpeed * glfwGetTime());
-			float y = ASTERIOD_BELT_RADIUS2_Y * sinf(angle + asteroidBeltSpeed * glfwGetTime());
-			// Draw the asteroid at the calculated xy coordinate. Essentially, asteroids in this case are just many small planets.
-			drawPlanet(shaderProgram, asteroidBeltVAO, 0.5f,0.0059f,0.0039f, 0.09f, 100, x, y, 50.0f, true, true, true, false, glm::vec4(0.5f, 0.5f, 0.5f, 1.0f), false, 0);
+/*------------------------------------------------------------------------------------------------------------
+Helper function to put the bodies that have a mass into the gravity simulation, for --physics
+Each one starts where its orbit starts, moving along with its parent plus the speed of a circular orbit around
+it; bodies orbiting the center go around the mass of the bodies sitting there. Bodies without a mass keep
+to their orbits, around wherever gravity takes their parent
+--------------------------------------------------------------------------------------------------------------*/
+
+NBodySimulation createSimulation(const Scene& scene, const vector<BodyHandle>& handles, BodyStore& bodies, vector<BodyHandle>& simulatedBodies,
+	vector<pair<BodyHandle, size_t>>& simulatedBelts)
+{
+	// Where every body starts, with parents sorted before their children
+	bodies.updatePositions(0.0);
+	vector<int> sceneIndices(bodies.size());
+	for (size_t i = 0; i < handles.size(); i++)
+		sceneIndices[bodies.indexOf(handles[i])] = (int)i;
+
+	double centralMass = 0.0;
+	for (const SceneBody& body : scene.bodies) {
+		if (body.parent < 0 && body.orbit == glm::vec2(0.0f))
+			centralMass += body.mass;
+	}
+
+	NBodySimulation simulation;
+	simulation.solver = PHYSICS_SOLVER;
+	simulation.integrator = PHYSICS_INTEGRATOR;
+	simulation.timeStepCriterion = PHYSICS_TIME_STEP_CRITERION;
+	simulation.timeStepAccuracy = PHYSICS_TIME_STEP_ACCURACY;
+	simulation.timeStepLength = PHYSICS_TIME_STEP_LENGTH;
+	simulation.maxTimeStepLevel = PHYSICS_MAX_TIME_STEP_LEVEL;
+	simulation.multipoleOrder = PHYSICS_MULTIPOLE_ORDER;
+	if (PHYSICS_OPENING_ANGLE >= 0.0) {
+		simulation.openingAngle = PHYSICS_OPENING_ANGLE;
+		simulation.multipoleOpeningAngle = PHYSICS_OPENING_ANGLE;
+	}
+	// The scenes are flat
+	simulation.treeDimensions = 2;
+	simulatedBodies.clear();
+	simulatedBelts.clear();
+	vector<double> velocitiesX(bodies.size(), 0.0), velocitiesY(bodies.size(), 0.0);
+	for (size_t i = 0; i < bodies.size(); i++) {
+		const SceneBody& body = scene.bodies[sceneIndices[i]];
+		int parent = bodies.parents[i];
+		double orbitedMass = parent >= 0 ? scene.bodies[sceneIndices[parent]].mass : centralMass;
+		if (parent >= 0) {
+			velocitiesX[i] = velocitiesX[parent];
+			velocitiesY[i] = velocitiesY[parent];
 		}
-		
+		// Orbits start at their x radius, heading the way the body goes around
+		double radius = fabs(body.orbit.x);
+		if (radius > 0.0 && orbitedMass > 0.0)
+			velocitiesY[i] += copysign(sqrt(simulation.gravitationalConstant * orbitedMass / radius), (double)body.orbit.y * body.moveSpeed);
+		if (body.mass > 0.0f) {
+			simulation.add(body.mass, bodies.positionsX[i], bodies.positionsY[i], 0.0, velocitiesX[i], velocitiesY[i], 0.0);
+			simulatedBodies.push_back(bodies.handleAt(i));
+		}
+	}
+	// Asteroids are massless particles, each on a circular orbit around the belt's center, going the way the belt turns
+	// They come after the bodies, so the bodies' particles still match simulatedBodies
+	for (size_t i = 0; i < bodies.size(); i++) {
+		const SceneBody& body = scene.bodies[sceneIndices[i]];
+		if (body.asteroidRings.empty())
+			continue;
+		int parent = bodies.parents[i];
+		double orbitedMass = parent >= 0 ? scene.bodies[sceneIndices[parent]].mass : centralMass;
+		simulatedBelts.push_back(make_pair(bodies.handleAt(i), simulation.size()));
+		for (const SceneAsteroidRing& ring : body.asteroidRings) {
+			for (int asteroid = 0; asteroid < ring.count; asteroid++) {
+				double angle = 2.0 * M_PI * asteroid * ring.spacing;
+				double offsetX = ring.radius.x * cos(angle);
+				double offsetY = ring.radius.y * sin(angle);
+				double radius = sqrt(offsetX * offsetX + offsetY * offsetY);
+				// Speed over radius, so that the offset turned a quarter turn gives the velocity
+				double turnRate = radius > 0.0 ? copysign(sqrt(simulation.gravitationalConstant * orbitedMass / radius) / radius, (double)body.moveSpeed) : 0.0;
+				simulation.add(0.0, bodies.positionsX[i] + offsetX, bodies.positionsY[i] + offsetY, 0.0,
+					velocitiesX[i] - turnRate * offsetY, velocitiesY[i] + turnRate * offsetX, 0.0);
+			}
+		}
+		bodies.renderInfo[i].asteroidPositions.resize(simulation.size() - simulatedBelts.back().second);
+	}
+	// Otherwise the whole system drifts off with the planets' momentum
+	simulation.removeNetMomentum();
+	return simulation;
+}
+
+/*------------------------------------------------------------------------------------------------------------
+Helper function to put the bodies that have a mass on Kepler orbits, for --physics with --integrator kepler
+Each one starts as it would in the simulation, and keeps the two-body orbit that gives it around its parent,
+which follows its own orbit in turn, or stays put when it is a body sitting still. Asteroids go around their
+belt the same way, if it has an orbit or sits still. Everything else keeps to its scene orbit
+--------------------------------------------------------------------------------------------------------------*/
+
+KeplerSystem createKeplerSystem(const Scene& scene, const vector<BodyHandle>& handles, BodyStore& bodies, vector<BodyHandle>& simulatedBodies,
+	vector<pair<BodyHandle, size_t>>& simulatedBelts)
+{
+	// Where every body starts, with parents sorted before their children
+	bodies.updatePositions(0.0);
+	vector<int> sceneIndices(bodies.size());
+	for (size_t i = 0; i < handles.size(); i++)
+		sceneIndices[bodies.indexOf(handles[i])] = (int)i;
+
+	double centralMass = 0.0;
+	for (const SceneBody& body : scene.bodies) {
+		if (body.parent < 0 && body.orbit == glm::vec2(0.0f))
+			centralMass += body.mass;
+	}
+
+	KeplerSystem system;
+	simulatedBodies.clear();
+	simulatedBelts.clear();
+	// The orbit of each body, or -1 if it has none
+	vector<int> orbitOf(bodies.size(), -1);
+	// What an orbit around body index goes around: the body's orbit, the body itself if it sits still, or the
+	// origin for index -1. Returns false for a body that moves along its scene orbit
+	auto findCenter = [&](int index, int& centerOrbit, double& centerX, double& centerY) {
+		centerOrbit = index >= 0 ? orbitOf[index] : -1;
+		centerX = index >= 0 ? bodies.positionsX[index] : 0.0;
+		centerY = index >= 0 ? bodies.positionsY[index] : 0.0;
+		return index < 0 || centerOrbit >= 0 || (bodies.parents[index] < 0 && scene.bodies[sceneIndices[index]].orbit == glm::vec2(0.0f));
+	};
+	// Start an orbit around a mass mu (the gravitational constant is 1) at an offset from its center, moving at a
+	// velocity relative to it. Returns false if that is no ellipse
+	auto addOrbit = [&](double mu, double x, double y, double velocityX, double velocityY, int centerOrbit, double centerX, double centerY) {
+		OrbitalElements elements;
+		if (!orbitalElementsFromState(mu, x, y, 0.0, velocityX, velocityY, 0.0, elements))
+			return false;
+		system.orbits.add(mu, elements);
+		system.centerOrbits.push_back(centerOrbit);
+		system.centersX.push_back(centerOrbit >= 0 ? 0.0 : centerX);
+		system.centersY.push_back(centerOrbit >= 0 ? 0.0 : centerY);
+		return true;
+	};
+
+	for (size_t i = 0; i < bodies.size(); i++) {
+		const SceneBody& body = scene.bodies[sceneIndices[i]];
+		int parent = bodies.parents[i];
+		double orbitedMass = parent >= 0 ? scene.bodies[sceneIndices[parent]].mass : centralMass;
+		double radius = fabs(body.orbit.x);
+		int centerOrbit;
+		double centerX, centerY;
+		if (body.mass <= 0.0f || radius <= 0.0 || orbitedMass <= 0.0 || !findCenter(parent, centerOrbit, centerX, centerY))
+			continue;
+		// Orbits start at their x radius, heading the way the body goes around at the speed of a circular orbit
+		double speed = copysign(sqrt(orbitedMass / radius), (double)body.orbit.y * body.moveSpeed);
+		if (addOrbit(orbitedMass + body.mass, bodies.positionsX[i] - centerX, bodies.positionsY[i] - centerY, 0.0, speed,
+				centerOrbit, centerX, centerY)) {
+			orbitOf[i] = (int)system.orbits.size() - 1;
+			simulatedBodies.push_back(bodies.handleAt(i));
+		}
+	}
+	// Each asteroid on a circular orbit around the belt's center, going the way the belt turns. They come after the
+	// bodies, so the bodies' orbits still match simulatedBodies
+	for (size_t i = 0; i < bodies.size(); i++) {
+		const SceneBody& body = scene.bodies[sceneIndices[i]];
+		int parent = bodies.parents[i];
+		double orbitedMass = parent >= 0 ? scene.bodies[sceneIndices[parent]].mass : centralMass;
+		int centerOrbit;
+		double centerX, centerY;
+		if (body.asteroidRings.empty() || orbitedMass <= 0.0 || !findCenter((int)i, centerOrbit, centerX, centerY))
+			continue;
+		// A ring flattened to a line has asteroids passing through its center, on no orbit at all
+		bool isFlat = false;
+		for (const SceneAsteroidRing& ring : body.asteroidRings)
+			isFlat = isFlat || ring.radius.x == 0.0f || ring.radius.y == 0.0f;
+		if (isFlat)
+			continue;
+		size_t firstOrbit = system.orbits.size();
+		for (const SceneAsteroidRing& ring : body.asteroidRings) {
+			for (int asteroid = 0; asteroid < ring.count; asteroid++) {
+				double angle = 2.0 * M_PI * asteroid * ring.spacing;
+				double offsetX = ring.radius.x * cos(angle);
+				double offsetY = ring.radius.y * sin(angle);
+				double radius = sqrt(offsetX * offsetX + offsetY * offsetY);
+				// Speed over radius, so that the offset turned a quarter turn gives the velocity
+				double turnRate = copysign(sqrt(orbitedMass / radius) / radius, (double)body.moveSpeed);
+				addOrbit(orbitedMass, offsetX, offsetY, -turnRate * offsetY, turnRate * offsetX, centerOrbit, centerX, centerY);
+			}
+		}
+		simulatedBelts.push_back(make_pair(bodies.handleAt(i), firstOrbit));
+		bodies.renderInfo[i].asteroidPositions.resize(system.orbits.size() - firstOrbit);
+	}
+	system.positionsX.resize(system.orbits.size());
+	system.positionsY.resize(system.orbits.size());
+	system.positionsZ.resize(system.orbits.size());
+	return system;
+}
+
+/*------------------------------------------------------------------------------------------------------------
+Helper function to work out where the Kepler orbits are at a time, for --integrator kepler
+Each orbit is added to its center's position, which is already done since centers come first
+--------------------------------------------------------------------------------------------------------------*/
 
+void moveKeplerSystem(KeplerSystem& system, double time)
+{
+	system.orbits.positionsAt(time, system.positionsX.data(), system.positionsY.data(), system.positionsZ.data());
+	for (size_t i = 0; i < system.centerOrbits.size(); i++) {
+		int center = system.centerOrbits[i];
+		system.positionsX[i] += center >= 0 ? system.positionsX[center] : system.centersX[i];
+		system.positionsY[i] += center >= 0 ? system.positionsY[center] : system.centersY[i];
+	}
+}
+
+/*------------------------------------------------------------------------------------------------------------
+Helper function to draw one body of the scene (and its orbit) in the rendering loop
+The store has already moved it for this frame; its orbit is centered on its parent, and if the parent is not
+shown, neither is the body
+--------------------------------------------------------------------------------------------------------------*/
+
+void drawBody(unsigned int shaderProgram, const BodyStore& bodies, size_t index)
+{
+	if (!bodies.isShown[index])
+		return;
+	const BodyRenderInfo& body = bodies.renderInfo[index];
+	int parent = bodies.parents[index];
+
+	if (!body.asteroidRings.empty()) {
+		drawAsteroidBelt(shaderProgram, bodies, index);
+		return;
 	}
-	// Third Belt
-	for (int segment = 0; segment <= 100; segment++) {
-		// Divide the circumference into segments and get the angle for segment
-		float angle = (2.0 * M_PI * float(segment)) / 100.0f;
-		// Get the value of x and y coordinates using trigonometric identities
-		float x = ASTERIOD_BELT_RADIUS3_X * cosf(angle + asteroidBeltSpeed * glfwGetTime());
-		float y = ASTERIOD_BELT_RADIUS3_Y * sinf(angle + asteroidBeltSpeed * glfwGetTime());
-		// Draw the asteroid at the calculated xy coordinate. Essentially, asteroids in this case are just many small planets.
-		drawPlanet(shaderProgram, asteroidBeltVAO, 0.5f, 0.00019f, 0.00019f, 0.05f, 100, x, y, 50.0f, true, true, true, false, glm::vec4(0.5f, 0.5f, 0.5f, 1.0f), false, 0);
+	// Draw the orbit as an elliptical ring, instead of solid object - bodies moved by gravity keep to no fixed orbit
+	if (body.orbitVAO != 0 && !bodies.isPlaced[index]) {
+		float centerX = parent >= 0 ? bodies.positionsX[parent] : 0.0f;
+		float centerY = parent >= 0 ? bodies.positionsY[parent] : 0.0f;
+		drawPlanet(shaderProgram, body.orbitVAO, 0.0f, 0.0f, 0.0f, 1.0f, body.segments, centerX, centerY, 0.0f, false, parent >= 0, false, true, body.orbitColor, false, 0);
+	}
+	// Rings grow with their planet, so that they stay clear of it
+	float scale = body.isDrawAsRing && parent >= 0 ? bodies.scales[index] + bodies.scales[parent] : bodies.scales[index];
+	// With no orbit of its own, drawPlanet puts the body right where the store placed it
+	drawPlanet(shaderProgram, body.VAO, 0.0f, 0.0f, 0.0f, scale, body.segments, bodies.positionsX[index], bodies.positionsY[index],
+		bodies.rotationSpeeds[index], body.isScale, body.isTranslate, body.isRotate, body.isDrawAsRing, body.color, body.textureID != 0, body.textureID);
+}
+
+/*------------------------------------------------------------------------------------------------------------
+Helper function to create multiple small object/asteroid for asteroid belt which is called in the reder loop
+Every ring of the belt places its asteroids evenly around an ellipse centered on the belt; where on each
+iteration an asteroid gets drawn
+--------------------------------------------------------------------------------------------------------------*/
+
+void drawAsteroidBelt(unsigned int shaderProgram, const BodyStore& bodies, size_t index) {
+	const BodyRenderInfo& belt = bodies.renderInfo[index];
+	float centerX = bodies.positionsX[index];
+	float centerY = bodies.positionsY[index];
+	float moveSpeed = bodies.moveSpeeds[index];
+	size_t asteroidIndex = 0;
+	for (const SceneAsteroidRing& ring : belt.asteroidRings) {
+		for (int asteroid = 0; asteroid < ring.count; asteroid++) {
+			// Asteroids moved by gravity are drawn where the simulation has them
+			if (!belt.asteroidPositions.empty()) {
+				glm::vec2 position = belt.asteroidPositions[asteroidIndex++];
+				drawPlanet(shaderProgram, belt.VAO, 0.0f, 0.0f, 0.0f, ring.scale, belt.segments, position.x, position.y,
+					bodies.rotationSpeeds[index], true, true, true, false, belt.color, belt.textureID != 0, belt.textureID);
+				continue;
+			}
+			// Get the angle of this asteroid - the whole belt turns at the belt's speed
+			float angle = (float)(2.0 * M_PI * asteroid * ring.spacing);
+			// Get the value of x and y coordinates using trigonometric identities
+			float x = centerX + ring.radius.x * cosf(angle + moveSpeed * simulationTime);
+			float y = centerY + ring.radius.y * sinf(angle + moveSpeed * simulationTime);
+			// Draw the asteroid at the calculated xy coordinate. Essentially, asteroids in this case are just many small planets.
+			drawPlanet(shaderProgram, belt.VAO, belt.asteroidSpeed, ring.asteroidOrbit.x, ring.asteroidOrbit.y, ring.scale, belt.segments, x, y,
+				bodies.rotationSpeeds[index], true, true, true, false, belt.color, belt.textureID != 0, belt.textureID);
+		}
 	}
 }
 
@@ -848,6 +1268,13 @@ void setupObjectBuffer(GLuint& VAO, GLuint& VBO, float radius_x_axis, float radi
 	// Store the vertices of a circle in a vector of type float
 	vector<float> vertices = getObjectVertices(radius_x_axis, radius_y_axis, segments);
 
+	// The software renderer keeps its own copy of the vertices, and its shape ID stands in for the VAO
+	if (softwareRenderer) {
+		VAO = softwareRenderer->addShape(vertices, radius_x_axis, radius_y_axis);
+		VBO = 0;
+		return;
+	}
+
 	std::vector<float> data;
 	// Pad the planet coordinates with its texture xy coordinates so that OpenGl knows how to apply its texture
 	for (int i = 0; i < vertices.size() / 2; ++i) {
@@ -890,6 +1317,12 @@ This function is used to send background vertices to the GPU that will be used b
 */
 
 void setupBackgroundBuffers(GLuint& backgroundVAO, GLuint& backgroundVBO, float* backgroundVertices, size_t vertexCount) {
+	// The software renderer draws the background without any vertices
+	if (softwareRenderer) {
+		backgroundVAO = backgroundVBO = 0;
+		return;
+	}
+
 	// Generate the VAO and VBO
 	glGenVertexArrays(1, &backgroundVAO);
 	glGenBuffers(1, &backgroundVBO);
@@ -920,6 +1353,11 @@ Function used to tell the OpenGL how to use the background position and texture
 */
 
 void useBackgroundTexture(unsigned int shaderProgram, GLuint backgroundVAO, unsigned int backgroundTextureID) {
+	if (softwareRenderer) {
+		softwareRenderer->setBackground(backgroundTextureID);
+		return;
+	}
+
 	// Activate the shader program
 	glUseProgram(shaderProgram);
 
@@ -973,37 +1411,74 @@ GLuint createShaderProgram(const char* vertexSource, const char* fragmentSource)
 }
 
 /*
-This function loads a texture from a user provided file path and generates an int texture ID
-Returns the texture ID if successful, or 0 if the texture failed to load
+Reads a texture file into memory, bottom row first as OpenGL takes it. Safe to call from any thread
+Returns false, after saying so, if the file could not be read
 */
+bool decodeTexture(char const* path, DecodedTexture& texture)
+{
+	// Set for this thread only, since several decode at once
+	stbi_set_flip_vertically_on_load_thread(true);
+	texture.data = stbi_load(path, &texture.width, &texture.height, &texture.channels, 0);
+	if (texture.data == nullptr) {
+		std::cerr << "Texture failed to load at path: " << path << std::endl;
+		return false;
+	}
+	return true;
+}
 
-unsigned int loadTexture(char const* path)
+/*
+Takes an evenly spread set of the texture's visible texels as RGBA, for the GIF palette
+*/
+void samplePalette(DecodedTexture& texture)
+{
+	// Step through the texels so that every texture adds about the same number of samples
+	int texelCount = texture.width * texture.height;
+	int stride = max(1, texelCount / PALETTE_SAMPLES_PER_TEXTURE);
+	texture.paletteSamples.clear();
+	for (int texel = 0; texel < texelCount; texel += stride) {
+		unsigned char* pixel = texture.data + texel * texture.channels;
+		// Fully transparent texels are never seen
+		if (texture.channels == 4 && pixel[3] == 0)
+			continue;
+		unsigned char red = pixel[0];
+		unsigned char green = texture.channels >= 3 ? pixel[1] : red;
+		unsigned char blue = texture.channels >= 3 ? pixel[2] : red;
+		texture.paletteSamples.insert(texture.paletteSamples.end(), { red, green, blue, 255 });
+	}
+}
+
+/*
+This function generates an int texture ID for a decoded texture file and frees the file's pixels; call it on the
+thread that owns the OpenGL context. If paletteSamples is given, the texture's samples are appended to it
+Returns the texture ID if successful, or 0 if the texture failed to load
+*/
+unsigned int uploadTexture(DecodedTexture& texture, vector<uint8_t>* paletteSamples)
 {
 	// variable to hold the textureID
 	unsigned int textureID;
-	stbi_set_flip_vertically_on_load(true);
-	// Generate a texture object with its ID as well
-	glGenTextures(1, &textureID);
-
-	// Variables to hold texture dimensions and component count
-	int width, height, nrComponents;
-	// Load the texture data
-	unsigned char* data = stbi_load(path, &width, &height, &nrComponents, 0);
+	// Generate a texture object with its ID as well - the software renderer hands out its own IDs instead
+	if (!softwareRenderer)
+		glGenTextures(1, &textureID);
+	if (texture.data == nullptr)
+		return 0;
 
-	if (data) // Check if the texture data was loaded witout any issues
-	{
+	if (softwareRenderer) {
+		// Rows are already bottom-up; the software renderer builds its own mipmaps and filters like the settings below
+		textureID = softwareRenderer->addTexture(texture.data, texture.width, texture.height, texture.channels);
+	}
+	else {
 		// Determine the format based on the number of components
 		GLenum format = GL_RGB; //rgb is the default
-		if (nrComponents == 1)
+		if (texture.channels == 1)
 			format = GL_RED;
-		else if (nrComponents == 3)
+		else if (texture.channels == 3)
 			format = GL_RGB;
-		else if (nrComponents == 4)
+		else if (texture.channels == 4)
 			format = GL_RGBA;
 
 		glBindTexture(GL_TEXTURE_2D, textureID);
 		// Set the texture image data
-		glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+		glTexImage2D(GL_TEXTURE_2D, 0, format, texture.width, texture.height, 0, format, GL_UNSIGNED_BYTE, texture.data);
 		// create a mipmaps for the texture
 		glGenerateMipmap(GL_TEXTURE_2D);
 
@@ -1012,20 +1487,61 @@ unsigned int loadTexture(char const* path)
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-		// Free the loaded image data
-		stbi_image_free(data);
-	}
-	else // Handle loading failure
-	{
-		std::cout << "Texture failed to load at path: " << path << std::endl;
-		stbi_image_free(data);
-		return 0;
 	}
+
+	if (paletteSamples != nullptr)
+		paletteSamples->insert(paletteSamples->end(), texture.paletteSamples.begin(), texture.paletteSamples.end());
+
+	// Free the loaded image data
+	stbi_image_free(texture.data);
+	texture.data = nullptr;
 	//return the texture ID
 	return textureID;
 }
 
+/*
+Reads every texture file the scene uses, each once, on the task scheduler: every file is decoded by one task,
+and a second task takes its palette samples as soon as it is in memory
+*/
+map<string, DecodedTexture> decodeSceneTextures(const Scene& scene)
+{
+	map<string, DecodedTexture> textures;
+	if (!scene.background.empty())
+		textures[scene.background];
+	for (const SceneBody& sceneBody : scene.bodies) {
+		if (!sceneBody.texture.empty())
+			textures[sceneBody.texture];
+	}
+
+	// The map is complete before the graph runs, so every task has an entry of its own to fill in
+	TaskGraph graph;
+	for (auto& entry : textures) {
+		const string& path = entry.first;
+		DecodedTexture& texture = entry.second;
+		int decode = graph.add([&path, &texture] { decodeTexture(path.c_str(), texture); });
+		int sample = graph.add([&texture] {
+			if (texture.data != nullptr)
+				samplePalette(texture);
+		});
+		graph.precede(decode, sample);
+	}
+	graph.run(TaskScheduler::shared());
+	return textures;
+}
+
+/*
+Adds a solid color to the GIF palette samples, repeated weight times so it is not outvoted by texture samples
+*/
+void addPaletteColor(vector<uint8_t>& paletteSamples, glm::vec4 color, int weight)
+{
+	uint8_t red = (uint8_t)(glm::clamp(color.r, 0.0f, 1.0f) * 255.0f + 0.5f);
+	uint8_t green = (uint8_t)(glm::clamp(color.g, 0.0f, 1.0f) * 255.0f + 0.5f);
+	uint8_t blue = (uint8_t)(glm::clamp(color.b, 0.0f, 1.0f) * 255.0f + 0.5f);
+	for (int i = 0; i < weight; i++) {
+		paletteSamples.insert(paletteSamples.end(), { red, green, blue, 255 });
+	}
+}
+
 /*
 Function to adjust viewport dynamically
 glfw: whenever the window size changed (by OS or user resize) this callback function executes
@@ -0,0 +1,143 @@
+/*
+* Title: Morton Order
+* Description: Implementation of the Morton sort declared in mortonOrder.h. 2D keys interleave 32 bits of
+*              x and y, 3D keys 21 bits of x, y and z, and the keys are sorted by a radix sort that skips
+*              the digits every key shares
+*/
+
+#include "mortonOrder.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+// Bits of the keys used for radix sorting in each pass
+static const int RADIX_BITS = 11;
+
+// Spread the low 32 bits of value to the even bits, for 2D keys
+static uint64_t spreadBits2(uint64_t value)
+{
+	value &= 0xffffffffull;
+	value = (value | (value << 16)) & 0x0000ffff0000ffffull;
+	value = (value | (value << 8)) & 0x00ff00ff00ff00ffull;
+	value = (value | (value << 4)) & 0x0f0f0f0f0f0f0f0full;
+	value = (value | (value << 2)) & 0x3333333333333333ull;
+	value = (value | (value << 1)) & 0x5555555555555555ull;
+	return value;
+}
+
+// Spread the low 21 bits of value to every third bit, for 3D keys
+static uint64_t spreadBits3(uint64_t value)
+{
+	value &= 0x1fffffull;
+	value = (value | (value << 32)) & 0x1f00000000ffffull;
+	value = (value | (value << 16)) & 0x1f0000ff0000ffull;
+	value = (value | (value << 8)) & 0x100f00f00f00f00full;
+	value = (value | (value << 4)) & 0x10c30c30c30c30c3ull;
+	value = (value | (value << 2)) & 0x1249249249249249ull;
+	return value;
+}
+
+MortonOrder::MortonOrder(int dimensions)
+	: keyDimensions(dimensions == 2 ? 2 : 3), keyLevels(dimensions == 2 ? 32 : 21)
+{
+}
+
+void MortonOrder::sort(size_t count, const double* x, const double* y, const double* z, double* corner, double& size)
+{
+	keys.resize(count);
+	particleOrder.resize(count);
+	if (count == 0) {
+		corner[0] = corner[1] = corner[2] = 0.0;
+		size = 1.0;
+		return;
+	}
+
+	double maximum[3] = { x[0], y[0], z[0] };
+	corner[0] = x[0];
+	corner[1] = y[0];
+	corner[2] = z[0];
+	for (size_t i = 1; i < count; i++) {
+		corner[0] = min(corner[0], x[i]);
+		corner[1] = min(corner[1], y[i]);
+		corner[2] = min(corner[2], z[i]);
+		maximum[0] = max(maximum[0], x[i]);
+		maximum[1] = max(maximum[1], y[i]);
+		maximum[2] = max(maximum[2], z[i]);
+	}
+	size = 0.0;
+	for (int axis = 0; axis < keyDimensions; axis++)
+		size = max(size, maximum[axis] - corner[axis]);
+	// A little larger, so the particles on the far side still fall inside the last cell
+	size = size > 0.0 ? size * (1.0 + 1e-9) : 1.0;
+
+	const double cells = ldexp(1.0, keyLevels);
+	const double scale = cells / size;
+	const uint64_t lastCell = (uint64_t)cells - 1;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t cellX = min((uint64_t)((x[i] - corner[0]) * scale), lastCell);
+		uint64_t cellY = min((uint64_t)((y[i] - corner[1]) * scale), lastCell);
+		if (keyDimensions == 2) {
+			keys[i] = spreadBits2(cellX) | (spreadBits2(cellY) << 1);
+		}
+		else {
+			uint64_t cellZ = min((uint64_t)((z[i] - corner[2]) * scale), lastCell);
+			keys[i] = spreadBits3(cellX) | (spreadBits3(cellY) << 1) | (spreadBits3(cellZ) << 2);
+		}
+		particleOrder[i] = (uint32_t)i;
+	}
+	radixSort();
+}
+
+void MortonOrder::gather(const double* values, double* sorted) const
+{
+	for (size_t i = 0; i < particleOrder.size(); i++)
+		sorted[i] = values[particleOrder[i]];
+}
+
+int MortonOrder::split(uint32_t begin, uint32_t end, int level, uint32_t* childBegins, int* childDigits) const
+{
+	// The keys are sorted, so each child's run ends where the digit for the next level changes
+	const int shift = (keyLevels - 1 - level) * keyDimensions;
+	const uint64_t digitMask = ((uint64_t)1 << keyDimensions) - 1;
+	int childCount = 0;
+	for (uint32_t i = begin; i < end;) {
+		int digit = (int)((keys[i] >> shift) & digitMask);
+		uint32_t childEnd = (uint32_t)(partition_point(keys.begin() + i, keys.begin() + end, [&](uint64_t key) {
+			return (int)((key >> shift) & digitMask) <= digit;
+		}) - keys.begin());
+		childBegins[childCount] = i;
+		childDigits[childCount] = digit;
+		childCount++;
+		i = childEnd;
+	}
+	childBegins[childCount] = end;
+	return childCount;
+}
+
+// Least significant digit first, skipping the digits every key shares (the high ones, usually)
+void MortonOrder::radixSort()
+{
+	const size_t count = keys.size();
+	sortKeys.resize(count);
+	sortOrder.resize(count);
+	const int keyBits = keyLevels * keyDimensions;
+	vector<size_t> bucketStarts(((size_t)1 << RADIX_BITS) + 1);
+	for (int shift = 0; shift < keyBits; shift += RADIX_BITS) {
+		const uint64_t mask = ((uint64_t)1 << RADIX_BITS) - 1;
+		fill(bucketStarts.begin(), bucketStarts.end(), 0);
+		for (size_t i = 0; i < count; i++)
+			bucketStarts[((keys[i] >> shift) & mask) + 1]++;
+		if (*max_element(bucketStarts.begin(), bucketStarts.end()) == count)
+			continue;
+		for (size_t bucket = 1; bucket < bucketStarts.size(); bucket++)
+			bucketStarts[bucket] += bucketStarts[bucket - 1];
+		for (size_t i = 0; i < count; i++) {
+			size_t target = bucketStarts[(keys[i] >> shift) & mask]++;
+			sortKeys[target] = keys[i];
+			sortOrder[target] = particleOrder[i];
+		}
+		keys.swap(sortKeys);
+		particleOrder.swap(sortOrder);
+	}
+}
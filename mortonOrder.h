@@ -0,0 +1,47 @@
+/*
+* Title: Morton Order
+* Description: Sorts particles along a Morton (Z-order) curve over their bounding cube, for the gravity trees.
+*              In that order every cell of a quadtree or octree holds a contiguous run of particles, so a
+*              tree can be built over runs of the sorted arrays instead of by moving particles into cells
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class MortonOrder {
+public:
+	// dimensions is 2 to split space only along x and y, or 3
+	explicit MortonOrder(int dimensions = 3);
+
+	int dimensions() const { return keyDimensions; }
+	// Levels below the root cell that the keys can tell apart
+	int levels() const { return keyLevels; }
+
+	// Key every particle by its cell in a grid of 2^levels() cells a side over the bounding cube (or square) and
+	// sort the keys, keeping the cube in corner and size. A flat sort keeps corner[2] at the lowest z
+	void sort(size_t count, const double* x, const double* y, const double* z, double* corner, double& size);
+
+	// Copy values into sorted, in Morton order
+	void gather(const double* values, double* sorted) const;
+
+	// Split the run from begin to end, which shares its keys above level, into the runs of its children: childBegins
+	// gets each child's first particle and then end, childDigits which child it is (bit 0 is x, bit 1 y and bit 2 z).
+	// Returns the number of children
+	int split(uint32_t begin, uint32_t end, int level, uint32_t* childBegins, int* childDigits) const;
+
+	// Original index of each particle in Morton order
+	const std::vector<uint32_t>& order() const { return particleOrder; }
+
+private:
+	void radixSort();
+
+	int keyDimensions;
+	int keyLevels;
+	std::vector<uint64_t> keys;
+	std::vector<uint32_t> particleOrder;
+	std::vector<uint64_t> sortKeys;
+	std::vector<uint32_t> sortOrder;
+};
@@ -0,0 +1,557 @@
+/*
+* Title: N-Body Simulation
+* Description: Leapfrog integration and direct-summation gravity for the simulation in nbody.h
+*/
+
+#include "nbody.h"
+#include "gravityKernel.h"
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+// Weights of the leapfrog steps in Yoshida's compositions: each is symmetric and adds up to 1
+static const double YOSHIDA4_WEIGHTS[] = {
+	1.3512071919596578, -1.7024143839193153, 1.3512071919596578
+};
+static const double YOSHIDA6_WEIGHTS[] = {
+	0.78451361047755726, 0.23557321335935813, -1.1776799841788701, 1.3151863206839112,
+	-1.1776799841788701, 0.23557321335935813, 0.78451361047755726
+};
+// Iterations allowed for Kepler's equation; Laguerre's method usually needs 3 or 4
+static const int KEPLER_ITERATIONS = 50;
+// Deepest block level allowed whatever maxTimeStepLevel says, so that the ticks of the finest step fit in 64 bits
+static const int BLOCK_LEVEL_LIMIT = 40;
+
+// Stumpff functions c2(z) = (1 - cos sqrt(z)) / z and c3(z) = (sqrt(z) - sin sqrt(z)) / sqrt(z)^3, for any sign of z
+static void stumpff(double z, double& c2, double& c3)
+{
+	if (fabs(z) < 1e-3) {
+		// Their series, as the closed forms lose every digit to cancellation near 0
+		c2 = 1.0 / 2.0 - z * (1.0 / 24.0 - z * (1.0 / 720.0 - z / 40320.0));
+		c3 = 1.0 / 6.0 - z * (1.0 / 120.0 - z * (1.0 / 5040.0 - z / 362880.0));
+	}
+	else if (z > 0.0) {
+		double root = sqrt(z);
+		c2 = (1.0 - cos(root)) / z;
+		c3 = (root - sin(root)) / (z * root);
+	}
+	else {
+		double root = sqrt(-z);
+		c2 = (cosh(root) - 1.0) / -z;
+		c3 = (sinh(root) - root) / (-z * root);
+	}
+}
+
+// Move a particle along its Kepler orbit around a mass mu / G at the origin for dt: ellipses, parabolas and hyperbolas
+// alike, by solving Kepler's equation in the universal anomaly x and applying Lagrange's f and g
+static void keplerDrift(double mu, double dt, double& x, double& y, double& z, double& vx, double& vy, double& vz)
+{
+	const double radius0 = sqrt(x * x + y * y + z * z);
+	if (radius0 == 0.0)
+		return;
+	const double rootMu = sqrt(mu);
+	const double speed2 = vx * vx + vy * vy + vz * vz;
+	const double sigma0 = (x * vx + y * vy + z * vz) / rootMu;
+	// 1 / semi-major axis: positive for ellipses
+	const double alpha = 2.0 / radius0 - speed2 / mu;
+	// Whole turns of an ellipse change nothing
+	if (alpha > 0.0) {
+		double period = 2.0 * 3.141592653589793 / (rootMu * alpha * sqrt(alpha));
+		dt = fmod(dt, period);
+	}
+
+	// Laguerre's method on f(x) = sigma0 x^2 c2 + (1 - alpha r0) x^3 c3 + r0 x - sqrt(mu) dt, whose derivative is the radius
+	double anomaly = alpha > 0.0 ? rootMu * dt * alpha : rootMu * dt / radius0;
+	double c2 = 0.5, c3 = 1.0 / 6.0, radius = radius0;
+	for (int iteration = 0; iteration < KEPLER_ITERATIONS; iteration++) {
+		const double anomaly2 = anomaly * anomaly;
+		const double zeta = alpha * anomaly2;
+		stumpff(zeta, c2, c3);
+		const double value = sigma0 * anomaly2 * c2 + (1.0 - alpha * radius0) * anomaly2 * anomaly * c3 + radius0 * anomaly - rootMu * dt;
+		radius = sigma0 * anomaly * (1.0 - zeta * c3) + (1.0 - alpha * radius0) * anomaly2 * c2 + radius0;
+		const double slope = sigma0 * (1.0 - zeta * c2) + (1.0 - alpha * radius0) * anomaly * (1.0 - zeta * c3);
+		const double n = 5.0;
+		const double root = sqrt(fabs((n - 1.0) * (n - 1.0) * radius * radius - n * (n - 1.0) * value * slope));
+		const double change = n * value / (radius + copysign(root, radius));
+		anomaly -= change;
+		if (fabs(change) <= 1e-15 * fabs(anomaly))
+			break;
+	}
+	const double anomaly2 = anomaly * anomaly;
+	stumpff(alpha * anomaly2, c2, c3);
+	radius = sigma0 * anomaly * (1.0 - alpha * anomaly2 * c3) + (1.0 - alpha * radius0) * anomaly2 * c2 + radius0;
+
+	const double f = 1.0 - anomaly2 * c2 / radius0;
+	const double g = dt - anomaly2 * anomaly * c3 / rootMu;
+	const double fDot = -rootMu * anomaly * (1.0 - alpha * anomaly2 * c3) / (radius * radius0);
+	const double gDot = 1.0 - anomaly2 * c2 / radius;
+	const double newX = f * x + g * vx, newY = f * y + g * vy, newZ = f * z + g * vz;
+	vx = fDot * x + gDot * vx;
+	vy = fDot * y + gDot * vy;
+	vz = fDot * z + gDot * vz;
+	x = newX;
+	y = newY;
+	z = newZ;
+}
+
+NBodySimulation::NBodySimulation(double gravitationalConstant, double softening)
+	: gravitationalConstant(gravitationalConstant), softening(softening)
+{
+}
+
+size_t NBodySimulation::add(double mass, double x, double y, double z, double velocityX, double velocityY, double velocityZ)
+{
+	masses.push_back(mass);
+	positionsX.push_back(x);
+	positionsY.push_back(y);
+	positionsZ.push_back(z);
+	velocitiesX.push_back(velocityX);
+	velocitiesY.push_back(velocityY);
+	velocitiesZ.push_back(velocityZ);
+	isAccelerationStale = true;
+	return masses.size() - 1;
+}
+
+bool integratorFromName(const std::string& name, Integrator& integrator)
+{
+	static const std::pair<const char*, Integrator> NAMES[] = {
+		{ "leapfrog", INTEGRATOR_LEAPFROG },
+		{ "yoshida4", INTEGRATOR_YOSHIDA4 },
+		{ "yoshida6", INTEGRATOR_YOSHIDA6 },
+		{ "wisdom-holman", INTEGRATOR_WISDOM_HOLMAN },
+		{ "block-leapfrog", INTEGRATOR_BLOCK_LEAPFROG }
+	};
+	for (const auto& entry : NAMES) {
+		if (name == entry.first) {
+			integrator = entry.second;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool timeStepCriterionFromName(const std::string& name, TimeStepCriterion& criterion)
+{
+	if (name == "orbit")
+		criterion = TIME_STEP_ORBIT;
+	else if (name == "acceleration")
+		criterion = TIME_STEP_ACCELERATION;
+	else
+		return false;
+	return true;
+}
+
+void NBodySimulation::step(double dt)
+{
+	switch (integrator) {
+	case INTEGRATOR_YOSHIDA4:
+		for (double weight : YOSHIDA4_WEIGHTS)
+			leapfrog(weight * dt);
+		break;
+	case INTEGRATOR_YOSHIDA6:
+		for (double weight : YOSHIDA6_WEIGHTS)
+			leapfrog(weight * dt);
+		break;
+	case INTEGRATOR_WISDOM_HOLMAN: {
+		// Without a central mass there are no Kepler orbits to follow
+		size_t central = findCentralBody();
+		if (size() > 0 && masses[central] > 0.0)
+			wisdomHolman(dt, central);
+		else
+			leapfrog(dt);
+		break;
+	}
+	case INTEGRATOR_BLOCK_LEAPFROG:
+		blockLeapfrog(dt);
+		break;
+	default:
+		leapfrog(dt);
+		break;
+	}
+	currentTime += dt;
+}
+
+size_t NBodySimulation::findCentralBody() const
+{
+	if (centralBody >= 0 && (size_t)centralBody < size())
+		return centralBody;
+	size_t central = 0;
+	for (size_t i = 1; i < size(); i++) {
+		if (masses[i] > masses[central])
+			central = i;
+	}
+	return central;
+}
+
+void NBodySimulation::leapfrog(double dt)
+{
+	const size_t count = size();
+	if (isAccelerationStale || accelerationExcludedBody != -1)
+		computeAccelerations(masses.data(), -1);
+
+	const double halfStep = 0.5 * dt;
+	for (size_t i = 0; i < count; i++) {
+		velocitiesX[i] += halfStep * accelerationsX[i];
+		velocitiesY[i] += halfStep * accelerationsY[i];
+		velocitiesZ[i] += halfStep * accelerationsZ[i];
+		positionsX[i] += dt * velocitiesX[i];
+		positionsY[i] += dt * velocitiesY[i];
+		positionsZ[i] += dt * velocitiesZ[i];
+	}
+	computeAccelerations(masses.data(), -1);
+	for (size_t i = 0; i < count; i++) {
+		velocitiesX[i] += halfStep * accelerationsX[i];
+		velocitiesY[i] += halfStep * accelerationsY[i];
+		velocitiesZ[i] += halfStep * accelerationsZ[i];
+	}
+}
+
+void NBodySimulation::wisdomHolman(double dt, size_t central)
+{
+	const size_t count = size();
+	const double centralMass = masses[central];
+	const double mu = gravitationalConstant * centralMass;
+	const double halfStep = 0.5 * dt;
+
+	// The kicks are the pull of everything but the central body, whose own orbit is in the Kepler drifts
+	if (interactionMasses.size() != count || accelerationExcludedBody != (int)central || isAccelerationStale) {
+		interactionMasses.assign(masses.begin(), masses.end());
+		interactionMasses[central] = 0.0;
+	}
+	if (isAccelerationStale || accelerationExcludedBody != (int)central)
+		computeAccelerations(interactionMasses.data(), (int)central);
+
+	// Into democratic heliocentric coordinates. The center of mass moves in a straight line, and the central body
+	// is worked out from it and the others at the end
+	double totalMass = 0.0, centerX = 0.0, centerY = 0.0, centerZ = 0.0, centerVelocityX = 0.0, centerVelocityY = 0.0, centerVelocityZ = 0.0;
+	for (size_t i = 0; i < count; i++) {
+		totalMass += masses[i];
+		centerX += masses[i] * positionsX[i];
+		centerY += masses[i] * positionsY[i];
+		centerZ += masses[i] * positionsZ[i];
+		centerVelocityX += masses[i] * velocitiesX[i];
+		centerVelocityY += masses[i] * velocitiesY[i];
+		centerVelocityZ += masses[i] * velocitiesZ[i];
+	}
+	centerX /= totalMass;
+	centerY /= totalMass;
+	centerZ /= totalMass;
+	centerVelocityX /= totalMass;
+	centerVelocityY /= totalMass;
+	centerVelocityZ /= totalMass;
+	const double centralX = positionsX[central], centralY = positionsY[central], centralZ = positionsZ[central];
+	for (size_t i = 0; i < count; i++) {
+		positionsX[i] -= centralX;
+		positionsY[i] -= centralY;
+		positionsZ[i] -= centralZ;
+		velocitiesX[i] -= centerVelocityX;
+		velocitiesY[i] -= centerVelocityY;
+		velocitiesZ[i] -= centerVelocityZ;
+	}
+
+	// The central body moves by the others' total momentum over its mass
+	auto jump = [&](double duration) {
+		double momentumX = 0.0, momentumY = 0.0, momentumZ = 0.0;
+		for (size_t i = 0; i < count; i++) {
+			if (i == central)
+				continue;
+			momentumX += masses[i] * velocitiesX[i];
+			momentumY += masses[i] * velocitiesY[i];
+			momentumZ += masses[i] * velocitiesZ[i];
+		}
+		const double scale = duration / centralMass;
+		for (size_t i = 0; i < count; i++) {
+			if (i == central)
+				continue;
+			positionsX[i] += scale * momentumX;
+			positionsY[i] += scale * momentumY;
+			positionsZ[i] += scale * momentumZ;
+		}
+	};
+	auto kick = [&]() {
+		for (size_t i = 0; i < count; i++) {
+			if (i == central)
+				continue;
+			velocitiesX[i] += halfStep * accelerationsX[i];
+			velocitiesY[i] += halfStep * accelerationsY[i];
+			velocitiesZ[i] += halfStep * accelerationsZ[i];
+		}
+	};
+
+	kick();
+	jump(halfStep);
+	for (size_t i = 0; i < count; i++) {
+		if (i != central)
+			keplerDrift(mu, dt, positionsX[i], positionsY[i], positionsZ[i], velocitiesX[i], velocitiesY[i], velocitiesZ[i]);
+	}
+	jump(halfStep);
+	// The pull between the others depends only on where they are from each other, so it can be worked out here
+	computeAccelerations(interactionMasses.data(), (int)central);
+	kick();
+
+	// And back, with the center of mass where its velocity takes it
+	centerX += dt * centerVelocityX;
+	centerY += dt * centerVelocityY;
+	centerZ += dt * centerVelocityZ;
+	double offsetX = 0.0, offsetY = 0.0, offsetZ = 0.0, momentumX = 0.0, momentumY = 0.0, momentumZ = 0.0;
+	for (size_t i = 0; i < count; i++) {
+		if (i == central)
+			continue;
+		offsetX += masses[i] * positionsX[i];
+		offsetY += masses[i] * positionsY[i];
+		offsetZ += masses[i] * positionsZ[i];
+		momentumX += masses[i] * velocitiesX[i];
+		momentumY += masses[i] * velocitiesY[i];
+		momentumZ += masses[i] * velocitiesZ[i];
+	}
+	const double newCentralX = centerX - offsetX / totalMass;
+	const double newCentralY = centerY - offsetY / totalMass;
+	const double newCentralZ = centerZ - offsetZ / totalMass;
+	for (size_t i = 0; i < count; i++) {
+		if (i == central)
+			continue;
+		positionsX[i] += newCentralX;
+		positionsY[i] += newCentralY;
+		positionsZ[i] += newCentralZ;
+		velocitiesX[i] += centerVelocityX;
+		velocitiesY[i] += centerVelocityY;
+		velocitiesZ[i] += centerVelocityZ;
+	}
+	positionsX[central] = newCentralX;
+	positionsY[central] = newCentralY;
+	positionsZ[central] = newCentralZ;
+	velocitiesX[central] = centerVelocityX - momentumX / centralMass;
+	velocitiesY[central] = centerVelocityY - momentumY / centralMass;
+	velocitiesZ[central] = centerVelocityZ - momentumZ / centralMass;
+}
+
+void NBodySimulation::blockLeapfrog(double dt)
+{
+	const size_t count = size();
+	if (count == 0)
+		return;
+	if (isAccelerationStale || accelerationExcludedBody != -1)
+		computeAccelerations(masses.data(), -1);
+	massiveParticles.clear();
+	for (size_t i = 0; i < count; i++) {
+		if (masses[i] != 0.0)
+			massiveParticles.push_back((uint32_t)i);
+	}
+
+	// Time within the step is counted in ticks of the shortest step allowed, so the steps line up exactly: a step at
+	// level l is 2^(deepest - l) ticks, and ends wherever the tick count is a multiple of that
+	const int deepest = std::min(std::max(maxTimeStepLevel, 0), BLOCK_LEVEL_LIMIT);
+	const uint64_t stepTicks = (uint64_t)1 << deepest;
+	auto levelTicks = [&](int level) { return stepTicks >> level; };
+	auto halfKick = [&](size_t i) {
+		const double halfStep = std::ldexp(0.5 * dt, -levels[i]);
+		velocitiesX[i] += halfStep * accelerationsX[i];
+		velocitiesY[i] += halfStep * accelerationsY[i];
+		velocitiesZ[i] += halfStep * accelerationsZ[i];
+	};
+
+	levels.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		levels[i] = chooseLevel(i, dt);
+		halfKick(i);
+	}
+	uint64_t tick = 0;
+	while (tick < stepTicks) {
+		// The shortest step anyone is on sets how far everything drifts
+		const int finest = *std::max_element(levels.begin(), levels.end());
+		const double substep = std::ldexp(dt, -finest);
+		for (size_t i = 0; i < count; i++) {
+			positionsX[i] += substep * velocitiesX[i];
+			positionsY[i] += substep * velocitiesY[i];
+			positionsZ[i] += substep * velocitiesZ[i];
+		}
+		tick += levelTicks(finest);
+
+		// The second half kick for the particles whose steps end here, then the first half of their next
+		activeParticles.clear();
+		for (size_t i = 0; i < count; i++) {
+			if (tick % levelTicks(levels[i]) == 0)
+				activeParticles.push_back((uint32_t)i);
+		}
+		computeActiveAccelerations();
+		for (uint32_t i : activeParticles)
+			halfKick(i);
+		if (tick == stepTicks)
+			break;
+		for (uint32_t i : activeParticles) {
+			// A shorter step can start at the end of any step, a longer one only where the longer steps end
+			int level = chooseLevel(i, dt);
+			if (level < levels[i]) {
+				int longest = levels[i];
+				while (longest > level && tick % levelTicks(longest - 1) == 0)
+					longest--;
+				level = longest;
+			}
+			levels[i] = level;
+			halfKick(i);
+		}
+	}
+	// Every particle ended a step on the last tick, so every acceleration is up to date
+	isAccelerationStale = false;
+	accelerationExcludedBody = -1;
+}
+
+int NBodySimulation::chooseLevel(size_t i, double dt) const
+{
+	const int deepest = std::min(std::max(maxTimeStepLevel, 0), BLOCK_LEVEL_LIMIT);
+	double timeStep = INFINITY;
+	if (timeStepCriterion == TIME_STEP_ORBIT) {
+		// Kepler's third law for the pair, P^2 = 4 pi^2 r^3 / G(m_i + m_j), taking the shortest period
+		double shortest2 = INFINITY;
+		for (uint32_t j : massiveParticles) {
+			if (j == i)
+				continue;
+			double dx = positionsX[j] - positionsX[i];
+			double dy = positionsY[j] - positionsY[i];
+			double dz = positionsZ[j] - positionsZ[i];
+			double distance2 = dx * dx + dy * dy + dz * dz + softening * softening;
+			double period2 = distance2 * sqrt(distance2) / (gravitationalConstant * (masses[i] + masses[j]));
+			shortest2 = std::min(shortest2, period2);
+		}
+		timeStep = timeStepAccuracy * 2.0 * 3.141592653589793 * sqrt(shortest2);
+	}
+	else {
+		double acceleration = sqrt(accelerationsX[i] * accelerationsX[i] + accelerationsY[i] * accelerationsY[i] + accelerationsZ[i] * accelerationsZ[i]);
+		if (acceleration > 0.0)
+			timeStep = timeStepAccuracy * sqrt(timeStepLength / acceleration);
+	}
+	// The smallest power-of-two fraction of dt no longer than timeStep
+	if (!(timeStep < dt))
+		return 0;
+	if (!(timeStep > std::ldexp(dt, -deepest)))
+		return deepest;
+	return std::min((int)ceil(log2(dt / timeStep)), deepest);
+}
+
+void NBodySimulation::computeActiveAccelerations()
+{
+	const size_t count = size();
+	if (solver == GRAVITY_FMM) {
+		// The expansions are handed down the whole tree at once, so there is nothing to save by asking for a few particles
+		computeAccelerations(masses.data(), -1);
+		return;
+	}
+	if (solver == GRAVITY_BARNES_HUT) {
+		if (!barnesHut || barnesHut->dimensions() != treeDimensions)
+			barnesHut = std::make_unique<BarnesHutSolver>(treeDimensions);
+		barnesHut->setOpeningAngle(openingAngle);
+		barnesHut->computeAccelerations(count, masses.data(), positionsX.data(), positionsY.data(), positionsZ.data(),
+			activeParticles.data(), activeParticles.size(), gravitationalConstant, softening,
+			accelerationsX.data(), accelerationsY.data(), accelerationsZ.data());
+		return;
+	}
+
+	const double softening2 = softening * softening;
+	gatherSources(masses.data());
+	for (uint32_t i : activeParticles) {
+		double ax = 0.0, ay = 0.0, az = 0.0;
+		accumulateGravity(positionsX[i], positionsY[i], positionsZ[i], packedMasses.size(), packedMasses.data(), packedX.data(), packedY.data(), packedZ.data(),
+			softening2, ax, ay, az);
+		accelerationsX[i] = gravitationalConstant * ax;
+		accelerationsY[i] = gravitationalConstant * ay;
+		accelerationsZ[i] = gravitationalConstant * az;
+	}
+}
+
+void NBodySimulation::gatherSources(const double* pullingMasses)
+{
+	packedMasses.clear();
+	packedX.clear();
+	packedY.clear();
+	packedZ.clear();
+	for (size_t i = 0; i < size(); i++) {
+		if (pullingMasses[i] == 0.0)
+			continue;
+		packedMasses.push_back(pullingMasses[i]);
+		packedX.push_back(positionsX[i]);
+		packedY.push_back(positionsY[i]);
+		packedZ.push_back(positionsZ[i]);
+	}
+}
+
+void NBodySimulation::computeAccelerations(const double* sourceMasses, int excludedBody)
+{
+	const size_t count = size();
+	const double softening2 = softening * softening;
+	accelerationsX.assign(count, 0.0);
+	accelerationsY.assign(count, 0.0);
+	accelerationsZ.assign(count, 0.0);
+
+	if (solver == GRAVITY_BARNES_HUT) {
+		// The solver keeps its tree storage, so it lives as long as it is used
+		if (!barnesHut || barnesHut->dimensions() != treeDimensions)
+			barnesHut = std::make_unique<BarnesHutSolver>(treeDimensions);
+		barnesHut->setOpeningAngle(openingAngle);
+		barnesHut->computeAccelerations(count, sourceMasses, positionsX.data(), positionsY.data(), positionsZ.data(), gravitationalConstant, softening,
+			accelerationsX.data(), accelerationsY.data(), accelerationsZ.data());
+		isAccelerationStale = false;
+		accelerationExcludedBody = excludedBody;
+		return;
+	}
+	if (solver == GRAVITY_FMM) {
+		if (!fastMultipole || fastMultipole->dimensions() != treeDimensions)
+			fastMultipole = std::make_unique<FmmSolver>(treeDimensions);
+		fastMultipole->setOrder(multipoleOrder);
+		fastMultipole->setOpeningAngle(multipoleOpeningAngle);
+		fastMultipole->computeAccelerations(count, sourceMasses, positionsX.data(), positionsY.data(), positionsZ.data(), gravitationalConstant, softening,
+			accelerationsX.data(), accelerationsY.data(), accelerationsZ.data());
+		isAccelerationStale = false;
+		accelerationExcludedBody = excludedBody;
+		return;
+	}
+
+	// Every particle against every particle with mass, with the sources in arrays of their own for the vector kernel
+	// (gravityKernel.h). Massless particles cost nothing as sources, and the particle itself adds nothing
+	gatherSources(sourceMasses);
+	for (size_t i = 0; i < count; i++) {
+		double ax = 0.0, ay = 0.0, az = 0.0;
+		accumulateGravity(positionsX[i], positionsY[i], positionsZ[i], packedMasses.size(), packedMasses.data(), packedX.data(), packedY.data(),
+			packedZ.data(), softening2, ax, ay, az);
+		accelerationsX[i] = gravitationalConstant * ax;
+		accelerationsY[i] = gravitationalConstant * ay;
+		accelerationsZ[i] = gravitationalConstant * az;
+	}
+	isAccelerationStale = false;
+	accelerationExcludedBody = excludedBody;
+}
+
+void NBodySimulation::removeNetMomentum()
+{
+	double totalMass = 0.0, momentumX = 0.0, momentumY = 0.0, momentumZ = 0.0;
+	for (size_t i = 0; i < size(); i++) {
+		totalMass += masses[i];
+		momentumX += masses[i] * velocitiesX[i];
+		momentumY += masses[i] * velocitiesY[i];
+		momentumZ += masses[i] * velocitiesZ[i];
+	}
+	if (totalMass <= 0.0)
+		return;
+	for (size_t i = 0; i < size(); i++) {
+		velocitiesX[i] -= momentumX / totalMass;
+		velocitiesY[i] -= momentumY / totalMass;
+		velocitiesZ[i] -= momentumZ / totalMass;
+	}
+}
+
+double NBodySimulation::energy() const
+{
+	const double softening2 = softening * softening;
+	double kinetic = 0.0, potential = 0.0;
+	for (size_t i = 0; i < size(); i++) {
+		kinetic += 0.5 * masses[i] * (velocitiesX[i] * velocitiesX[i] + velocitiesY[i] * velocitiesY[i] + velocitiesZ[i] * velocitiesZ[i]);
+		for (size_t j = i + 1; j < size(); j++) {
+			double dx = positionsX[j] - positionsX[i];
+			double dy = positionsY[j] - positionsY[i];
+			double dz = positionsZ[j] - positionsZ[i];
+			double distance2 = dx * dx + dy * dy + dz * dz + softening2;
+			if (distance2 > 0.0)
+				potential -= gravitationalConstant * masses[i] * masses[j] / sqrt(distance2);
+		}
+	}
+	return kinetic + potential;
+}
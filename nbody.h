@@ -0,0 +1,148 @@
+/*
+* Title: N-Body Simulation
+* Description: Newtonian gravity between point masses, kept apart from rendering: no GL or GLFW, just
+*              the masses, positions and velocities in double precision, one array per coordinate, and
+*              step(dt) to move them forward. Whoever draws the bodies only reads the positions back, so
+*              the same simulation runs in a window or in batch as fast as it can. Forces come from
+*              direct summation over every pair of particles, or from a Barnes-Hut tree (barnesHut.h) or
+*              the fast multipole method (fmm.h) when there are too many particles for that. The
+*              fixed-step integrators are symplectic, so energy errors stay bounded instead of piling up;
+*              the block leapfrog gives each particle a step to suit its orbit, so a few fast bodies do not
+*              hold everything else to their pace
+*/
+
+#pragma once
+
+#include "alignedVector.h"
+#include "barnesHut.h"
+#include "fmm.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// How the forces are worked out
+enum GravitySolver {
+	GRAVITY_DIRECT,			// Exactly, from every pair of particles: O(N^2), best up to a few thousand particles
+	GRAVITY_BARNES_HUT,		// Approximated by a tree, within openingAngle: O(N log N)
+	GRAVITY_FMM				// Approximated by expansions between cells of a tree, set by multipoleOrder and
+							// multipoleOpeningAngle: O(N), ahead of Barnes-Hut from a few hundred thousand particles
+};
+
+// How step(dt) moves the particles
+enum Integrator {
+	INTEGRATOR_LEAPFROG,		// Kick-drift-kick leapfrog (velocity Verlet): second order, one force pass per step
+	INTEGRATOR_YOSHIDA4,		// Three leapfrog steps with Yoshida's weights: fourth order, three force passes
+	INTEGRATOR_YOSHIDA6,		// Seven leapfrog steps: sixth order, seven force passes
+	INTEGRATOR_WISDOM_HOLMAN,	// Exact Kepler orbits around the central body, kicked by everything else: second order in
+								// the other bodies' pull alone, so planetary systems take steps 10 to 100 times larger
+	INTEGRATOR_BLOCK_LEAPFROG	// Leapfrog with a step of its own for every particle, dt halved as often as the particle
+								// needs (timeStepCriterion), and forces worked out only for the particles ending a step.
+								// Every particle is back in step at the end of step(dt)
+};
+
+// The integrator called "leapfrog", "yoshida4", "yoshida6", "wisdom-holman" or "block-leapfrog"; false for any other name
+bool integratorFromName(const std::string& name, Integrator& integrator);
+
+// How the block leapfrog picks the step of each particle
+enum TimeStepCriterion {
+	TIME_STEP_ORBIT,			// timeStepAccuracy times the shortest period it would orbit any one massive particle with
+								// at its distance: a planet's year, a moon's month, or a close pass. O(N) per particle, for
+								// systems with few massive bodies
+	TIME_STEP_ACCELERATION		// timeStepAccuracy * sqrt(timeStepLength / |acceleration|), for star clusters and the like
+};
+
+// The criterion called "orbit" or "acceleration"; false for any other name
+bool timeStepCriterionFromName(const std::string& name, TimeStepCriterion& criterion);
+
+class NBodySimulation {
+public:
+	// Forces are scaled by gravitationalConstant, and softening (a length) keeps them finite when two
+	// particles get very close: the distance r is taken as sqrt(r^2 + softening^2)
+	explicit NBodySimulation(double gravitationalConstant = 1.0, double softening = 0.0);
+
+	// Add a particle and return its index
+	size_t add(double mass, double x, double y, double z, double velocityX, double velocityY, double velocityZ);
+	size_t size() const { return masses.size(); }
+
+	// Move time forward by dt with the integrator
+	void step(double dt);
+	double time() const { return currentTime; }
+
+	// Make the total momentum zero, so the system as a whole stays where it is
+	void removeNetMomentum();
+	// Kinetic plus potential energy, to see how well a time step conserves it
+	double energy() const;
+
+	// Has to be called after changing masses or positions by hand between steps
+	void markChanged() { isAccelerationStale = true; }
+
+	double gravitationalConstant;
+	double softening;
+	// Changes take effect from the next force pass
+	GravitySolver solver = GRAVITY_DIRECT;
+	double openingAngle = 0.5;
+	int multipoleOrder = 4;
+	double multipoleOpeningAngle = 0.8;
+	int treeDimensions = 3;			// 2 builds a quadtree over x and y, for flat systems
+	Integrator integrator = INTEGRATOR_LEAPFROG;
+	// The body the Wisdom-Holman map moves the others around; -1 takes the most massive
+	int centralBody = -1;
+	// Block leapfrog steps are dt / 2^level, with level from 0 to maxTimeStepLevel
+	TimeStepCriterion timeStepCriterion = TIME_STEP_ORBIT;
+	double timeStepAccuracy = 0.01;
+	double timeStepLength = 1e-3;
+	int maxTimeStepLevel = 16;
+
+	// The state, one entry per particle
+	AlignedVector<double> masses;
+	AlignedVector<double> positionsX;
+	AlignedVector<double> positionsY;
+	AlignedVector<double> positionsZ;
+	AlignedVector<double> velocitiesX;
+	AlignedVector<double> velocitiesY;
+	AlignedVector<double> velocitiesZ;
+
+private:
+	// Half a velocity step from the current accelerations, a full position step, then the other half from the new
+	// accelerations
+	void leapfrog(double dt);
+	// Kick, jump, Kepler drift, jump, kick in democratic heliocentric coordinates: positions relative to the central body
+	// and velocities relative to the center of mass
+	void wisdomHolman(double dt, size_t central);
+	// Kick-drift-kick with a power-of-two fraction of dt for every particle. Every substep drifts all of them, and kicks
+	// the ones whose steps end there
+	void blockLeapfrog(double dt);
+	// The block level particle i needs for its next step
+	int chooseLevel(size_t i, double dt) const;
+	// The particle given by centralBody, or the most massive
+	size_t findCentralBody() const;
+	// Accelerations for the current positions from the pull of sourceMasses, kept from the end of one step for the
+	// start of the next. excludedBody is the particle sourceMasses leaves out, or -1
+	void computeAccelerations(const double* sourceMasses, int excludedBody);
+	// Accelerations from the pull of every particle, of the active particles only
+	void computeActiveAccelerations();
+	// Copy the particles with a mass in pullingMasses into the packed arrays, for the gravity kernel
+	void gatherSources(const double* pullingMasses);
+
+	AlignedVector<double> accelerationsX;
+	AlignedVector<double> accelerationsY;
+	AlignedVector<double> accelerationsZ;
+	std::unique_ptr<BarnesHutSolver> barnesHut;
+	std::unique_ptr<FmmSolver> fastMultipole;
+	// The particles that pull, next to each other
+	AlignedVector<double> packedMasses;
+	AlignedVector<double> packedX;
+	AlignedVector<double> packedY;
+	AlignedVector<double> packedZ;
+	// The masses without the central body, for the Wisdom-Holman kicks
+	AlignedVector<double> interactionMasses;
+	// Block leapfrog levels, the particles ending a step and the particles with mass, which are all that pull
+	std::vector<int> levels;
+	std::vector<uint32_t> activeParticles;
+	std::vector<uint32_t> massiveParticles;
+	bool isAccelerationStale = true;
+	int accelerationExcludedBody = -1;
+	double currentTime = 0.0;
+};
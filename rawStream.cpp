@@ -0,0 +1,462 @@
+/*
+* Title: Raw Frame Streaming
+* Description: Implementation of the raw frame writer declared in rawStream.h
+*
+* Frames go through a small set of buffers: the caller copies a frame into a free buffer, and the
+* writer thread converts every queued frame and hands them all to the OS in one gathered write
+*/
+
+#include "rawStream.h"
+#include "frameScale.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RAW_STREAM_SSE2
+#endif
+
+using namespace std;
+
+/*----------------------------------------------------------------------
+Color conversion - BT.601 limited range, 8.8 fixed point
+------------------------------------------------------------------------*/
+
+static inline uint8_t lumaOf(int r, int g, int b)
+{
+	return (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+// Chroma from the sums of the four pixels of a 2x2 block
+static inline uint8_t chromaUOf(int r, int g, int b)
+{
+	return (uint8_t)(((-38 * r - 74 * g + 112 * b + 512) >> 10) + 128);
+}
+
+static inline uint8_t chromaVOf(int r, int g, int b)
+{
+	return (uint8_t)(((112 * r - 94 * g - 18 * b + 512) >> 10) + 128);
+}
+
+#ifdef RAW_STREAM_SSE2
+// Each RGBA pixel is one 32 bit lane; masking and shifting splits it into 16 bit (R, B) and (G, A)
+// pairs, which _mm_madd_epi16 weighs and adds in one step
+static inline __m128i lumaOf4(__m128i redBlue, __m128i greenAlpha)
+{
+	const __m128i redBlueWeights = _mm_set1_epi32((25 << 16) | 66);
+	const __m128i greenWeights = _mm_set1_epi32(129);
+	__m128i luma = _mm_add_epi32(_mm_madd_epi16(redBlue, redBlueWeights), _mm_madd_epi16(greenAlpha, greenWeights));
+	return _mm_add_epi32(_mm_srli_epi32(_mm_add_epi32(luma, _mm_set1_epi32(128)), 8), _mm_set1_epi32(16));
+}
+
+// Weighs the column sums of two rows, adds neighbouring columns, and leaves the two results in the low half
+static inline __m128i chromaOf4Columns(__m128i redBlueSum, __m128i greenAlphaSum, int redWeight, int greenWeight, int blueWeight)
+{
+	const __m128i redBlueWeights = _mm_set1_epi32((blueWeight << 16) | (redWeight & 0xffff));
+	const __m128i greenWeights = _mm_set1_epi32(greenWeight & 0xffff);
+	__m128i columns = _mm_add_epi32(_mm_madd_epi16(redBlueSum, redBlueWeights), _mm_madd_epi16(greenAlphaSum, greenWeights));
+	__m128i pairs = _mm_add_epi32(columns, _mm_srli_epi64(columns, 32));
+	return _mm_shuffle_epi32(pairs, _MM_SHUFFLE(2, 0, 2, 0));
+}
+
+static inline void storeChroma4(__m128i low, __m128i high, uint8_t* out)
+{
+	__m128i chroma = _mm_unpacklo_epi64(low, high);
+	chroma = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(chroma, _mm_set1_epi32(512)), 10), _mm_set1_epi32(128));
+	chroma = _mm_packs_epi32(chroma, chroma);
+	int packed = _mm_cvtsi128_si32(_mm_packus_epi16(chroma, chroma));
+	memcpy(out, &packed, 4);
+}
+
+// Converts 8 pixels of two rows: 16 luma samples and 4 of each chroma; bottomLuma may be null
+static void convert8Pixels(const uint8_t* top, const uint8_t* bottom, uint8_t* topLuma, uint8_t* bottomLuma, uint8_t* u, uint8_t* v)
+{
+	const __m128i lowBytes = _mm_set1_epi32(0x00ff00ff);
+	__m128i redBlue[4], greenAlpha[4];
+	const uint8_t* rows[2] = { top, bottom };
+	for (int i = 0; i < 4; i++) {
+		__m128i pixels = _mm_loadu_si128((const __m128i*)(rows[i / 2] + (i % 2) * 16));
+		redBlue[i] = _mm_and_si128(pixels, lowBytes);
+		greenAlpha[i] = _mm_srli_epi16(pixels, 8);
+	}
+
+	__m128i luma = _mm_packs_epi32(lumaOf4(redBlue[0], greenAlpha[0]), lumaOf4(redBlue[1], greenAlpha[1]));
+	_mm_storel_epi64((__m128i*)topLuma, _mm_packus_epi16(luma, luma));
+	if (bottomLuma) {
+		luma = _mm_packs_epi32(lumaOf4(redBlue[2], greenAlpha[2]), lumaOf4(redBlue[3], greenAlpha[3]));
+		_mm_storel_epi64((__m128i*)bottomLuma, _mm_packus_epi16(luma, luma));
+	}
+
+	__m128i redBlueSum[2] = { _mm_add_epi16(redBlue[0], redBlue[2]), _mm_add_epi16(redBlue[1], redBlue[3]) };
+	__m128i greenAlphaSum[2] = { _mm_add_epi16(greenAlpha[0], greenAlpha[2]), _mm_add_epi16(greenAlpha[1], greenAlpha[3]) };
+	storeChroma4(chromaOf4Columns(redBlueSum[0], greenAlphaSum[0], -38, -74, 112),
+				 chromaOf4Columns(redBlueSum[1], greenAlphaSum[1], -38, -74, 112), u);
+	storeChroma4(chromaOf4Columns(redBlueSum[0], greenAlphaSum[0], 112, -94, -18),
+				 chromaOf4Columns(redBlueSum[1], greenAlphaSum[1], 112, -94, -18), v);
+}
+#endif
+
+void convertRgbaToYuv420(const uint8_t* rgba, int width, int height, uint8_t* y, uint8_t* u, uint8_t* v)
+{
+	const int chromaWidth = (width + 1) / 2;
+	for (int row = 0; row < height; row += 2) {
+		// An odd last row is paired with itself
+		const bool hasBottom = row + 1 < height;
+		const uint8_t* top = rgba + (size_t)row * width * 4;
+		const uint8_t* bottom = hasBottom ? top + (size_t)width * 4 : top;
+		uint8_t* topLuma = y + (size_t)row * width;
+		uint8_t* bottomLuma = hasBottom ? topLuma + width : nullptr;
+		uint8_t* uRow = u + (size_t)(row / 2) * chromaWidth;
+		uint8_t* vRow = v + (size_t)(row / 2) * chromaWidth;
+
+		int x = 0;
+#ifdef RAW_STREAM_SSE2
+		for (; x + 8 <= width; x += 8)
+			convert8Pixels(top + x * 4, bottom + x * 4, topLuma + x, bottomLuma ? bottomLuma + x : nullptr, uRow + x / 2, vRow + x / 2);
+#endif
+		for (; x < width; x += 2) {
+			// An odd last column is paired with itself too
+			const int next = min(x + 1, width - 1);
+			const uint8_t* block[4] = { top + x * 4, top + next * 4, bottom + x * 4, bottom + next * 4 };
+			topLuma[x] = lumaOf(block[0][0], block[0][1], block[0][2]);
+			if (next != x)
+				topLuma[next] = lumaOf(block[1][0], block[1][1], block[1][2]);
+			if (bottomLuma) {
+				bottomLuma[x] = lumaOf(block[2][0], block[2][1], block[2][2]);
+				if (next != x)
+					bottomLuma[next] = lumaOf(block[3][0], block[3][1], block[3][2]);
+			}
+			int red = 0, green = 0, blue = 0;
+			for (const uint8_t* pixel : block) {
+				red += pixel[0];
+				green += pixel[1];
+				blue += pixel[2];
+			}
+			uRow[x / 2] = chromaUOf(red, green, blue);
+			vRow[x / 2] = chromaVOf(red, green, blue);
+		}
+	}
+}
+
+void convertRgbaToRgb(const uint8_t* rgba, size_t pixelCount, uint8_t* rgb)
+{
+	for (size_t i = 0; i < pixelCount; i++) {
+		rgb[i * 3] = rgba[i * 4];
+		rgb[i * 3 + 1] = rgba[i * 4 + 1];
+		rgb[i * 3 + 2] = rgba[i * 4 + 2];
+	}
+}
+
+/*----------------------------------------------------------------------
+Output - one handle, written with gathered writes
+------------------------------------------------------------------------*/
+
+// Frame buffers shared between the caller and the writer thread
+const int RAW_STREAM_FRAME_BUFFERS = 4;
+
+struct OutputSpan {
+	const uint8_t* data;
+	size_t size;
+};
+
+#if defined(_WIN32)
+typedef HANDLE OutputHandle;
+static const OutputHandle NO_OUTPUT = INVALID_HANDLE_VALUE;
+
+static OutputHandle openOutput(const string& target, bool& ownsHandle)
+{
+	ownsHandle = target != "-";
+	if (!ownsHandle)
+		return GetStdHandle(STD_OUTPUT_HANDLE);
+	// Pipes have to exist already; files are replaced
+	bool isPipe = target.rfind("\\\\.\\pipe\\", 0) == 0;
+	return CreateFileA(target.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, isPipe ? OPEN_EXISTING : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+}
+
+static void closeOutput(OutputHandle output)
+{
+	CloseHandle(output);
+}
+
+// Windows has no gathered write for ordinary handles, so each span is its own WriteFile call;
+// spans are whole frames, which keeps the calls large
+static bool writeSpans(OutputHandle output, const OutputSpan* spans, int count)
+{
+	for (int i = 0; i < count; i++) {
+		const uint8_t* data = spans[i].data;
+		size_t remaining = spans[i].size;
+		while (remaining > 0) {
+			DWORD written = 0;
+			DWORD chunk = (DWORD)min(remaining, (size_t)1 << 30);
+			if (!WriteFile(output, data, chunk, &written, NULL) || written == 0)
+				return false;
+			data += written;
+			remaining -= written;
+		}
+	}
+	return true;
+}
+#else
+typedef int OutputHandle;
+static const OutputHandle NO_OUTPUT = -1;
+
+static OutputHandle openOutput(const string& target, bool& ownsHandle)
+{
+	// A reader that goes away should end the stream, not the program
+	signal(SIGPIPE, SIG_IGN);
+	ownsHandle = target != "-";
+	if (!ownsHandle)
+		return STDOUT_FILENO;
+	// Opening a named pipe waits until something opens it for reading
+	return ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+static void closeOutput(OutputHandle output)
+{
+	::close(output);
+}
+
+static bool writeSpans(OutputHandle output, const OutputSpan* spans, int count)
+{
+	vector<iovec> buffers(count);
+	for (int i = 0; i < count; i++) {
+		buffers[i].iov_base = (void*)spans[i].data;
+		buffers[i].iov_len = spans[i].size;
+	}
+	iovec* next = buffers.data();
+	while (count > 0) {
+		ssize_t written = writev(output, next, min(count, IOV_MAX));
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		// Skip whatever was written, which may end partway through a buffer
+		while (count > 0 && (size_t)written >= next->iov_len) {
+			written -= next->iov_len;
+			next++;
+			count--;
+		}
+		if (count > 0) {
+			next->iov_base = (uint8_t*)next->iov_base + written;
+			next->iov_len -= written;
+		}
+	}
+	return true;
+}
+#endif
+
+/*----------------------------------------------------------------------
+Writer
+------------------------------------------------------------------------*/
+
+struct StreamFrame {
+	vector<uint8_t> rgba;		// as submitted
+	vector<uint8_t> scaled;		// shrunk to the output size, if the stream downscales
+	vector<uint8_t> encoded;	// frame header and pixels, ready to write
+};
+
+struct RawStreamWriter::State {
+	OutputHandle output = NO_OUTPUT;
+	bool ownsOutput = false;
+	RawStreamFormat format = RAW_STREAM_Y4M;
+	int sourceWidth = 0;
+	int sourceHeight = 0;
+	int scaleDivisor = 1;
+	int width = 0;
+	int height = 0;
+
+	thread writer;
+	mutex lock;
+	condition_variable frameQueued;
+	condition_variable frameFree;
+	deque<unique_ptr<StreamFrame>> queuedFrames;
+	vector<unique_ptr<StreamFrame>> freeFrames;
+	bool stopping = false;
+	atomic<bool> failed{ false };
+
+	void encodeFrame(StreamFrame& frame) const;
+	void writerLoop();
+};
+
+void RawStreamWriter::State::encodeFrame(StreamFrame& frame) const
+{
+	const State& s = *this;
+	const uint8_t* pixels = frame.rgba.data();
+	if (s.scaleDivisor > 1) {
+		frame.scaled.resize((size_t)s.width * s.height * 4);
+		downscaleFrame(pixels, s.sourceWidth, s.sourceHeight, s.scaleDivisor, frame.scaled.data());
+		pixels = frame.scaled.data();
+	}
+
+	if (s.format == RAW_STREAM_Y4M) {
+		static const char header[] = "FRAME\n";
+		const size_t lumaSize = (size_t)s.width * s.height;
+		const size_t chromaSize = (size_t)((s.width + 1) / 2) * ((s.height + 1) / 2);
+		frame.encoded.resize(sizeof(header) - 1 + lumaSize + 2 * chromaSize);
+		memcpy(frame.encoded.data(), header, sizeof(header) - 1);
+		uint8_t* luma = frame.encoded.data() + sizeof(header) - 1;
+		convertRgbaToYuv420(pixels, s.width, s.height, luma, luma + lumaSize, luma + lumaSize + chromaSize);
+	}
+	else {
+		char header[64];
+		int headerSize = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", s.width, s.height);
+		frame.encoded.resize(headerSize + (size_t)s.width * s.height * 3);
+		memcpy(frame.encoded.data(), header, headerSize);
+		convertRgbaToRgb(pixels, (size_t)s.width * s.height, frame.encoded.data() + headerSize);
+	}
+}
+
+// Converts and writes whatever is queued, in batches, until the writer is closed
+void RawStreamWriter::State::writerLoop()
+{
+	State& s = *this;
+	unique_lock<mutex> guard(s.lock);
+	while (true) {
+		s.frameQueued.wait(guard, [&s] { return s.stopping || !s.queuedFrames.empty(); });
+		if (s.queuedFrames.empty())
+			return;
+
+		vector<unique_ptr<StreamFrame>> batch;
+		while (!s.queuedFrames.empty()) {
+			batch.push_back(move(s.queuedFrames.front()));
+			s.queuedFrames.pop_front();
+		}
+		guard.unlock();
+
+		// After a failed write the frames are still taken, so the caller never blocks, but dropped
+		if (!s.failed) {
+			vector<OutputSpan> spans;
+			for (auto& frame : batch) {
+				s.encodeFrame(*frame);
+				spans.push_back({ frame->encoded.data(), frame->encoded.size() });
+			}
+			if (!writeSpans(s.output, spans.data(), (int)spans.size()))
+				s.failed = true;
+		}
+
+		guard.lock();
+		for (auto& frame : batch)
+			s.freeFrames.push_back(move(frame));
+		s.frameFree.notify_all();
+	}
+}
+
+RawStreamWriter::RawStreamWriter() : state(make_unique<State>()) {}
+
+RawStreamWriter::~RawStreamWriter()
+{
+	close();
+}
+
+bool RawStreamWriter::open(const string& target, int width, int height, RawStreamFormat format,
+						   int frameRateNumerator, int frameRateDenominator, int scaleDivisor)
+{
+	close();
+
+	State& s = *state;
+	s.output = openOutput(target, s.ownsOutput);
+	if (s.output == NO_OUTPUT)
+		return false;
+
+	s.format = format;
+	s.sourceWidth = width;
+	s.sourceHeight = height;
+	s.scaleDivisor = min(max(scaleDivisor, 1), MAX_FRAME_SCALE_DIVISOR);
+	s.width = scaledFrameSize(width, s.scaleDivisor);
+	s.height = scaledFrameSize(height, s.scaleDivisor);
+	s.failed = false;
+	s.stopping = false;
+
+	// PPM frames each carry their own header; Y4M has one for the whole stream
+	if (format == RAW_STREAM_Y4M) {
+		char header[128];
+		int headerSize = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420jpeg XYSCSS=420JPEG\n",
+			s.width, s.height, frameRateNumerator, max(frameRateDenominator, 1));
+		OutputSpan span = { (const uint8_t*)header, (size_t)headerSize };
+		if (!writeSpans(s.output, &span, 1)) {
+			if (s.ownsOutput)
+				closeOutput(s.output);
+			s.output = NO_OUTPUT;
+			return false;
+		}
+	}
+
+	for (int i = 0; i < RAW_STREAM_FRAME_BUFFERS; i++) {
+		auto frame = make_unique<StreamFrame>();
+		frame->rgba.resize((size_t)width * height * 4);
+		s.freeFrames.push_back(move(frame));
+	}
+	s.writer = thread(&State::writerLoop, &s);
+	return true;
+}
+
+void RawStreamWriter::submitFrame(const uint8_t* rgba)
+{
+	State& s = *state;
+	if (s.output == NO_OUTPUT)
+		return;
+
+	unique_ptr<StreamFrame> frame;
+	{
+		unique_lock<mutex> guard(s.lock);
+		s.frameFree.wait(guard, [&s] { return !s.freeFrames.empty(); });
+		frame = move(s.freeFrames.back());
+		s.freeFrames.pop_back();
+	}
+	memcpy(frame->rgba.data(), rgba, frame->rgba.size());
+	{
+		lock_guard<mutex> guard(s.lock);
+		s.queuedFrames.push_back(move(frame));
+	}
+	s.frameQueued.notify_one();
+}
+
+void RawStreamWriter::close()
+{
+	State& s = *state;
+	if (s.output == NO_OUTPUT)
+		return;
+
+	{
+		lock_guard<mutex> guard(s.lock);
+		s.stopping = true;
+	}
+	s.frameQueued.notify_one();
+	s.writer.join();
+
+	if (s.ownsOutput)
+		closeOutput(s.output);
+	s.output = NO_OUTPUT;
+	s.freeFrames.clear();
+}
+
+bool RawStreamWriter::isOpen() const
+{
+	return state->output != NO_OUTPUT;
+}
+
+bool RawStreamWriter::hasFailed() const
+{
+	return state->failed;
+}
@@ -0,0 +1,49 @@
+/*
+* Title: Raw Frame Streaming
+* Description: Writes captured frames uncompressed, as a Y4M video or a series of PPM images,
+*              to a file, a named pipe or standard output ("-"), so an external encoder can take
+*              them without any quantization. Color conversion and writing run on a thread of
+*              their own; the caller only pays for copying the frame
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+enum RawStreamFormat {
+	RAW_STREAM_Y4M,	// YUV 4:2:0, BT.601 limited range - what video encoders expect
+	RAW_STREAM_PPM	// 8 bit RGB images back to back, for tools that read image sequences
+};
+
+class RawStreamWriter {
+public:
+	RawStreamWriter();
+	// Writes the frames still queued and closes the output
+	~RawStreamWriter();
+
+	RawStreamWriter(const RawStreamWriter&) = delete;
+	RawStreamWriter& operator=(const RawStreamWriter&) = delete;
+
+	// Open target ("-" for standard output) for frames of the given size, shrunk by scaleDivisor
+	// frameRate is frames per second, as a fraction, and only recorded in the Y4M header
+	bool open(const std::string& target, int width, int height, RawStreamFormat format,
+			  int frameRateNumerator, int frameRateDenominator, int scaleDivisor = 1);
+	// Queue a top-down RGBA frame; blocks while every frame buffer is waiting to be written
+	void submitFrame(const uint8_t* rgba);
+	void close();
+
+	bool isOpen() const;
+	// True once a write failed, for example because the program reading the pipe quit
+	bool hasFailed() const;
+
+private:
+	struct State;
+	std::unique_ptr<State> state;
+};
+
+// Color conversions used by the writer, exposed for other raw sinks
+// Y is width x height, U and V are (width + 1) / 2 x (height + 1) / 2, each chroma sample the average of a 2x2 block
+void convertRgbaToYuv420(const uint8_t* rgba, int width, int height, uint8_t* y, uint8_t* u, uint8_t* v);
+void convertRgbaToRgb(const uint8_t* rgba, size_t pixelCount, uint8_t* rgb);
@@ -0,0 +1,546 @@
+/*
+* Title: Scene Files
+* Description: Implementation of the scene loader declared in scene.h
+*
+* The file is parsed into a tree of JSON values first (a small parser of its own, since the scene is
+* the only JSON the program reads), then every body is checked and copied out of the tree. Keys that
+* are not part of the format are reported, so a misspelt key does not quietly fall back to its default
+*/
+
+#include "scene.h"
+#include "nbody.h"
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+using namespace std;
+
+namespace {
+
+struct JsonValue {
+	enum Type { JSON_NULL, JSON_BOOLEAN, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT };
+	Type type = JSON_NULL;
+	bool boolean = false;
+	double number = 0.0;
+	string text;
+	vector<JsonValue> items;
+	vector<pair<string, JsonValue>> members;
+	// Line the value starts on, for error messages
+	int line = 1;
+
+	const JsonValue* find(const char* key) const
+	{
+		for (const auto& member : members) {
+			if (member.first == key)
+				return &member.second;
+		}
+		return nullptr;
+	}
+};
+
+// Objects and arrays deeper than this are rejected rather than risking the stack
+const int MAX_JSON_DEPTH = 64;
+
+class JsonParser {
+public:
+	// text has to outlive the parser
+	JsonParser(const string& text) : position(text.c_str()), end(text.c_str() + text.size()) {}
+
+	bool parse(JsonValue& value)
+	{
+		if (!parseValue(value, 0))
+			return false;
+		skipSpace();
+		if (position != end)
+			return fail("unexpected text after the end of the scene");
+		return true;
+	}
+
+	const string& error() const { return errorMessage; }
+
+private:
+	const char* position;
+	const char* end;
+	int line = 1;
+	string errorMessage;
+
+	bool fail(const string& message)
+	{
+		errorMessage = "line " + to_string(line) + ": " + message;
+		return false;
+	}
+
+	void skipSpace()
+	{
+		while (position < end && (*position == ' ' || *position == '\t' || *position == '\r' || *position == '\n')) {
+			if (*position == '\n')
+				line++;
+			position++;
+		}
+	}
+
+	bool consume(const char* word)
+	{
+		size_t length = strlen(word);
+		if ((size_t)(end - position) < length || memcmp(position, word, length) != 0)
+			return false;
+		position += length;
+		return true;
+	}
+
+	bool parseValue(JsonValue& value, int depth)
+	{
+		skipSpace();
+		value.line = line;
+		if (position == end)
+			return fail("unexpected end of file");
+		if (depth > MAX_JSON_DEPTH)
+			return fail("values are nested too deeply");
+
+		char c = *position;
+		if (c == '{')
+			return parseObject(value, depth);
+		if (c == '[')
+			return parseArray(value, depth);
+		if (c == '"') {
+			value.type = JsonValue::JSON_STRING;
+			return parseString(value.text);
+		}
+		if (consume("true") || consume("false")) {
+			value.type = JsonValue::JSON_BOOLEAN;
+			value.boolean = c == 't';
+			return true;
+		}
+		if (consume("null")) {
+			value.type = JsonValue::JSON_NULL;
+			return true;
+		}
+		if (c == '-' || (c >= '0' && c <= '9')) {
+			// strtod reads a little more than JSON allows (hex, "inf"), which does no harm here
+			string digits;
+			while (position < end && strchr("+-0123456789.eE", *position) != nullptr)
+				digits += *position++;
+			char* digitsEnd = nullptr;
+			value.type = JsonValue::JSON_NUMBER;
+			value.number = strtod(digits.c_str(), &digitsEnd);
+			if (digitsEnd != digits.c_str() + digits.size())
+				return fail("\"" + digits + "\" is not a number");
+			return true;
+		}
+		return fail(string("unexpected character '") + c + "'");
+	}
+
+	bool parseString(string& text)
+	{
+		position++;
+		while (position < end && *position != '"') {
+			char c = *position++;
+			if (c == '\n')
+				return fail("strings cannot span lines");
+			if (c != '\\') {
+				text += c;
+				continue;
+			}
+			if (position == end)
+				break;
+			char escaped = *position++;
+			switch (escaped) {
+			case 'n': text += '\n'; break;
+			case 't': text += '\t'; break;
+			case 'r': text += '\r'; break;
+			case 'b': text += '\b'; break;
+			case 'f': text += '\f'; break;
+			case 'u': {
+				// Names are expected to be ASCII or UTF-8 already, so \u escapes are turned back into UTF-8
+				if (end - position < 4)
+					return fail("incomplete \\u escape");
+				unsigned int code = (unsigned int)strtoul(string(position, 4).c_str(), nullptr, 16);
+				position += 4;
+				if (code < 0x80)
+					text += (char)code;
+				else if (code < 0x800) {
+					text += (char)(0xc0 | (code >> 6));
+					text += (char)(0x80 | (code & 0x3f));
+				}
+				else {
+					text += (char)(0xe0 | (code >> 12));
+					text += (char)(0x80 | ((code >> 6) & 0x3f));
+					text += (char)(0x80 | (code & 0x3f));
+				}
+				break;
+			}
+			default: text += escaped; break;
+			}
+		}
+		if (position == end)
+			return fail("unterminated string");
+		position++;
+		return true;
+	}
+
+	bool parseArray(JsonValue& value, int depth)
+	{
+		value.type = JsonValue::JSON_ARRAY;
+		position++;
+		skipSpace();
+		if (position < end && *position == ']') {
+			position++;
+			return true;
+		}
+		while (true) {
+			value.items.emplace_back();
+			if (!parseValue(value.items.back(), depth + 1))
+				return false;
+			skipSpace();
+			if (position < end && *position == ',') {
+				position++;
+				continue;
+			}
+			if (position < end && *position == ']') {
+				position++;
+				return true;
+			}
+			return fail("expected ',' or ']' in an array");
+		}
+	}
+
+	bool parseObject(JsonValue& value, int depth)
+	{
+		value.type = JsonValue::JSON_OBJECT;
+		position++;
+		skipSpace();
+		if (position < end && *position == '}') {
+			position++;
+			return true;
+		}
+		while (true) {
+			skipSpace();
+			if (position == end || *position != '"')
+				return fail("expected a quoted key in an object");
+			string key;
+			if (!parseString(key))
+				return false;
+			skipSpace();
+			if (position == end || *position != ':')
+				return fail("expected ':' after \"" + key + "\"");
+			position++;
+			value.members.emplace_back(key, JsonValue());
+			if (!parseValue(value.members.back().second, depth + 1))
+				return false;
+			skipSpace();
+			if (position < end && *position == ',') {
+				position++;
+				continue;
+			}
+			if (position < end && *position == '}') {
+				position++;
+				return true;
+			}
+			return fail("expected ',' or '}' in an object");
+		}
+	}
+};
+
+// Reads the members of one JSON object into the fields of a scene struct, remembering the first problem
+class ObjectReader {
+public:
+	ObjectReader(const JsonValue& object, const string& context, string& error)
+		: object(object), context(context), error(error)
+	{
+		if (object.type != JsonValue::JSON_OBJECT)
+			fail(object, "must be an object");
+	}
+
+	void readNumber(const char* key, float& out)
+	{
+		const JsonValue* value = take(key);
+		if (value == nullptr)
+			return;
+		if (value->type != JsonValue::JSON_NUMBER)
+			fail(*value, string("\"") + key + "\" must be a number");
+		else
+			out = (float)value->number;
+	}
+
+	// For values that need more than a float's 7 digits, such as time steps, which get added up millions of times
+	void readNumber(const char* key, double& out)
+	{
+		const JsonValue* value = take(key);
+		if (value == nullptr)
+			return;
+		if (value->type != JsonValue::JSON_NUMBER)
+			fail(*value, string("\"") + key + "\" must be a number");
+		else
+			out = value->number;
+	}
+
+	void readInteger(const char* key, int& out, int minimum)
+	{
+		const JsonValue* value = take(key);
+		if (value == nullptr)
+			return;
+		if (value->type != JsonValue::JSON_NUMBER || value->number < minimum || value->number > 1e9 || value->number != floor(value->number))
+			fail(*value, string("\"") + key + "\" must be a whole number of at least " + to_string(minimum));
+		else
+			out = (int)value->number;
+	}
+
+	void readBoolean(const char* key, bool& out)
+	{
+		const JsonValue* value = take(key);
+		if (value == nullptr)
+			return;
+		if (value->type != JsonValue::JSON_BOOLEAN)
+			fail(*value, string("\"") + key + "\" must be true or false");
+		else
+			out = value->boolean;
+	}
+
+	void readString(const char* key, string& out)
+	{
+		const JsonValue* value = take(key);
+		if (value == nullptr)
+			return;
+		if (value->type != JsonValue::JSON_STRING)
+			fail(*value, string("\"") + key + "\" must be a string");
+		else
+			out = value->text;
+	}
+
+	void readVector(const char* key, glm::vec2& out)
+	{
+		float components[2];
+		if (readNumbers(key, components, 2, 2))
+			out = glm::vec2(components[0], components[1]);
+	}
+
+	// Colors are [red, green, blue] or [red, green, blue, alpha], from 0 to 1
+	bool readColor(const char* key, glm::vec4& out)
+	{
+		float components[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+		if (!readNumbers(key, components, 3, 4))
+			return false;
+		out = glm::vec4(components[0], components[1], components[2], components[3]);
+		return true;
+	}
+
+	const JsonValue* take(const char* key)
+	{
+		const JsonValue* value = object.find(key);
+		if (value != nullptr)
+			usedKeys.push_back(key);
+		return value;
+	}
+
+	// Report the first key nothing asked for; call after reading every field
+	void checkUnusedKeys()
+	{
+		for (const auto& member : object.members) {
+			bool isUsed = false;
+			for (const string& key : usedKeys)
+				isUsed |= key == member.first;
+			if (!isUsed) {
+				fail(member.second, "unknown key \"" + member.first + "\"");
+				return;
+			}
+		}
+	}
+
+	void fail(const JsonValue& value, const string& message)
+	{
+		if (error.empty())
+			error = "line " + to_string(value.line) + ": " + context + message;
+	}
+
+	bool hasFailed() const { return !error.empty(); }
+
+private:
+	const JsonValue& object;
+	string context;
+	string& error;
+	vector<string> usedKeys;
+
+	bool readNumbers(const char* key, float* out, size_t minimumCount, size_t maximumCount)
+	{
+		const JsonValue* value = take(key);
+		if (value == nullptr)
+			return false;
+		bool isValid = value->type == JsonValue::JSON_ARRAY && value->items.size() >= minimumCount && value->items.size() <= maximumCount;
+		for (size_t i = 0; isValid && i < value->items.size(); i++)
+			isValid = value->items[i].type == JsonValue::JSON_NUMBER;
+		if (!isValid) {
+			string count = minimumCount == maximumCount ? to_string(minimumCount) : to_string(minimumCount) + " or " + to_string(maximumCount);
+			fail(*value, string("\"") + key + "\" must be an array of " + count + " numbers");
+			return false;
+		}
+		for (size_t i = 0; i < value->items.size(); i++)
+			out[i] = (float)value->items[i].number;
+		return true;
+	}
+};
+
+bool readAsteroidRing(const JsonValue& value, const string& context, SceneAsteroidRing& ring, string& error)
+{
+	ring = { glm::vec2(0.0f), 1, 0.01f, 1.0f, glm::vec2(0.0f) };
+	ObjectReader reader(value, context, error);
+	if (reader.hasFailed())
+		return false;
+	reader.readVector("radius", ring.radius);
+	reader.readInteger("count", ring.count, 1);
+	reader.readNumber("spacing", ring.spacing);
+	reader.readNumber("scale", ring.scale);
+	reader.readVector("asteroidOrbit", ring.asteroidOrbit);
+	reader.checkUnusedKeys();
+	return !reader.hasFailed();
+}
+
+bool readPhysics(const JsonValue& value, ScenePhysics& physics, string& error)
+{
+	ObjectReader reader(value, "physics: ", error);
+	if (reader.hasFailed())
+		return false;
+	Integrator integrator;
+	reader.readString("integrator", physics.integrator);
+	if (!physics.integrator.empty() && physics.integrator != "kepler" && !integratorFromName(physics.integrator, integrator))
+		reader.fail(value, "there is no integrator called \"" + physics.integrator + "\"");
+	reader.readNumber("timeStep", physics.timeStep);
+	if (physics.timeStep < 0.0)
+		reader.fail(value, "\"timeStep\" cannot be negative");
+	TimeStepCriterion criterion;
+	reader.readString("timeStepCriterion", physics.timeStepCriterion);
+	if (!physics.timeStepCriterion.empty() && !timeStepCriterionFromName(physics.timeStepCriterion, criterion))
+		reader.fail(value, "there is no time step criterion called \"" + physics.timeStepCriterion + "\"");
+	reader.readNumber("timeStepAccuracy", physics.timeStepAccuracy);
+	if (physics.timeStepAccuracy < 0.0)
+		reader.fail(value, "\"timeStepAccuracy\" cannot be negative");
+	reader.readNumber("timeStepLength", physics.timeStepLength);
+	if (physics.timeStepLength < 0.0)
+		reader.fail(value, "\"timeStepLength\" cannot be negative");
+	reader.readInteger("maxTimeStepLevel", physics.maxTimeStepLevel, 1);
+	reader.checkUnusedKeys();
+	return !reader.hasFailed();
+}
+
+// The parent is only named here; loadScene finds it once every body has been read
+bool readBody(const JsonValue& value, const unordered_map<string, int>& bodyIndices, SceneBody& body, string& parent, string& error)
+{
+	const JsonValue* name = value.find("name");
+	if (name == nullptr || name->type != JsonValue::JSON_STRING || name->text.empty()) {
+		error = "line " + to_string(value.line) + ": every body needs a \"name\"";
+		return false;
+	}
+	string context = "body \"" + name->text + "\": ";
+	ObjectReader reader(value, context, error);
+	if (reader.hasFailed())
+		return false;
+
+	reader.readString("name", body.name);
+	if (bodyIndices.count(body.name) != 0)
+		reader.fail(*name, "the name is already taken");
+	reader.readString("parent", parent);
+	reader.readVector("shape", body.shape);
+	reader.readInteger("segments", body.segments, 3);
+	reader.readNumber("scale", body.scale);
+	reader.readVector("orbit", body.orbit);
+	reader.readNumber("speed", body.moveSpeed);
+	reader.readNumber("rotationSpeed", body.rotationSpeed);
+	reader.readNumber("mass", body.mass);
+	if (body.mass < 0.0f)
+		reader.fail(value, "\"mass\" cannot be negative");
+	reader.readColor("color", body.color);
+	reader.readString("texture", body.texture);
+	body.isOrbitDrawn = reader.readColor("orbitColor", body.orbitColor);
+	reader.readBoolean("ring", body.isRing);
+	reader.readBoolean("visible", body.isVisible);
+	if (body.isRing && parent.empty())
+		reader.fail(value, "a ring needs a parent");
+
+	const JsonValue* rings = reader.take("asteroidRings");
+	if (rings != nullptr && rings->type != JsonValue::JSON_ARRAY)
+		reader.fail(*rings, "\"asteroidRings\" must be an array");
+	else if (rings != nullptr) {
+		for (const JsonValue& ringValue : rings->items) {
+			SceneAsteroidRing ring;
+			if (!readAsteroidRing(ringValue, context + "asteroid ring: ", ring, error))
+				return false;
+			body.asteroidRings.push_back(ring);
+		}
+	}
+	reader.readNumber("asteroidSpeed", body.asteroidSpeed);
+	reader.checkUnusedKeys();
+	return !reader.hasFailed();
+}
+
+}
+
+bool loadScene(const string& filename, Scene& scene, string& error)
+{
+	scene = Scene();
+	error.clear();
+	ifstream file(filename, ios::binary);
+	if (!file) {
+		error = "cannot open " + filename;
+		return false;
+	}
+	stringstream contents;
+	contents << file.rdbuf();
+	const string text = contents.str();
+
+	JsonValue root;
+	JsonParser parser(text);
+	if (!parser.parse(root)) {
+		error = filename + ": " + parser.error();
+		return false;
+	}
+
+	ObjectReader reader(root, "", error);
+	reader.readString("background", scene.background);
+	const JsonValue* physics = reader.take("physics");
+	if (physics != nullptr)
+		readPhysics(*physics, scene.physics, error);
+	const JsonValue* bodies = reader.take("bodies");
+	if (bodies == nullptr || bodies->type != JsonValue::JSON_ARRAY)
+		reader.fail(root, "the scene needs a \"bodies\" array");
+	reader.checkUnusedKeys();
+
+	unordered_map<string, int> bodyIndices;
+	vector<string> parents;
+	if (!reader.hasFailed()) {
+		scene.bodies.reserve(bodies->items.size());
+		for (const JsonValue& value : bodies->items) {
+			SceneBody body;
+			string parent;
+			if (!readBody(value, bodyIndices, body, parent, error))
+				break;
+			bodyIndices[body.name] = (int)scene.bodies.size();
+			scene.bodies.push_back(move(body));
+			parents.push_back(parent);
+		}
+	}
+
+	// Parents can be listed anywhere, as long as following them never leads back to the same body
+	for (size_t i = 0; i < scene.bodies.size() && error.empty(); i++) {
+		if (parents[i].empty())
+			continue;
+		auto found = bodyIndices.find(parents[i]);
+		if (found == bodyIndices.end())
+			error = "line " + to_string(bodies->items[i].line) + ": body \"" + scene.bodies[i].name + "\": there is no body called \"" + parents[i] + "\" to orbit";
+		else
+			scene.bodies[i].parent = found->second;
+	}
+	for (size_t i = 0; i < scene.bodies.size() && error.empty(); i++) {
+		int ancestor = scene.bodies[i].parent;
+		for (size_t depth = 0; ancestor >= 0 && depth < scene.bodies.size(); depth++)
+			ancestor = scene.bodies[ancestor].parent;
+		if (ancestor >= 0)
+			error = "line " + to_string(bodies->items[i].line) + ": body \"" + scene.bodies[i].name + "\": it ends up orbiting itself";
+	}
+	if (!error.empty()) {
+		error = filename + ": " + error;
+		return false;
+	}
+	return true;
+}
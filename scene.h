@@ -0,0 +1,81 @@
+/*
+* Title: Scene Files
+* Description: Reads the bodies of a scene from a JSON file, so scenes can be changed (or grown to
+*              thousands of bodies and moons) without touching the code. The format is described in
+*              the README; scenes/solarSystem.json is the default scene
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+// One ring of asteroids: count asteroids spaced spacing turns apart around an ellipse
+struct SceneAsteroidRing {
+	glm::vec2 radius;
+	int count;
+	float spacing;
+	float scale;
+	// Each asteroid also circles its place on the ring along this small ellipse
+	glm::vec2 asteroidOrbit;
+};
+
+struct SceneBody {
+	std::string name;
+	// Index of the body this one orbits, before or after it in the list; -1 orbits the center of the scene
+	int parent = -1;
+	// Radii of the body's outline before scaling, and how many segments it is drawn with
+	glm::vec2 shape = glm::vec2(0.05f, 0.05f);
+	int segments = 100;
+	float scale = 1.0f;
+	// Radii of the orbit around the parent, and how fast the body goes around it (radians per second)
+	glm::vec2 orbit = glm::vec2(0.0f);
+	float moveSpeed = 0.0f;
+	// Degrees per second
+	float rotationSpeed = 0.0f;
+	// Bodies with a mass take part in the gravity simulation (--physics), in units where G is 1
+	float mass = 0.0f;
+	glm::vec4 color = glm::vec4(1.0f);
+	// Path of the texture; the color is used when there is none
+	std::string texture;
+	// Whether the orbit is drawn, and in which color
+	bool isOrbitDrawn = false;
+	glm::vec4 orbitColor = glm::vec4(1.0f);
+	// Rings are drawn as an outline around the parent, and their scale is added to the parent's
+	bool isRing = false;
+	bool isVisible = true;
+	// An asteroid belt instead of a single body: the asteroids take the body's shape, color and
+	// rotation, moveSpeed turns the whole belt, and asteroidSpeed moves each asteroid on its small orbit
+	std::vector<SceneAsteroidRing> asteroidRings;
+	float asteroidSpeed = 0.0f;
+};
+
+// How the gravity simulation (--physics) moves the bodies; left empty or 0, the program's own choice is kept
+struct ScenePhysics {
+	// "leapfrog", "yoshida4", "yoshida6", "wisdom-holman" or "block-leapfrog" (see Integrator in nbody.h), or "kepler"
+	// for closed-form orbits around each body's parent (see keplerOrbits.h), which takes no steps at all
+	std::string integrator;
+	// Seconds of simulation time per step; for "block-leapfrog", between the points where every body is in step
+	double timeStep = 0.0;
+	// How "block-leapfrog" picks each body's step: "orbit" or "acceleration" (see TimeStepCriterion in nbody.h)
+	std::string timeStepCriterion;
+	// Under "block-leapfrog", the fraction of its shortest orbital period each body steps by ("orbit"), or the
+	// factor on sqrt(timeStepLength / acceleration) ("acceleration")
+	double timeStepAccuracy = 0.0;
+	// The length scale of the "acceleration" criterion, such as the softening or a typical distance between bodies
+	double timeStepLength = 0.0;
+	// "block-leapfrog" halves timeStep at most this many times
+	int maxTimeStepLevel = 0;
+};
+
+struct Scene {
+	// Texture stretched over the whole window behind the bodies
+	std::string background;
+	ScenePhysics physics;
+	// In drawing order: bodies later in the list are drawn over earlier ones
+	std::vector<SceneBody> bodies;
+};
+
+// Read a scene file; returns false, with the reason (and line) in error, if it cannot be read or is not a valid scene
+bool loadScene(const std::string& filename, Scene& scene, std::string& error);
@@ -0,0 +1,539 @@
+/*
+* Title: Software Renderer
+* Description: Implementation of the CPU rasterizer declared in softwareRenderer.h
+*
+* A frame is drawn in three steps:
+*   set up     the workers move every draw call's vertices into window coordinates and work out its
+*              pixel bounds and how texture coordinates change across the screen
+*   bin        each draw call is listed in every tile its bounds touch, in the order it was queued
+*   rasterize  the workers take tiles one at a time, copy the background in and draw the tile's calls
+* Pixel centers sit at +0.5 and a filled span covers the centers with left <= x < right, which is the
+* rule OpenGL uses, so shapes cover the same pixels they do on the GPU. Filling takes a span per row,
+* so shapes have to be convex; the ellipses of the scene are. Textures are filtered like
+* GL_LINEAR_MIPMAP_LINEAR, with 8 bit weights. Texture filtering and span filling use SSE2 on x86;
+* other targets use the plain loops
+*/
+
+#include "softwareRenderer.h"
+#include "taskScheduler.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SOFTWARE_RENDERER_SSE2
+#endif
+
+using namespace std;
+
+// Frames are rasterized in squares of this many pixels; each tile is one task for the workers
+static const int TILE_SIZE = 64;
+// Draw calls are set up by the workers in batches of this many
+static const int SETUP_BATCH_SIZE = 256;
+
+// Pixels are kept as 32 bit words with the bytes in R, G, B, A order, as in the frame
+static uint32_t packPixel(uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha)
+{
+	const uint8_t bytes[4] = { red, green, blue, alpha };
+	uint32_t pixel;
+	memcpy(&pixel, bytes, 4);
+	return pixel;
+}
+
+// A color channel the way OpenGL stores a float in an 8 bit framebuffer
+static uint8_t toByte(float channel)
+{
+	return (uint8_t)lroundf(min(max(channel, 0.0f), 1.0f) * 255.0f);
+}
+
+// Texture coordinates outside the texture wrap around, as with GL_REPEAT
+static int wrapTexel(int position, int size)
+{
+	if ((unsigned)position < (unsigned)size)
+		return position;
+	position %= size;
+	return position < 0 ? position + size : position;
+}
+
+static void fillSpan(uint32_t* pixels, int count, uint32_t color)
+{
+	int i = 0;
+#ifdef SOFTWARE_RENDERER_SSE2
+	const __m128i colors = _mm_set1_epi32((int)color);
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_si128((__m128i*)(pixels + i), colors);
+#endif
+	for (; i < count; i++)
+		pixels[i] = color;
+}
+
+struct SoftwareRenderer::State {
+	// One mipmap level; rows go bottom-up, so row 0 is texture coordinate v = 0
+	struct TextureLevel {
+		int width;
+		int height;
+		vector<uint32_t> texels;
+	};
+
+	struct Shape {
+		vector<glm::vec2> vertices;
+		float radiusX;
+		float radiusY;
+	};
+
+	struct DrawCall {
+		unsigned int shape;
+		int vertexCount;
+		glm::mat4 transform;
+		bool isOutline;
+		uint32_t color;
+		unsigned int texture;
+
+		// Filled in by setUp: the vertices in window coordinates are points[firstPoint...]
+		size_t firstPoint;
+		// Pixels the call may touch; right and bottom are exclusive
+		int left, top, right, bottom;
+		// Texture coordinates at window position (x, y): u = u0 + ux * x + uy * y, and likewise v
+		float u0, ux, uy;
+		float v0, vx, vy;
+		// Mipmap level to sample, and how much of the next level to blend in (out of 256)
+		int level;
+		int nextLevelWeight;
+	};
+
+	int width;
+	int height;
+	int tilesX;
+	int tilesY;
+
+	vector<vector<TextureLevel>> textures;
+	vector<Shape> shapes;
+	vector<DrawCall> drawCalls;
+	vector<glm::vec2> points;
+	// Draw calls touching each tile, in the order they were queued
+	vector<vector<uint32_t>> tileDrawCalls;
+
+	unsigned int backgroundTexture = 0;
+	bool isBackgroundCurrent = false;
+	vector<uint32_t> background;
+
+	State(int width, int height)
+		: width(width), height(height)
+	{
+		tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+		tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+		tileDrawCalls.resize((size_t)tilesX * tilesY);
+		background.resize((size_t)width * height);
+	}
+
+	// Level n + 1 averages 2 x 2 blocks of level n, like glGenerateMipmap
+	static void buildMipmaps(vector<TextureLevel>& levels)
+	{
+		while (levels.back().width > 1 || levels.back().height > 1) {
+			const TextureLevel& source = levels.back();
+			TextureLevel level;
+			level.width = max(1, source.width / 2);
+			level.height = max(1, source.height / 2);
+			level.texels.resize((size_t)level.width * level.height);
+			for (int y = 0; y < level.height; y++) {
+				const uint8_t* row0 = (const uint8_t*)(source.texels.data() + (size_t)min(2 * y, source.height - 1) * source.width);
+				const uint8_t* row1 = (const uint8_t*)(source.texels.data() + (size_t)min(2 * y + 1, source.height - 1) * source.width);
+				uint8_t* out = (uint8_t*)(level.texels.data() + (size_t)y * level.width);
+				for (int x = 0; x < level.width; x++) {
+					int x0 = min(2 * x, source.width - 1) * 4;
+					int x1 = min(2 * x + 1, source.width - 1) * 4;
+					for (int channel = 0; channel < 4; channel++)
+						out[x * 4 + channel] = (uint8_t)((row0[x0 + channel] + row0[x1 + channel] + row1[x0 + channel] + row1[x1 + channel] + 2) / 4);
+				}
+			}
+			levels.push_back(move(level));
+		}
+	}
+
+	// Blend the four texels around (s, t), with 8 bit weights
+	static uint32_t sampleBilinear(const TextureLevel& level, float s, float t)
+	{
+		float sFloor = floorf(s);
+		float tFloor = floorf(t);
+		int fx = (int)((s - sFloor) * 256.0f);
+		int fy = (int)((t - tFloor) * 256.0f);
+		int x0 = wrapTexel((int)sFloor, level.width);
+		int y0 = wrapTexel((int)tFloor, level.height);
+		int x1 = x0 + 1 < level.width ? x0 + 1 : 0;
+		int y1 = y0 + 1 < level.height ? y0 + 1 : 0;
+		const uint32_t* row0 = level.texels.data() + (size_t)y0 * level.width;
+		const uint32_t* row1 = level.texels.data() + (size_t)y1 * level.width;
+
+#ifdef SOFTWARE_RENDERER_SSE2
+		// Both texels of a row share a register, so one pass blends the rows and a second the columns
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i rounding = _mm_set1_epi16(128);
+		__m128i top = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128((int)row0[x0]), _mm_cvtsi32_si128((int)row0[x1])), zero);
+		__m128i bottom = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128((int)row1[x0]), _mm_cvtsi32_si128((int)row1[x1])), zero);
+		__m128i rows = _mm_add_epi16(_mm_mullo_epi16(top, _mm_set1_epi16((short)(256 - fy))), _mm_mullo_epi16(bottom, _mm_set1_epi16((short)fy)));
+		rows = _mm_srli_epi16(_mm_add_epi16(rows, rounding), 8);
+		__m128i columns = _mm_mullo_epi16(rows, _mm_set_epi16((short)fx, (short)fx, (short)fx, (short)fx,
+			(short)(256 - fx), (short)(256 - fx), (short)(256 - fx), (short)(256 - fx)));
+		columns = _mm_add_epi16(columns, _mm_srli_si128(columns, 8));
+		columns = _mm_srli_epi16(_mm_add_epi16(columns, rounding), 8);
+		return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(columns, columns));
+#else
+		const uint8_t* a = (const uint8_t*)(row0 + x0);
+		const uint8_t* b = (const uint8_t*)(row0 + x1);
+		const uint8_t* c = (const uint8_t*)(row1 + x0);
+		const uint8_t* d = (const uint8_t*)(row1 + x1);
+		uint8_t bytes[4];
+		for (int channel = 0; channel < 4; channel++) {
+			int left = (a[channel] * (256 - fy) + c[channel] * fy + 128) >> 8;
+			int right = (b[channel] * (256 - fy) + d[channel] * fy + 128) >> 8;
+			bytes[channel] = (uint8_t)((left * (256 - fx) + right * fx + 128) >> 8);
+		}
+		uint32_t pixel;
+		memcpy(&pixel, bytes, 4);
+		return pixel;
+#endif
+	}
+
+	// The mipmap levels GL_LINEAR_MIPMAP_LINEAR blends when a pixel covers texelsPerPixel texels of level 0
+	static void chooseMipmapLevels(const vector<TextureLevel>& levels, float texelsPerPixel, int& level, int& nextLevelWeight)
+	{
+		float lambda = log2f(texelsPerPixel);
+		level = 0;
+		nextLevelWeight = 0;
+		if (!(lambda > 0.0f))
+			return;
+		const int lastLevel = (int)levels.size() - 1;
+		level = min((int)lambda, lastLevel);
+		if (level < lastLevel)
+			nextLevelWeight = (int)((lambda - level) * 256.0f);
+	}
+
+	// Sample at texture coordinates (u, v) the way OpenGL's trilinear filter does: bilinearly in two
+	// neighbouring mipmap levels, blended by how close the footprint is to each
+	static uint32_t sampleTexture(const vector<TextureLevel>& levels, int level, int nextLevelWeight, float u, float v)
+	{
+		const TextureLevel& first = levels[level];
+		uint32_t sample = sampleBilinear(first, u * first.width - 0.5f, v * first.height - 0.5f);
+		if (nextLevelWeight == 0)
+			return sample;
+		const TextureLevel& second = levels[level + 1];
+		uint32_t nextSample = sampleBilinear(second, u * second.width - 0.5f, v * second.height - 0.5f);
+#ifdef SOFTWARE_RENDERER_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		__m128i blend = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)sample), zero), _mm_set1_epi16((short)(256 - nextLevelWeight))),
+			_mm_mullo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)nextSample), zero), _mm_set1_epi16((short)nextLevelWeight)));
+		blend = _mm_srli_epi16(_mm_add_epi16(blend, _mm_set1_epi16(128)), 8);
+		return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(blend, blend));
+#else
+		uint8_t bytes[4], nextBytes[4];
+		memcpy(bytes, &sample, 4);
+		memcpy(nextBytes, &nextSample, 4);
+		for (int channel = 0; channel < 4; channel++)
+			bytes[channel] = (uint8_t)((bytes[channel] * (256 - nextLevelWeight) + nextBytes[channel] * nextLevelWeight + 128) >> 8);
+		memcpy(&sample, bytes, 4);
+		return sample;
+#endif
+	}
+
+	// The background is the same every frame, so it is sampled once and copied into each tile
+	void drawBackground()
+	{
+		isBackgroundCurrent = true;
+		if (backgroundTexture == 0) {
+			fill(background.begin(), background.end(), 0u);
+			return;
+		}
+		const vector<TextureLevel>& levels = textures[backgroundTexture - 1];
+		int level, nextLevelWeight;
+		chooseMipmapLevels(levels, max((float)levels[0].width / width, (float)levels[0].height / height), level, nextLevelWeight);
+		TaskScheduler::shared().parallelFor(height, [&](int y) {
+			// Texture coordinates run from 0 to 1 across the frame, with v = 0 at the bottom
+			float v = 1.0f - (y + 0.5f) / height;
+			for (int x = 0; x < width; x++)
+				background[(size_t)y * width + x] = sampleTexture(levels, level, nextLevelWeight, (x + 0.5f) / width, v);
+		});
+	}
+
+	void setUp(DrawCall& call)
+	{
+		const Shape& shape = shapes[call.shape - 1];
+		const glm::mat4& m = call.transform;
+		call.left = call.right = call.top = call.bottom = 0;
+
+		// Window position = A * vertex + c, with y pointing down
+		const float halfWidth = width * 0.5f;
+		const float halfHeight = height * 0.5f;
+		const float axx = m[0][0] * halfWidth, axy = m[1][0] * halfWidth, cx = (m[3][0] + 1.0f) * halfWidth;
+		const float ayx = -m[0][1] * halfHeight, ayy = -m[1][1] * halfHeight, cy = (1.0f - m[3][1]) * halfHeight;
+
+		glm::vec2* windowPoints = points.data() + call.firstPoint;
+		glm::vec2 lowest(INFINITY), highest(-INFINITY);
+		for (int i = 0; i < call.vertexCount; i++) {
+			const glm::vec2& vertex = shape.vertices[i];
+			glm::vec2 point(axx * vertex.x + axy * vertex.y + cx, ayx * vertex.x + ayy * vertex.y + cy);
+			windowPoints[i] = point;
+			lowest = glm::min(lowest, point);
+			highest = glm::max(highest, point);
+		}
+		if (call.vertexCount < (call.isOutline ? 2 : 3))
+			return;
+
+		// Fills cover pixel centers inside the shape; lines step through the pixels they pass
+		glm::vec2 first = call.isOutline ? glm::floor(lowest - 0.5f) : glm::ceil(lowest - 0.5f);
+		glm::vec2 last = call.isOutline ? glm::floor(highest) + 1.0f : glm::ceil(highest - 0.5f);
+		if (!(first.x < INFINITY && last.x > -INFINITY && first.y < INFINITY && last.y > -INFINITY))
+			return;
+		call.left = (int)max(first.x, 0.0f);
+		call.top = (int)max(first.y, 0.0f);
+		call.right = (int)min(last.x, (float)width);
+		call.bottom = (int)min(last.y, (float)height);
+
+		if (call.texture == 0)
+			return;
+		float determinant = axx * ayy - axy * ayx;
+		if (fabsf(determinant) < 1e-12f) {
+			call.right = call.left;
+			return;
+		}
+		// Texture coordinates are u = x / (2 radiusX) + 0.5 and v = y / (2 radiusY) + 0.5 of the untransformed
+		// vertex, so invert A to find them for any window position
+		float uScale = shape.radiusX != 0.0f ? 1.0f / (2.0f * shape.radiusX * determinant) : 0.0f;
+		float vScale = shape.radiusY != 0.0f ? 1.0f / (2.0f * shape.radiusY * determinant) : 0.0f;
+		call.ux = ayy * uScale;
+		call.uy = -axy * uScale;
+		call.u0 = 0.5f - call.ux * cx - call.uy * cy;
+		call.vx = -ayx * vScale;
+		call.vy = axx * vScale;
+		call.v0 = 0.5f - call.vx * cx - call.vy * cy;
+
+		// The transform has no perspective, so one mipmap choice holds for the whole shape
+		const vector<TextureLevel>& levels = textures[call.texture - 1];
+		float texelsPerPixel = max(hypotf(call.ux * levels[0].width, call.vx * levels[0].height), hypotf(call.uy * levels[0].width, call.vy * levels[0].height));
+		chooseMipmapLevels(levels, texelsPerPixel, call.level, call.nextLevelWeight);
+	}
+
+	uint32_t shade(const DrawCall& call, int x, int y) const
+	{
+		if (call.texture == 0)
+			return call.color;
+		float centerX = x + 0.5f, centerY = y + 0.5f;
+		return sampleTexture(textures[call.texture - 1], call.level, call.nextLevelWeight,
+			call.u0 + call.ux * centerX + call.uy * centerY, call.v0 + call.vx * centerX + call.vy * centerY);
+	}
+
+	// Fill a convex polygon inside the rectangle [left, right) x [top, bottom)
+	void fillPolygon(const DrawCall& call, int left, int top, int right, int bottom, uint32_t* frame) const
+	{
+		const glm::vec2* polygon = points.data() + call.firstPoint;
+		const int count = call.vertexCount;
+		for (int y = top; y < bottom; y++) {
+			// Where the row's pixel centers enter and leave the polygon
+			float centerY = y + 0.5f;
+			float spanStart = INFINITY, spanEnd = -INFINITY;
+			for (int i = 0, previous = count - 1; i < count; previous = i++) {
+				const glm::vec2& a = polygon[previous];
+				const glm::vec2& b = polygon[i];
+				if ((a.y <= centerY) == (b.y <= centerY))
+					continue;
+				float crossing = a.x + (centerY - a.y) * (b.x - a.x) / (b.y - a.y);
+				spanStart = min(spanStart, crossing);
+				spanEnd = max(spanEnd, crossing);
+			}
+			if (spanStart >= spanEnd)
+				continue;
+			int x0 = max(left, (int)ceilf(spanStart - 0.5f));
+			int x1 = min(right, (int)ceilf(spanEnd - 0.5f));
+			if (x0 >= x1)
+				continue;
+
+			uint32_t* row = frame + (size_t)y * width;
+			if (call.texture == 0) {
+				fillSpan(row + x0, x1 - x0, call.color);
+				continue;
+			}
+			const vector<TextureLevel>& levels = textures[call.texture - 1];
+			float u = call.u0 + call.ux * (x0 + 0.5f) + call.uy * centerY;
+			float v = call.v0 + call.vx * (x0 + 0.5f) + call.vy * centerY;
+			for (int x = x0; x < x1; x++)
+				row[x] = sampleTexture(levels, call.level, call.nextLevelWeight, u + call.ux * (x - x0), v + call.vx * (x - x0));
+		}
+	}
+
+	// Draw the closed outline through the polygon's vertices inside the rectangle, one pixel wide
+	// Each segment lights one pixel per column (or per row when it is steep), and none for its last one,
+	// which the next segment starts on
+	void drawOutline(const DrawCall& call, int left, int top, int right, int bottom, uint32_t* frame) const
+	{
+		const glm::vec2* polygon = points.data() + call.firstPoint;
+		const int count = call.vertexCount;
+		for (int i = 0; i < count; i++) {
+			glm::vec2 a = polygon[i];
+			glm::vec2 b = polygon[(i + 1) % count];
+			bool isSteep = fabsf(b.y - a.y) > fabsf(b.x - a.x);
+			if (isSteep) {
+				swap(a.x, a.y);
+				swap(b.x, b.y);
+			}
+			if (a.x == b.x)
+				continue;
+			if (a.x > b.x)
+				swap(a, b);
+			float slope = (b.y - a.y) / (b.x - a.x);
+			// Along the long axis, clipped to the rectangle
+			int start = max(isSteep ? top : left, (int)ceilf(a.x - 0.5f));
+			int end = min(isSteep ? bottom : right, (int)ceilf(b.x - 0.5f));
+			for (int major = start; major < end; major++) {
+				int minor = (int)floorf(a.y + (major + 0.5f - a.x) * slope);
+				int x = isSteep ? minor : major;
+				int y = isSteep ? major : minor;
+				if (x >= left && x < right && y >= top && y < bottom)
+					frame[(size_t)y * width + x] = shade(call, x, y);
+			}
+		}
+	}
+
+	void renderTile(int tile, uint32_t* frame) const
+	{
+		int left = (tile % tilesX) * TILE_SIZE;
+		int top = (tile / tilesX) * TILE_SIZE;
+		int right = min(left + TILE_SIZE, width);
+		int bottom = min(top + TILE_SIZE, height);
+		for (int y = top; y < bottom; y++)
+			memcpy(frame + (size_t)y * width + left, background.data() + (size_t)y * width + left, (right - left) * sizeof(uint32_t));
+
+		for (uint32_t index : tileDrawCalls[tile]) {
+			const DrawCall& call = drawCalls[index];
+			int callLeft = max(left, call.left), callTop = max(top, call.top);
+			int callRight = min(right, call.right), callBottom = min(bottom, call.bottom);
+			if (call.isOutline)
+				drawOutline(call, callLeft, callTop, callRight, callBottom, frame);
+			else
+				fillPolygon(call, callLeft, callTop, callRight, callBottom, frame);
+		}
+	}
+};
+
+SoftwareRenderer::SoftwareRenderer(int width, int height)
+	: state(make_unique<State>(width, height)) {}
+
+SoftwareRenderer::~SoftwareRenderer() = default;
+
+unsigned int SoftwareRenderer::addTexture(const uint8_t* pixels, int width, int height, int channels)
+{
+	State::TextureLevel level;
+	level.width = max(1, width);
+	level.height = max(1, height);
+	level.texels.resize((size_t)level.width * level.height);
+	for (size_t i = 0; i < (size_t)width * height; i++) {
+		const uint8_t* texel = pixels + i * channels;
+		if (channels == 1)
+			level.texels[i] = packPixel(texel[0], 0, 0, 255);
+		else if (channels == 2)
+			level.texels[i] = packPixel(texel[0], texel[0], texel[0], texel[1]);
+		else
+			level.texels[i] = packPixel(texel[0], texel[1], texel[2], channels == 4 ? texel[3] : 255);
+	}
+	vector<State::TextureLevel> levels;
+	levels.push_back(move(level));
+	State::buildMipmaps(levels);
+	state->textures.push_back(move(levels));
+	return (unsigned int)state->textures.size();
+}
+
+unsigned int SoftwareRenderer::addShape(const vector<float>& vertices, float radiusX, float radiusY)
+{
+	State::Shape shape;
+	for (size_t i = 0; i + 1 < vertices.size(); i += 2)
+		shape.vertices.push_back(glm::vec2(vertices[i], vertices[i + 1]));
+	shape.radiusX = radiusX;
+	shape.radiusY = radiusY;
+	state->shapes.push_back(move(shape));
+	return (unsigned int)state->shapes.size();
+}
+
+void SoftwareRenderer::setBackground(unsigned int textureID)
+{
+	State& s = *state;
+	if (textureID > s.textures.size())
+		textureID = 0;
+	if (textureID != s.backgroundTexture) {
+		s.backgroundTexture = textureID;
+		s.isBackgroundCurrent = false;
+	}
+}
+
+void SoftwareRenderer::beginFrame()
+{
+	state->drawCalls.clear();
+}
+
+void SoftwareRenderer::draw(unsigned int shapeID, int vertexCount, const glm::mat4& transform, bool isOutline, glm::vec4 color, unsigned int textureID)
+{
+	State& s = *state;
+	if (shapeID == 0 || shapeID > s.shapes.size())
+		return;
+	State::DrawCall call = {};
+	call.shape = shapeID;
+	call.vertexCount = min(vertexCount, (int)s.shapes[shapeID - 1].vertices.size());
+	call.transform = transform;
+	call.isOutline = isOutline;
+	call.color = packPixel(toByte(color.r), toByte(color.g), toByte(color.b), toByte(color.a));
+	call.texture = textureID <= s.textures.size() ? textureID : 0;
+
+	// Drawing the same thing twice in a row changes nothing (the middle asteroid belt draws each asteroid 101 times)
+	if (!s.drawCalls.empty()) {
+		const State::DrawCall& last = s.drawCalls.back();
+		if (last.shape == call.shape && last.vertexCount == call.vertexCount && last.transform == call.transform &&
+			last.isOutline == call.isOutline && last.color == call.color && last.texture == call.texture)
+			return;
+	}
+	s.drawCalls.push_back(call);
+}
+
+void SoftwareRenderer::render(uint8_t* frame)
+{
+	State& s = *state;
+	if (!s.isBackgroundCurrent)
+		s.drawBackground();
+
+	size_t pointCount = 0;
+	for (State::DrawCall& call : s.drawCalls) {
+		call.firstPoint = pointCount;
+		pointCount += call.vertexCount;
+	}
+	s.points.resize(pointCount);
+	const int callCount = (int)s.drawCalls.size();
+	TaskScheduler::shared().parallelFor((callCount + SETUP_BATCH_SIZE - 1) / SETUP_BATCH_SIZE, [&](int batch) {
+		int end = min(callCount, (batch + 1) * SETUP_BATCH_SIZE);
+		for (int i = batch * SETUP_BATCH_SIZE; i < end; i++)
+			s.setUp(s.drawCalls[i]);
+	});
+
+	for (vector<uint32_t>& calls : s.tileDrawCalls)
+		calls.clear();
+	for (int i = 0; i < callCount; i++) {
+		const State::DrawCall& call = s.drawCalls[i];
+		if (call.left >= call.right || call.top >= call.bottom)
+			continue;
+		for (int tileY = call.top / TILE_SIZE; tileY <= (call.bottom - 1) / TILE_SIZE; tileY++)
+			for (int tileX = call.left / TILE_SIZE; tileX <= (call.right - 1) / TILE_SIZE; tileX++)
+				s.tileDrawCalls[(size_t)tileY * s.tilesX + tileX].push_back((uint32_t)i);
+	}
+
+	uint32_t* pixels = (uint32_t*)frame;
+	TaskScheduler::shared().parallelFor(s.tilesX * s.tilesY, [&](int tile) {
+		s.renderTile(tile, pixels);
+	});
+}
+
+int SoftwareRenderer::width() const
+{
+	return state->width;
+}
+
+int SoftwareRenderer::height() const
+{
+	return state->height;
+}
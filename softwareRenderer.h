@@ -0,0 +1,51 @@
+/*
+* Title: Software Renderer
+* Description: Draws the scene into an RGBA frame on the CPU, for machines with no OpenGL driver at all.
+*              It takes the same shapes, transforms, colors and textures the OpenGL path uses: filled
+*              outlines are drawn like GL_TRIANGLE_FAN, outlines like GL_LINE_LOOP, and textures are
+*              filtered bilinearly within and between mipmap levels, as uploadTexture sets up. The frame
+*              is split into tiles that the shared task scheduler fills in parallel, each replaying
+*              the draw calls that touch it in order. Frames come out top-down, ready for the recorder,
+*              so nothing is read back or flipped
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <glm/glm.hpp>
+
+class SoftwareRenderer {
+public:
+	// The tiles are drawn on the shared task scheduler
+	SoftwareRenderer(int width, int height);
+	~SoftwareRenderer();
+
+	SoftwareRenderer(const SoftwareRenderer&) = delete;
+	SoftwareRenderer& operator=(const SoftwareRenderer&) = delete;
+
+	// Copy a texture and build its mipmaps. Rows go bottom-up, as glTexImage2D takes them, and 1, 3 or 4
+	// channels are read like GL_RED, GL_RGB and GL_RGBA. Returns the texture's ID, which is never 0
+	unsigned int addTexture(const uint8_t* pixels, int width, int height, int channels);
+	// Keep an outline (x, y pairs) whose texture coordinates span radiusX x radiusY, like the vertex buffers
+	// setupObjectBuffer makes. Returns the shape's ID, which is never 0
+	unsigned int addShape(const std::vector<float>& vertices, float radiusX, float radiusY);
+
+	// Texture stretched over the whole frame behind everything else; 0 clears to black instead
+	void setBackground(unsigned int textureID);
+	// Forget the draw calls of the last frame
+	void beginFrame();
+	// Queue the first vertexCount vertices of a shape, moved by transform into normalized device coordinates
+	// The shape is filled, or only its outline drawn; it takes its color from the texture unless textureID is 0
+	void draw(unsigned int shapeID, int vertexCount, const glm::mat4& transform, bool isOutline, glm::vec4 color, unsigned int textureID);
+	// Draw the queued calls into frame, which holds width x height top-down RGBA pixels
+	void render(uint8_t* frame);
+
+	int width() const;
+	int height() const;
+
+private:
+	struct State;
+	std::unique_ptr<State> state;
+};
@@ -0,0 +1,347 @@
+/*
+* Title: Lossless Recordings (.ssrec)
+* Description: Implementation of the .ssrec writer and reader declared in ssrec.h
+*/
+
+#include "ssrec.h"
+#include "frameCodec.h"
+#include "frameScale.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+static const char SSREC_MAGIC[5] = { 'S', 'S', 'R', 'E', 'C' };
+const uint8_t SSREC_VERSION = 1;
+const size_t SSREC_HEADER_SIZE = 16;
+const size_t SSREC_FRAME_HEADER_SIZE = 16;
+// Frame buffers shared between the caller and the writer thread
+const int SSREC_FRAME_BUFFERS = 3;
+
+static void put32(uint8_t* out, uint32_t value)
+{
+	for (int i = 0; i < 4; i++)
+		out[i] = (uint8_t)(value >> (8 * i));
+}
+
+static uint32_t get32(const uint8_t* in)
+{
+	return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+static void putTime(uint8_t* out, double time)
+{
+	uint64_t bits;
+	memcpy(&bits, &time, 8);
+	for (int i = 0; i < 8; i++)
+		out[i] = (uint8_t)(bits >> (8 * i));
+}
+
+static double getTime(const uint8_t* in)
+{
+	uint64_t bits = 0;
+	for (int i = 0; i < 8; i++)
+		bits |= (uint64_t)in[i] << (8 * i);
+	double time;
+	memcpy(&time, &bits, 8);
+	return time;
+}
+
+// fopen is flagged as unsafe by MSVC
+static FILE* openFile(const char* path, const char* mode)
+{
+#if defined(_MSC_VER)
+	FILE* file = nullptr;
+	fopen_s(&file, path, mode);
+	return file;
+#else
+	return fopen(path, mode);
+#endif
+}
+
+// Recordings can pass 2 GB, which is more than fseek's long reaches on Windows
+static bool seekFile(FILE* file, uint64_t offset)
+{
+#if defined(_MSC_VER)
+	return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+	return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+static uint64_t fileSize(FILE* file)
+{
+#if defined(_MSC_VER)
+	_fseeki64(file, 0, SEEK_END);
+	return (uint64_t)_ftelli64(file);
+#else
+	fseeko(file, 0, SEEK_END);
+	return (uint64_t)ftello(file);
+#endif
+}
+
+/*----------------------------------------------------------------------
+Writer
+------------------------------------------------------------------------*/
+
+struct SsrecFrame {
+	vector<uint8_t> rgba;
+	double time = 0.0;
+};
+
+struct SsrecWriter::State {
+	FILE* file = nullptr;
+	int sourceWidth = 0;
+	int sourceHeight = 0;
+	int scaleDivisor = 1;
+	int width = 0;
+	int height = 0;
+
+	// Only touched by the writer thread
+	vector<uint8_t> previousFrame;
+	vector<uint8_t> scaled;
+	vector<uint8_t> delta;
+	vector<uint8_t> compressed;
+	int framesSinceKeyFrame = 0;
+
+	thread writer;
+	mutex lock;
+	condition_variable frameQueued;
+	condition_variable frameFree;
+	deque<unique_ptr<SsrecFrame>> queuedFrames;
+	vector<unique_ptr<SsrecFrame>> freeFrames;
+	bool stopping = false;
+	atomic<bool> failed{ false };
+
+	void writeFrame(const SsrecFrame& frame);
+	void writerLoop();
+};
+
+void SsrecWriter::State::writeFrame(const SsrecFrame& frame)
+{
+	const uint8_t* pixels = frame.rgba.data();
+	if (scaleDivisor > 1) {
+		scaled.resize((size_t)width * height * 4);
+		downscaleFrame(pixels, sourceWidth, sourceHeight, scaleDivisor, scaled.data());
+		pixels = scaled.data();
+	}
+
+	const size_t frameSize = (size_t)width * height * 4;
+	const bool isKeyFrame = previousFrame.empty() || framesSinceKeyFrame >= SSREC_KEY_FRAME_INTERVAL;
+	delta.resize(frameSize);
+	deltaFrame(pixels, isKeyFrame ? nullptr : previousFrame.data(), frameSize, delta.data());
+
+	// The frame header goes in front of the data so each frame is a single write
+	compressed.assign(SSREC_FRAME_HEADER_SIZE, 0);
+	lzCompress(delta.data(), frameSize, compressed);
+	put32(compressed.data(), (uint32_t)(compressed.size() - SSREC_FRAME_HEADER_SIZE));
+	compressed[4] = isKeyFrame ? 1 : 0;
+	putTime(compressed.data() + 8, frame.time);
+	if (fwrite(compressed.data(), 1, compressed.size(), file) != compressed.size())
+		failed = true;
+
+	previousFrame.assign(pixels, pixels + frameSize);
+	framesSinceKeyFrame = isKeyFrame ? 1 : framesSinceKeyFrame + 1;
+}
+
+// Compresses and writes queued frames in order until the writer is closed
+void SsrecWriter::State::writerLoop()
+{
+	unique_lock<mutex> guard(lock);
+	while (true) {
+		frameQueued.wait(guard, [this] { return stopping || !queuedFrames.empty(); });
+		if (queuedFrames.empty())
+			return;
+
+		unique_ptr<SsrecFrame> frame = move(queuedFrames.front());
+		queuedFrames.pop_front();
+		guard.unlock();
+
+		if (!failed)
+			writeFrame(*frame);
+
+		guard.lock();
+		freeFrames.push_back(move(frame));
+		frameFree.notify_all();
+	}
+}
+
+SsrecWriter::SsrecWriter() : state(make_unique<State>()) {}
+
+SsrecWriter::~SsrecWriter()
+{
+	close();
+}
+
+bool SsrecWriter::open(const string& filename, int width, int height, int scaleDivisor)
+{
+	close();
+
+	State& s = *state;
+	s.file = openFile(filename.c_str(), "wb");
+	if (s.file == nullptr)
+		return false;
+
+	s.sourceWidth = width;
+	s.sourceHeight = height;
+	s.scaleDivisor = min(max(scaleDivisor, 1), MAX_FRAME_SCALE_DIVISOR);
+	s.width = scaledFrameSize(width, s.scaleDivisor);
+	s.height = scaledFrameSize(height, s.scaleDivisor);
+	s.previousFrame.clear();
+	s.framesSinceKeyFrame = 0;
+	s.failed = false;
+	s.stopping = false;
+
+	uint8_t header[SSREC_HEADER_SIZE] = {};
+	memcpy(header, SSREC_MAGIC, sizeof(SSREC_MAGIC));
+	header[5] = SSREC_VERSION;
+	put32(header + 8, (uint32_t)s.width);
+	put32(header + 12, (uint32_t)s.height);
+	// Flushed straight away, since a buffered write only fails later. A disk that is already full would otherwise
+	// leave a file no reader can open, with no error
+	if (fwrite(header, 1, sizeof(header), s.file) != sizeof(header) || fflush(s.file) != 0) {
+		fclose(s.file);
+		s.file = nullptr;
+		return false;
+	}
+
+	for (int i = 0; i < SSREC_FRAME_BUFFERS; i++) {
+		auto frame = make_unique<SsrecFrame>();
+		frame->rgba.resize((size_t)width * height * 4);
+		s.freeFrames.push_back(move(frame));
+	}
+	s.writer = thread(&State::writerLoop, &s);
+	return true;
+}
+
+void SsrecWriter::submitFrame(const uint8_t* rgba, double time)
+{
+	State& s = *state;
+	if (s.file == nullptr)
+		return;
+
+	unique_ptr<SsrecFrame> frame;
+	{
+		unique_lock<mutex> guard(s.lock);
+		s.frameFree.wait(guard, [&s] { return !s.freeFrames.empty(); });
+		frame = move(s.freeFrames.back());
+		s.freeFrames.pop_back();
+	}
+	memcpy(frame->rgba.data(), rgba, frame->rgba.size());
+	frame->time = time;
+	{
+		lock_guard<mutex> guard(s.lock);
+		s.queuedFrames.push_back(move(frame));
+	}
+	s.frameQueued.notify_one();
+}
+
+bool SsrecWriter::close()
+{
+	State& s = *state;
+	if (s.file == nullptr)
+		return !s.failed;
+
+	{
+		lock_guard<mutex> guard(s.lock);
+		s.stopping = true;
+	}
+	s.frameQueued.notify_one();
+	s.writer.join();
+
+	// The last frames may still be in the stdio buffer, so a full disk can show up only now
+	if (fclose(s.file) != 0)
+		s.failed = true;
+	s.file = nullptr;
+	s.freeFrames.clear();
+	s.previousFrame.clear();
+	s.previousFrame.shrink_to_fit();
+	return !s.failed;
+}
+
+bool SsrecWriter::isOpen() const
+{
+	return state->file != nullptr;
+}
+
+bool SsrecWriter::hasFailed() const
+{
+	return state->failed;
+}
+
+/*----------------------------------------------------------------------
+Reader
+------------------------------------------------------------------------*/
+
+SsrecReader::~SsrecReader()
+{
+	close();
+}
+
+bool SsrecReader::open(const string& filename)
+{
+	close();
+	file = openFile(filename.c_str(), "rb");
+	if (file == nullptr)
+		return false;
+
+	uint8_t header[SSREC_HEADER_SIZE];
+	if (fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header, SSREC_MAGIC, sizeof(SSREC_MAGIC)) != 0 || header[5] != SSREC_VERSION) {
+		close();
+		return false;
+	}
+	frameWidth = (int)get32(header + 8);
+	frameHeight = (int)get32(header + 12);
+
+	// Walk the frame headers, skipping over the data
+	// A recording cut short (by a crash, say) ends in a frame with missing data, which is left out
+	const uint64_t size = fileSize(file);
+	uint64_t offset = SSREC_HEADER_SIZE;
+	uint8_t frameHeader[SSREC_FRAME_HEADER_SIZE];
+	while (offset + SSREC_FRAME_HEADER_SIZE <= size && seekFile(file, offset) && fread(frameHeader, 1, sizeof(frameHeader), file) == sizeof(frameHeader)) {
+		SsrecFrameInfo info;
+		info.offset = offset + SSREC_FRAME_HEADER_SIZE;
+		info.dataSize = get32(frameHeader);
+		info.isKeyFrame = (frameHeader[4] & 1) != 0;
+		info.time = getTime(frameHeader + 8);
+		if (info.offset + info.dataSize > size)
+			break;
+		index.push_back(info);
+		offset = info.offset + info.dataSize;
+	}
+	return true;
+}
+
+void SsrecReader::close()
+{
+	if (file)
+		fclose(file);
+	file = nullptr;
+	index.clear();
+	frameWidth = 0;
+	frameHeight = 0;
+}
+
+bool SsrecReader::readFrame(size_t frameIndex, const uint8_t* previousFrame, uint8_t* frame)
+{
+	if (file == nullptr || frameIndex >= index.size())
+		return false;
+	const SsrecFrameInfo& info = index[frameIndex];
+	if (!info.isKeyFrame && previousFrame == nullptr)
+		return false;
+
+	compressed.resize(info.dataSize);
+	if (!seekFile(file, info.offset) || fread(compressed.data(), 1, info.dataSize, file) != info.dataSize)
+		return false;
+
+	const size_t frameSize = (size_t)frameWidth * frameHeight * 4;
+	if (!lzDecompress(compressed.data(), compressed.size(), frame, frameSize))
+		return false;
+	deltaFrame(frame, info.isKeyFrame ? nullptr : previousFrame, frameSize, frame);
+	return true;
+}
@@ -0,0 +1,80 @@
+/*
+* Title: Lossless Recordings (.ssrec)
+* Description: A recording format that is cheap to write while the simulation runs: every frame
+*              is XORed with the frame before it and LZ-compressed on a background thread. The
+*              ssrecTranscode tool turns these files into GIFs, PNGs or raw video afterwards, so
+*              the expensive encoding happens offline
+*
+* File layout, all numbers little endian:
+*   header  "SSREC" version(1 byte) 2 unused bytes, width (4 bytes), height (4 bytes)
+*   frames  data size (4 bytes), flags (1 byte, bit 0 = key frame), 3 unused bytes,
+*           time in seconds (8 byte double), then the data
+* A key frame is compressed on its own; every other frame needs the frame before it
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Frames between key frames; a damaged frame only spoils the frames up to the next key frame
+const int SSREC_KEY_FRAME_INTERVAL = 120;
+
+class SsrecWriter {
+public:
+	SsrecWriter();
+	// Writes the frames still queued and closes the file
+	~SsrecWriter();
+
+	SsrecWriter(const SsrecWriter&) = delete;
+	SsrecWriter& operator=(const SsrecWriter&) = delete;
+
+	// Create the file for frames of the given size, stored shrunk by scaleDivisor
+	bool open(const std::string& filename, int width, int height, int scaleDivisor = 1);
+	// Queue a top-down RGBA frame shown at time (seconds); blocks while every frame buffer is waiting to be written
+	void submitFrame(const uint8_t* rgba, double time);
+	// False if a frame or the end of the file could not be written, which leaves the recording cut short
+	bool close();
+
+	bool isOpen() const;
+	// True once a write failed, for example because the disk is full
+	bool hasFailed() const;
+
+private:
+	struct State;
+	std::unique_ptr<State> state;
+};
+
+struct SsrecFrameInfo {
+	uint64_t offset;	// of the data in the file
+	uint32_t dataSize;
+	bool isKeyFrame;
+	double time;
+};
+
+class SsrecReader {
+public:
+	~SsrecReader();
+
+	// Reads the header and indexes every frame; a file cut short (by a crash, say) keeps its whole frames
+	bool open(const std::string& filename);
+	void close();
+
+	int width() const { return frameWidth; }
+	int height() const { return frameHeight; }
+	const std::vector<SsrecFrameInfo>& frames() const { return index; }
+
+	// Decode frame number frameIndex into width x height RGBA pixels
+	// previousFrame must hold the frame before it, unless it is a key frame
+	bool readFrame(size_t frameIndex, const uint8_t* previousFrame, uint8_t* frame);
+
+private:
+	FILE* file = nullptr;
+	int frameWidth = 0;
+	int frameHeight = 0;
+	std::vector<SsrecFrameInfo> index;
+	std::vector<uint8_t> compressed;
+};
@@ -0,0 +1,325 @@
+/*
+* Title: Task Scheduler
+* Description: Implementation of the work-stealing scheduler and task graphs declared in taskScheduler.h
+*
+* A task queued from a worker goes on the back of that worker's deque; from any other thread it goes on the
+* incoming queue. A worker looks for work at the back of its own deque, then at the front of the incoming
+* queue, then at the front of the other workers' deques, and sleeps once it finds none. A thread in wait()
+* only takes tasks of the group it waits for, so it never picks up long unrelated work (a GIF frame, say)
+* while the rest of its own loop is done, and whatever it cannot take is already running somewhere
+*/
+
+#include "taskScheduler.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+
+struct QueuedTask {
+	function<void()> work;
+	TaskGroup* group;
+};
+
+struct Worker {
+	mutex lock;
+	deque<QueuedTask> tasks;
+	thread runner;
+};
+
+struct TaskScheduler::State {
+	vector<unique_ptr<Worker>> workers;
+	mutex incomingLock;
+	deque<QueuedTask> incoming;
+	// Tasks in any queue, not counting the ones running
+	atomic<int> queuedTasks{ 0 };
+
+	// Sleeping workers wait for tasks on wake, waiting threads for their groups on finished
+	mutex sleepLock;
+	condition_variable wake;
+	condition_variable finished;
+	bool stopping = false;
+
+	void workerLoop(int index);
+	bool takeTask(int index, QueuedTask& task);
+	bool takeGroupTask(int index, const TaskGroup& group, QueuedTask& task);
+	void execute(QueuedTask& task);
+};
+
+// The scheduler and worker index of the thread, if it is a worker
+static thread_local TaskScheduler::State* currentScheduler = nullptr;
+static thread_local int currentWorker = -1;
+
+static void pinThread(thread& worker, int processor)
+{
+#if defined(_WIN32)
+	SetThreadAffinityMask(worker.native_handle(), (DWORD_PTR)1 << (processor % (8 * sizeof(DWORD_PTR))));
+#elif defined(__linux__)
+	cpu_set_t processors;
+	CPU_ZERO(&processors);
+	CPU_SET(processor % CPU_SETSIZE, &processors);
+	pthread_setaffinity_np(worker.native_handle(), sizeof(processors), &processors);
+#else
+	(void)worker;
+	(void)processor;
+#endif
+}
+
+TaskScheduler::TaskScheduler(int threadCount, bool pinThreads)
+	: state(make_unique<State>())
+{
+	const int processorCount = (int)max(1u, thread::hardware_concurrency());
+	if (threadCount <= 0)
+		threadCount = processorCount;
+	// The thread handing out the work is one of them
+	const int workerCount = threadCount - 1;
+
+	State& s = *state;
+	for (int i = 0; i < workerCount; i++)
+		s.workers.push_back(make_unique<Worker>());
+	// Every deque exists before any worker can look at the others'
+	for (int i = 0; i < workerCount; i++) {
+		s.workers[i]->runner = thread(&State::workerLoop, &s, i);
+		if (pinThreads)
+			pinThread(s.workers[i]->runner, (i + 1) % processorCount);
+	}
+}
+
+TaskScheduler::~TaskScheduler()
+{
+	State& s = *state;
+	{
+		lock_guard<mutex> guard(s.sleepLock);
+		s.stopping = true;
+	}
+	s.wake.notify_all();
+	for (auto& worker : s.workers)
+		worker->runner.join();
+}
+
+static mutex sharedLock;
+static unique_ptr<TaskScheduler> sharedScheduler;
+static int sharedThreadCount = 0;
+static bool sharedPinThreads = false;
+
+TaskScheduler& TaskScheduler::shared()
+{
+	lock_guard<mutex> guard(sharedLock);
+	if (!sharedScheduler)
+		sharedScheduler = make_unique<TaskScheduler>(sharedThreadCount, sharedPinThreads);
+	return *sharedScheduler;
+}
+
+bool TaskScheduler::configureShared(int threadCount, bool pinThreads)
+{
+	lock_guard<mutex> guard(sharedLock);
+	if (sharedScheduler)
+		return false;
+	sharedThreadCount = threadCount;
+	sharedPinThreads = pinThreads;
+	return true;
+}
+
+int TaskScheduler::workerCount() const
+{
+	return (int)state->workers.size();
+}
+
+void TaskScheduler::run(TaskGroup& group, function<void()> task)
+{
+	State& s = *state;
+	group.pending.fetch_add(1, memory_order_relaxed);
+	if (s.workers.empty()) {
+		QueuedTask queued = { move(task), &group };
+		s.execute(queued);
+		return;
+	}
+	if (currentScheduler == &s) {
+		Worker& worker = *s.workers[currentWorker];
+		lock_guard<mutex> guard(worker.lock);
+		worker.tasks.push_back({ move(task), &group });
+		s.queuedTasks.fetch_add(1, memory_order_release);
+	}
+	else {
+		lock_guard<mutex> guard(s.incomingLock);
+		s.incoming.push_back({ move(task), &group });
+		s.queuedTasks.fetch_add(1, memory_order_release);
+	}
+	// Taking the lock orders this after any worker's last look at queuedTasks, so none sleeps through it
+	{
+		lock_guard<mutex> guard(s.sleepLock);
+	}
+	s.wake.notify_one();
+}
+
+void TaskScheduler::wait(TaskGroup& group)
+{
+	State& s = *state;
+	const int index = currentScheduler == &s ? currentWorker : -1;
+	while (!group.isDone()) {
+		QueuedTask task;
+		if (s.takeGroupTask(index, group, task)) {
+			s.execute(task);
+			continue;
+		}
+		// The rest of the group is running on other threads
+		unique_lock<mutex> lock(s.sleepLock);
+		s.finished.wait(lock, [&group] { return group.isDone(); });
+	}
+}
+
+void TaskScheduler::State::workerLoop(int index)
+{
+	currentScheduler = this;
+	currentWorker = index;
+	while (true) {
+		QueuedTask task;
+		if (takeTask(index, task)) {
+			execute(task);
+			continue;
+		}
+		unique_lock<mutex> lock(sleepLock);
+		wake.wait(lock, [this] { return stopping || queuedTasks.load(memory_order_acquire) > 0; });
+		// Every queued task is run before stopping, so no submitted work is lost
+		if (stopping && queuedTasks.load(memory_order_acquire) == 0)
+			return;
+	}
+}
+
+bool TaskScheduler::State::takeTask(int index, QueuedTask& task)
+{
+	if (queuedTasks.load(memory_order_acquire) == 0)
+		return false;
+	{
+		Worker& own = *workers[index];
+		lock_guard<mutex> guard(own.lock);
+		if (!own.tasks.empty()) {
+			task = move(own.tasks.back());
+			own.tasks.pop_back();
+			queuedTasks.fetch_sub(1, memory_order_relaxed);
+			return true;
+		}
+	}
+	{
+		lock_guard<mutex> guard(incomingLock);
+		if (!incoming.empty()) {
+			task = move(incoming.front());
+			incoming.pop_front();
+			queuedTasks.fetch_sub(1, memory_order_relaxed);
+			return true;
+		}
+	}
+	// Steal, starting from the next worker so that thieves spread out
+	const int count = (int)workers.size();
+	for (int offset = 1; offset < count; offset++) {
+		Worker& victim = *workers[(index + offset) % count];
+		lock_guard<mutex> guard(victim.lock);
+		if (!victim.tasks.empty()) {
+			task = move(victim.tasks.front());
+			victim.tasks.pop_front();
+			queuedTasks.fetch_sub(1, memory_order_relaxed);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Newest first from the thread's own deque, oldest first from the others
+static bool takeFromQueue(mutex& lock, deque<QueuedTask>& tasks, const TaskGroup& group, bool newestFirst, QueuedTask& task)
+{
+	lock_guard<mutex> guard(lock);
+	if (newestFirst) {
+		for (auto queued = tasks.rbegin(); queued != tasks.rend(); ++queued) {
+			if (queued->group == &group) {
+				task = move(*queued);
+				tasks.erase(next(queued).base());
+				return true;
+			}
+		}
+	}
+	else {
+		for (auto queued = tasks.begin(); queued != tasks.end(); ++queued) {
+			if (queued->group == &group) {
+				task = move(*queued);
+				tasks.erase(queued);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+bool TaskScheduler::State::takeGroupTask(int index, const TaskGroup& group, QueuedTask& task)
+{
+	if (queuedTasks.load(memory_order_acquire) == 0)
+		return false;
+	bool found = index >= 0 && takeFromQueue(workers[index]->lock, workers[index]->tasks, group, true, task);
+	found = found || takeFromQueue(incomingLock, incoming, group, false, task);
+	for (int i = 0; i < (int)workers.size() && !found; i++) {
+		if (i != index)
+			found = takeFromQueue(workers[i]->lock, workers[i]->tasks, group, false, task);
+	}
+	if (found)
+		queuedTasks.fetch_sub(1, memory_order_relaxed);
+	return found;
+}
+
+void TaskScheduler::State::execute(QueuedTask& task)
+{
+	task.work();
+	// The group may be gone as soon as its count reaches 0, so it is not touched after that
+	if (task.group->pending.fetch_sub(1, memory_order_acq_rel) == 1) {
+		lock_guard<mutex> guard(sleepLock);
+		finished.notify_all();
+	}
+}
+
+/*-----------------------------------------------------------------------
+Task graphs
+-------------------------------------------------------------------------*/
+
+int TaskGraph::add(function<void()> task)
+{
+	nodes.push_back({ move(task), {}, 0 });
+	return (int)nodes.size() - 1;
+}
+
+void TaskGraph::precede(int before, int after)
+{
+	nodes[before].successors.push_back(after);
+	nodes[after].predecessorCount++;
+}
+
+void TaskGraph::run(TaskScheduler& scheduler)
+{
+	remainingPredecessors = make_unique<atomic<int>[]>(nodes.size());
+	for (size_t i = 0; i < nodes.size(); i++)
+		remainingPredecessors[i].store(nodes[i].predecessorCount, memory_order_relaxed);
+	TaskGroup group;
+	for (size_t i = 0; i < nodes.size(); i++) {
+		if (nodes[i].predecessorCount == 0)
+			scheduler.run(group, [this, &scheduler, &group, i] { runNode(scheduler, group, (int)i); });
+	}
+	scheduler.wait(group);
+}
+
+void TaskGraph::runNode(TaskScheduler& scheduler, TaskGroup& group, int index)
+{
+	nodes[index].task();
+	// A successor is queued before this task counts as finished, so the group never runs dry early
+	for (int successor : nodes[index].successors) {
+		if (remainingPredecessors[successor].fetch_sub(1, memory_order_acq_rel) == 1)
+			scheduler.run(group, [this, &scheduler, &group, successor] { runNode(scheduler, group, successor); });
+	}
+}
@@ -0,0 +1,107 @@
+/*
+* Title: Task Scheduler
+* Description: One set of worker threads for the whole program, shared by the physics, the software
+*              renderer, recording and loading, so that together they never run more threads than the
+*              processor has. Every worker keeps its own deque of tasks: it takes the newest from the
+*              back, whose data is still in its cache, and idle workers steal the oldest from the front of
+*              the others'. A thread waiting for tasks runs the ones it is waiting for that have not
+*              started yet, so parallel loops can nest and the caller of a loop works on it too
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Tasks that are waited for together. It has to outlive them: wait for it before it goes out of scope
+class TaskGroup {
+public:
+	TaskGroup() = default;
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup& operator=(const TaskGroup&) = delete;
+
+	bool isDone() const { return pending.load(std::memory_order_acquire) == 0; }
+
+private:
+	friend class TaskScheduler;
+	std::atomic<int> pending{ 0 };
+};
+
+class TaskScheduler {
+public:
+	// Tasks run on threadCount threads in all: threadCount - 1 workers, and the thread that hands out the work and
+	// helps with it. 0 uses one thread per hardware thread, so a single core gets no workers at all. pinThreads ties
+	// worker i to logical processor i + 1, leaving processor 0 for the thread that hands out the work
+	explicit TaskScheduler(int threadCount = 0, bool pinThreads = false);
+	// Finishes every queued task before the workers are joined
+	~TaskScheduler();
+
+	TaskScheduler(const TaskScheduler&) = delete;
+	TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+	// The scheduler the program shares, made on first use. configureShared() sets it up beforehand, and returns false
+	// once it exists already
+	static TaskScheduler& shared();
+	static bool configureShared(int threadCount, bool pinThreads);
+
+	// Queue a task in group; from a worker it goes on that worker's own deque. Without workers the task runs on the
+	// calling thread before run() returns, since nothing else would pick it up
+	void run(TaskGroup& group, std::function<void()> task);
+	// Block until every task in group has finished, running its queued tasks on this thread meanwhile
+	void wait(TaskGroup& group);
+
+	// Run task(0) to task(taskCount - 1) on the workers and the calling thread, and return once all are done. The
+	// tasks are handed out one at a time, so uneven ones still balance
+	template<typename Task>
+	void parallelFor(int taskCount, const Task& task)
+	{
+		std::atomic<int> nextTask(0);
+		auto work = [&]() {
+			for (int index = nextTask++; index < taskCount; index = nextTask++)
+				task(index);
+		};
+		TaskGroup helpers;
+		int helperCount = std::min(workerCount(), taskCount - 1);
+		for (int i = 0; i < helperCount; i++)
+			run(helpers, work);
+		work();
+		wait(helpers);
+	}
+
+	int workerCount() const;
+	// Threads a parallel loop runs on: the workers and the caller
+	int threadCount() const { return workerCount() + 1; }
+
+	struct State;
+
+private:
+	std::unique_ptr<State> state;
+};
+
+// Tasks that each start once the tasks they depend on have finished, for work with more shape than a loop
+class TaskGraph {
+public:
+	// Add a task and return its index
+	int add(std::function<void()> task);
+	// Task after does not start until task before has finished. There must be no cycles
+	void precede(int before, int after);
+	// Run every task as soon as it can, and return once all of them are done. A graph can be run again
+	void run(TaskScheduler& scheduler);
+
+	size_t size() const { return nodes.size(); }
+
+private:
+	struct Node {
+		std::function<void()> task;
+		std::vector<int> successors;
+		int predecessorCount = 0;
+	};
+	void runNode(TaskScheduler& scheduler, TaskGroup& group, int index);
+
+	std::vector<Node> nodes;
+	// Predecessors still running, for each node while the graph runs
+	std::unique_ptr<std::atomic<int>[]> remainingPredecessors;
+};
@@ -0,0 +1,369 @@
+/*
+* Title: gravityBenchmark
+* Description: Times the gravity solvers of the simulation against each other as the number of particles grows:
+*              direct summation, the Barnes-Hut tree (barnesHut.h) and the fast multipole method (fmm.h). Each
+*              tree solver is also checked against direct summation on a sample of the particles, so that speed
+*              can be compared at a known accuracy. First, the pairwise kernel all of them share
+*              (gravityKernel.h) is timed on one thread with each instruction set the processor has, and so is
+*              the Kepler propagator (keplerOrbits.h) that --integrator kepler uses in place of a solver
+*
+* Usage: gravityBenchmark [--min N] [--max N] [--factor N] [--distribution disk|sphere] [--threads N] [--order N]
+*                         [--fmm-angle X] [--bh-angle X] [--sample N] [--repeat N] [--kernel N] [--kepler N]
+*   --min, --max        particle counts to run, from min up to max, multiplying by --factor (10 by default) each time;
+*                       10 000 to 10 000 000 by default
+*   --distribution      disk: a flat ring of particles, like an asteroid belt, in quadtrees (the default)
+*                       sphere: a Plummer sphere, like a star cluster, in octrees
+*   --order, --fmm-angle  expansion order and opening angle of the multipole method (4 and 0.8 by default)
+*   --bh-angle          opening angle of Barnes-Hut (0.5 by default)
+*   --sample N          particles direct summation is worked out for (1000 by default). Its time for all of them is
+*                       scaled up from the sample, unless the sample is every particle
+*   --repeat N          time each solver N times and keep the fastest (1 by default)
+*   --kernel N          particles the kernel is timed with, every one against every other (4096 by default); 0 skips it
+*   --kepler N          orbits the Kepler propagator is timed with (1 000 000 by default); 0 skips it
+*/
+
+#include "barnesHut.h"
+#include "fmm.h"
+#include "gravityKernel.h"
+#include "keplerOrbits.h"
+#include "taskScheduler.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Seed for the particles, so that every run times the same ones
+const unsigned PARTICLE_SEED = 12345;
+// Softening length, as a fraction of the size of the distribution
+const double SOFTENING = 1e-4;
+
+enum ParticleDistribution {
+	DISTRIBUTION_DISK,
+	DISTRIBUTION_SPHERE
+};
+
+struct BenchmarkOptions {
+	size_t minimumCount = 10000;
+	size_t maximumCount = 10000000;
+	size_t factor = 10;
+	ParticleDistribution distribution = DISTRIBUTION_DISK;
+	int threads = 0;
+	int order = 4;
+	double fmmOpeningAngle = 0.8;
+	double barnesHutOpeningAngle = 0.5;
+	size_t sampleCount = 1000;
+	int repeat = 1;
+	size_t kernelCount = 4096;
+	size_t keplerCount = 1000000;
+};
+
+struct Particles {
+	vector<double> masses;
+	vector<double> x;
+	vector<double> y;
+	vector<double> z;
+};
+
+struct Accelerations {
+	vector<double> x;
+	vector<double> y;
+	vector<double> z;
+};
+
+static void printUsage()
+{
+	cerr << "Usage: gravityBenchmark [--min N] [--max N] [--factor N] [--distribution disk|sphere] [--threads N] [--order N]"
+		 << " [--fmm-angle X] [--bh-angle X] [--sample N] [--repeat N] [--kernel N] [--kepler N]" << endl;
+}
+
+static bool parseArguments(int argc, char** argv, BenchmarkOptions& options)
+{
+	for (int i = 1; i < argc; i++) {
+		string argument = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (argument == "--min" && hasValue)
+			options.minimumCount = max(2ll, atoll(argv[++i]));
+		else if (argument == "--max" && hasValue)
+			options.maximumCount = max(2ll, atoll(argv[++i]));
+		else if (argument == "--factor" && hasValue)
+			options.factor = max(2ll, atoll(argv[++i]));
+		else if (argument == "--distribution" && hasValue)
+			options.distribution = string(argv[++i]) == "sphere" ? DISTRIBUTION_SPHERE : DISTRIBUTION_DISK;
+		else if (argument == "--threads" && hasValue)
+			options.threads = atoi(argv[++i]);
+		else if (argument == "--order" && hasValue)
+			options.order = min(max(1, atoi(argv[++i])), FMM_MAX_ORDER);
+		else if (argument == "--fmm-angle" && hasValue)
+			options.fmmOpeningAngle = atof(argv[++i]);
+		else if (argument == "--bh-angle" && hasValue)
+			options.barnesHutOpeningAngle = atof(argv[++i]);
+		else if (argument == "--sample" && hasValue)
+			options.sampleCount = max(1ll, atoll(argv[++i]));
+		else if (argument == "--repeat" && hasValue)
+			options.repeat = max(1, atoi(argv[++i]));
+		else if (argument == "--kernel" && hasValue)
+			options.kernelCount = max(0ll, atoll(argv[++i]));
+		else if (argument == "--kepler" && hasValue)
+			options.keplerCount = max(0ll, atoll(argv[++i]));
+		else
+			return false;
+	}
+	return options.minimumCount <= options.maximumCount;
+}
+
+// count particles of equal mass, adding up to 1
+static Particles createParticles(size_t count, ParticleDistribution distribution)
+{
+	Particles particles;
+	particles.masses.assign(count, 1.0 / count);
+	particles.x.resize(count);
+	particles.y.resize(count);
+	particles.z.resize(count);
+	mt19937_64 random(PARTICLE_SEED);
+	uniform_real_distribution<double> uniform(0.0, 1.0);
+	const double twoPi = 6.283185307179586;
+	for (size_t i = 0; i < count; i++) {
+		if (distribution == DISTRIBUTION_DISK) {
+			// Evenly over the area of a ring from radius 0.5 to 1.5
+			double radius = sqrt(0.25 + 2.0 * uniform(random));
+			double angle = twoPi * uniform(random);
+			particles.x[i] = radius * cos(angle);
+			particles.y[i] = radius * sin(angle);
+			particles.z[i] = 0.0;
+		}
+		else {
+			// Plummer sphere of scale radius 1, cut off at radius 10
+			double radius;
+			do {
+				radius = 1.0 / sqrt(pow(max(uniform(random), 1e-12), -2.0 / 3.0) - 1.0);
+			} while (radius > 10.0);
+			double cosine = 2.0 * uniform(random) - 1.0;
+			double sine = sqrt(1.0 - cosine * cosine);
+			double angle = twoPi * uniform(random);
+			particles.x[i] = radius * sine * cos(angle);
+			particles.y[i] = radius * sine * sin(angle);
+			particles.z[i] = radius * cosine;
+		}
+	}
+	return particles;
+}
+
+// Accelerations of the sampled particles (every count / sampleCount-th) by direct summation over all of them, on every thread
+static Accelerations directSample(const Particles& particles, const vector<size_t>& sample)
+{
+	Accelerations result;
+	result.x.resize(sample.size());
+	result.y.resize(sample.size());
+	result.z.resize(sample.size());
+	const size_t count = particles.masses.size();
+	const double softening2 = SOFTENING * SOFTENING;
+	TaskScheduler::shared().parallelFor((int)sample.size(), [&](int k) {
+		const size_t target = sample[k];
+		double ax = 0.0, ay = 0.0, az = 0.0;
+		for (size_t j = 0; j < count; j++) {
+			double dx = particles.x[j] - particles.x[target];
+			double dy = particles.y[j] - particles.y[target];
+			double dz = particles.z[j] - particles.z[target];
+			double distance2 = dx * dx + dy * dy + dz * dz + softening2;
+			if (j == target)
+				continue;
+			double inverseDistance = 1.0 / sqrt(distance2);
+			double pull = particles.masses[j] * inverseDistance * inverseDistance * inverseDistance;
+			ax += dx * pull;
+			ay += dy * pull;
+			az += dz * pull;
+		}
+		result.x[k] = ax;
+		result.y[k] = ay;
+		result.z[k] = az;
+	});
+	return result;
+}
+
+// Root mean square of the error in the sampled accelerations, relative to their root mean square size
+static double sampleError(const Accelerations& accelerations, const vector<size_t>& sample, const Accelerations& reference)
+{
+	double error2 = 0.0, size2 = 0.0;
+	for (size_t k = 0; k < sample.size(); k++) {
+		size_t i = sample[k];
+		double dx = accelerations.x[i] - reference.x[k];
+		double dy = accelerations.y[i] - reference.y[k];
+		double dz = accelerations.z[i] - reference.z[k];
+		error2 += dx * dx + dy * dy + dz * dz;
+		size2 += reference.x[k] * reference.x[k] + reference.y[k] * reference.y[k] + reference.z[k] * reference.z[k];
+	}
+	return size2 > 0.0 ? sqrt(error2 / size2) : 0.0;
+}
+
+// Fastest of repeat calls to solver, in milliseconds
+template<typename Solver>
+static double timeSolver(Solver& solver, const Particles& particles, Accelerations& accelerations, int repeat)
+{
+	const size_t count = particles.masses.size();
+	accelerations.x.resize(count);
+	accelerations.y.resize(count);
+	accelerations.z.resize(count);
+	double fastest = INFINITY;
+	for (int i = 0; i < repeat; i++) {
+		auto start = chrono::steady_clock::now();
+		solver.computeAccelerations(count, particles.masses.data(), particles.x.data(), particles.y.data(), particles.z.data(), 1.0, SOFTENING,
+			accelerations.x.data(), accelerations.y.data(), accelerations.z.data());
+		fastest = min(fastest, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+	}
+	return fastest;
+}
+
+// Every particle against every other with each instruction set up to the processor's, in interactions per second, and
+// the largest relative error of an acceleration against the scalar kernel
+static void benchmarkKernel(const BenchmarkOptions& options)
+{
+	const size_t count = options.kernelCount;
+	Particles particles = createParticles(count, options.distribution);
+	const double softening2 = SOFTENING * SOFTENING;
+	Accelerations reference, accelerations;
+	reference.x.resize(count);
+	reference.y.resize(count);
+	reference.z.resize(count);
+	printf("%12s %16s %10s\n", "kernel", "interactions/s", "error");
+	for (int isa = GRAVITY_KERNEL_SCALAR; isa <= gravityKernelSupportedIsa(); isa++) {
+		setGravityKernelIsa((GravityKernelIsa)isa);
+		Accelerations& result = isa == GRAVITY_KERNEL_SCALAR ? reference : accelerations;
+		result.x.resize(count);
+		result.y.resize(count);
+		result.z.resize(count);
+		double fastest = INFINITY;
+		for (int i = 0; i < options.repeat; i++) {
+			auto start = chrono::steady_clock::now();
+			for (size_t target = 0; target < count; target++) {
+				double ax = 0.0, ay = 0.0, az = 0.0;
+				accumulateGravity(particles.x[target], particles.y[target], particles.z[target], count, particles.masses.data(), particles.x.data(),
+					particles.y.data(), particles.z.data(), softening2, ax, ay, az);
+				result.x[target] = ax;
+				result.y[target] = ay;
+				result.z[target] = az;
+			}
+			fastest = min(fastest, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+		}
+		double error = 0.0;
+		for (size_t k = 0; k < count && isa != GRAVITY_KERNEL_SCALAR; k++) {
+			double dx = result.x[k] - reference.x[k], dy = result.y[k] - reference.y[k], dz = result.z[k] - reference.z[k];
+			double size2 = reference.x[k] * reference.x[k] + reference.y[k] * reference.y[k] + reference.z[k] * reference.z[k];
+			if (size2 > 0.0)
+				error = max(error, sqrt((dx * dx + dy * dy + dz * dz) / size2));
+		}
+		printf("%12s %16.3e %10.2e\n", gravityKernelIsaName((GravityKernelIsa)isa), (double)count * count / fastest, error);
+	}
+	// The solvers use the best one
+	setGravityKernelIsa(gravityKernelSupportedIsa());
+	printf("\n");
+	fflush(stdout);
+}
+
+// Orbits like an asteroid belt's propagated to a new time with each instruction set up to the processor's, in orbits per
+// second, and the largest distance from the scalar propagator's positions, relative to the orbit's size
+static void benchmarkKepler(const BenchmarkOptions& options)
+{
+	const size_t count = options.keplerCount;
+	KeplerOrbits orbits;
+	mt19937_64 random(PARTICLE_SEED);
+	uniform_real_distribution<double> uniform(0.0, 1.0);
+	const double twoPi = 6.283185307179586;
+	for (size_t i = 0; i < count; i++) {
+		OrbitalElements elements;
+		elements.semiMajorAxis = 0.5 + uniform(random);
+		elements.eccentricity = 0.3 * uniform(random);
+		elements.inclination = 0.2 * uniform(random);
+		elements.ascendingNode = twoPi * uniform(random);
+		elements.argumentOfPeriapsis = twoPi * uniform(random);
+		elements.meanAnomaly = twoPi * uniform(random);
+		orbits.add(1.0, elements);
+	}
+	Particles reference, positions;
+	for (Particles* result : { &reference, &positions }) {
+		result->x.resize(count);
+		result->y.resize(count);
+		result->z.resize(count);
+	}
+	printf("%12s %16s %10s\n", "kepler", "orbits/s", "error");
+	for (int isa = GRAVITY_KERNEL_SCALAR; isa <= gravityKernelSupportedIsa(); isa++) {
+		setGravityKernelIsa((GravityKernelIsa)isa);
+		Particles& result = isa == GRAVITY_KERNEL_SCALAR ? reference : positions;
+		double fastest = INFINITY;
+		for (int i = 0; i < options.repeat; i++) {
+			// A different time each round, far from the epoch, as when scrubbing through a long run
+			auto start = chrono::steady_clock::now();
+			orbits.positionsAt(1000.0 * (i + 1), result.x.data(), result.y.data(), result.z.data());
+			fastest = min(fastest, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+		}
+		if (options.repeat > 1 && isa != GRAVITY_KERNEL_SCALAR) {
+			// Compared at the scalar propagator's last time
+			orbits.positionsAt(1000.0 * options.repeat, result.x.data(), result.y.data(), result.z.data());
+		}
+		double error = 0.0;
+		for (size_t k = 0; k < count && isa != GRAVITY_KERNEL_SCALAR; k++) {
+			double dx = result.x[k] - reference.x[k], dy = result.y[k] - reference.y[k], dz = result.z[k] - reference.z[k];
+			error = max(error, sqrt(dx * dx + dy * dy + dz * dz) / orbits.elements(k).semiMajorAxis);
+		}
+		printf("%12s %16.3e %10.2e\n", gravityKernelIsaName((GravityKernelIsa)isa), (double)count / fastest, error);
+	}
+	setGravityKernelIsa(gravityKernelSupportedIsa());
+	printf("\n");
+	fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+	BenchmarkOptions options;
+	if (!parseArguments(argc, argv, options)) {
+		printUsage();
+		return 1;
+	}
+
+	const int dimensions = options.distribution == DISTRIBUTION_DISK ? 2 : 3;
+	TaskScheduler::configureShared(options.threads, false);
+	BarnesHutSolver barnesHut(dimensions);
+	barnesHut.setOpeningAngle(options.barnesHutOpeningAngle);
+	FmmSolver fastMultipole(dimensions);
+	fastMultipole.setOrder(options.order);
+	fastMultipole.setOpeningAngle(options.fmmOpeningAngle);
+	cerr << (dimensions == 2 ? "Disk" : "Plummer sphere") << ", " << TaskScheduler::shared().threadCount() << " threads, Barnes-Hut opening angle " << barnesHut.openingAngle()
+		 << ", multipole order " << fastMultipole.order() << " and opening angle " << fastMultipole.openingAngle() << endl;
+	cerr << "Errors are the RMS error of the accelerations of " << options.sampleCount << " particles against direct summation" << endl;
+	if (options.kernelCount > 0)
+		benchmarkKernel(options);
+	if (options.keplerCount > 0)
+		benchmarkKepler(options);
+
+	printf("%12s %14s %16s %10s %12s %10s\n", "particles", "direct ms", "barnes-hut ms", "error", "fmm ms", "error");
+	for (size_t count = options.minimumCount; count <= options.maximumCount; count *= options.factor) {
+		Particles particles = createParticles(count, options.distribution);
+		vector<size_t> sample;
+		const size_t sampleCount = min(options.sampleCount, count);
+		for (size_t k = 0; k < sampleCount; k++)
+			sample.push_back(k * count / sampleCount);
+
+		auto start = chrono::steady_clock::now();
+		Accelerations reference = directSample(particles, sample);
+		double directTime = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() * count / sampleCount;
+
+		Accelerations accelerations;
+		double barnesHutTime = timeSolver(barnesHut, particles, accelerations, options.repeat);
+		double barnesHutError = sampleError(accelerations, sample, reference);
+		double fastMultipoleTime = timeSolver(fastMultipole, particles, accelerations, options.repeat);
+		double fastMultipoleError = sampleError(accelerations, sample, reference);
+
+		// Direct times scaled up from the sample are marked with a *
+		printf("%12zu %13.1f%c %16.1f %10.2e %12.1f %10.2e\n", count, directTime, sampleCount < count ? '*' : ' ',
+			barnesHutTime, barnesHutError, fastMultipoleTime, fastMultipoleError);
+		fflush(stdout);
+		if (count > options.maximumCount / options.factor)
+			break;
+	}
+	return 0;
+}
@@ -0,0 +1,272 @@
+/*
+* Title: PNG Writer
+* Description: Implementation of the PNG encoder declared in pngWriter.h
+*/
+
+#include "pngWriter.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+/*----------------------------------------------------------------------
+Checksums
+------------------------------------------------------------------------*/
+
+static uint32_t crc32Of(const uint8_t* data, size_t size, uint32_t crc = 0)
+{
+	static uint32_t table[256];
+	static bool isTableReady = [] {
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+		return true;
+	}();
+	(void)isTableReady;
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static uint32_t adler32Of(const uint8_t* data, size_t size)
+{
+	uint32_t a = 1, b = 0;
+	while (size > 0) {
+		// Largest block that cannot overflow before the modulo
+		size_t block = min(size, (size_t)5552);
+		for (size_t i = 0; i < block; i++) {
+			a += data[i];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+		data += block;
+		size -= block;
+	}
+	return (b << 16) | a;
+}
+
+/*----------------------------------------------------------------------
+Deflate with fixed Huffman codes
+------------------------------------------------------------------------*/
+
+struct BitWriter {
+	vector<uint8_t>& out;
+	uint64_t bits = 0;
+	int count = 0;
+
+	explicit BitWriter(vector<uint8_t>& output) : out(output) {}
+
+	// Deflate packs values starting from the lowest bit
+	void write(uint32_t value, int length)
+	{
+		bits |= (uint64_t)value << count;
+		count += length;
+		while (count >= 8) {
+			out.push_back((uint8_t)bits);
+			bits >>= 8;
+			count -= 8;
+		}
+	}
+
+	// Huffman codes are defined from their highest bit, so they go in reversed
+	void writeCode(uint32_t code, int length)
+	{
+		uint32_t reversed = 0;
+		for (int i = 0; i < length; i++)
+			reversed |= ((code >> i) & 1) << (length - 1 - i);
+		write(reversed, length);
+	}
+
+	void flush()
+	{
+		if (count > 0)
+			out.push_back((uint8_t)bits);
+		bits = 0;
+		count = 0;
+	}
+};
+
+static const uint16_t LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t DISTANCE_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t DISTANCE_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// Fixed literal/length code for symbol 0..287
+static void writeSymbol(BitWriter& writer, int symbol)
+{
+	if (symbol < 144)
+		writer.writeCode(0x30 + symbol, 8);
+	else if (symbol < 256)
+		writer.writeCode(0x190 + symbol - 144, 9);
+	else if (symbol < 280)
+		writer.writeCode(symbol - 256, 7);
+	else
+		writer.writeCode(0xc0 + symbol - 280, 8);
+}
+
+static void writeMatch(BitWriter& writer, int length, int distance)
+{
+	int lengthCode = (int)(upper_bound(LENGTH_BASE, LENGTH_BASE + 29, length) - LENGTH_BASE) - 1;
+	writeSymbol(writer, 257 + lengthCode);
+	writer.write(length - LENGTH_BASE[lengthCode], LENGTH_EXTRA[lengthCode]);
+
+	int distanceCode = (int)(upper_bound(DISTANCE_BASE, DISTANCE_BASE + 30, distance) - DISTANCE_BASE) - 1;
+	writer.writeCode(distanceCode, 5);
+	writer.write(distance - DISTANCE_BASE[distanceCode], DISTANCE_EXTRA[distanceCode]);
+}
+
+// One fixed-Huffman block; matches come from a hash of the last position each 3 byte sequence was seen at
+static void deflateFixed(const uint8_t* data, size_t size, vector<uint8_t>& out)
+{
+	const int hashBits = 15;
+	const size_t maxDistance = 32768;
+	const size_t maxLength = 258;
+	vector<int64_t> lastSeen((size_t)1 << hashBits, -1);
+
+	BitWriter writer(out);
+	writer.write(1, 1);	// last block
+	writer.write(1, 2);	// fixed Huffman codes
+
+	size_t position = 0;
+	while (position < size) {
+		size_t length = 0, distance = 0;
+		if (position + 3 <= size) {
+			uint32_t sequence = data[position] | (data[position + 1] << 8) | (data[position + 2] << 16);
+			uint32_t hash = (sequence * 2654435761u) >> (32 - hashBits);
+			int64_t candidate = lastSeen[hash];
+			lastSeen[hash] = (int64_t)position;
+			if (candidate >= 0 && position - (size_t)candidate <= maxDistance) {
+				size_t limit = min(maxLength, size - position);
+				const uint8_t* a = data + candidate;
+				const uint8_t* b = data + position;
+				while (length < limit && a[length] == b[length])
+					length++;
+				distance = position - (size_t)candidate;
+			}
+		}
+
+		if (length >= 3) {
+			writeMatch(writer, (int)length, (int)distance);
+			position += length;
+		}
+		else {
+			writeSymbol(writer, data[position]);
+			position++;
+		}
+	}
+	writeSymbol(writer, 256); // end of block
+	writer.flush();
+}
+
+/*----------------------------------------------------------------------
+PNG
+------------------------------------------------------------------------*/
+
+static void put32BigEndian(vector<uint8_t>& out, uint32_t value)
+{
+	out.push_back((uint8_t)(value >> 24));
+	out.push_back((uint8_t)(value >> 16));
+	out.push_back((uint8_t)(value >> 8));
+	out.push_back((uint8_t)value);
+}
+
+static void writeChunk(vector<uint8_t>& out, const char* type, const uint8_t* data, size_t size)
+{
+	put32BigEndian(out, (uint32_t)size);
+	size_t typeStart = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data, data + size);
+	put32BigEndian(out, crc32Of(out.data() + typeStart, size + 4));
+}
+
+static inline uint8_t paethPredictor(int left, int up, int upLeft)
+{
+	int estimate = left + up - upLeft;
+	int toLeft = abs(estimate - left), toUp = abs(estimate - up), toUpLeft = abs(estimate - upLeft);
+	if (toLeft <= toUp && toLeft <= toUpLeft)
+		return (uint8_t)left;
+	return (uint8_t)(toUp <= toUpLeft ? up : upLeft);
+}
+
+void encodePng(const uint8_t* rgba, int width, int height, vector<uint8_t>& out)
+{
+	static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	out.assign(signature, signature + 8);
+
+	uint8_t header[13] = {};
+	for (int i = 0; i < 4; i++) {
+		header[i] = (uint8_t)(width >> (24 - 8 * i));
+		header[4 + i] = (uint8_t)(height >> (24 - 8 * i));
+	}
+	header[8] = 8;	// bits per channel
+	header[9] = 2;	// RGB
+	writeChunk(out, "IHDR", header, sizeof(header));
+
+	// Each row gets whichever filter leaves the smallest values, the usual rule of thumb
+	const size_t rowSize = (size_t)width * 3;
+	vector<uint8_t> filtered((rowSize + 1) * height);
+	vector<uint8_t> row(rowSize), previousRow(rowSize, 0);
+	vector<uint8_t> candidates[4] = { vector<uint8_t>(rowSize), vector<uint8_t>(rowSize), vector<uint8_t>(rowSize), vector<uint8_t>(rowSize) };
+	for (int y = 0; y < height; y++) {
+		const uint8_t* source = rgba + (size_t)y * width * 4;
+		for (int x = 0; x < width; x++)
+			memcpy(&row[x * 3], source + x * 4, 3);
+
+		size_t bestCost = SIZE_MAX;
+		int bestFilter = 0;
+		for (int filter = 0; filter < 4; filter++) {
+			uint8_t* candidate = candidates[filter].data();
+			size_t cost = 0;
+			for (size_t i = 0; i < rowSize; i++) {
+				int left = i >= 3 ? row[i - 3] : 0;
+				int up = previousRow[i];
+				int upLeft = i >= 3 ? previousRow[i - 3] : 0;
+				uint8_t prediction = filter == 0 ? 0 : filter == 1 ? (uint8_t)left : filter == 2 ? (uint8_t)up : paethPredictor(left, up, upLeft);
+				candidate[i] = (uint8_t)(row[i] - prediction);
+				cost += (size_t)abs((int)(int8_t)candidate[i]);
+			}
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestFilter = filter;
+			}
+		}
+		// PNG numbers the filters none, sub, up, average, paeth; average is not tried
+		static const uint8_t filterType[4] = { 0, 1, 2, 4 };
+		uint8_t* destination = filtered.data() + (size_t)y * (rowSize + 1);
+		destination[0] = filterType[bestFilter];
+		memcpy(destination + 1, candidates[bestFilter].data(), rowSize);
+		swap(row, previousRow);
+	}
+
+	vector<uint8_t> zlibData = { 0x78, 0x01 };
+	deflateFixed(filtered.data(), filtered.size(), zlibData);
+	uint32_t adler = adler32Of(filtered.data(), filtered.size());
+	put32BigEndian(zlibData, adler);
+	writeChunk(out, "IDAT", zlibData.data(), zlibData.size());
+	writeChunk(out, "IEND", nullptr, 0);
+}
+
+bool writePng(const string& filename, const uint8_t* rgba, int width, int height)
+{
+	vector<uint8_t> png;
+	encodePng(rgba, width, height, png);
+
+	FILE* file = nullptr;
+#if defined(_MSC_VER)
+	fopen_s(&file, filename.c_str(), "wb");
+#else
+	file = fopen(filename.c_str(), "wb");
+#endif
+	if (file == nullptr)
+		return false;
+	bool isWritten = fwrite(png.data(), 1, png.size(), file) == png.size();
+	return fclose(file) == 0 && isWritten;
+}
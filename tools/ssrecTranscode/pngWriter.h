@@ -0,0 +1,18 @@
+/*
+* Title: PNG Writer
+* Description: Writes RGB PNG images for ssrecTranscode. The image data is compressed with a
+*              single-pass LZ77 and deflate's fixed Huffman codes, which is far quicker than a
+*              full zlib and still much smaller than storing the pixels
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Encode top-down RGBA pixels (alpha is dropped) as a PNG file in memory
+void encodePng(const uint8_t* rgba, int width, int height, std::vector<uint8_t>& out);
+
+// Encode and write to filename; returns false if the file could not be written
+bool writePng(const std::string& filename, const uint8_t* rgba, int width, int height);
@@ -0,0 +1,266 @@
+/*
+* Title: ssrecTranscode
+* Description: Converts .ssrec recordings made by the simulation into GIFs, PNG images or raw
+*              Y4M/PPM video. The expensive encoding runs here, on every core, instead of while
+*              the simulation is rendering
+*
+* Usage: ssrecTranscode <input.ssrec> <output> [--threads N] [--step N] [--scale N] [--palette frame|learn|sampled] [--dither none|fs|ordered] [--dedup N] [--format y4m|ppm] [--compare FILE]
+*   output.gif          one GIF, frames quantized and compressed in parallel
+*   output.y4m / .ppm   raw video; "-" writes to standard output in the --format given
+*   output.png          one PNG per frame, output_00000.png and so on, encoded in parallel
+*   --step N            keep every Nth frame
+*   --scale N           shrink frames by a factor of N
+*   --palette learn     build the GIF palette from the first frames instead of for every frame
+*   --palette sampled   build every frame's palette from a sample of its pixels, starting from an earlier frame's palette
+*   --dither MODE       GIF dithering: Floyd-Steinberg error diffusion or an ordered Bayer pattern
+*   --dedup N           drop GIF frames within N of the frame before them (default 0, exact repeats; -1 keeps all)
+*   --compare FILE      fail unless the output is byte for byte the same as FILE, e.g. one written with other --threads
+*/
+
+#include "capture.h"
+#include "rawStream.h"
+#include "ssrec.h"
+#include "pngWriter.h"
+#include "frameScale.h"
+#include "taskScheduler.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Frames the GIF palette is learned from with --palette learn
+const int LEARN_PALETTE_FRAMES = 10;
+
+struct TranscodeOptions {
+	string input;
+	string output;
+	int threads = 0;		// Threads in all, this one included; 0 uses one per hardware thread
+	int frameStep = 1;
+	int scaleDivisor = 1;
+	GifPaletteMode paletteMode = GIF_PALETTE_PER_FRAME;
+	GifDitherMode dither = GIF_DITHER_NONE;
+	int duplicateTolerance = 0;
+	RawStreamFormat streamFormat = RAW_STREAM_Y4M;
+	string compareWith;		// A file the output must match exactly, or empty
+};
+
+static bool endsWith(const string& text, const char* suffix)
+{
+	size_t length = strlen(suffix);
+	return text.size() >= length && text.compare(text.size() - length, length, suffix) == 0;
+}
+
+static void printUsage()
+{
+	cerr << "Usage: ssrecTranscode <input.ssrec> <output.gif|.y4m|.ppm|.png|-> [--threads N] [--step N] [--scale N]"
+		 << " [--palette frame|learn|sampled] [--dither none|fs|ordered] [--dedup N] [--format y4m|ppm] [--compare FILE]" << endl;
+}
+
+static bool parseArguments(int argc, char** argv, TranscodeOptions& options)
+{
+	vector<string> positional;
+	for (int i = 1; i < argc; i++) {
+		string argument = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (argument == "--threads" && hasValue)
+			options.threads = atoi(argv[++i]);
+		else if (argument == "--step" && hasValue)
+			options.frameStep = max(1, atoi(argv[++i]));
+		else if (argument == "--scale" && hasValue)
+			options.scaleDivisor = min(max(1, atoi(argv[++i])), MAX_FRAME_SCALE_DIVISOR);
+		else if (argument == "--palette" && hasValue) {
+			string mode = argv[++i];
+			options.paletteMode = mode == "learn" ? GIF_PALETTE_FROM_FIRST_FRAMES : mode == "sampled" ? GIF_PALETTE_SAMPLED : GIF_PALETTE_PER_FRAME;
+		}
+		else if (argument == "--dither" && hasValue) {
+			string mode = argv[++i];
+			options.dither = mode == "fs" ? GIF_DITHER_FLOYD_STEINBERG : mode == "ordered" ? GIF_DITHER_ORDERED : GIF_DITHER_NONE;
+		}
+		else if (argument == "--dedup" && hasValue)
+			options.duplicateTolerance = atoi(argv[++i]);
+		else if (argument == "--format" && hasValue)
+			options.streamFormat = string(argv[++i]) == "ppm" ? RAW_STREAM_PPM : RAW_STREAM_Y4M;
+		else if (argument == "--compare" && hasValue)
+			options.compareWith = argv[++i];
+		else if (argument.size() > 2 && argument.compare(0, 2, "--") == 0)
+			return false;
+		else
+			positional.push_back(argument);
+	}
+	if (positional.size() != 2)
+		return false;
+	options.input = positional[0];
+	options.output = positional[1];
+	if (endsWith(options.output, ".ppm"))
+		options.streamFormat = RAW_STREAM_PPM;
+	return true;
+}
+
+// True if both files can be read and hold the same bytes
+static bool filesMatch(const string& first, const string& second)
+{
+	ifstream a(first, ios::binary), b(second, ios::binary);
+	if (!a || !b)
+		return false;
+	return equal(istreambuf_iterator<char>(a), istreambuf_iterator<char>(), istreambuf_iterator<char>(b), istreambuf_iterator<char>());
+}
+
+/*
+Decodes every frame in order and hands the ones that are kept (every frameStep-th) to handleFrame
+Returns the number of frames handed over, or -1 if a frame could not be decoded
+*/
+template <typename FrameHandler>
+static int forEachFrame(SsrecReader& reader, int frameStep, FrameHandler handleFrame)
+{
+	const size_t frameSize = (size_t)reader.width() * reader.height() * 4;
+	vector<uint8_t> frame(frameSize), previous(frameSize);
+	const vector<SsrecFrameInfo>& frames = reader.frames();
+	int keptFrames = 0;
+	for (size_t i = 0; i < frames.size(); i++) {
+		if (!reader.readFrame(i, previous.data(), frame.data())) {
+			cerr << "Frame " << i << " is damaged" << endl;
+			return -1;
+		}
+		if (i % frameStep == 0) {
+			handleFrame(frame.data(), frames[i].time);
+			keptFrames++;
+		}
+		swap(frame, previous);
+	}
+	return keptFrames;
+}
+
+static int transcodeToGif(SsrecReader& reader, const TranscodeOptions& options)
+{
+	GifPipeline pipeline;
+	pipeline.setDownscale(options.scaleDivisor);
+	pipeline.setDuplicateTolerance(options.duplicateTolerance);
+	if (!pipeline.begin(options.output.c_str(), reader.width(), reader.height(), 2, 8, options.dither))
+		return -1;
+	if (options.paletteMode == GIF_PALETTE_FROM_FIRST_FRAMES)
+		pipeline.learnPalette(LEARN_PALETTE_FRAMES);
+	pipeline.setSampledPalette(options.paletteMode == GIF_PALETTE_SAMPLED);
+
+	double lastTime = 0.0, remainder = 0.0;
+	bool isFirstFrame = true;
+	int keptFrames = forEachFrame(reader, options.frameStep, [&](const uint8_t* frame, double time) {
+		int delay = nextGifDelay(time, lastTime, remainder, isFirstFrame);
+		isFirstFrame = false;
+		if (delay > 0)
+			pipeline.submitFrame(frame, delay);
+	});
+	pipeline.end();
+	return keptFrames;
+}
+
+static int transcodeToStream(SsrecReader& reader, const TranscodeOptions& options)
+{
+	// The recording has no fixed rate, so the stream gets the average one
+	const vector<SsrecFrameInfo>& frames = reader.frames();
+	double duration = frames.size() > 1 ? frames.back().time - frames.front().time : 0.0;
+	int frameRate = duration > 0.0 ? (int)lround((frames.size() - 1) / duration) : 60;
+
+	RawStreamWriter stream;
+	if (!stream.open(options.output, reader.width(), reader.height(), options.streamFormat, max(frameRate, 1), options.frameStep, options.scaleDivisor))
+		return -1;
+	int keptFrames = forEachFrame(reader, options.frameStep, [&](const uint8_t* frame, double) {
+		stream.submitFrame(frame);
+	});
+	stream.close();
+	return stream.hasFailed() ? -1 : keptFrames;
+}
+
+static int transcodeToPng(SsrecReader& reader, const TranscodeOptions& options)
+{
+	const string baseName = options.output.substr(0, options.output.size() - 4);
+	const int width = scaledFrameSize(reader.width(), options.scaleDivisor);
+	const int height = scaledFrameSize(reader.height(), options.scaleDivisor);
+
+	// Frames are independent once decoded; waiting after every few keeps memory bounded
+	TaskScheduler& scheduler = TaskScheduler::shared();
+	TaskGroup writes;
+	const int maxFramesInFlight = 2 * scheduler.threadCount();
+	int framesInFlight = 0;
+	int pngIndex = 0;
+	bool hasFailed = false;
+	mutex failureLock;
+
+	int keptFrames = forEachFrame(reader, options.frameStep, [&](const uint8_t* frame, double) {
+		auto pixels = make_shared<vector<uint8_t>>((size_t)width * height * 4);
+		downscaleFrame(frame, reader.width(), reader.height(), options.scaleDivisor, pixels->data());
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), "_%05d.png", pngIndex++);
+		string filename = baseName + suffix;
+
+		scheduler.run(writes, [pixels, filename, width, height, &hasFailed, &failureLock] {
+			if (!writePng(filename, pixels->data(), width, height)) {
+				lock_guard<mutex> guard(failureLock);
+				hasFailed = true;
+			}
+		});
+		if (++framesInFlight >= maxFramesInFlight) {
+			scheduler.wait(writes);
+			framesInFlight = 0;
+		}
+	});
+	scheduler.wait(writes);
+	return hasFailed ? -1 : keptFrames;
+}
+
+int main(int argc, char** argv)
+{
+	TranscodeOptions options;
+	if (!parseArguments(argc, argv, options)) {
+		printUsage();
+		return 1;
+	}
+
+	TaskScheduler::configureShared(options.threads, false);
+
+	SsrecReader reader;
+	if (!reader.open(options.input)) {
+		cerr << "Could not read " << options.input << " as an .ssrec recording" << endl;
+		return 1;
+	}
+	cerr << options.input << ": " << reader.width() << " x " << reader.height() << ", " << reader.frames().size() << " frames" << endl;
+
+	auto start = chrono::steady_clock::now();
+	int writtenFrames;
+	if (endsWith(options.output, ".gif"))
+		writtenFrames = transcodeToGif(reader, options);
+	else if (endsWith(options.output, ".png"))
+		writtenFrames = transcodeToPng(reader, options);
+	else if (endsWith(options.output, ".y4m") || endsWith(options.output, ".ppm") || options.output == "-")
+		writtenFrames = transcodeToStream(reader, options);
+	else {
+		printUsage();
+		return 1;
+	}
+
+	if (writtenFrames < 0) {
+		cerr << "Failed to write " << options.output << endl;
+		return 1;
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cerr << "Wrote " << writtenFrames << " frames to " << options.output << " in " << seconds << " s using " << TaskScheduler::shared().threadCount() << " threads" << endl;
+
+	// The output does not depend on the thread count, which this checks against a file written with a different one
+	if (!options.compareWith.empty()) {
+		if (!filesMatch(options.output, options.compareWith)) {
+			cerr << options.output << " differs from " << options.compareWith << endl;
+			return 1;
+		}
+		cerr << options.output << " matches " << options.compareWith << endl;
+	}
+	return 0;
+}